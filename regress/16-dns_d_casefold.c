@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "dns.h"
+
+#define countof(a) (sizeof (a) / sizeof *(a))
+
+/* longer than one AVX2 block so the vector and scalar tails both run */
+#define LONGNAME "a-rather-long-label-for-vector-kernels.Another-Long-Label-To-Fold-0123456789.example.com"
+
+static void
+check_trim(const char *src, const char *expect)
+{
+	char dn[DNS_D_MAXNAME + 1];
+
+	dns_d_init(dn, sizeof dn, src, strlen(src), DNS_D_TRIM);
+	if (strcmp(dn, expect))
+		errx(1, "trim(%s): expected %s, but got %s", src, expect, dn);
+}
+
+static void
+check_ldh(const char *src, _Bool expect)
+{
+	if (dns_d_isldh(src, strlen(src)) != expect)
+		errx(1, "isldh(%s): expected %d", src, expect);
+}
+
+static void
+check_comp(void)
+{
+	struct dns_packet *P = dns_p_new(512);
+	unsigned short rp;
+	int error;
+
+	if ((error = dns_p_push(P, DNS_S_QD, LONGNAME ".", strlen(LONGNAME) + 1, DNS_T_A, DNS_C_IN, 0, 0)))
+		errx(1, "dns_p_push: %s", dns_strerror(error));
+
+	rp = P->end;
+
+	if ((error = dns_p_push(P, DNS_S_AN, "A-RATHER-LONG-LABEL-FOR-VECTOR-KERNELS.another-long-label-to-fold-0123456789.EXAMPLE.COM.", strlen(LONGNAME) + 1, DNS_T_A, DNS_C_IN, 0, &(struct dns_a){ { 0 } })))
+		errx(1, "dns_p_push: %s", dns_strerror(error));
+
+	if ((P->data[rp] & 0xc0) != 0xc0)
+		errx(1, "name differing only in case not compressed");
+}
+
+int
+main(void)
+{
+	static const struct { const char *src, *expect; } trim[] = {
+		{ "..www..example...com..", "www.example.com." },
+		{ "www.example.com", "www.example.com" },
+		{ "...", "" },
+		{ LONGNAME, LONGNAME },
+		{ "." LONGNAME "..", LONGNAME "." },
+	};
+	size_t i;
+
+	for (i = 0; i < countof(trim); i++)
+		check_trim(trim[i].src, trim[i].expect);
+
+	check_ldh("www.example.com", 1);
+	check_ldh("www.example.com.", 1);
+	check_ldh(".", 1);
+	check_ldh(LONGNAME, 1);
+	check_ldh(LONGNAME "_", 0);
+	check_ldh("_sip._tcp.example.com", 0);
+	check_ldh("-www.example.com", 0);
+	check_ldh("www..example.com", 0);
+	check_ldh("a-rather-long-label-for-vector-kernels\x80.example.com", 0);
+	check_ldh("", 0);
+
+	check_comp();
+
+	warnx("OK");
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <err.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns.h"
+#include "cache.h"
+
+#define ZONE "example.com."
+
+/*
+ * Stand-in primary. Serial 2 is served by AXFR; IXFR from serial 2 moves
+ * the zone to serial 3. Every answer spans several messages and only the
+ * first carries the question, as permitted by RFC 5936. The IXFR adds a
+ * record the zone already holds, which must not be duplicated. The fourth
+ * connection answers an IXFR from serial 3 with a delta, then fails.
+ */
+struct rec { const char *name; enum dns_type type; unsigned value; };
+
+#define SOA(n) { ZONE, DNS_T_SOA, (n) }
+#define A(name, n) { name "." ZONE, DNS_T_A, (n) }
+#define END { NULL, 0, 0 }
+#define FAIL { ZONE, DNS_T_ALL, 0 } /* SERVFAIL */
+
+static const struct rec axfr[] = {
+	SOA(2), A("a", 1), A("b", 2), END,
+	A("c", 3), A("a", 5), END,
+	SOA(2), END,
+	END,
+};
+
+static const struct rec ixfr[] = {
+	SOA(3), SOA(2), A("a", 1), A("b", 2), END,
+	SOA(3), A("a", 9), A("d", 4), A("c", 3), END,
+	SOA(3), END,
+	END,
+};
+
+static const struct rec uptodate[] = {
+	SOA(3), END,
+	END,
+};
+
+static const struct rec broken[] = {
+	SOA(4), SOA(3), A("a", 5), END,
+	FAIL, END,
+	END,
+};
+
+static void
+push(struct dns_packet *P, const struct rec *rec)
+{
+	struct dns_soa soa = { "ns." ZONE, "hostmaster." ZONE, rec->value, 3600, 600, 86400, 300 };
+	struct dns_a a = { { htonl(0x7f000000 + rec->value) } };
+	int error;
+
+	if ((error = dns_p_push(P, DNS_S_AN, rec->name, strlen(rec->name), rec->type, DNS_C_IN, 60, (rec->type == DNS_T_SOA)? (void *)&soa : (void *)&a)))
+		errx(1, "dns_p_push: %s", dns_strerror(error));
+}
+
+static void
+serve(int fd, int conn)
+{
+	unsigned char len[2];
+	struct dns_packet *Q = dns_p_new(1024), *A;
+	const struct rec *rec;
+	struct dns_soa soa = { .serial = 0 };
+	struct dns_rr rr;
+	char qname[DNS_D_MAXNAME + 1];
+	_Bool first = 1;
+
+	if (2 != recv(fd, len, 2, MSG_WAITALL))
+		_exit(1);
+	Q->end = (len[0] << 8) | len[1];
+	if ((long)Q->end != recv(fd, Q->data, Q->end, MSG_WAITALL))
+		_exit(1);
+
+	if (dns_rr_parse(&rr, 12, Q) || !dns_d_expand(qname, sizeof qname, rr.dn.p, Q, &(int){ 0 }))
+		_exit(1);
+
+	if (rr.type == DNS_T_AXFR) {
+		rec = axfr;
+	} else {
+		dns_rr_foreach(&rr, Q, .section = DNS_S_NS, .type = DNS_T_SOA) {
+			if (dns_soa_parse(&soa, &rr, Q))
+				_exit(1);
+		}
+		rec = (soa.serial != 3)? ixfr : (conn == 3)? broken : uptodate;
+	}
+
+	for (; rec->name; rec++, first = 0) {
+		A = dns_p_new(1024);
+		dns_header(A)->qid = dns_header(Q)->qid;
+		dns_header(A)->qr = 1;
+		dns_header(A)->aa = 1;
+
+		if (first)
+			dns_rr_foreach(&rr, Q, .section = DNS_S_QD) {
+				dns_rr_copy(A, &rr, Q);
+			}
+
+		for (; rec->name; rec++) {
+			if (rec->type == DNS_T_ALL)
+				dns_header(A)->rcode = DNS_RC_SERVFAIL;
+			else
+				push(A, rec);
+		}
+
+		len[0] = 0xff & (A->end >> 8);
+		len[1] = 0xff & (A->end >> 0);
+		if (2 != send(fd, len, 2, 0) || (long)A->end != send(fd, A->data, A->end, 0))
+			_exit(1);
+	}
+
+	close(fd);
+}
+
+static void
+check(struct cache *C, const char *expect)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	if (!(fp = open_memstream(&buf, &size)))
+		err(1, "open_memstream");
+	cache_dumpfile(C, fp);
+	fclose(fp);
+
+	if (strcmp(buf, expect))
+		errx(1, "expected:\n%sgot:\n%s", expect, buf);
+
+	free(buf);
+}
+
+int
+main(void)
+{
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof sin;
+	struct cache *C;
+	pid_t pid;
+	int lfd, fd, error, i;
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (-1 == (lfd = socket(AF_INET, SOCK_STREAM, 0))
+	||  0 != bind(lfd, (struct sockaddr *)&sin, sizeof sin)
+	||  0 != listen(lfd, 4)
+	||  0 != getsockname(lfd, (struct sockaddr *)&sin, &sinlen))
+		err(1, "listen");
+
+	if (-1 == (pid = fork()))
+		err(1, "fork");
+
+	if (pid == 0) {
+		for (i = 0; i < 5; i++) {
+			if (-1 == (fd = accept(lfd, NULL, NULL)))
+				_exit(1);
+			serve(fd, i);
+		}
+		_exit(0);
+	}
+
+	close(lfd);
+
+	if (!(C = cache_open(&error)))
+		errx(1, "cache_open: %s", dns_strerror(error));
+
+	if ((error = cache_transfer(C, "example.com", DNS_T_AXFR, (struct sockaddr *)&sin, 5)))
+		errx(1, "AXFR: %s", dns_strerror(error));
+
+	check(C,
+		"example.com. 60 IN SOA ns.example.com. hostmaster.example.com. 2 3600 600 86400 300\n"
+		"a.example.com. 60 IN A 127.0.0.1\n"
+		"a.example.com. 60 IN A 127.0.0.5\n"
+		"b.example.com. 60 IN A 127.0.0.2\n"
+		"c.example.com. 60 IN A 127.0.0.3\n");
+
+	if ((error = cache_transfer(C, ZONE, DNS_T_IXFR, (struct sockaddr *)&sin, 5)))
+		errx(1, "IXFR: %s", dns_strerror(error));
+
+	check(C,
+		"example.com. 60 IN SOA ns.example.com. hostmaster.example.com. 3 3600 600 86400 300\n"
+		"a.example.com. 60 IN A 127.0.0.5\n"
+		"a.example.com. 60 IN A 127.0.0.9\n"
+		"c.example.com. 60 IN A 127.0.0.3\n"
+		"d.example.com. 60 IN A 127.0.0.4\n");
+
+	if ((error = cache_transfer(C, ZONE, DNS_T_IXFR, (struct sockaddr *)&sin, 5)))
+		errx(1, "IXFR (up to date): %s", dns_strerror(error));
+
+	check(C,
+		"example.com. 60 IN SOA ns.example.com. hostmaster.example.com. 3 3600 600 86400 300\n"
+		"a.example.com. 60 IN A 127.0.0.5\n"
+		"a.example.com. 60 IN A 127.0.0.9\n"
+		"c.example.com. 60 IN A 127.0.0.3\n"
+		"d.example.com. 60 IN A 127.0.0.4\n");
+
+	/* half-applied, so serial 3 is no longer claimed */
+	if (DNS_EFAIL != (error = cache_transfer(C, ZONE, DNS_T_IXFR, (struct sockaddr *)&sin, 5)))
+		errx(1, "IXFR (failing): %s", (error)? dns_strerror(error) : "no error");
+
+	check(C,
+		"a.example.com. 60 IN A 127.0.0.9\n"
+		"c.example.com. 60 IN A 127.0.0.3\n"
+		"d.example.com. 60 IN A 127.0.0.4\n");
+
+	/* without a serial to offer, IXFR becomes AXFR */
+	if ((error = cache_transfer(C, ZONE, DNS_T_IXFR, (struct sockaddr *)&sin, 5)))
+		errx(1, "IXFR (after failure): %s", dns_strerror(error));
+
+	check(C,
+		"example.com. 60 IN SOA ns.example.com. hostmaster.example.com. 2 3600 600 86400 300\n"
+		"a.example.com. 60 IN A 127.0.0.1\n"
+		"a.example.com. 60 IN A 127.0.0.5\n"
+		"b.example.com. 60 IN A 127.0.0.2\n"
+		"c.example.com. 60 IN A 127.0.0.3\n");
+
+	cache_close(C);
+
+	if (-1 == waitpid(pid, &i, 0) || !WIFEXITED(i) || WEXITSTATUS(i))
+		errx(1, "stand-in server failed");
+
+	warnx("OK");
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "dns.h"
+
+#define countof(a) (sizeof (a) / sizeof *(a))
+
+/*
+ * The resolver builds its queries from per-(qtype, qclass, qflags)
+ * templates. A cache hook sees each query as built, and compares it with
+ * one pushed from scratch. Appending a record whose owner shares the
+ * QNAME shows that both packets compress against the QNAME alike.
+ */
+static struct {
+	const char *qname;
+	enum dns_type qtype;
+	_Bool rd, edns0;
+	unsigned count;
+} Q;
+
+
+static struct dns_packet *
+expect_query(void)
+{
+	struct dns_packet *P;
+	int error;
+
+	if (!(P = dns_p_make(512, &error)))
+		errx(1, "dns_p_make: %s", dns_strerror(error));
+
+	if ((error = dns_p_push(P, DNS_S_QD, Q.qname, strlen(Q.qname), Q.qtype, DNS_C_IN, 0, 0)))
+		errx(1, "dns_p_push: %s", dns_strerror(error));
+
+	dns_header(P)->rd = Q.rd;
+
+	if (Q.edns0) {
+		struct dns_opt opt = DNS_OPT_INIT(&opt);
+
+		opt.version = 0;
+		opt.maxudp = 4096;
+
+		if ((error = dns_p_push(P, DNS_S_AR, ".", 1, DNS_T_OPT, dns_opt_class(&opt), dns_opt_ttl(&opt), &opt)))
+			errx(1, "dns_p_push: %s", dns_strerror(error));
+	}
+
+	return P;
+}
+
+
+static void
+push_glue(struct dns_packet *P, const char *what)
+{
+	char host[DNS_D_MAXNAME + 1];
+	int error;
+
+	snprintf(host, sizeof host, "ns1.%s", Q.qname);
+
+	if ((error = dns_p_push(P, DNS_S_AR, host, strlen(host), DNS_T_A, DNS_C_IN, 60, &(struct dns_a){ { 0 } })))
+		errx(1, "%s: %s: dns_p_push: %s", Q.qname, what, dns_strerror(error));
+}
+
+
+static struct dns_packet *
+check_query(struct dns_packet *query, struct dns_cache *cache, int *error)
+{
+	struct dns_packet *P = expect_query(), *A;
+	struct dns_rr rr;
+	size_t end = P->end;
+
+	(void)cache;
+
+	if (query->end != P->end || memcmp(query->data, P->data, P->end))
+		errx(1, "%s: templated query differs from a rebuilt one", Q.qname);
+
+	if (dns_p_count(query, DNS_S_AR) != dns_p_count(P, DNS_S_AR))
+		errx(1, "%s: additional counts differ", Q.qname);
+
+	push_glue(query, "templated");
+	push_glue(P, "rebuilt");
+
+	if (query->end != P->end || memcmp(query->data, P->data, P->end))
+		errx(1, "%s: names compress differently against a templated query", Q.qname);
+
+	/* "ns1" then a pointer */
+	if ((query->data[end + 4] & 0xc0) != 0xc0)
+		errx(1, "%s: glue owner not compressed against the QNAME", Q.qname);
+
+	dns_p_free(P);
+
+	Q.count++;
+
+	/* answer, so the resolver finishes without the network */
+	if (!(A = dns_p_make(512, error)))
+		return NULL;
+
+	dns_rr_foreach(&rr, query, .section = DNS_S_QD) {
+		if ((*error = dns_rr_copy(A, &rr, query)))
+			goto error;
+	}
+
+	if ((*error = dns_p_push(A, DNS_S_AN, Q.qname, strlen(Q.qname), DNS_T_A, DNS_C_IN, 60, &(struct dns_a){ { 0 } })))
+		goto error;
+
+	return A;
+error:
+	dns_p_free(A);
+
+	return NULL;
+}
+
+
+static void
+resolve(struct dns_resolver *R)
+{
+	struct dns_packet *A;
+	int error;
+
+	if ((error = dns_res_submit(R, Q.qname, Q.qtype, DNS_C_IN)))
+		errx(1, "%s: dns_res_submit: %s", Q.qname, dns_strerror(error));
+
+	while ((error = dns_res_check(R))) {
+		if (error != EAGAIN)
+			errx(1, "%s: dns_res_check: %s", Q.qname, dns_strerror(error));
+		dns_res_poll(R, 1);
+	}
+
+	if (!(A = dns_res_fetch(R, &error)))
+		errx(1, "%s: dns_res_fetch: %s", Q.qname, dns_strerror(error));
+
+	dns_p_free(A);
+}
+
+
+int
+main(void)
+{
+	static const char *name[] = {
+		"example.com.",
+		"www.example.com.",
+		"a-rather-long-label-that-shifts-every-offset.example.org.",
+		"x.",
+		"www.example.com.",
+	};
+	static const enum dns_type type[] = { DNS_T_A, DNS_T_AAAA, DNS_T_MX, DNS_T_TXT, DNS_T_A };
+	struct dns_resolv_conf *resconf;
+	struct dns_hosts *hosts;
+	struct dns_hints *hints;
+	struct dns_resolver *R;
+	struct dns_cache cache;
+	unsigned flags, i, j, expect = 0;
+	int error;
+
+	dns_cache_init(&cache);
+	cache.query = &check_query;
+
+	for (flags = 0; flags < 4; flags++) {
+		if (!(resconf = dns_resconf_open(&error)))
+			errx(1, "dns_resconf_open: %s", dns_strerror(error));
+
+		memset(resconf->lookup, 0, sizeof resconf->lookup);
+		resconf->lookup[0] = 'c';
+		resconf->options.recurse = !(flags & 1);
+		resconf->options.edns0 = !!(flags & 2);
+
+		if (!(hosts = dns_hosts_open(&error)))
+			errx(1, "dns_hosts_open: %s", dns_strerror(error));
+		if (!(hints = dns_hints_open(resconf, &error)))
+			errx(1, "dns_hints_open: %s", dns_strerror(error));
+		if (!(R = dns_res_open(resconf, hosts, hints, &cache, dns_opts(), &error)))
+			errx(1, "dns_res_open: %s", dns_strerror(error));
+
+		Q.rd = !!(flags & 1);
+		Q.edns0 = !!(flags & 2);
+
+		/* twice over, so the second pass reuses each template */
+		for (j = 0; j < 2; j++) {
+			for (i = 0; i < countof(name); i++) {
+				Q.qname = name[i];
+				Q.qtype = type[i];
+				resolve(R);
+				expect++;
+			}
+		}
+
+		dns_res_close(R);
+		dns_hints_close(hints);
+		dns_hosts_close(hosts);
+		dns_resconf_close(resconf);
+	}
+
+	if (Q.count != expect)
+		errx(1, "cache consulted %u times, expected %u", Q.count, expect);
+
+	warnx("OK");
+
+	return 0;
+}
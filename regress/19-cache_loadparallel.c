@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <err.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "dns.h"
+#include "cache.h"
+
+/*
+ * A zone larger than one parallel chunk, with directives, groups,
+ * comments and owner-less lines, must load the same through
+ * cache_loadpath() and cache_loadparallel(), down to the bytes of the
+ * saved image, which hold each RRset's names compressed. A FIFO can't be
+ * mapped, so cache_loadparallel() must stream it.
+ */
+static void
+mkzone(FILE *fp)
+{
+	unsigned i;
+
+	fputs("$ORIGIN example.com.\n$TTL 300\n", fp);
+	fputs("@ IN SOA ns1 hostmaster.example.com. ( 1 3600 600\n\t86400 300 ) ; serial\n", fp);
+	fputs("  IN NS ns1\nns1 IN A 192.0.2.1\n", fp);
+
+	for (i = 0; i < 60000; i++) {
+		if (i % 10000 == 0)
+			fprintf(fp, "$ORIGIN sub%u.example.com.\n", i / 10000);
+
+		fprintf(fp, "h%u 60 IN A 10.%u.%u.%u ; host %u\n", i, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff, i);
+
+		if (i % 7 == 0)
+			fprintf(fp, "  IN TXT \"t(%u)\"\n", i);
+		if (i % 13 == 0)
+			fprintf(fp, "m%u IN MX ( 10\n\tmx%u )\n", i, i);
+	}
+}
+
+/* the zone file, then the image */
+static char *
+dump(struct cache *C, size_t *size)
+{
+	char *buf = NULL;
+	FILE *fp;
+	int error;
+
+	if (!(fp = open_memstream(&buf, size)))
+		err(1, "open_memstream");
+	cache_dumpfile(C, fp);
+	if ((error = cache_saveimage(C, fp)))
+		errx(1, "cache_saveimage: %s", dns_strerror(error));
+	fclose(fp);
+
+	return buf;
+}
+
+static char *
+load(const char *path, unsigned threads, size_t *size)
+{
+	struct cache *C;
+	char *buf;
+	int error;
+
+	if (!(C = cache_open(&error)))
+		errx(1, "cache_open: %s", dns_strerror(error));
+
+	if (threads)
+		error = cache_loadparallel(C, path, ".", 3600, threads);
+	else
+		error = cache_loadpath(C, path, ".", 3600);
+
+	if (error)
+		errx(1, "%s (%u threads): %s", path, threads, dns_strerror(error));
+
+	buf = dump(C, size);
+	cache_close(C);
+
+	return buf;
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/cache_loadparallel.XXXXXX", file[64], fifo[64];
+	char *expect, *got;
+	size_t explen, gotlen;
+	unsigned threads;
+	FILE *fp;
+	pid_t pid;
+	int status;
+
+	if (!mkdtemp(dir))
+		err(1, "mkdtemp");
+	snprintf(file, sizeof file, "%s/zone", dir);
+	snprintf(fifo, sizeof fifo, "%s/fifo", dir);
+
+	if (!(fp = fopen(file, "w")))
+		err(1, "%s", file);
+	mkzone(fp);
+	if (0 != fclose(fp))
+		err(1, "%s", file);
+
+	expect = load(file, 0, &explen);
+
+	if (!strstr(expect, "h59999.sub5.example.com. 60 IN A 10.0.234.95\n"))
+		errx(1, "zone not loaded:\n%.256s", expect);
+
+	for (threads = 1; threads <= 4; threads++) {
+		got = load(file, threads, &gotlen);
+		if (gotlen != explen || memcmp(got, expect, explen))
+			errx(1, "%u threads: parallel load differs", threads);
+		free(got);
+	}
+
+	if (0 != mkfifo(fifo, 0600))
+		err(1, "%s", fifo);
+
+	if (-1 == (pid = fork()))
+		err(1, "fork");
+
+	if (pid == 0) {
+		if (!(fp = fopen(fifo, "w")))
+			_exit(1);
+		mkzone(fp);
+		_exit(0 != fclose(fp));
+	}
+
+	got = load(fifo, 4, &gotlen);
+
+	if (-1 == waitpid(pid, &status, 0) || !WIFEXITED(status) || WEXITSTATUS(status))
+		errx(1, "FIFO writer failed");
+
+	if (gotlen != explen || memcmp(got, expect, explen))
+		errx(1, "FIFO: streamed load differs");
+
+	free(got);
+	free(expect);
+
+	unlink(fifo);
+	unlink(file);
+	rmdir(dir);
+
+	warnx("OK");
+
+	return 0;
+}
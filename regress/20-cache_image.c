@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <err.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "dns.h"
+#include "cache.h"
+
+/*
+ * An image saved from a cache must attach, dump and answer exactly like
+ * the cache it came from. cache_saveimage() writes the header (32 bytes),
+ * then 16-byte index entries of type, name, data and len. Images whose
+ * offsets leave the file, or whose index isn't ascending, must be refused
+ * since lookups binary search the index.
+ */
+#define HDRLEN 32
+#define ENTLEN 16
+
+static const char *host[] = { "a", "b", "mail", "www", "zz" };
+
+static struct cache *
+mkcache(void)
+{
+	struct cache *C;
+	char name[DNS_D_MAXNAME + 1];
+	struct dns_txt txt;
+	unsigned i, j;
+	int error;
+
+	dns_txt_init(&txt, sizeof txt);
+	txt.len = 3;
+	memcpy(txt.data, "txt", 3);
+
+	if (!(C = cache_open(&error)))
+		errx(1, "cache_open: %s", dns_strerror(error));
+
+	for (i = 0; i < sizeof host / sizeof *host; i++) {
+		snprintf(name, sizeof name, "%s.example.com.", host[i]);
+
+		for (j = 0; j <= i; j++) {
+			struct dns_a a = { { htonl(0xc0000200 + 10 * i + j) } };
+
+			if ((error = cache_insert(C, name, DNS_T_A, 300, &a)))
+				errx(1, "cache_insert: %s", dns_strerror(error));
+		}
+
+		if ((error = cache_insert(C, name, DNS_T_TXT, 300, &txt)))
+			errx(1, "cache_insert: %s", dns_strerror(error));
+	}
+
+	return C;
+}
+
+static char *
+dump(struct cache *C)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	if (!(fp = open_memstream(&buf, &size)))
+		err(1, "open_memstream");
+	cache_dumpfile(C, fp);
+	fclose(fp);
+
+	return buf;
+}
+
+static unsigned
+query(struct cache *C, const char *qname, enum dns_type qtype)
+{
+	struct dns_cache *res = cache_resi(C);
+	struct dns_packet *Q = dns_p_new(512), *A;
+	unsigned count;
+	int error = 0;
+
+	if ((error = dns_p_push(Q, DNS_S_QD, qname, strlen(qname), qtype, DNS_C_IN, 0, 0)))
+		errx(1, "dns_p_push: %s", dns_strerror(error));
+
+	if (!(A = res->query(Q, res, &error))) {
+		if (error)
+			errx(1, "%s: %s", qname, dns_strerror(error));
+		return 0;
+	}
+
+	count = dns_p_count(A, DNS_S_AN);
+	dns_p_free(A);
+
+	return count;
+}
+
+static void
+save(struct cache *C, const char *path)
+{
+	FILE *fp;
+	int error;
+
+	if (!(fp = fopen(path, "w")))
+		err(1, "%s", path);
+	if ((error = cache_saveimage(C, fp)))
+		errx(1, "cache_saveimage: %s", dns_strerror(error));
+	if (0 != fclose(fp))
+		err(1, "%s", path);
+}
+
+static size_t
+slurp(const char *path, unsigned char **data)
+{
+	FILE *fp;
+	long size;
+
+	if (!(fp = fopen(path, "r")) || 0 != fseek(fp, 0, SEEK_END) || -1 == (size = ftell(fp)))
+		err(1, "%s", path);
+	rewind(fp);
+
+	if (!(*data = malloc(size)) || (size_t)size != fread(*data, 1, size, fp))
+		err(1, "%s", path);
+	fclose(fp);
+
+	return size;
+}
+
+static void
+spew(const char *path, const unsigned char *data, size_t size)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(path, "w")) || size != fwrite(data, 1, size, fp) || 0 != fclose(fp))
+		err(1, "%s", path);
+}
+
+static void
+reject(const char *path, const char *what)
+{
+	struct cache *C;
+	int error;
+
+	if (!(C = cache_open(&error)))
+		errx(1, "cache_open: %s", dns_strerror(error));
+
+	if (EINVAL != (error = cache_loadimage(C, path)))
+		errx(1, "%s: accepted (%s)", what, (error)? dns_strerror(error) : "no error");
+
+	cache_close(C);
+}
+
+int
+main(void)
+{
+	char path[] = "/tmp/cache_image.XXXXXX";
+	struct cache *C, *I;
+	unsigned char *data, *copy, tmp[ENTLEN];
+	char *expect, *got;
+	size_t size, count, i;
+	uint32_t off;
+	int fd, error;
+
+	if (-1 == (fd = mkstemp(path)))
+		err(1, "mkstemp");
+	close(fd);
+
+	C = mkcache();
+	expect = dump(C);
+	save(C, path);
+
+	if (!(I = cache_open(&error)))
+		errx(1, "cache_open: %s", dns_strerror(error));
+	if ((error = cache_loadimage(I, path)))
+		errx(1, "cache_loadimage: %s", dns_strerror(error));
+
+	got = dump(I);
+	if (strcmp(got, expect))
+		errx(1, "image dump differs:\n%sexpected:\n%s", got, expect);
+	free(got);
+
+	/* every entry must be found by the binary search */
+	for (i = 0; i < sizeof host / sizeof *host; i++) {
+		char name[DNS_D_MAXNAME + 1];
+
+		snprintf(name, sizeof name, "%s.example.com.", host[i]);
+
+		if (query(I, name, DNS_T_A) != i + 1 || query(C, name, DNS_T_A) != i + 1)
+			errx(1, "%s A: wrong answer", name);
+		if (query(I, name, DNS_T_TXT) != 1)
+			errx(1, "%s TXT: wrong answer", name);
+		if (query(I, name, DNS_T_MX) != 0)
+			errx(1, "%s MX: unexpected answer", name);
+	}
+
+	if (query(I, "WWW.Example.COM.", DNS_T_A) != 4)
+		errx(1, "lookup not case-insensitive");
+	if (query(I, "nope.example.com.", DNS_T_A) != 0)
+		errx(1, "nope.example.com.: unexpected answer");
+
+	cache_close(I);
+	cache_close(C);
+
+	size = slurp(path, &data);
+	memcpy(&off, &data[16], 4);
+	count = off;
+	if (count != 2 * (sizeof host / sizeof *host))
+		errx(1, "image holds %zu RRsets", count);
+
+	if (!(copy = malloc(size)))
+		err(1, "malloc");
+
+	/* swapping two entries breaks the ordering */
+	memcpy(copy, data, size);
+	memcpy(tmp, &copy[HDRLEN + 1 * ENTLEN], ENTLEN);
+	memcpy(&copy[HDRLEN + 1 * ENTLEN], &copy[HDRLEN + 2 * ENTLEN], ENTLEN);
+	memcpy(&copy[HDRLEN + 2 * ENTLEN], tmp, ENTLEN);
+	spew(path, copy, size);
+	reject(path, "unsorted index");
+
+	/* a duplicate entry is as bad */
+	memcpy(copy, data, size);
+	memcpy(&copy[HDRLEN + 1 * ENTLEN], &copy[HDRLEN + 0 * ENTLEN], ENTLEN);
+	spew(path, copy, size);
+	reject(path, "duplicate entry");
+
+	/* packet running past the end */
+	memcpy(copy, data, size);
+	off = size;
+	memcpy(&copy[HDRLEN + 3 * ENTLEN + 12], &off, 4);
+	spew(path, copy, size);
+	reject(path, "packet out of bounds");
+
+	/* name offset past the end */
+	memcpy(copy, data, size);
+	memcpy(&copy[HDRLEN + 3 * ENTLEN + 4], &off, 4);
+	spew(path, copy, size);
+	reject(path, "name out of bounds");
+
+	/* truncated */
+	spew(path, data, size - 1);
+	reject(path, "truncated image");
+
+	free(copy);
+	free(data);
+	free(expect);
+	unlink(path);
+
+	warnx("OK");
+
+	return 0;
+}
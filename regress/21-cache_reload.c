@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <err.h>
+#include <arpa/inet.h>
+
+#include "dns.h"
+#include "cache.h"
+
+/*
+ * cache_reloadfile() diffs a zone against the live cache as it streams.
+ * A reload must only touch its own zone: a sibling zone, a zone loaded
+ * beneath it and learned entries survive. A RRset split across the file
+ * is merged, and an unchanged serial stops the reload at the SOA. A reload
+ * failing midway drops the zone's SOA, so retrying the same serial is
+ * applied rather than skipped. Without an origin, the SOA names the zone.
+ */
+static const char v1[] =
+	"$ORIGIN example.com.\n"
+	"@ 60 IN SOA ns hostmaster.example.com. 1 3600 600 86400 300\n"
+	"a 60 IN A 192.0.2.1\n"
+	"b 60 IN A 192.0.2.2\n"
+	"c 60 IN TXT \"old\"\n";
+
+static const char v2[] =
+	"$ORIGIN example.com.\n"
+	"@ 60 IN SOA ns hostmaster.example.com. 2 3600 600 86400 300\n"
+	"a 60 IN A 192.0.2.9\n"
+	"d 60 IN A 192.0.2.4\n"
+	"c 60 IN TXT \"old\"\n"
+	"d 60 IN A 192.0.2.5\n";
+
+/* serial 2 again, but different; must be skipped */
+static const char v2bis[] =
+	"$ORIGIN example.com.\n"
+	"@ 60 IN SOA ns hostmaster.example.com. 2 3600 600 86400 300\n"
+	"z 60 IN A 192.0.2.26\n";
+
+static const char sub[] =
+	"$ORIGIN sub.example.com.\n"
+	"@ 60 IN SOA ns hostmaster.sub.example.com. 7 3600 600 86400 300\n"
+	"x 60 IN A 198.51.100.1\n";
+
+static const char org[] =
+	"$ORIGIN example.org.\n"
+	"@ 60 IN SOA ns hostmaster.example.org. 1 3600 600 86400 300\n"
+	"www 60 IN A 203.0.113.1\n";
+
+static const char v2dump[] =
+	"example.com. 60 IN SOA ns.example.com. hostmaster.example.com. 2 3600 600 86400 300\n"
+	"a.example.com. 60 IN A 192.0.2.9\n"
+	"c.example.com. 60 IN TXT \"old\"\n"
+	"d.example.com. 60 IN A 192.0.2.4\n"
+	"d.example.com. 60 IN A 192.0.2.5\n"
+	"learned.example.com. 60 IN A 192.0.2.200\n"
+	"sub.example.com. 60 IN SOA ns.sub.example.com. hostmaster.sub.example.com. 7 3600 600 86400 300\n"
+	"x.sub.example.com. 60 IN A 198.51.100.1\n"
+	"example.org. 60 IN SOA ns.example.org. hostmaster.example.org. 1 3600 600 86400 300\n"
+	"www.example.org. 60 IN A 203.0.113.1\n";
+
+static FILE *
+text(const char *src)
+{
+	FILE *fp;
+
+	if (!(fp = tmpfile()) || strlen(src) != fwrite(src, 1, strlen(src), fp))
+		err(1, "tmpfile");
+	rewind(fp);
+
+	return fp;
+}
+
+static void
+load(struct cache *C, const char *src, const char *origin, _Bool reload, int expect)
+{
+	FILE *fp = text(src);
+	int error;
+
+	if (reload)
+		error = cache_reloadfile(C, fp, origin, 3600);
+	else
+		error = cache_loadfile(C, fp, origin, 3600);
+
+	if (error != expect)
+		errx(1, "%s: %s (expected %s)", (reload)? "reload" : "load", dns_strerror(error), (expect)? dns_strerror(expect) : "success");
+
+	fclose(fp);
+}
+
+static void
+check(struct cache *C, const char *what, const char *expect)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	if (!(fp = open_memstream(&buf, &size)))
+		err(1, "open_memstream");
+	cache_dumpfile(C, fp);
+	fclose(fp);
+
+	if (strcmp(buf, expect))
+		errx(1, "%s: expected:\n%sgot:\n%s", what, expect, buf);
+
+	free(buf);
+}
+
+int
+main(void)
+{
+	struct dns_a a = { { htonl(0xc00002c8) } };
+	char bad[4096];
+	struct cache *C;
+	size_t n;
+	int error, i;
+
+	if (!(C = cache_open(&error)))
+		errx(1, "cache_open: %s", dns_strerror(error));
+
+	load(C, v1, NULL, 0, 0);
+	load(C, sub, NULL, 0, 0);
+	load(C, org, NULL, 0, 0);
+
+	if ((error = cache_insert(C, "learned.example.com.", DNS_T_A, 60, &a)))
+		errx(1, "cache_insert: %s", dns_strerror(error));
+
+	load(C, v2, NULL, 1, 0);
+	check(C, "reload", v2dump);
+
+	load(C, v2bis, "example.com.", 1, 0);
+	check(C, "same serial", v2dump);
+
+	/* serial 3 with an RRset too large for the cache */
+	n = snprintf(bad, sizeof bad, "$ORIGIN example.com.\n@ 60 IN SOA ns hostmaster.example.com. 3 3600 600 86400 300\nnew 60 IN A 192.0.2.3\n");
+	for (i = 0; i < 100; i++)
+		n += snprintf(&bad[n], sizeof bad - n, "big 60 IN A 192.0.2.%d\n", i);
+
+	load(C, bad, NULL, 1, DNS_ENOBUFS);
+
+	/* whatever was applied, the old serial must not be trusted */
+	load(C, v2bis, NULL, 1, 0);
+	check(C, "retry",
+		"example.com. 60 IN SOA ns.example.com. hostmaster.example.com. 2 3600 600 86400 300\n"
+		"learned.example.com. 60 IN A 192.0.2.200\n"
+		"sub.example.com. 60 IN SOA ns.sub.example.com. hostmaster.sub.example.com. 7 3600 600 86400 300\n"
+		"x.sub.example.com. 60 IN A 198.51.100.1\n"
+		"z.example.com. 60 IN A 192.0.2.26\n"
+		"example.org. 60 IN SOA ns.example.org. hostmaster.example.org. 1 3600 600 86400 300\n"
+		"www.example.org. 60 IN A 203.0.113.1\n");
+
+	cache_close(C);
+
+	warnx("OK");
+
+	return 0;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <err.h>
+
+#include "dns.h"
+#include "cache.h"
+
+/*
+ * A recursive resolver given a local copy of the root (RFC 8806) through
+ * dns_res_setlocal() must answer from it at DNS_R_HINTS: data, NODATA and
+ * NXDOMAIN without the network, and referrals below its cuts. The hints
+ * are empty, so anything left to the network fails instead.
+ */
+static const char root[] =
+	"$ORIGIN .\n"
+	"@ 86400 IN SOA a.root-servers.net. nstld.verisign-grs.com. 7 1800 900 604800 3600\n"
+	"@ 518400 IN NS a.root-servers.net.\n"
+	"com. 172800 IN NS a.gtld-servers.net.\n"
+	"net. 172800 IN NS a.gtld-servers.net.\n"
+	"a.gtld-servers.net. 172800 IN A 192.5.6.30\n"
+	"a.root-servers.net. 518400 IN A 198.41.0.4\n"
+	"a.b.ent. 86400 IN TXT \"deep\"\n"
+	"*.wild. 86400 IN TXT \"wild\"\n"
+	"alias. 86400 IN CNAME a.b.ent.\n";
+
+static struct dns_packet *
+local(struct cache *C, const char *qname, enum dns_type qtype, int *error)
+{
+	struct dns_cache *res = cache_local(C);
+	struct dns_packet *Q = dns_p_new(512);
+
+	if ((*error = dns_p_push(Q, DNS_S_QD, qname, strlen(qname), qtype, DNS_C_IN, 0, 0)))
+		errx(1, "dns_p_push: %s", dns_strerror(*error));
+
+	*error = 0;
+
+	return res->query(Q, res, error);
+}
+
+static struct dns_packet *
+resolve(struct dns_resolver *R, const char *qname, enum dns_type qtype, int *error)
+{
+	if ((*error = dns_res_submit(R, qname, qtype, DNS_C_IN)))
+		errx(1, "%s: dns_res_submit: %s", qname, dns_strerror(*error));
+
+	while ((*error = dns_res_check(R))) {
+		if (*error != EAGAIN)
+			return NULL;
+		dns_res_poll(R, 1);
+	}
+
+	return dns_res_fetch(R, error);
+}
+
+static void
+negative(struct dns_resolver *R, const char *qname, enum dns_type qtype, enum dns_rcode rcode)
+{
+	struct dns_packet *A;
+	struct dns_rr rr;
+	int error;
+
+	if (!(A = resolve(R, qname, qtype, &error)))
+		errx(1, "%s: %s", qname, dns_strerror(error));
+
+	if (dns_p_rcode(A) != rcode || !dns_header(A)->aa || dns_p_count(A, DNS_S_AN))
+		errx(1, "%s: expected authoritative %s", qname, dns_strrcode(rcode));
+
+	if (dns_p_count(A, DNS_S_NS) != 1)
+		errx(1, "%s: no SOA in the authority section", qname);
+
+	dns_rr_foreach(&rr, A, .section = DNS_S_NS) {
+		if (rr.type != DNS_T_SOA || rr.ttl != 3600)
+			errx(1, "%s: authority isn't the SOA with the negative TTL", qname);
+	}
+
+	dns_p_free(A);
+}
+
+int
+main(void)
+{
+	struct dns_resolv_conf *resconf;
+	struct dns_hosts *hosts;
+	struct dns_hints *hints;
+	struct dns_resolver *R;
+	struct dns_packet *A;
+	struct cache *C;
+	FILE *fp;
+	int error;
+
+	if (!(C = cache_open(&error)))
+		errx(1, "cache_open: %s", dns_strerror(error));
+
+	if (!(fp = tmpfile()) || sizeof root - 1 != fwrite(root, 1, sizeof root - 1, fp))
+		err(1, "tmpfile");
+	rewind(fp);
+
+	if ((error = cache_loadfile(C, fp, ".", 3600)))
+		errx(1, "cache_loadfile: %s", dns_strerror(error));
+	fclose(fp);
+
+	/* below a cut: a referral carrying the glue */
+	if (!(A = local(C, "www.example.com.", DNS_T_A, &error)))
+		errx(1, "www.example.com.: no referral (%s)", dns_strerror(error));
+	if (dns_header(A)->aa || dns_p_count(A, DNS_S_AN) || dns_p_count(A, DNS_S_NS) != 1 || dns_p_count(A, DNS_S_AR) != 1)
+		errx(1, "www.example.com.: malformed referral");
+	dns_p_free(A);
+
+	/* left to the network */
+	if ((A = local(C, "x.wild.", DNS_T_TXT, &error)) || error)
+		errx(1, "x.wild.: wildcard answered locally");
+	if ((A = local(C, "alias.", DNS_T_A, &error)) || error)
+		errx(1, "alias.: CNAME answered locally");
+
+	if (!(resconf = dns_resconf_open(&error)))
+		errx(1, "dns_resconf_open: %s", dns_strerror(error));
+
+	memset(resconf->lookup, 0, sizeof resconf->lookup);
+	resconf->lookup[0] = 'b';
+	resconf->options.recurse = 1;
+
+	if (!(hosts = dns_hosts_open(&error)))
+		errx(1, "dns_hosts_open: %s", dns_strerror(error));
+	if (!(hints = dns_hints_open(resconf, &error)))
+		errx(1, "dns_hints_open: %s", dns_strerror(error));
+	if (!(R = dns_res_open(resconf, hosts, hints, NULL, dns_opts(), &error)))
+		errx(1, "dns_res_open: %s", dns_strerror(error));
+
+	dns_res_setlocal(R, cache_local(C));
+
+	if (!(A = resolve(R, "a.b.ent.", DNS_T_TXT, &error)))
+		errx(1, "a.b.ent.: %s", dns_strerror(error));
+	if (dns_p_rcode(A) != DNS_RC_NOERROR || !dns_header(A)->aa || dns_p_count(A, DNS_S_AN) != 1)
+		errx(1, "a.b.ent.: expected an authoritative answer");
+	dns_p_free(A);
+
+	negative(R, "nonexistent-tld.", DNS_T_A, DNS_RC_NXDOMAIN);
+	negative(R, "c.ent.", DNS_T_A, DNS_RC_NXDOMAIN);
+	negative(R, "a.b.ent.", DNS_T_AAAA, DNS_RC_NOERROR);
+	negative(R, ".", DNS_T_MX, DNS_RC_NOERROR);
+	/* an empty non-terminal exists */
+	negative(R, "b.ent.", DNS_T_A, DNS_RC_NOERROR);
+
+	/* a wildcard must not be denied, and the empty hints can't resolve it */
+	if ((A = resolve(R, "x.wild.", DNS_T_TXT, &error))) {
+		if (dns_p_rcode(A) == DNS_RC_NXDOMAIN)
+			errx(1, "x.wild.: denied despite the wildcard");
+		dns_p_free(A);
+	}
+
+	dns_res_close(R);
+	dns_hints_close(hints);
+	dns_hosts_close(hosts);
+	dns_resconf_close(resconf);
+	cache_close(C);
+
+	warnx("OK");
+
+	return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <err.h>
+
+#include "dns.h"
+#include "cache.h"
+
+/*
+ * An excerpt of the root zone as IANA publishes it, tab separated, with
+ * a DNSKEY grouped over lines as dig prints it. Every record must load,
+ * DNSSEC and ZONEMD ones as opaque RDATA, and the DS and NSEC of a TLD
+ * must be answered from the parent side of its cut.
+ */
+static const char root[] =
+	".\t86400\tIN\tSOA\ta.root-servers.net. nstld.verisign-grs.com. 2023121900 1800 900 604800 86400\n"
+	".\t86400\tIN\tRRSIG\tSOA 8 0 86400 20240101050000 20231219040000 46780 . cm9vdCB6b25lIHNpZ25hdHVyZSwgdHJ1bmNhdGVkIQ==\n"
+	".\t518400\tIN\tNS\ta.root-servers.net.\n"
+	".\t86400\tIN\tZONEMD\t2023121900 1 241 01020304 05060708 090A0B0C\n"
+	".\t172800\tIN\tDNSKEY\t257 3 8 ( AQIDBAUGBwgJCgsMDQ4PEBESExQVFhcYGRobH\n"
+	"\t\t\tB0eHyAhIiMkJSYnKP7/ ) ; KSK\n"
+	".\t86400\tIN\tNSEC\taaa. ZONEMD NS SOA RRSIG NSEC DNSKEY\n"
+	"com.\t172800\tIN\tNS\ta.gtld-servers.net.\n"
+	"com.\t86400\tIN\tDS\t19718 13 2 8ACBB0CD28F41250A80A491389424D341522D946B0DA0C0291F2D3D7 71D7805A\n"
+	"com.\t86400\tIN\tNSEC\tcommbank. NS DS RRSIG NSEC\n"
+	"net.\t172800\tIN\tNS\ta.gtld-servers.net.\n"
+	"a.gtld-servers.net.\t172800\tIN\tA\t192.5.6.30\n"
+	"a.root-servers.net.\t518400\tIN\tA\t198.41.0.4\n";
+
+static const unsigned char ds[] = {
+	0x4d, 0x06, 13, 2,
+	0x8a, 0xcb, 0xb0, 0xcd, 0x28, 0xf4, 0x12, 0x50, 0xa8, 0x0a, 0x49, 0x13, 0x89, 0x42, 0x4d, 0x34,
+	0x15, 0x22, 0xd9, 0x46, 0xb0, 0xda, 0x0c, 0x02, 0x91, 0xf2, 0xd3, 0xd7, 0x71, 0xd7, 0x80, 0x5a,
+};
+
+static const unsigned char dnskey[] = {
+	0x01, 0x01, 3, 8,
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,
+	21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	0xfe, 0xff,
+};
+
+static const unsigned char rrsig[] = {
+	0x00, 0x06, 8, 0, 0x00, 0x01, 0x51, 0x80,
+	0x65, 0x92, 0x46, 0xd0, /* 20240101050000 */
+	0x65, 0x81, 0x15, 0x40, /* 20231219040000 */
+	0xb6, 0xbc, 0,
+	'r', 'o', 'o', 't', ' ', 'z', 'o', 'n', 'e', ' ', 's', 'i', 'g', 'n', 'a', 't', 'u', 'r', 'e', ',',
+	' ', 't', 'r', 'u', 'n', 'c', 'a', 't', 'e', 'd', '!',
+};
+
+static const unsigned char zonemd[] = {
+	0x78, 0x96, 0x63, 0xec, 1, 241,
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+};
+
+static const unsigned char apexnsec[] = {
+	3, 'a', 'a', 'a', 0,
+	0, 8, 0x22, 0x00, 0x00, 0x00, 0x00, 0x03, 0x80, 0x01,
+};
+
+static const unsigned char tldnsec[] = {
+	8, 'c', 'o', 'm', 'm', 'b', 'a', 'n', 'k', 0,
+	0, 6, 0x20, 0x00, 0x00, 0x00, 0x00, 0x13,
+};
+
+static struct dns_packet *
+local(struct cache *C, const char *qname, enum dns_type qtype)
+{
+	struct dns_cache *res = cache_local(C);
+	struct dns_packet *Q = dns_p_new(512), *A;
+	int error = 0;
+
+	if ((error = dns_p_push(Q, DNS_S_QD, qname, strlen(qname), qtype, DNS_C_IN, 0, 0)))
+		errx(1, "dns_p_push: %s", dns_strerror(error));
+
+	if (!(A = res->query(Q, res, &error)))
+		errx(1, "%s %s: not answered locally (%s)", qname, dns_strtype(qtype), (error)? dns_strerror(error) : "no error");
+
+	return A;
+}
+
+static void
+answer(struct cache *C, const char *qname, enum dns_type qtype, const void *rdata, size_t rdlen)
+{
+	struct dns_packet *A = local(C, qname, qtype);
+	struct dns_rr rr;
+
+	if (dns_p_rcode(A) != DNS_RC_NOERROR || !dns_header(A)->aa || dns_p_count(A, DNS_S_AN) != 1)
+		errx(1, "%s %s: expected an authoritative answer", qname, dns_strtype(qtype));
+
+	dns_rr_foreach(&rr, A, .section = DNS_S_AN) {
+		if (rr.type != qtype || rr.rd.len != rdlen || memcmp(&A->data[rr.rd.p], rdata, rdlen))
+			errx(1, "%s %s: wrong RDATA", qname, dns_strtype(qtype));
+	}
+
+	dns_p_free(A);
+}
+
+int
+main(void)
+{
+	struct dns_packet *A;
+	struct cache *C;
+	FILE *fp;
+	int error;
+
+	if (!(C = cache_open(&error)))
+		errx(1, "cache_open: %s", dns_strerror(error));
+
+	if (!(fp = tmpfile()) || sizeof root - 1 != fwrite(root, 1, sizeof root - 1, fp))
+		err(1, "tmpfile");
+	rewind(fp);
+
+	if ((error = cache_loadfile(C, fp, ".", 3600)))
+		errx(1, "cache_loadfile: %s", dns_strerror(error));
+	fclose(fp);
+
+	answer(C, ".", DNS_T_DNSKEY, dnskey, sizeof dnskey);
+	answer(C, ".", DNS_T_RRSIG, rrsig, sizeof rrsig);
+	answer(C, ".", DNS_T_ZONEMD, zonemd, sizeof zonemd);
+	answer(C, ".", DNS_T_NSEC, apexnsec, sizeof apexnsec);
+
+	/* the parent side of the cut, not a referral */
+	answer(C, "com.", DNS_T_DS, ds, sizeof ds);
+	answer(C, "com.", DNS_T_NSEC, tldnsec, sizeof tldnsec);
+
+	A = local(C, "net.", DNS_T_DS);
+	if (dns_p_rcode(A) != DNS_RC_NOERROR || !dns_header(A)->aa || dns_p_count(A, DNS_S_AN))
+		errx(1, "net. DS: expected NODATA");
+	dns_p_free(A);
+
+	A = local(C, "com.", DNS_T_NS);
+	if (dns_header(A)->aa || dns_p_count(A, DNS_S_NS) != 1)
+		errx(1, "com. NS: expected a referral");
+	dns_p_free(A);
+
+	cache_close(C);
+
+	warnx("OK");
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <err.h>
+#include <pthread.h>
+
+#include "dns.h"
+
+#define countof(a) (sizeof (a) / sizeof *(a))
+
+static struct dns_p_stat
+delta(const struct dns_p_stat *from)
+{
+	const struct dns_p_stat *now = dns_p_stat();
+
+	return (struct dns_p_stat){
+		.allocs = now->allocs - from->allocs,
+		.hits   = now->hits - from->hits,
+		.misses = now->misses - from->misses,
+		.frees  = now->frees - from->frees,
+		.cached = now->cached - from->cached,
+	};
+}
+
+static void
+expect(const char *what, const struct dns_p_stat *from, unsigned long allocs, unsigned long hits, unsigned long misses, unsigned long frees, unsigned long cached)
+{
+	struct dns_p_stat d = delta(from);
+
+	if (d.allocs != allocs || d.hits != hits || d.misses != misses || d.frees != frees || d.cached != cached)
+		errx(1, "%s: expected %lu/%lu/%lu/%lu/%lu allocs/hits/misses/frees/cached, but got %lu/%lu/%lu/%lu/%lu", what,
+			allocs, hits, misses, frees, cached,
+			d.allocs, d.hits, d.misses, d.frees, d.cached);
+}
+
+static struct dns_packet *
+make(size_t len)
+{
+	struct dns_packet *P;
+	int error;
+
+	if (!(P = dns_p_make(len, &error)))
+		errx(1, "dns_p_make: %s", dns_strerror(error));
+
+	return P;
+}
+
+/* a fresh thread starts with an empty pool and zeroed counters */
+static void *
+other(void *arg)
+{
+	struct dns_packet *P = arg;
+	const struct dns_p_stat *stat = dns_p_stat();
+
+	if (stat->allocs || stat->frees)
+		errx(1, "thread: counters shared with the main thread");
+
+	dns_p_free(P);
+
+	if (dns_p_stat()->frees != 1 || dns_p_stat()->cached != 1)
+		errx(1, "thread: free not counted in the thread's own pool");
+
+	return NULL;
+}
+
+int
+main(void)
+{
+	struct dns_packet *P, *Q, *many[40];
+	struct dns_p_stat from;
+	pthread_t thread;
+	size_t i;
+
+	dns_p_flush();
+
+	/* a released packet serves the next request of its size class */
+	from = *dns_p_stat();
+	P = make(512);
+	dns_p_free(P);
+	Q = make(300);
+	if (Q != P)
+		errx(1, "packet not reused");
+	expect("reuse", &from, 2, 1, 1, 1, 1);
+
+	/* sizes round up to a class; another class doesn't hit */
+	from = *dns_p_stat();
+	P = make(600);
+	if (P->size != 1024)
+		errx(1, "size 600: expected class 1024, but got %zu", P->size);
+	expect("class", &from, 1, 0, 1, 0, 0);
+
+	/* dns_p_grow releases the smaller packet to the pool */
+	from = *dns_p_stat();
+	if (dns_p_grow(&Q))
+		errx(1, "dns_p_grow failed");
+	if (Q->size != 1024)
+		errx(1, "grow: expected class 1024, but got %zu", Q->size);
+	expect("grow", &from, 1, 0, 1, 1, 1);
+	dns_p_free(P);
+	dns_p_free(Q);
+
+	/* the free lists are bounded */
+	from = *dns_p_stat();
+	for (i = 0; i < countof(many); i++)
+		many[i] = make(2048);
+	for (i = 0; i < countof(many); i++)
+		dns_p_free(many[i]);
+	if (delta(&from).cached >= countof(many))
+		errx(1, "free list not bounded");
+
+	/* dns_p_flush empties them */
+	dns_p_flush();
+	from = *dns_p_stat();
+	dns_p_free(make(2048));
+	expect("flush", &from, 1, 0, 1, 1, 1);
+
+	/* each thread keeps its own pool */
+	from = *dns_p_stat();
+	P = make(512);
+	if (pthread_create(&thread, NULL, &other, P) || pthread_join(thread, NULL))
+		errx(1, "pthread_create failed");
+	expect("thread", &from, 1, 0, 1, 0, 0);
+
+	dns_p_flush();
+
+	warnx("OK");
+
+	return 0;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <err.h>
+#include <arpa/inet.h>
+
+#include "dns.h"
+#include "cache.h"
+#include "allocs.h"
+
+/*
+ * Everything a resolver opened with an allocator hands out or keeps must
+ * come from it: the answers of the hosts table, the hints and a local
+ * cache included. Nothing may reach malloc(3) while resolving, and
+ * nothing may be left once everything is closed.
+ */
+static const char zone[] =
+	"$ORIGIN .\n"
+	"@ 86400 IN SOA a.root-servers.net. nstld.verisign-grs.com. 7 1800 900 604800 3600\n"
+	"@ 518400 IN NS a.root-servers.net.\n"
+	"a.root-servers.net. 518400 IN A 198.41.0.4\n"
+	"a.b.ent. 86400 IN TXT \"deep\"\n";
+
+/* a bump allocator, so counting it doesn't itself reach malloc(3) */
+struct counter {
+	unsigned long mallocs, frees, live;
+	size_t used;
+	_Alignas(16) unsigned char arena[1 << 20];
+};
+
+static void *
+counting_malloc(size_t size, void *arg)
+{
+	struct counter *n = arg;
+	void *p;
+
+	size = (size + 15) & ~(size_t)15;
+
+	if (size > sizeof n->arena - n->used)
+		return NULL;
+
+	p = &n->arena[n->used];
+	n->used += size;
+	n->mallocs++;
+	n->live++;
+
+	return p;
+}
+
+static void
+counting_free(void *p, void *arg)
+{
+	struct counter *n = arg;
+
+	if (p) {
+		n->frees++;
+		n->live--;
+	}
+}
+
+static struct dns_packet *
+resolve(struct dns_resolver *R, const char *qname, enum dns_type qtype, struct counter *n)
+{
+	struct dns_packet *A;
+	int error;
+
+	if ((error = dns_res_submit(R, qname, qtype, DNS_C_IN)))
+		errx(1, "%s: dns_res_submit: %s", qname, dns_strerror(error));
+
+	while ((error = dns_res_check(R))) {
+		if (error != EAGAIN)
+			errx(1, "%s: %s", qname, dns_strerror(error));
+		dns_res_poll(R, 1);
+	}
+
+	if (!(A = dns_res_fetch(R, &error)))
+		errx(1, "%s: %s", qname, dns_strerror(error));
+
+	if (A->alloc.arg != n)
+		errx(1, "%s: answer not from the allocator", qname);
+
+	return A;
+}
+
+int
+main(void)
+{
+	static struct counter n;
+	struct dns_options opts = { .alloc = { &n, &counting_malloc, NULL, &counting_free } };
+	struct dns_resolv_conf *resconf;
+	struct dns_hosts *hosts;
+	struct dns_hints *hints;
+	struct dns_resolver *R;
+	struct dns_packet *Q = dns_p_new(512), *A;
+	struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(53) };
+	struct in_addr addr;
+	unsigned long allocs;
+	struct cache *C;
+	FILE *fp;
+	int error;
+
+	if (!(C = cache_open2(&opts, &error)))
+		errx(1, "cache_open2: %s", dns_strerror(error));
+
+	if (!(fp = tmpfile()) || sizeof zone - 1 != fwrite(zone, 1, sizeof zone - 1, fp))
+		err(1, "tmpfile");
+	rewind(fp);
+
+	if ((error = cache_loadfile(C, fp, ".", 3600)))
+		errx(1, "cache_loadfile: %s", dns_strerror(error));
+	fclose(fp);
+
+	allocs = nallocs;
+
+	if (!(resconf = dns_resconf_open2(&opts, &error)))
+		errx(1, "dns_resconf_open2: %s", dns_strerror(error));
+
+	memset(resconf->lookup, 0, sizeof resconf->lookup);
+	resconf->lookup[0] = 'f';
+	resconf->lookup[1] = 'b';
+	resconf->options.recurse = 1;
+
+	if (!(hosts = dns_hosts_open2(&opts, &error)))
+		errx(1, "dns_hosts_open2: %s", dns_strerror(error));
+
+	inet_pton(AF_INET, "192.0.2.1", &addr);
+	if ((error = dns_hosts_insert(hosts, AF_INET, &addr, "host.example.", 0)))
+		errx(1, "dns_hosts_insert: %s", dns_strerror(error));
+
+	/* the hints take the resolv.conf's allocator */
+	if (!(hints = dns_hints_open(resconf, &error)))
+		errx(1, "dns_hints_open: %s", dns_strerror(error));
+
+	inet_pton(AF_INET, "192.0.2.53", &sin.sin_addr);
+	if ((error = dns_hints_insert(hints, "example.", (struct sockaddr *)&sin, 1)))
+		errx(1, "dns_hints_insert: %s", dns_strerror(error));
+
+	if (!(R = dns_res_open(resconf, hosts, hints, NULL, &opts, &error)))
+		errx(1, "dns_res_open: %s", dns_strerror(error));
+
+	dns_res_setlocal(R, cache_local(C));
+
+	/* from the hosts table */
+	A = resolve(R, "host.example.", DNS_T_A, &n);
+	if (dns_p_count(A, DNS_S_AN) != 1)
+		errx(1, "host.example.: expected the hosts entry");
+	dns_p_free(A);
+
+	/* from the local cache */
+	A = resolve(R, "a.b.ent.", DNS_T_TXT, &n);
+	if (dns_p_rcode(A) != DNS_RC_NOERROR || dns_p_count(A, DNS_S_AN) != 1)
+		errx(1, "a.b.ent.: expected an answer");
+	dns_p_free(A);
+
+	/* the referral the hints make for a stub query */
+	if ((error = dns_p_push(Q, DNS_S_QD, "www.example.", strlen("www.example."), DNS_T_A, DNS_C_IN, 0, NULL)))
+		errx(1, "dns_p_push: %s", dns_strerror(error));
+	if (!(A = dns_hints_query(hints, Q, &error)))
+		errx(1, "dns_hints_query: %s", dns_strerror(error));
+	if (A->alloc.arg != &n)
+		errx(1, "hints answer not from the allocator");
+	dns_p_free(A);
+
+	dns_res_close(R);
+	dns_hints_close(hints);
+	dns_hosts_close(hosts);
+	dns_resconf_close(resconf);
+
+	if (HAVE_ALLOCS && nallocs != allocs)
+		errx(1, "%lu allocations bypassed the allocator", nallocs - allocs);
+
+	cache_close(C);
+
+	if (!n.mallocs || n.live)
+		errx(1, "%lu of %lu allocations left", n.live, n.mallocs);
+
+	warnx("OK");
+
+	return 0;
+}
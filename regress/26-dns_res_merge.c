@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "dns.c"
+
+/*
+ * dns_res_merge() joins the answer to a CNAME with the answer for its
+ * target. A record in both must appear once, however the names in it
+ * are compressed or cased; the hash must agree with dns_rr_cmp(). The
+ * header counts bound how many records are considered, but can't be
+ * trusted to size anything.
+ */
+static struct dns_packet *
+make(const char *qname)
+{
+	struct dns_packet *P;
+	int error;
+
+	if (!(P = dns_p_make(1024, &error)))
+		errx(1, "dns_p_make: %s", dns_strerror(error));
+
+	if ((error = dns_p_push(P, DNS_S_QD, qname, strlen(qname), DNS_T_MX, DNS_C_IN, 0, NULL)))
+		errx(1, "dns_p_push: %s", dns_strerror(error));
+
+	return P;
+}
+
+static void
+push(struct dns_packet *P, enum dns_section section, const char *name, enum dns_type type, const void *any)
+{
+	int error;
+
+	if ((error = dns_p_push(P, section, name, strlen(name), type, DNS_C_IN, 3600, any)))
+		errx(1, "dns_p_push(%s %s): %s", name, dns_strtype(type), dns_strerror(error));
+}
+
+static unsigned
+count(struct dns_packet *P, enum dns_section section, enum dns_type type)
+{
+	struct dns_rr rr;
+	unsigned n = 0;
+
+	dns_rr_foreach(&rr, P, .section = section, .type = type) {
+		n++;
+	}
+
+	return n;
+}
+
+static unsigned short
+rdlen(struct dns_packet *P, enum dns_section section, enum dns_type type)
+{
+	struct dns_rr rr;
+
+	dns_rr_foreach(&rr, P, .section = section, .type = type) {
+		return rr.rd.len;
+	}
+
+	return 0;
+}
+
+static size_t largest;
+
+static void *
+sizing_malloc(size_t size, void *arg)
+{
+	(void)arg;
+
+	if (size > largest)
+		largest = size;
+
+	return malloc(size);
+}
+
+static void
+sizing_free(void *p, void *arg)
+{
+	(void)arg;
+
+	free(p);
+}
+
+static struct dns_packet *
+merge(struct dns_packet *P0, struct dns_packet *P1)
+{
+	static const struct dns_allocator sizing = { NULL, &sizing_malloc, NULL, &sizing_free };
+	struct dns_packet *M;
+	int error;
+
+	if (!(M = dns_res_merge(P0, P1, &sizing, &error)))
+		errx(1, "dns_res_merge: %s", dns_strerror(error));
+
+	return M;
+}
+
+static void
+expect(struct dns_packet *M, const char *what, enum dns_section section, enum dns_type type, unsigned n)
+{
+	if (count(M, section, type) != n)
+		errx(1, "%s: expected %u %s %s, but got %u", what, n, dns_strsection(section), dns_strtype(type), count(M, section, type));
+}
+
+int
+main(void)
+{
+	struct dns_packet *P0, *P1, *M;
+	struct dns_soa soa = { "ns1.example.", "hostmaster.example.", 7, 1800, 900, 604800, 3600 };
+	struct dns_soa SOA = { "NS1.EXAMPLE.", "Hostmaster.Example.", 7, 1800, 900, 604800, 3600 };
+	struct dns_a a;
+
+	/* the answer for the alias: names compress against its question */
+	P0 = make("mail.example.");
+	push(P0, DNS_S_AN, "mail.example.", DNS_T_CNAME, &(struct dns_cname){ "mx.example." });
+	push(P0, DNS_S_AN, "mx.example.", DNS_T_MX, &(struct dns_mx){ 10, "relay.mx.example." });
+	push(P0, DNS_S_NS, "example.", DNS_T_NS, &(struct dns_ns){ "ns1.example." });
+	push(P0, DNS_S_NS, "example.", DNS_T_SOA, &soa);
+	a.addr.s_addr = htonl(0xc0000201);
+	push(P0, DNS_S_AR, "ns1.example.", DNS_T_A, &a);
+
+	/*
+	 * the answer for the target: the same records, cased otherwise and
+	 * pushed where nothing precedes them to compress against
+	 */
+	P1 = make("mx.example.");
+	push(P1, DNS_S_AN, "MX.example.", DNS_T_MX, &(struct dns_mx){ 10, "Relay.MX.Example." });
+	push(P1, DNS_S_AN, "mx.example.", DNS_T_MX, &(struct dns_mx){ 20, "relay.mx.example." });
+	push(P1, DNS_S_NS, "EXAMPLE.", DNS_T_SOA, &SOA);
+	push(P1, DNS_S_NS, "Example.", DNS_T_NS, &(struct dns_ns){ "NS1.example." });
+	push(P1, DNS_S_AR, "NS1.EXAMPLE.", DNS_T_A, &a);
+	a.addr.s_addr = htonl(0xc0000202);
+	push(P1, DNS_S_AR, "ns1.example.", DNS_T_A, &a);
+
+	/* make sure the duplicates really are encoded differently */
+	if (rdlen(P0, DNS_S_NS, DNS_T_NS) == rdlen(P1, DNS_S_NS, DNS_T_NS))
+		errx(1, "NS encoded alike in both packets");
+	if (rdlen(P0, DNS_S_NS, DNS_T_SOA) == rdlen(P1, DNS_S_NS, DNS_T_SOA))
+		errx(1, "SOA encoded alike in both packets");
+
+	M = merge(P0, P1);
+	expect(M, "merge", DNS_S_QD, DNS_T_MX, 1);
+	expect(M, "merge", DNS_S_AN, DNS_T_CNAME, 1);
+	expect(M, "merge", DNS_S_AN, DNS_T_MX, 2);
+	expect(M, "merge", DNS_S_NS, DNS_T_NS, 1);
+	expect(M, "merge", DNS_S_NS, DNS_T_SOA, 1);
+	expect(M, "merge", DNS_S_AR, DNS_T_A, 2);
+	dns_p_free(M);
+
+	/* everything is a duplicate of itself */
+	M = merge(P1, P1);
+	expect(M, "self", DNS_S_AN, DNS_T_MX, 2);
+	expect(M, "self", DNS_S_NS, DNS_T_ALL, 2);
+	expect(M, "self", DNS_S_AR, DNS_T_A, 2);
+	dns_p_free(M);
+
+	/* inflated counts: only what parses is merged or sized for */
+	dns_header(P1)->ancount = htons(65535);
+	dns_header(P1)->arcount = htons(65535);
+	largest = 0;
+	M = merge(P0, P1);
+	expect(M, "counts", DNS_S_AN, DNS_T_MX, 2);
+	if (largest > dns_p_calcsize(65535))
+		errx(1, "counts: %zu bytes allocated to merge %zu", largest, P0->end + P1->end);
+	dns_p_free(M);
+
+	dns_p_free(P0);
+	dns_p_free(P1);
+
+	warnx("OK");
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+/* ==========================================================================
+ * allocs.c - Allocation counters for the benchmarks.
+ * --------------------------------------------------------------------------
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#include <stddef.h>	/* size_t */
+#include <stdlib.h>	/* malloc(3) calloc(3) realloc(3) */
+
+#include "allocs.h"
+
+
+unsigned long nallocs;
+
+#if HAVE_ALLOCS
+/*
+ * glibc lets us interpose on malloc(3) and friends by forwarding to its
+ * internal entry points. The loaders count from several threads.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *malloc(size_t size) {
+	__atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+
+	return __libc_malloc(size);
+} /* malloc() */
+
+void *calloc(size_t count, size_t size) {
+	__atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+
+	return __libc_calloc(count, size);
+} /* calloc() */
+
+void *realloc(void *p, size_t size) {
+	__atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+
+	return __libc_realloc(p, size);
+} /* realloc() */
+#endif
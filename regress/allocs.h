@@ -0,0 +1,42 @@
+/* ==========================================================================
+ * allocs.h - Allocation counters for the benchmarks.
+ * --------------------------------------------------------------------------
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#ifndef ALLOCS_H
+#define ALLOCS_H
+
+#include <stdlib.h>	/* __GLIBC__ via <features.h> */
+
+/*
+ * allocs.c interposes on malloc(3), calloc(3) and realloc(3) where glibc
+ * lets it. HAVE_ALLOCS is 0 elsewhere, and nallocs stays at 0.
+ */
+#if defined __GLIBC__
+#define HAVE_ALLOCS 1
+#else
+#define HAVE_ALLOCS 0
+#endif
+
+/** Allocations so far; benchmarks reset or difference it. */
+extern unsigned long nallocs;
+
+#endif /* ALLOCS_H */
@@ -33,6 +33,8 @@
 
 #include <errno.h>
 
+#include <time.h>
+
 #include <unistd.h>
 
 #include <sys/queue.h>
@@ -46,6 +48,8 @@
 #include "dns.h"
 #include "spf.h"
 
+#include "allocs.h"
+
 
 #define lengthof(a) (sizeof (a) / sizeof (a)[0])
 
@@ -116,15 +120,67 @@ static struct {
 	struct {
 		unsigned count, passed, failed;
 	} tests;
+
+	struct {
+		unsigned loops; /* timed replays after the checked pass */
+		_Bool synthetic;
+
+		unsigned long checks, allocs, ops, queries;
+		double elapsed;
+	} bench;
+
+	struct {
+		_Bool enabled;
+		unsigned count, differed;
+	} flat;
+
+	struct {
+		_Bool enabled;
+		unsigned count, differed;
+
+		struct spf_pcache *pcache; /* per section */
+		struct spf_vcache *vcache; /* per section */
+		struct spf_pool *pool;     /* per section */
+	} cached;
+
+	struct {
+		_Bool enabled;
+		unsigned count, differed;
+	} batch;
 } MAIN;
 
 
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+} /* now() */
+
+
 #define SET4(a, b, c, d, ...) \
 	((1 << (a)) | (1 << (b)) | (1 << (c)) | (1 << (d)))
 #define SET(...) SET4(__VA_ARGS__, 0, 0, 0)
 #define INSET(set, x) ((set) & (1 << (x)))
 
 
+/*
+ * Stands between the resolver and the zone data, counting every lookup
+ * which reaches it.
+ */
+static struct dns_cache lookups;
+static unsigned long nlookups;
+
+static struct dns_packet *lookups_query(struct dns_packet *Q, struct dns_cache *C, int *error) {
+	struct dns_cache *zone = C->arg[0].p;
+
+	nlookups++;
+
+	return zone->query(Q, zone, error);
+} /* lookups_query() */
+
+
 static struct dns_resolver *mkres(struct cache *zonedata) {
 	struct dns_resolv_conf *resconf;
 	struct dns_hosts *hosts;
@@ -132,6 +188,10 @@ static struct dns_resolver *mkres(struct cache *zonedata) {
 	struct dns_resolver *res;
 	int error;
 
+	dns_cache_init(&lookups);
+	lookups.arg[0].p = cache_resi(zonedata);
+	lookups.query = &lookups_query;
+
 	resconf = dns_resconf_open(&error);
 	assert(resconf);
 	memset(resconf->lookup, 0, sizeof resconf->lookup);
@@ -142,7 +202,7 @@ static struct dns_resolver *mkres(struct cache *zonedata) {
 	hints = dns_hints_open(resconf, &error);
 	assert(hints);
 
-	res = dns_res_open(dns_resconf_mortal(resconf), dns_hosts_mortal(hosts), dns_hints_mortal(hints), cache_resi(zonedata), dns_opts(), &error);
+	res = dns_res_open(dns_resconf_mortal(resconf), dns_hosts_mortal(hosts), dns_hints_mortal(hints), &lookups, dns_opts(), &error);
 	assert(res);
 
 	return res;
@@ -173,7 +233,11 @@ struct test {
 
 	char *exp;
 
+	unsigned prefetch;        /* spf_options.prefetch */
+	unsigned long maxlookups; /* 0 if unbounded */
+
 	struct {
+		_Bool checked;
 		int result;
 		char *exp;
 	} actual;
@@ -213,14 +277,86 @@ static void test_dump(struct test *test, struct spf_env *env, struct cache *zone
 } /* test_dump() */
 
 
+/*
+ * Compares a check made some other way with the VM's verdict and
+ * explanation. Returns non-zero, after saying how, if they differ.
+ */
+static int test_differs(struct test *test, const char *how, int error, enum spf_result result, const char *exp) {
+	if (!error && result == test->actual.result && streq((exp)? exp : "", (test->actual.exp)? test->actual.exp : ""))
+		return 0;
+
+	fprintf(stderr, "%s: %s DIFFERS: %s \"%s\" (%s \"%s\")\n", test->name, how,
+		(error)? spf_strerror(error) : spf_strresult(result), (exp)? exp : "",
+		spf_strresult(test->actual.result), (test->actual.exp)? test->actual.exp : "");
+
+	return 1;
+} /* test_differs() */
+
+
+/*
+ * Checks a test again against its domain's flattened policy. Whatever the
+ * trie answers, and whatever it defers, must match the VM's verdict,
+ * explanation included.
+ */
+static void test_flat(struct test *test, struct dns_resolver *res, const struct spf_env *env) {
+	struct spf_options opts = spf_defaults;
+	struct spf_resolver *spf;
+	int error;
+
+	/* e.g. no policy to flatten */
+	if (!(opts.flat = spf_flat_open(env->d, res, &spf_defaults, 5, &error)))
+		return;
+
+	spf = spf_open(env, res, &opts, &error);
+	assert(spf);
+
+	while (EAGAIN == (error = spf_check(spf)))
+		spf_poll(spf, 1);
+
+	MAIN.flat.count++;
+	MAIN.flat.differed += test_differs(test, "FLAT", error, spf_result(spf), spf_exp(spf));
+
+	spf_close(spf);
+	spf_flat_close(opts.flat);
+} /* test_flat() */
+
+
+/*
+ * Checks a test twice more through the section's policy and verdict
+ * caches: once to fill them, and once to run from what they kept. The
+ * resolvers come from the section's pool, reset between checks.
+ */
+static void test_cached(struct test *test, const struct spf_env *env) {
+	struct spf_resolver *spf;
+	int error, i;
+
+	for (i = 0; i < 2; i++) {
+		spf = spf_pool_get(MAIN.cached.pool, env, &error);
+		assert(spf);
+
+		while (EAGAIN == (error = spf_check(spf)))
+			spf_poll(spf, 1);
+
+		MAIN.cached.count++;
+		MAIN.cached.differed += test_differs(test, "CACHED", error, spf_result(spf), spf_exp(spf));
+
+		spf_pool_put(MAIN.cached.pool, spf);
+	}
+} /* test_cached() */
+
+
 static void test_run(struct test *test, struct dns_resolver *res, struct cache *zonedata) {
+	struct spf_options opts = spf_defaults;
 	struct spf_env env;
 	struct spf_resolver *spf;
 	int error, result, i, passed = 0;
+	unsigned long lookups = nlookups;
 	const char *exp;
 
+	opts.prefetch = test->prefetch;
+
 	spf_env_init(&env, test->host.type, &test->host.ip, test->helo, test->mailfrom);
-	spf = spf_open(&env, res, &spf_defaults, &error);
+	spf = spf_open(&env, res, &opts, &error);
 	assert(spf);
 
 	while ((error = spf_check(spf))) {
@@ -239,12 +375,25 @@ static void test_run(struct test *test, struct dns_resolver *res, struct cache *
 		passed = 1;
 	}
 
+	if (test->maxlookups && nlookups - lookups > test->maxlookups) {
+		SAY("%lu lookups, expected at most %lu", nlookups - lookups, test->maxlookups);
+
+		passed = 0;
+	}
+
+	test->actual.checked = 1;
 	test->actual.result = result;
 
 	if (exp) {
 		test->actual.exp = strdup(exp);
 		assert(test->actual.exp);
 	}
+
+	if (MAIN.flat.enabled)
+		test_flat(test, res, &env);
+
+	if (MAIN.cached.enabled)
+		test_cached(test, &env);
 done:
 	if (passed) {
 		MAIN.tests.passed++;
@@ -263,6 +412,29 @@ done:
 } /* test_run() */
 
 
+/*
+ * Replay a test without checking the outcome; only the cost is of
+ * interest here.
+ */
+static void test_bench(struct test *test, struct dns_resolver *res) {
+	struct spf_env env;
+	struct spf_resolver *spf;
+	int error;
+
+	spf_env_init(&env, test->host.type, &test->host.ip, test->helo, test->mailfrom);
+	spf = spf_open(&env, res, &spf_defaults, &error);
+	assert(spf);
+
+	while (EAGAIN == (error = spf_check(spf)))
+		spf_poll(spf, 1);
+
+	MAIN.bench.checks++;
+	MAIN.bench.ops += spf_info(spf)->stat.ops;
+
+	spf_close(spf);
+} /* test_bench() */
+
+
 static void test_free(struct test *test) {
 	free(test->name);
 	free(test->descr);
@@ -287,17 +459,101 @@ struct section {
 }; /* struct section */
 
 
+/*
+ * Checks the section's tests again all at once through a batch, which
+ * interleaves them and shares one resolver pool. Tests the VM couldn't
+ * complete are left out.
+ */
+static void section_batch(struct section *section, const char *name, struct dns_resolver *res) {
+	struct spf_batch *batch;
+	struct spf_batch_result r;
+	struct spf_env env;
+	struct test *test;
+	int error;
+
+	batch = spf_batch_open(res, &spf_defaults, 0, &error);
+	assert(batch);
+
+	CIRCLEQ_FOREACH(test, &section->tests, cqe) {
+		if (!test->actual.checked || !(streq(test->name, name) || streq(name, "all")))
+			continue;
+
+		spf_env_init(&env, test->host.type, &test->host.ip, test->helo, test->mailfrom);
+		error = spf_batch_submit(batch, &env, test);
+		assert(!error);
+	}
+
+	while (EAGAIN == (error = spf_batch_check(batch)))
+		spf_batch_poll(batch, 1);
+
+	while (spf_batch_fetch(batch, &r)) {
+		MAIN.batch.count++;
+		MAIN.batch.differed += test_differs(r.arg, "BATCH", r.error, r.result, r.exp);
+	}
+
+	spf_batch_close(batch);
+} /* section_batch() */
+
+
 static void section_run(struct section *section, const char *name) {
 	struct dns_resolver *res;
 	struct test *test;
+	unsigned long allocs, lookups;
+	double begin;
+	unsigned i;
+	int error;
 
 	res = mkres(section->zonedata);
 
+	/* the same names hold other records in other sections */
+	if (MAIN.cached.enabled) {
+		struct spf_options opts = spf_defaults;
+
+		MAIN.cached.pcache = spf_pcache_open(0, &error);
+		assert(MAIN.cached.pcache);
+
+		MAIN.cached.vcache = spf_vcache_open(0, &error);
+		assert(MAIN.cached.vcache);
+
+		opts.pcache = MAIN.cached.pcache;
+		opts.vcache = MAIN.cached.vcache;
+
+		MAIN.cached.pool = spf_pool_open(res, &opts, 0, &error);
+		assert(MAIN.cached.pool);
+	}
+
 	CIRCLEQ_FOREACH(test, &section->tests, cqe) {
 		if (streq(test->name, name) || streq(name, "all"))
 			test_run(test, res, section->zonedata);
 	}
 
+	spf_pool_close(MAIN.cached.pool);
+	MAIN.cached.pool = NULL;
+
+	spf_vcache_close(MAIN.cached.vcache);
+	MAIN.cached.vcache = NULL;
+
+	spf_pcache_close(MAIN.cached.pcache);
+	MAIN.cached.pcache = NULL;
+
+	if (MAIN.batch.enabled)
+		section_batch(section, name, res);
+
+	allocs  = nallocs;
+	lookups = nlookups;
+	begin   = now();
+
+	for (i = 0; i < MAIN.bench.loops; i++) {
+		CIRCLEQ_FOREACH(test, &section->tests, cqe) {
+			if (streq(test->name, name) || streq(name, "all"))
+				test_bench(test, res);
+		}
+	}
+
+	MAIN.bench.elapsed += now() - begin;
+	MAIN.bench.allocs  += nallocs - allocs;
+	MAIN.bench.queries += nlookups - lookups;
+
 	dns_res_close(res);
 } /* section_run() */
 
@@ -635,6 +891,150 @@ static struct section *nextsection(yaml_parser_t *parser, const char *testname)
 } /* nextsection() */
 
 
+/*
+ * Policies shaped like those of large mail providers: an include tree
+ * fanning out to netblock lists, a redirect into it, an MX-based policy
+ * and a macro-driven exists lookup. Expected results are fixed, so the
+ * first pass checks them like the suite's own.
+ */
+static void synthrr(struct cache *zonedata, const char *name, int type, const char *data) {
+	union dns_any anyrr;
+	char host[256];
+	int rv, error;
+
+	dns_any_init(&anyrr, sizeof anyrr);
+
+	switch (type) {
+	case DNS_T_A:
+		rv = inet_pton(AF_INET, data, &anyrr.a);
+		assert(rv == 1);
+
+		break;
+	case DNS_T_MX:
+		anyrr.mx.preference = strtoul(data, (char **)&data, 10);
+		dns_d_init(anyrr.mx.host, sizeof anyrr.mx.host, data + 1, strlen(data + 1), DNS_D_ANCHOR);
+
+		break;
+	case DNS_T_TXT:
+		assert(strlen(data) < anyrr.txt.size);
+		anyrr.txt.len = strlen(data);
+		memcpy(anyrr.txt.data, data, anyrr.txt.len);
+
+		break;
+	default:
+		panic("%s: unsupported RR type", dns_strtype(type));
+	}
+
+	dns_d_init(host, sizeof host, name, strlen(name), DNS_D_ANCHOR);
+
+	error = cache_insert(zonedata, host, type, 3600, &anyrr);
+	assert(!error);
+} /* synthrr() */
+
+
+static struct test *synthtest(struct section *section, const char *name, const char *host, const char *mailfrom, const char *result) {
+	struct test *test;
+	int rv;
+
+	test = calloc(1, sizeof *test);
+	assert(test);
+
+	test->name = strdup(name);
+	test->helo = strdup("mail.example.net");
+	test->mailfrom = strdup(mailfrom);
+	test->result[0] = strdup(result);
+	assert(test->name && test->helo && test->mailfrom && test->result[0]);
+	test->rcount = 1;
+
+	test->host.type = (strchr(host, ':'))? AF_INET6 : AF_INET;
+	rv = inet_pton(test->host.type, host, &test->host.ip);
+	assert(rv == 1);
+
+	CIRCLEQ_INSERT_TAIL(&section->tests, test, cqe);
+
+	MAIN.tests.count++;
+
+	return test;
+} /* synthtest() */
+
+
+static struct section *synthsection(void) {
+	struct section *section;
+	struct test *test;
+	char name[64], txt[256];
+	unsigned i, k;
+	int error;
+
+	section = calloc(1, sizeof *section);
+	assert(section);
+	CIRCLEQ_INIT(&section->tests);
+
+	section->descr = strdup("Synthetic large-provider policies");
+	assert(section->descr);
+
+	section->zonedata = cache_open(&error);
+	assert(section->zonedata);
+
+	for (k = 0; k < 4; k++) {
+		snprintf(txt, sizeof txt, "v=spf1");
+
+		for (i = 0; i < 10; i++)
+			snprintf(txt + strlen(txt), sizeof txt - strlen(txt), " ip4:10.%u.%u.0/20", k, i * 16);
+
+		snprintf(txt + strlen(txt), sizeof txt - strlen(txt), " ip6:2001:db8:%u::/48 ~all", k);
+		snprintf(name, sizeof name, "_nb%u.big.example", k);
+		synthrr(section->zonedata, name, DNS_T_TXT, txt);
+	}
+
+	synthrr(section->zonedata, "_spf.big.example", DNS_T_TXT, "v=spf1 include:_nb0.big.example include:_nb1.big.example include:_nb2.big.example include:_nb3.big.example ~all");
+	synthrr(section->zonedata, "big.example", DNS_T_TXT, "v=spf1 include:_spf.big.example ~all");
+	synthrr(section->zonedata, "fwd.example", DNS_T_TXT, "v=spf1 redirect=_spf.big.example");
+
+	synthrr(section->zonedata, "mx.example", DNS_T_TXT, "v=spf1 mx:mx.example a:relay.mx.example -all");
+	synthrr(section->zonedata, "mx.example", DNS_T_MX, "10 mx1.mx.example");
+	synthrr(section->zonedata, "mx.example", DNS_T_MX, "20 mx2.mx.example");
+	synthrr(section->zonedata, "mx.example", DNS_T_MX, "30 mx3.mx.example");
+	synthrr(section->zonedata, "mx1.mx.example", DNS_T_A, "198.51.100.1");
+	synthrr(section->zonedata, "mx2.mx.example", DNS_T_A, "198.51.100.2");
+	synthrr(section->zonedata, "mx3.mx.example", DNS_T_A, "198.51.100.3");
+	synthrr(section->zonedata, "relay.mx.example", DNS_T_A, "198.51.100.10");
+
+	synthrr(section->zonedata, "macro.example", DNS_T_TXT, "v=spf1 exists:%{ir}._spf.macro.example -all exp=explain.macro.example");
+	synthrr(section->zonedata, "4.100.51.198._spf.macro.example", DNS_T_A, "127.0.0.2");
+	synthrr(section->zonedata, "explain.macro.example", DNS_T_TXT, "%{i} may not send mail as %{s}");
+
+	synthrr(section->zonedata, "strict.example", DNS_T_TXT, "v=spf1 ip4:10.9.0.0/16 -all exp=explain.strict.example");
+	synthrr(section->zonedata, "explain.strict.example", DNS_T_TXT, "%{i} is not a strict.example server");
+	synthrr(section->zonedata, "bare.example", DNS_T_TXT, "v=spf1 include:_nb0.big.example -all");
+
+	/*
+	 * _s1 is compiled with one term left; prefetching more of its exists
+	 * targets than that only issues queries the limit won't let us use.
+	 */
+	synthrr(section->zonedata, "_s0.deep.example", DNS_T_TXT, "v=spf1 exists:a0.deep.example exists:a1.deep.example exists:a2.deep.example exists:a3.deep.example exists:a4.deep.example exists:a5.deep.example exists:a6.deep.example ?all");
+	synthrr(section->zonedata, "_s1.deep.example", DNS_T_TXT, "v=spf1 exists:b0.deep.example exists:b1.deep.example exists:b2.deep.example exists:b3.deep.example exists:b4.deep.example exists:b5.deep.example exists:b6.deep.example exists:b7.deep.example exists:b8.deep.example exists:b9.deep.example -all");
+	synthrr(section->zonedata, "deep.example", DNS_T_TXT, "v=spf1 include:_s0.deep.example include:_s1.deep.example -all");
+
+	synthtest(section, "synth-include-first", "10.0.1.1", "user@big.example", "pass");
+	synthtest(section, "synth-include-last", "10.3.159.9", "user@big.example", "pass");
+	synthtest(section, "synth-include-ip6", "2001:db8:2::1", "user@big.example", "pass");
+	synthtest(section, "synth-include-miss", "192.0.2.1", "user@big.example", "softfail");
+	synthtest(section, "synth-redirect", "10.2.33.7", "user@fwd.example", "pass");
+	synthtest(section, "synth-mx-pass", "198.51.100.2", "user@mx.example", "pass");
+	synthtest(section, "synth-mx-miss", "198.51.100.99", "user@mx.example", "fail");
+	synthtest(section, "synth-exists-pass", "198.51.100.4", "user@macro.example", "pass");
+	synthtest(section, "synth-exists-miss", "198.51.100.5", "user@macro.example", "fail");
+	synthtest(section, "synth-all-pass", "10.9.1.1", "user@strict.example", "pass");
+	synthtest(section, "synth-all-exp", "192.0.2.9", "user@strict.example", "fail");
+	synthtest(section, "synth-all-defexp", "192.0.2.9", "user@bare.example", "fail");
+	test = synthtest(section, "synth-prefetch-budget", "192.0.2.9", "user@deep.example", "permerror");
+	test->prefetch = 10;
+	test->maxlookups = 11; /* as many as without prefetching */
+
+	return section;
+} /* synthsection() */
+
+
 static void trace(yaml_parser_t *parser) {
 	yaml_event_t event;
 	int ok, done = 0;
@@ -662,9 +1062,14 @@ static void trace(yaml_parser_t *parser) {
 
 
 #define USAGE \
-	"rfc4408-tests [-vh] [TEST]\n" \
-	"  -v  increase verboseness\n" \
-	"  -h  print usage\n" \
+	"rfc4408-tests [-n:sfcbvh] [TEST]\n" \
+	"  -n NUM  after checking, replay the tests NUM times and report costs\n" \
+	"  -s      add synthetic large-provider policies\n" \
+	"  -f      check each test again with its policy flattened\n" \
+	"  -c      check each test again through the caches and a pool\n" \
+	"  -b      check each section again all at once in a batch\n" \
+	"  -v      increase verboseness\n" \
+	"  -h      print usage\n" \
 	"\n" \
 	"Report bugs to William Ahern <william@25thandClement.com>\n"
 
@@ -677,8 +1082,28 @@ int main(int argc, char **argv) {
 	struct section *section;
 	char *test;
 
-	while (-1 != (opt = getopt(argc, argv, "vh"))) {
+	while (-1 != (opt = getopt(argc, argv, "n:sfcbvh"))) {
 		switch (opt) {
+		case 'n':
+			MAIN.bench.loops = strtoul(optarg, NULL, 0);
+
+			break;
+		case 's':
+			MAIN.bench.synthetic = 1;
+
+			break;
+		case 'f':
+			MAIN.flat.enabled = 1;
+
+			break;
+		case 'c':
+			MAIN.cached.enabled = 1;
+
+			break;
+		case 'b':
+			MAIN.batch.enabled = 1;
+
+			break;
 		case 'v':
 			spf_debug++;
 			dns_debug++;
@@ -720,12 +1145,40 @@ int main(int argc, char **argv) {
 			section_free(section);
 		} /* while() */
 
+		if (MAIN.bench.synthetic) {
+			section = synthsection();
+			section_run(section, test);
+			section_free(section);
+		}
+
 		#define PCT(a, b) (((float)a / (float)b) * (float)100)
 		printf("PASSED %u of %u (%.2f%%)\n", MAIN.tests.passed, MAIN.tests.count, PCT(MAIN.tests.passed, MAIN.tests.count));
 		printf("FAILED %u of %u (%.2f%%)\n", MAIN.tests.failed, MAIN.tests.count, PCT(MAIN.tests.failed, MAIN.tests.count));
+
+		if (MAIN.flat.enabled)
+			printf("FLAT %u of %u differed\n", MAIN.flat.differed, MAIN.flat.count);
+
+		if (MAIN.cached.enabled)
+			printf("CACHED %u of %u differed\n", MAIN.cached.differed, MAIN.cached.count);
+
+		if (MAIN.batch.enabled)
+			printf("BATCH %u of %u differed\n", MAIN.batch.differed, MAIN.batch.count);
+
+		if (MAIN.bench.checks) {
+			#define PER(n) ((double)(n) / (double)MAIN.bench.checks)
+			printf("BENCH %lu checks in %.3fs (%.0f checks/s)\n", MAIN.bench.checks, MAIN.bench.elapsed, (MAIN.bench.elapsed > 0)? MAIN.bench.checks / MAIN.bench.elapsed : 0.0);
+
+			if (HAVE_ALLOCS)
+				printf("BENCH %.2f allocations per check\n", PER(MAIN.bench.allocs));
+			else
+				printf("BENCH - allocations per check\n");
+
+			printf("BENCH %.2f VM instructions per check\n", PER(MAIN.bench.ops));
+			printf("BENCH %.2f DNS lookups per check\n", PER(MAIN.bench.queries));
+		}
 	}
 
 	yaml_parser_delete(&parser);
 
-	return 0;
+	return (MAIN.flat.differed || MAIN.cached.differed || MAIN.batch.differed)? EXIT_FAILURE : 0;
 } /* main() */
@@ -0,0 +1,409 @@
+/* ==========================================================================
+ * zonebench.c - Zone parser and loader benchmark.
+ * --------------------------------------------------------------------------
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#include <stddef.h>	/* size_t */
+#include <stdio.h>	/* FILE fprintf(3) printf(3) tmpfile(3) */
+#include <stdlib.h>	/* EXIT_FAILURE strtoul(3) */
+
+#include <string.h>	/* strcmp(3) strerror(3) strtok(3) */
+
+#include <errno.h>	/* errno */
+
+#include <time.h>	/* CLOCK_MONOTONIC clock_gettime(2) */
+
+#include <unistd.h>	/* getopt(3) fork(2) pipe(2) read(2) write(2) _exit(2) */
+
+#include <sys/types.h>	/* pid_t */
+#include <sys/stat.h>	/* fstat(2) */
+#include <sys/wait.h>	/* waitpid(2) */
+#include <sys/resource.h>	/* getrusage(2) */
+
+#include "dns.h"
+#include "zone.h"
+#include "cache.h"
+
+#include "allocs.h"
+
+
+static const char *progname;
+
+#define OOPS(cond, ...) \
+	do { if (cond) { fprintf(stderr, "%s: ", progname); fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); exit(EXIT_FAILURE); } } while (0)
+
+
+/*
+ * S Y N T H E T I C  Z O N E S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static struct {
+	unsigned long count;
+	const char *mix;
+	unsigned depth;
+	unsigned long churn;
+	unsigned long seed;
+} gen = {
+	.count = 100000,
+	.mix = "mixed",
+	.depth = 3,
+	.churn = 1000,
+	.seed = 1,
+};
+
+/* percentages of A, AAAA, MX and TXT records */
+static const struct {
+	const char *name;
+	unsigned a, aaaa, mx, txt;
+} mixes[] = {
+	{ "mixed", 40, 20, 15, 25 },
+	{ "a",     100, 0, 0, 0 },
+	{ "aaaa",  0, 100, 0, 0 },
+	{ "mx",    10, 0, 90, 0 },
+	{ "txt",   10, 0, 0, 90 },
+};
+
+
+static unsigned long rnd(void) {
+	/* xorshift64 */
+	gen.seed ^= gen.seed << 13;
+	gen.seed ^= gen.seed >> 7;
+	gen.seed ^= gen.seed << 17;
+
+	return gen.seed;
+} /* rnd() */
+
+
+static void gensoa(FILE *fp, const char *owner) {
+	fprintf(fp,
+		"%s IN SOA ns1.bench.example. hostmaster.bench.example. (\n"
+		"\t\t%lu\t; serial\n"
+		"\t\t3600\t; refresh\n"
+		"\t\t600\t; retry\n"
+		"\t\t86400\t; expire\n"
+		"\t\t300 )\t; minimum\n", owner, 2000000000UL + (rnd() % 1000));
+} /* gensoa() */
+
+
+static void genname(FILE *fp, unsigned long i) {
+	unsigned d;
+
+	fprintf(fp, "h%lu", i);
+
+	for (d = 1; d < gen.depth; d++)
+		fprintf(fp, ".l%lu", (i >> d) % 16);
+} /* genname() */
+
+
+/* returns the number of records written */
+static unsigned long genzone(FILE *fp) {
+	unsigned long i, total = 0, r;
+	unsigned mix, n, j;
+
+	for (mix = 0; strcmp(mixes[mix].name, gen.mix); mix++) {
+		OOPS(mix + 1 >= sizeof mixes / sizeof *mixes, "%s: unknown record mix", gen.mix);
+	}
+
+	fputs("$ORIGIN bench.example.\n$TTL 3600\n", fp);
+	gensoa(fp, "@");
+	fputs("@ IN NS ns1\nns1 IN A 192.0.2.1\n", fp);
+	total += 3;
+
+	for (i = 0; i < gen.count; i++) {
+		if (gen.churn && i && !(i % gen.churn)) {
+			fprintf(fp, "$ORIGIN z%lu.bench.example.\n", (i / gen.churn) % 64);
+			gensoa(fp, "@");
+			total++;
+		}
+
+		genname(fp, i);
+
+		r = rnd() % 100;
+
+		if (r < mixes[mix].a) {
+			fprintf(fp, " IN A 198.51.%lu.%lu\n", (i >> 8) & 0xff, i & 0xff);
+		} else if ((r -= mixes[mix].a) < mixes[mix].aaaa) {
+			fprintf(fp, " 300 IN AAAA 2001:db8::%lx:%lx\n", (i >> 16) & 0xffff, i & 0xffff);
+		} else if ((r -= mixes[mix].aaaa) < mixes[mix].mx) {
+			fprintf(fp, " IN MX %lu mx%lu.bench.example.\n", (rnd() % 6) * 10, rnd() % 8);
+		} else {
+			fputs(" IN TXT", fp);
+
+			for (n = 1 + rnd() % 3, j = 0; j < n; j++)
+				fprintf(fp, " \"v=spf1 ip4:192.0.2.%lu/%lu include:_spf%u.bench.example; with \\\"quotes\\\" -all\"", rnd() % 256, 24 + rnd() % 9, j);
+
+			fputc('\n', fp);
+		}
+
+		total++;
+	}
+
+	OOPS(0 != fflush(fp), "fflush: %s", strerror(errno));
+
+	return total;
+} /* genzone() */
+
+
+/*
+ * P H A S E S
+ *
+ * Each phase runs in its own process so that peak RSS and allocation
+ * counts aren't polluted by earlier phases.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct result {
+	unsigned long records;
+	double elapsed;
+	long maxrss; /* KiB */
+	unsigned long allocs;
+}; /* struct result */
+
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+} /* now() */
+
+
+static unsigned long parseonly(FILE *fp) {
+	struct zonerec rec[64];
+	unsigned char buf[16384];
+	struct zonearena arena = { buf, sizeof buf, 0 };
+	struct zonefile *zone;
+	unsigned long count = 0;
+	size_t n;
+	int error = 0;
+
+	OOPS(!(zone = zone_open(".", 3600, &error)), "zone_open: %s", dns_strerror(error));
+
+	/* same strategy as cache_loadfile() */
+	if (0 == ftell(fp) && 0 == zone_parsemap(zone, fileno(fp))) {
+		while ((n = zone_getrrs(rec, sizeof rec / sizeof *rec, &arena, zone, &error)))
+			count += n;
+	} else {
+		while (!error && zone_parsefile(zone, fp)) {
+			while ((n = zone_getrrs(rec, sizeof rec / sizeof *rec, &arena, zone, &error)))
+				count += n;
+		}
+	}
+
+	OOPS(error, "zone_getrrs: %s", dns_strerror(error));
+
+	zone_close(zone);
+
+	return count;
+} /* parseonly() */
+
+
+static struct cache *load(FILE *fp) {
+	struct cache *C;
+	int error;
+
+	OOPS(!(C = cache_open(&error)), "cache_open: %s", dns_strerror(error));
+	OOPS((error = cache_loadfile(C, fp, ".", 3600)), "cache_loadfile: %s", dns_strerror(error));
+
+	return C;
+} /* load() */
+
+
+static void runphase(const char *phase, FILE *fp, struct result *res) {
+	struct result tmp = { 0 };
+	struct rusage ru;
+	struct cache *C = NULL;
+	FILE *null = NULL;
+	double begin;
+	int fd[2], status;
+	pid_t pid;
+
+	OOPS(0 != pipe(fd), "pipe: %s", strerror(errno));
+	fflush(stdout);
+
+	OOPS(-1 == (pid = fork()), "fork: %s", strerror(errno));
+
+	if (pid == 0) {
+		close(fd[0]);
+		rewind(fp);
+
+		if (!strcmp(phase, "dump")) {
+			C = load(fp);
+			OOPS(!(null = fopen("/dev/null", "w")), "/dev/null: %s", strerror(errno));
+		}
+
+		nallocs = 0;
+		begin = now();
+
+		if (!strcmp(phase, "parse")) {
+			tmp.records = parseonly(fp);
+		} else if (!strcmp(phase, "load")) {
+			C = load(fp);
+		} else if (!strcmp(phase, "dump")) {
+			cache_dumpfile(C, null);
+			fflush(null);
+		} else {
+			OOPS(1, "%s: unknown phase", phase);
+		}
+
+		tmp.elapsed = now() - begin;
+		tmp.allocs = nallocs;
+
+		getrusage(RUSAGE_SELF, &ru);
+		tmp.maxrss = ru.ru_maxrss;
+
+		if ((ssize_t)sizeof tmp != write(fd[1], &tmp, sizeof tmp))
+			_exit(EXIT_FAILURE);
+
+		_exit(0);
+	}
+
+	close(fd[1]);
+
+	OOPS((ssize_t)sizeof *res != read(fd[0], res, sizeof *res), "%s: phase failed", phase);
+	close(fd[0]);
+
+	OOPS(-1 == waitpid(pid, &status, 0) || !WIFEXITED(status) || WEXITSTATUS(status), "%s: phase failed", phase);
+} /* runphase() */
+
+
+/*
+ * M A I N  R O U T I N E S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define USAGE \
+	"zonebench [-n:m:d:o:s:f:p:gh]\n" \
+	"  -n COUNT   number of synthetic records (default 100000)\n" \
+	"  -m MIX     record mix: mixed, a, aaaa, mx or txt (default mixed)\n" \
+	"  -d DEPTH   labels per owner name (default 3)\n" \
+	"  -o EVERY   switch $ORIGIN and add an SOA every EVERY records (default 1000)\n" \
+	"  -s SEED    random seed\n" \
+	"  -f PATH    benchmark an existing zone file instead\n" \
+	"  -p PHASES  comma-separated phases: parse, load, dump (default all)\n" \
+	"  -g         write the synthetic zone to stdout and exit\n" \
+	"  -h         print usage\n" \
+	"\n" \
+	"Report bugs to William Ahern <william@25thandClement.com>\n"
+
+
+int main(int argc, char *argv[]) {
+	extern char *optarg;
+	char phases[64] = "parse,load,dump";
+	const char *path = NULL, *phase;
+	struct result res;
+	unsigned long records = 0;
+	struct stat st;
+	FILE *fp;
+	int opt, dump = 0;
+
+	progname = argv[0];
+
+	while (-1 != (opt = getopt(argc, argv, "n:m:d:o:s:f:p:gh"))) {
+		switch (opt) {
+		case 'n':
+			gen.count = strtoul(optarg, NULL, 0);
+
+			break;
+		case 'm':
+			gen.mix = optarg;
+
+			break;
+		case 'd':
+			gen.depth = strtoul(optarg, NULL, 0);
+
+			break;
+		case 'o':
+			gen.churn = strtoul(optarg, NULL, 0);
+
+			break;
+		case 's':
+			gen.seed = strtoul(optarg, NULL, 0) | 1;
+
+			break;
+		case 'f':
+			path = optarg;
+
+			break;
+		case 'p':
+			dns_strlcpy(phases, optarg, sizeof phases);
+
+			break;
+		case 'g':
+			dump = 1;
+
+			break;
+		case 'h':
+			fputs(USAGE, stdout);
+
+			return 0;
+		default:
+			fputs(USAGE, stderr);
+
+			return EXIT_FAILURE;
+		} /* switch() */
+	} /* while() */
+
+	if (dump) {
+		genzone(stdout);
+
+		return 0;
+	}
+
+	if (path) {
+		OOPS(!(fp = fopen(path, "r")), "%s: %s", path, strerror(errno));
+	} else {
+		OOPS(!(fp = tmpfile()), "tmpfile: %s", strerror(errno));
+		records = genzone(fp);
+	}
+
+	OOPS(0 != fstat(fileno(fp), &st), "fstat: %s", strerror(errno));
+
+	printf("%-6s %10s %10s %12s %10s %12s %10s\n", "phase", "records", "seconds", "records/s", "MB/s", "peak KiB", "allocs");
+
+	for (phase = strtok(phases, ","); phase; phase = strtok(NULL, ",")) {
+		runphase(phase, fp, &res);
+
+		/* only parsing counts records; other phases reuse its count */
+		if (res.records)
+			records = res.records;
+
+		printf("%-6s %10lu %10.3f %12.0f ", phase, records, res.elapsed, (res.elapsed > 0)? records / res.elapsed : 0.0);
+
+		if (strcmp(phase, "dump") && res.elapsed > 0)
+			printf("%10.1f ", st.st_size / res.elapsed / (1024 * 1024));
+		else
+			printf("%10s ", "-");
+
+		printf("%12ld ", res.maxrss);
+
+		if (HAVE_ALLOCS)
+			printf("%10lu\n", res.allocs);
+		else
+			printf("%10s\n", "-");
+	}
+
+	fclose(fp);
+
+	return 0;
+} /* main() */
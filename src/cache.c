@@ -24,13 +24,21 @@
  * ==========================================================================
  */
 #include <stddef.h>	/* NULL */
+#include <stdint.h>	/* UINT32_MAX uint32_t uint64_t */
 #include <stdlib.h>	/* malloc(3) free(3) */
 #include <stdio.h>	/* FILE fprintf(3) */
 
-#include <string.h>	/* strcasecmp(3) memset(3) */
+#include <string.h>	/* strcasecmp(3) strncasecmp(3) memset(3) */
 
 #include <errno.h>	/* errno */
 
+#include <fcntl.h>	/* O_RDONLY open(2) */
+#include <unistd.h>	/* close(2) */
+
+#include <sys/types.h>	/* off_t */
+#include <sys/stat.h>	/* struct stat fstat(2) */
+#include <sys/mman.h>	/* mmap(2) munmap(2) */
+
 #include <assert.h>	/* assert(3) */
 
 #include "dns.h"
@@ -39,221 +47,1407 @@
 #include "tree.h"
 
 
-#define SAY_(fmt, ...) \
-	do { fprintf(stderr, fmt "%.1s", __func__, __LINE__, __VA_ARGS__); } while (0)
-#define SAY(...) SAY_(">>>> (%s:%d) " __VA_ARGS__, "\n")
-#define HAI SAY("HAI")
+#define SAY_(fmt, ...) \
+	do { fprintf(stderr, fmt "%.1s", __func__, __LINE__, __VA_ARGS__); } while (0)
+#define SAY(...) SAY_(">>>> (%s:%d) " __VA_ARGS__, "\n")
+#define HAI SAY("HAI")
+
+
+struct rrset {
+	char name[DNS_D_MAXNAME + 1];
+	enum dns_type type;
+	_Bool zone; /* loaded from a zone file rather than learned */
+	unsigned gen; /* last reload or transfer to supply it */
+
+	union {
+		struct dns_packet packet;
+		unsigned char pbuf[dns_p_calcsize(1024)];
+	};
+
+	RB_ENTRY(rrset) rbe;
+}; /* struct rrset */
+
+
+static int rrset_init(struct rrset *set, const char *name, enum dns_type type) {
+	int error;
+
+	memset(set, 0, sizeof *set);
+
+	dns_strlcpy(set->name, name, sizeof set->name);
+	set->type = type;
+
+	dns_p_init(&set->packet, sizeof set->pbuf);
+
+	if ((error = dns_p_push(&set->packet, DNS_S_QD, name, strlen(name), type, DNS_C_IN, 0, NULL)))
+		return error;
+
+	return 0;
+} /* rrset_init() */
+
+
+RB_HEAD(rrcache, rrset);
+
+/*
+ * The canonical order of RFC 4034 section 6.1: labels compared caselessly
+ * from the root down, so everything at or below a name sorts right after
+ * it.
+ */
+static int cache_dncmp(const char *a, const char *b) {
+	const char *ae = a + strlen(a), *be = b + strlen(b), *al, *bl;
+	size_t alen, blen;
+	int cmp;
+
+	if (ae > a && ae[-1] == '.')
+		ae--;
+	if (be > b && be[-1] == '.')
+		be--;
+
+	while (ae > a && be > b) {
+		for (al = ae; al > a && al[-1] != '.'; al--)
+			;;
+		for (bl = be; bl > b && bl[-1] != '.'; bl--)
+			;;
+
+		alen = ae - al;
+		blen = be - bl;
+
+		if ((cmp = strncasecmp(al, bl, DNS_PP_MIN(alen, blen))))
+			return cmp;
+		if (alen != blen)
+			return (alen < blen)? -1 : 1;
+
+		ae = (al > a)? al - 1 : al;
+		be = (bl > b)? bl - 1 : bl;
+	}
+
+	return (ae > a) - (be > b);
+} /* cache_dncmp() */
+
+
+static inline int rrset_cmp(struct rrset *a, struct rrset *b) {
+	int cmp;
+	return ((cmp = cache_dncmp(a->name, b->name)))? cmp : a->type - b->type;
+}
+
+RB_PROTOTYPE(rrcache, rrset, rbe, rrset_cmp)
+RB_GENERATE(rrcache, rrset, rbe, rrset_cmp)
+
+
+/*
+ * Compiled images are a header, an index of RRsets in tree order, then the
+ * owner names and RRset packets the index points into. Offsets are from
+ * the start of the image. Fields are in host byte order, which the header
+ * records so a foreign image is rejected rather than misread.
+ */
+#define IMG_MAGIC   "DNSCIMG"
+#define IMG_VERSION 2
+#define IMG_BOM     0x01020304U
+
+struct imghdr {
+	char magic[8];
+	uint32_t bom, version, count, pad;
+	uint64_t size;
+}; /* struct imghdr */
+
+struct imgent {
+	uint32_t type;
+	uint32_t name; /* NUL-terminated */
+	uint32_t data, len; /* RRset packet */
+}; /* struct imgent */
+
+
+struct cache {
+	struct dns_cache res;
+	struct dns_cache local;
+	struct rrcache root;
+	unsigned gen;
+
+	struct {
+		void *base;
+		size_t size;
+		const struct imgent *index;
+		size_t count;
+	} image;
+
+	/* for the packets we hand out */
+	struct dns_allocator alloc;
+}; /* struct cache */
+
+
+/* orders like rrset_cmp(), which cache_saveimage() writes the index in */
+static int cache_imgcmp(const void *base, const struct imgent *ent, enum dns_type type, const char *name) {
+	int cmp;
+
+	return ((cmp = cache_dncmp(name, (const char *)base + ent->name)))? cmp : (int)type - (int)ent->type;
+} /* cache_imgcmp() */
+
+
+static const struct imgent *cache_imgfind(struct cache *C, const char *name, enum dns_type type) {
+	const struct imgent *ent;
+	size_t lo = 0, hi = C->image.count, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		ent = &C->image.index[mid];
+		cmp = cache_imgcmp(C->image.base, ent, type, name);
+
+		if (cmp < 0)
+			hi = mid;
+		else if (cmp > 0)
+			lo = mid + 1;
+		else
+			return ent;
+	}
+
+	return NULL;
+} /* cache_imgfind() */
+
+
+static struct dns_packet *cache_imgpacket(struct cache *C, const struct imgent *ent, int *error) {
+	struct dns_packet *P;
+
+	if (!(P = dns_p_make2(ent->len, &C->alloc, error)))
+		return NULL;
+
+	memcpy(P->data, (unsigned char *)C->image.base + ent->data, ent->len);
+	P->end = ent->len;
+
+	return P;
+} /* cache_imgpacket() */
+
+
+static struct rrset *cache_find(struct cache *C, const char *name, enum dns_type type, _Bool make, int *error_) {
+	struct rrset key, *set;
+	int error;
+
+	dns_strlcpy(key.name, name, sizeof key.name);
+	key.type = type;
+
+	if ((set = RB_FIND(rrcache, &C->root, &key)))
+		return set;
+
+	if (!make)
+		return NULL;
+
+	if (!(set = malloc(sizeof *set)))
+		goto syerr;
+
+	if ((error = rrset_init(set, name, type)))
+		goto error;
+
+	assert(!RB_INSERT(rrcache, &C->root, set));
+
+	return set;
+syerr:
+	error = errno;
+error:
+	*error_ = error;
+
+	free(set);
+
+	return NULL;
+} /* cache_find() */
+
+
+int cache_insert(struct cache *C, const char *name, enum dns_type type, unsigned ttl, const void *any) {
+	struct rrset *set;
+	int error;
+
+	if (!(set = cache_find(C, name, type, 1, &error)))
+		return error;
+
+	if ((error = dns_p_push(&set->packet, DNS_S_AN, name, strlen(name), type, DNS_C_IN, ttl, any)))
+		return error;
+
+	return 0;
+} /* cache_insert() */
+
+
+static size_t cache_wirename(char *dst, size_t lim, const unsigned char *src, size_t len) {
+	size_t p = 0, n = 0, count;
+
+	while (p < len && src[p]) {
+		count = DNS_PP_MIN(src[p], len - p - 1);
+		p++;
+
+		if (n + count + 1 < lim) {
+			memcpy(&dst[n], &src[p], count);
+			dst[n + count] = '.';
+		}
+
+		n += count + 1;
+		p += count;
+	}
+
+	if (!n && lim > 1)
+		dst[n++] = '.';
+
+	if (lim > 0)
+		dst[DNS_PP_MIN(n, lim - 1)] = '\0';
+
+	return n;
+} /* cache_wirename() */
+
+
+int cache_insertrecs(struct cache *C, const struct zonerec *rec, size_t count, const struct zonearena *arena) {
+	char name[DNS_D_MAXNAME + 1];
+	struct rrset *set = NULL;
+	size_t i, len = 0;
+	int error;
+
+	for (i = 0; i < count; i++) {
+		/* zones are usually grouped by owner, so skip the lookup */
+		if (!set || rec[i].type != rec[i - 1].type || rec[i].namelen != rec[i - 1].namelen
+		||  memcmp(&arena->base[rec[i].name], &arena->base[rec[i - 1].name], rec[i].namelen)) {
+			if ((len = cache_wirename(name, sizeof name, &arena->base[rec[i].name], rec[i].namelen)) >= sizeof name)
+				return DNS_EILLEGAL;
+
+			if (!(set = cache_find(C, name, rec[i].type, 1, &error)))
+				return error;
+
+			set->zone = 1;
+		}
+
+		/* stored as DNS_C_IN, like cache_insert() */
+		if ((error = dns_p_pushrd(&set->packet, DNS_S_AN, name, len, rec[i].type, DNS_C_IN, rec[i].ttl, &arena->base[rec[i].rdata], rec[i].rdlen)))
+			return error;
+	}
+
+	return 0;
+} /* cache_insertrecs() */
+
+
+struct dns_packet *cache_query(struct dns_packet *query, struct dns_cache *res, int *error) {
+	struct cache *cache = res->state;
+	struct dns_packet *ans = NULL;
+	char qname[DNS_D_MAXNAME + 1];
+	struct dns_rr rr;
+	struct rrset *set;
+
+	if ((*error = dns_rr_parse(&rr, 12, query)))
+		return NULL;
+
+	if (!dns_d_expand(qname, sizeof qname, rr.dn.p, query, error))
+		goto error;
+
+	if (!(set = cache_find(cache, qname, rr.type, 0, error))) {
+		const struct imgent *ent;
+
+		if (!(ent = cache_imgfind(cache, qname, rr.type)))
+			return NULL;
+
+		return cache_imgpacket(cache, ent, error);
+	}
+
+	if (!(ans = dns_p_make2(set->packet.end, &cache->alloc, error)))
+		goto error;
+
+	return dns_p_copy(ans, &set->packet);
+error:
+	dns_p_free(ans);
+
+	return NULL;
+} /* cache_query() */
+
+
+static struct dns_packet *cache_referral(struct cache *C, struct dns_packet *query, struct rrset *cut, int *error) {
+	static const enum dns_type glue[] = { DNS_T_A, DNS_T_AAAA };
+	struct dns_packet *P;
+	struct rrset *set;
+	struct dns_rr rr, ar;
+	struct dns_ns ns;
+	size_t size, i;
+
+	size = query->end + cut->packet.end;
+
+	dns_rr_foreach(&rr, &cut->packet, .section = DNS_S_AN) {
+		if ((*error = dns_ns_parse(&ns, &rr, &cut->packet)))
+			return NULL;
+
+		for (i = 0; i < sizeof glue / sizeof *glue; i++) {
+			if ((set = cache_find(C, ns.host, glue[i], 0, error)))
+				size += set->packet.end;
+		}
+	}
+
+	if (!(P = dns_p_make2(size, &C->alloc, error)))
+		return NULL;
+
+	dns_rr_foreach(&rr, query, .section = DNS_S_QD) {
+		if ((*error = dns_rr_copy(P, &rr, query)))
+			goto error;
+	}
+
+	dns_rr_foreach(&rr, &cut->packet, .section = DNS_S_AN) {
+		rr.section = DNS_S_NS;
+
+		if ((*error = dns_rr_copy(P, &rr, &cut->packet)))
+			goto error;
+	}
+
+	dns_rr_foreach(&rr, &cut->packet, .section = DNS_S_AN) {
+		dns_ns_parse(&ns, &rr, &cut->packet);
+
+		for (i = 0; i < sizeof glue / sizeof *glue; i++) {
+			if (!(set = cache_find(C, ns.host, glue[i], 0, error)))
+				continue;
+
+			dns_rr_foreach(&ar, &set->packet, .section = DNS_S_AN) {
+				ar.section = DNS_S_AR;
+
+				if ((*error = dns_rr_copy(P, &ar, &set->packet)))
+					goto error;
+			}
+		}
+	}
+
+	return P;
+error:
+	dns_p_free(P);
+
+	return NULL;
+} /* cache_referral() */
+
+
+static _Bool cache_inzone(const char *name, const char *zone) {
+	size_t nlen = strlen(name), zlen = strlen(zone);
+
+	if (zlen <= 1)
+		return 1;
+
+	if (nlen < zlen || strcasecmp(&name[nlen - zlen], zone))
+		return 0;
+
+	return nlen == zlen || name[nlen - zlen - 1] == '.';
+} /* cache_inzone() */
+
+
+/* the first RRset ordered at or after key; tree.h lacks RB_NFIND */
+static struct rrset *cache_nfind(struct cache *C, struct rrset *key) {
+	struct rrset *set = RB_ROOT(&C->root), *next = NULL;
+	int cmp;
+
+	while (set) {
+		if ((cmp = rrset_cmp(key, set)) > 0) {
+			set = RB_RIGHT(set, rbe);
+		} else {
+			next = set;
+
+			if (!cmp)
+				break;
+
+			set = RB_LEFT(set, rbe);
+		}
+	}
+
+	return next;
+} /* cache_nfind() */
+
+
+/*
+ * Whether name owns data in zone or is an empty non-terminal above some.
+ * Returns -1 if it owns a CNAME, or if a wildcard in the zone could cover
+ * it, since neither is followed or synthesized here.
+ */
+static int cache_exists(struct cache *C, const char *name, const char *zone) {
+	char wild[DNS_D_MAXNAME + 1];
+	struct rrset key, *set;
+	const char *dn;
+
+	dns_strlcpy(key.name, name, sizeof key.name);
+	key.type = 0;
+
+	/* name's own RRsets come first, then its descendants' */
+	for (set = cache_nfind(C, &key); set && cache_inzone(set->name, name); set = RB_NEXT(rrcache, &C->root, set)) {
+		if (!set->zone)
+			continue;
+
+		return (set->type == DNS_T_CNAME && !cache_dncmp(set->name, name))? -1 : 1;
+	}
+
+	/* a wildcard at any ancestor within the zone could cover it */
+	for (dn = strchr(name, '.'); dn; dn = strchr(dn, '.')) {
+		if (!cache_inzone((*++dn)? dn : ".", zone))
+			break;
+
+		if ((size_t)snprintf(wild, sizeof wild, "*.%s", dn) >= sizeof wild)
+			continue;
+
+		dns_strlcpy(key.name, wild, sizeof key.name);
+		key.type = 0;
+
+		for (set = cache_nfind(C, &key); set && !cache_dncmp(set->name, wild); set = RB_NEXT(rrcache, &C->root, set)) {
+			if (set->zone)
+				return -1;
+		}
+	}
+
+	return 0;
+} /* cache_exists() */
+
+
+/*
+ * Authoritative NXDOMAIN or NODATA, the zone's SOA in the authority
+ * section with the negative caching TTL of RFC 2308.
+ */
+static struct dns_packet *cache_negative(struct cache *C, struct dns_packet *query, struct rrset *soa, _Bool nxdomain, int *error) {
+	struct dns_packet *P;
+	struct dns_soa rd;
+	struct dns_rr rr;
+
+	if (!(P = dns_p_make2(query->end + soa->packet.end, &C->alloc, error)))
+		return NULL;
+
+	dns_rr_foreach(&rr, query, .section = DNS_S_QD) {
+		if ((*error = dns_rr_copy(P, &rr, query)))
+			goto error;
+	}
+
+	dns_rr_foreach(&rr, &soa->packet, .section = DNS_S_AN) {
+		if ((*error = dns_soa_parse(&rd, &rr, &soa->packet)))
+			goto error;
+
+		if ((*error = dns_p_push(P, DNS_S_NS, soa->name, strlen(soa->name), DNS_T_SOA, DNS_C_IN, DNS_PP_MIN(rr.ttl, rd.minimum), &rd)))
+			goto error;
+	}
+
+	dns_header(P)->aa = 1;
+
+	if (nxdomain)
+		dns_header(P)->rcode = DNS_RC_NXDOMAIN;
+
+	return P;
+error:
+	dns_p_free(P);
+
+	return NULL;
+} /* cache_negative() */
+
+
+/*
+ * Answers as the authority for the zones loaded into the cache, such as
+ * a local copy of the root zone (RFC 8806). A name below a zone cut gets
+ * a referral to the delegated servers with whatever glue is held, and a
+ * name without the data asked for gets NXDOMAIN or NODATA. Names outside
+ * any loaded zone, CNAMEs and wildcards are left to the network.
+ */
+static struct dns_packet *cache_authquery(struct dns_packet *query, struct dns_cache *res, int *error) {
+	struct cache *C = res->state;
+	struct dns_packet *ans;
+	char qname[DNS_D_MAXNAME + 1];
+	unsigned short label[DNS_D_MAXNAME / 2 + 1];
+	struct rrset *set, *soa = NULL, *cut = NULL;
+	struct dns_rr rr;
+	const char *name;
+	size_t len, n = 0, i;
+	int exists;
+
+	*error = 0;
+
+	if ((*error = dns_rr_parse(&rr, 12, query)))
+		return NULL;
+
+	if (!(len = dns_d_expand(qname, sizeof qname, rr.dn.p, query, error)))
+		return NULL;
+	else if (len >= sizeof qname)
+		return *error = DNS_EILLEGAL, NULL;
+
+	for (i = 0; i + 1 < len; i++) {
+		if (i == 0 || qname[i - 1] == '.')
+			label[n++] = i;
+	}
+
+	/* walk down from the root to the topmost cut below an apex */
+	for (i = n + 1; i-- > 0 && !cut; ) {
+		name = (i == n)? "." : &qname[label[i]];
+
+		if ((set = cache_find(C, name, DNS_T_SOA, 0, error)))
+			soa = set;
+		else if (soa)
+			cut = cache_find(C, name, DNS_T_NS, 0, error);
+	}
+
+	if (!soa)
+		return NULL;
+
+	/* the parent side of a cut holds its DS and NSEC (RFC 4035 3.1.4.1) */
+	if (cut && !((rr.type == DNS_T_DS || rr.type == DNS_T_NSEC) && !cache_dncmp(cut->name, qname)))
+		return cache_referral(C, query, cut, error);
+
+	if (!(set = cache_find(C, qname, rr.type, 0, error))) {
+		if ((exists = cache_exists(C, qname, soa->name)) < 0)
+			return NULL;
+
+		return cache_negative(C, query, soa, !exists, error);
+	}
+
+	if (!(ans = dns_p_make2(set->packet.end, &C->alloc, error)))
+		return NULL;
+
+	dns_p_copy(ans, &set->packet);
+	dns_header(ans)->aa = 1;
+
+	return ans;
+} /* cache_authquery() */
+
+
+struct dns_cache *cache_resi(struct cache *cache) {
+	return &cache->res;
+} /* cache_resi() */
+
+
+struct dns_cache *cache_local(struct cache *cache) {
+	return &cache->local;
+} /* cache_local() */
+
+
+void cache_close(struct cache *C) {
+	struct rrset *set;
+
+	if (!C)
+		return;
+
+	while ((set = RB_MIN(rrcache, &C->root))) {
+		RB_REMOVE(rrcache, &C->root, set);
+		free(set);
+	}
+
+	if (C->image.base)
+		munmap(C->image.base, C->image.size);
+
+	free(C);
+} /* cache_close() */
+
+
+struct cache *cache_open2(const struct dns_options *opts, int *error) {
+	struct cache *C;
+
+	if (!(C = malloc(sizeof *C)))
+		goto syerr;
+
+	dns_cache_init(&C->res);
+	C->res.state = C;
+	C->res.query = &cache_query;
+
+	dns_cache_init(&C->local);
+	C->local.state = C;
+	C->local.query = &cache_authquery;
+
+	RB_INIT(&C->root);
+	C->gen = 0;
+
+	memset(&C->image, 0, sizeof C->image);
+
+	if (opts)
+		C->alloc = opts->alloc;
+	else
+		memset(&C->alloc, 0, sizeof C->alloc);
+
+	return C;
+syerr:
+	*error = errno;
+
+	cache_close(C);
+
+	return NULL;
+} /* cache_open2() */
+
+
+struct cache *cache_open(int *error) {
+	return cache_open2(NULL, error);
+} /* cache_open() */
+
+
+static _Bool rrset_soa(struct rrset *set, struct dns_soa *soa) {
+	struct dns_rr rr;
+
+	dns_rr_foreach(&rr, &set->packet, .section = DNS_S_AN) {
+		return 0 == dns_soa_parse(soa, &rr, &set->packet);
+	}
+
+	return 0;
+} /* rrset_soa() */
+
+
+static _Bool cache_soa(struct cache *C, const char *name, struct dns_soa *soa) {
+	struct rrset *set;
+	int error;
+
+	return (set = cache_find(C, name, DNS_T_SOA, 0, &error)) && rrset_soa(set, soa);
+} /* cache_soa() */
+
+
+static void cache_dropsoa(struct cache *C, const char *zone) {
+	struct rrset *set;
+	int error;
+
+	if ((set = cache_find(C, zone, DNS_T_SOA, 0, &error))) {
+		RB_REMOVE(rrcache, &C->root, set);
+		free(set);
+	}
+} /* cache_dropsoa() */
+
+
+/*
+ * A reload or full transfer diffs the new copy of a zone against the
+ * live tree as its RRsets stream in, rather than building a second tree.
+ * Each RRset is collected in a scratch set and compared with its live
+ * counterpart when the next one begins: identical RRsets are left alone,
+ * changed ones are overwritten and new ones are inserted, all stamped
+ * with the diff's generation. Once the copy ends, zone RRsets in its
+ * scope which weren't stamped are deleted. Learned entries survive unless
+ * the zone now supplies the same RRset. An attached image is read-only.
+ *
+ * A leading SOA names the zone's scope and is held back until the end. If
+ * a reload finds its serial already live, the rest isn't parsed. A diff
+ * which fails after changing the tree removes the zone's SOA instead, so
+ * a retry can't mistake the half-applied zone for the old serial.
+ */
+struct cache_diff {
+	struct cache *C;
+	char zone[DNS_D_MAXNAME + 1];
+	unsigned gen;
+
+	struct rrset *set; /* being collected */
+	struct rrset *spare;
+	struct rrset *soa; /* leading SOA */
+	unsigned count; /* RRsets collected */
+	_Bool inplace; /* set is live, stamped earlier in this diff */
+
+	_Bool checkserial, same, dirty;
+}; /* struct cache_diff */
+
+
+static int cache_diffinit(struct cache_diff *D, struct cache *C, const char *origin) {
+	memset(D, 0, sizeof *D);
+	D->C = C;
+
+	origin = (origin)? origin : ".";
+
+	if (dns_d_anchor(D->zone, sizeof D->zone, origin, strlen(origin)) >= sizeof D->zone)
+		return DNS_EILLEGAL;
+
+	/* 0 marks RRsets no diff has stamped */
+	if (!(D->gen = ++C->gen))
+		D->gen = ++C->gen;
+
+	return 0;
+} /* cache_diffinit() */
+
+
+static void cache_diffflush(struct cache_diff *D) {
+	struct cache *C = D->C;
+	struct rrset *set = D->set, *old;
+	struct dns_soa soa, cur;
+
+	D->set = NULL;
+
+	if (!set || D->inplace)
+		return;
+
+	if (!D->count++ && set->type == DNS_T_SOA) {
+		D->soa = set;
+		dns_strlcpy(D->zone, set->name, sizeof D->zone);
+
+		if (D->checkserial && rrset_soa(set, &soa) && cache_soa(C, set->name, &cur) && soa.serial == cur.serial)
+			D->same = 1;
+
+		return;
+	}
+
+	if ((old = RB_FIND(rrcache, &C->root, set))) {
+		if (old->packet.end == set->packet.end && !memcmp(old->packet.data, set->packet.data, set->packet.end)) {
+			old->zone = 1;
+			old->gen = D->gen;
+
+			D->spare = set;
+
+			return;
+		}
+
+		RB_REMOVE(rrcache, &C->root, old);
+		D->spare = old;
+	}
+
+	set->zone = 1;
+	set->gen = D->gen;
+
+	old = RB_INSERT(rrcache, &C->root, set);
+	assert(!old);
+
+	D->dirty = 1;
+} /* cache_diffflush() */
+
+
+/*
+ * Returns the RRset to push the next record of name and type into. NULL
+ * with *error 0 means the leading SOA matched and the diff is over.
+ */
+static struct rrset *cache_diffset(struct cache_diff *D, const char *name, enum dns_type type, int *error) {
+	struct rrset *set;
+
+	if ((set = D->set) && set->type == type && !strcasecmp(set->name, name))
+		return set;
+
+	cache_diffflush(D);
+
+	if (D->same) {
+		*error = 0;
+
+		return NULL;
+	}
+
+	/* a scattered RRset is appended to where it went the first time */
+	if ((set = D->soa) && type == DNS_T_SOA && !strcasecmp(set->name, name))
+		goto inplace;
+
+	if ((set = cache_find(D->C, name, type, 0, error)) && set->gen == D->gen) {
+		D->dirty = 1;
+
+		goto inplace;
+	}
+
+	if (!(set = D->spare) && !(set = malloc(sizeof *set))) {
+		*error = errno;
+
+		return NULL;
+	}
+
+	D->spare = NULL;
+
+	if ((*error = rrset_init(set, name, type))) {
+		D->spare = set;
+
+		return NULL;
+	}
+
+	D->set = set;
+	D->inplace = 0;
+
+	return set;
+inplace:
+	D->set = set;
+	D->inplace = 1;
+
+	return set;
+} /* cache_diffset() */
+
+
+static void cache_difffree(struct cache_diff *D) {
+	if (!D->inplace)
+		free(D->set);
+	D->set = NULL;
+
+	free(D->spare);
+	D->spare = NULL;
+
+	free(D->soa);
+	D->soa = NULL;
+} /* cache_difffree() */
+
+
+/* the apex of a zone loaded beneath zone which holds name, if any */
+static const char *cache_nested(struct cache *C, const char *name, const char *zone) {
+	size_t zlen = strlen(zone);
+	struct rrset *set;
+	const char *dn;
+	int error;
+
+	for (dn = name; strlen(dn) > zlen; dn++) {
+		if ((set = cache_find(C, dn, DNS_T_SOA, 0, &error)) && set->zone)
+			return set->name;
+
+		if (!(dn = strchr(dn, '.')))
+			break;
+	}
+
+	return NULL;
+} /* cache_nested() */
+
+
+static void cache_diffend(struct cache_diff *D) {
+	struct cache *C = D->C;
+	struct rrset key, *set, *nxt, *old;
+	const char *nested = NULL;
+
+	cache_diffflush(D);
+
+	if (D->same)
+		goto done;
+
+	dns_strlcpy(key.name, D->zone, sizeof key.name);
+	key.type = 0;
+
+	/* the zone's names are contiguous, a nested zone's within them */
+	for (set = cache_nfind(C, &key); set && cache_inzone(set->name, D->zone); set = nxt) {
+		nxt = RB_NEXT(rrcache, &C->root, set);
+
+		if (!set->zone || set->gen == D->gen)
+			continue;
+
+		/* replaced below */
+		if (D->soa && set->type == DNS_T_SOA && !cache_dncmp(set->name, D->zone))
+			continue;
+
+		if (nested && cache_inzone(set->name, nested))
+			continue;
+
+		if ((nested = cache_nested(C, set->name, D->zone)))
+			continue;
+
+		RB_REMOVE(rrcache, &C->root, set);
+		free(set);
+	}
+
+	if ((set = D->soa)) {
+		D->soa = NULL;
+
+		if ((old = RB_FIND(rrcache, &C->root, set))) {
+			RB_REMOVE(rrcache, &C->root, old);
+			free(old);
+		}
+
+		set->zone = 1;
+		set->gen = D->gen;
+
+		old = RB_INSERT(rrcache, &C->root, set);
+		assert(!old);
+	}
+done:
+	cache_difffree(D);
+} /* cache_diffend() */
+
+
+static void cache_diffabort(struct cache_diff *D) {
+	cache_difffree(D);
+
+	if (D->dirty)
+		cache_dropsoa(D->C, D->zone);
+} /* cache_diffabort() */
+
+
+static int cache_diffrecs(struct cache_diff *D, const struct zonerec *rec, size_t count, const struct zonearena *arena) {
+	char name[DNS_D_MAXNAME + 1];
+	struct rrset *set = NULL;
+	size_t i, len = 0;
+	int error;
+
+	for (i = 0; i < count; i++) {
+		if (!set || rec[i].type != rec[i - 1].type || rec[i].namelen != rec[i - 1].namelen
+		||  memcmp(&arena->base[rec[i].name], &arena->base[rec[i - 1].name], rec[i].namelen)) {
+			if ((len = cache_wirename(name, sizeof name, &arena->base[rec[i].name], rec[i].namelen)) >= sizeof name)
+				return DNS_EILLEGAL;
+
+			if (!(set = cache_diffset(D, name, rec[i].type, &error)))
+				return error;
+		}
+
+		if ((error = dns_p_pushrd(&set->packet, DNS_S_AN, name, len, rec[i].type, DNS_C_IN, rec[i].ttl, &arena->base[rec[i].rdata], rec[i].rdlen)))
+			return error;
+	}
+
+	return 0;
+} /* cache_diffrecs() */
+
+
+static int cache_loadrecs(struct cache *C, struct zonefile *zone, struct cache_diff *D) {
+	struct zonerec rec[64];
+	unsigned char buf[16384];
+	struct zonearena arena = { buf, sizeof buf, 0 };
+	size_t count;
+	int error;
+
+	while ((count = zone_getrrs(rec, sizeof rec / sizeof *rec, &arena, zone, &error))) {
+		if (D)
+			error = cache_diffrecs(D, rec, count, &arena);
+		else
+			error = cache_insertrecs(C, rec, count, &arena);
+
+		if (error)
+			return error;
+
+		if (D && D->same)
+			return 0;
+	}
+
+	return error;
+} /* cache_loadrecs() */
+
+
+static int cache_loadzone(struct cache *C, FILE *fp, const char *origin, unsigned ttl, struct cache_diff *D) {
+	struct zonefile *zone;
+	int error;
+
+	if (!(zone = zone_open(origin, ttl, &error)))
+		goto error;
+
+	/* map regular files read from the start; stream everything else */
+	if (0 == ftell(fp) && 0 == zone_parsemap(zone, fileno(fp))) {
+		if ((error = cache_loadrecs(C, zone, D)))
+			goto error;
+	} else {
+		while (zone_parsefile(zone, fp)) {
+			if ((error = cache_loadrecs(C, zone, D)))
+				goto error;
+
+			if (D && D->same)
+				break;
+		}
+	}
+
+	zone_close(zone);
+
+	return 0;
+error:
+	zone_close(zone);
+
+	return error;
+} /* cache_loadzone() */
+
+
+int cache_loadfile(struct cache *C, FILE *fp, const char *origin, unsigned ttl) {
+	return cache_loadzone(C, fp, origin, ttl, NULL);
+} /* cache_loadfile() */
+
+
+/*
+ * Diffs the new file against the live tree as it's parsed. See struct
+ * cache_diff. A NULL origin is the root, as for cache_loadfile().
+ */
+int cache_reloadfile(struct cache *C, FILE *fp, const char *origin, unsigned ttl) {
+	struct cache_diff D;
+	int error;
+
+	if ((error = cache_diffinit(&D, C, origin)))
+		return error;
+
+	D.checkserial = 1;
+
+	if ((error = cache_loadzone(C, fp, origin, ttl, &D))) {
+		cache_diffabort(&D);
+
+		return error;
+	}
+
+	cache_diffend(&D);
+
+	return 0;
+} /* cache_reloadfile() */
+
+
+int cache_loadpath(struct cache *C, const char *path, const char *origin, unsigned ttl) {
+	FILE *fp;
+	int error;
+
+	if (!strcmp(path, "-"))
+		return cache_loadfile(C, stdin, origin, ttl);
+
+	if (!(fp = fopen(path, "r")))
+		return errno;
+
+	error = cache_loadfile(C, fp, origin, ttl);
+
+	fclose(fp);
+
+	return error;
+} /* cache_loadpath() */
+
+
+static int cache_merge(void *C, const struct zonerec *rec, size_t count, const struct zonearena *arena) {
+	return cache_insertrecs(C, rec, count, arena);
+} /* cache_merge() */
+
+
+/*
+ * Only a regular file can be mapped and split. Pipes, FIFOs and other
+ * special files are streamed through cache_loadfile() instead.
+ */
+int cache_loadparallel(struct cache *C, const char *path, const char *origin, unsigned ttl, unsigned threads) {
+	struct stat st;
+	FILE *fp;
+	int fd, error;
+
+	if (!strcmp(path, "-"))
+		return cache_loadfile(C, stdin, origin, ttl);
+
+	if (-1 == (fd = open(path, O_RDONLY)))
+		return errno;
+
+	if (0 != fstat(fd, &st))
+		goto syerr;
+
+	if (!S_ISREG(st.st_mode)) {
+		if (!(fp = fdopen(fd, "r")))
+			goto syerr;
+
+		error = cache_loadfile(C, fp, origin, ttl);
+
+		fclose(fp);
+
+		return error;
+	}
+
+	error = zone_parallel(fd, origin, ttl, threads, &cache_merge, C);
+
+	close(fd);
+
+	return error;
+syerr:
+	error = errno;
+
+	close(fd);
+
+	return error;
+} /* cache_loadparallel() */
+
+
+/*
+ * Z O N E  T R A N S F E R S
+ *
+ * AXFR (RFC 5936) and IXFR (RFC 1995) responses are consumed message by
+ * message as they arrive. A full transfer is diffed against the live tree
+ * like a reload (see struct cache_diff); an incremental one is applied
+ * directly. The SOA records delimiting IXFR deltas are never stored; the
+ * zone's SOA is replaced once the closing SOA is seen. A transfer which
+ * fails after changing the tree removes the zone's SOA, so the next one
+ * is a full transfer rather than an IXFR from a serial no longer held.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct cache_xfer {
+	struct cache *C;
+	struct cache_diff diff; /* full transfer */
+
+	char zone[DNS_D_MAXNAME + 1];
+	enum dns_type type;
+
+	struct dns_soa soa; /* leading SOA */
+	unsigned ttl;
+
+	unsigned count;
+	enum { XFR_NONE, XFR_FULL, XFR_DEL, XFR_ADD } mode;
+	_Bool done, dirty;
+}; /* struct cache_xfer */
+
+
+static _Bool cache_rrsame(struct dns_rr *a, struct dns_packet *P, struct dns_rr *b, struct dns_packet *Q) {
+	/* dns_txt_cmp() doesn't order; TXT rdata holds no names, so compare it raw */
+	if (a->type == b->type && (a->type == DNS_T_TXT || a->type == DNS_T_SPF))
+		return a->rd.len == b->rd.len && !memcmp(&P->data[a->rd.p], &Q->data[b->rd.p], a->rd.len);
+
+	return 0 == dns_rr_cmp(a, P, b, Q);
+} /* cache_rrsame() */
+
+
+static int cache_addrr(struct cache *C, struct dns_rr *rr, struct dns_packet *P) {
+	char name[DNS_D_MAXNAME + 1];
+	union dns_any any;
+	struct rrset *set;
+	struct dns_rr x;
+	size_t len;
+	int error;
+
+	if (!(len = dns_d_expand(name, sizeof name, rr->dn.p, P, &error)))
+		return error;
+	else if (len >= sizeof name)
+		return DNS_EILLEGAL;
+
+	if ((error = dns_any_parse(dns_any_init(&any, sizeof any), rr, P)))
+		return error;
 
+	if (!(set = cache_find(C, name, rr->type, 1, &error)))
+		return error;
 
-struct rrset {
-	char name[DNS_D_MAXNAME + 1];
-	enum dns_type type;
+	set->zone = 1;
 
-	union {
-		struct dns_packet packet;
-		unsigned char pbuf[dns_p_calcsize(1024)];
-	};
+	/* an RRset holds no duplicates, RFC 2181 section 5 */
+	dns_rr_foreach(&x, &set->packet, .section = DNS_S_AN) {
+		if (cache_rrsame(&x, &set->packet, rr, P))
+			return 0;
+	}
 
-	RB_ENTRY(rrset) rbe;
-}; /* struct rrset */
+	return dns_p_push(&set->packet, DNS_S_AN, name, len, rr->type, DNS_C_IN, rr->ttl, &any);
+} /* cache_addrr() */
 
 
-static int rrset_init(struct rrset *set, const char *name, enum dns_type type) {
+static int cache_diffrr(struct cache_diff *D, struct dns_rr *rr, struct dns_packet *P) {
+	char name[DNS_D_MAXNAME + 1];
+	union dns_any any;
+	struct rrset *set;
+	size_t len;
 	int error;
 
-	memset(set, 0, sizeof *set);
-
-	dns_strlcpy(set->name, name, sizeof set->name);
-	set->type = type;
+	if (!(len = dns_d_expand(name, sizeof name, rr->dn.p, P, &error)))
+		return error;
+	else if (len >= sizeof name)
+		return DNS_EILLEGAL;
 
-	dns_p_init(&set->packet, sizeof set->pbuf);
+	if ((error = dns_any_parse(dns_any_init(&any, sizeof any), rr, P)))
+		return error;
 
-	if ((error = dns_p_push(&set->packet, DNS_S_QD, name, strlen(name), type, DNS_C_IN, 0, NULL)))
+	if (!(set = cache_diffset(D, name, rr->type, &error)))
 		return error;
 
-	return 0;
-} /* rrset_init() */
+	return dns_p_push(&set->packet, DNS_S_AN, name, len, rr->type, DNS_C_IN, rr->ttl, &any);
+} /* cache_diffrr() */
 
 
-RB_HEAD(rrcache, rrset);
+static int cache_delrr(struct cache *C, struct dns_rr *rr, struct dns_packet *P) {
+	char name[DNS_D_MAXNAME + 1];
+	union {
+		struct dns_packet packet;
+		unsigned char pbuf[dns_p_calcsize(1024)];
+	} old;
+	struct rrset *set;
+	struct dns_rr x;
+	_Bool found = 0;
+	size_t len;
+	int error;
 
-static inline int rrset_cmp(struct rrset *a, struct rrset *b) {
-	int cmp;
-	return ((cmp = a->type - b->type))? cmp : strcasecmp(a->name, b->name);
-}
+	if (!(len = dns_d_expand(name, sizeof name, rr->dn.p, P, &error)))
+		return error;
+	else if (len >= sizeof name)
+		return DNS_EILLEGAL;
 
-RB_PROTOTYPE(rrcache, rrset, rbe, rrset_cmp)
-RB_GENERATE(rrcache, rrset, rbe, rrset_cmp)
+	if (!(set = cache_find(C, name, rr->type, 0, &error)))
+		return 0;
 
+	dns_p_copy(dns_p_init(&old.packet, sizeof old), &set->packet);
 
-struct cache {
-	struct dns_cache res;
-	struct rrcache root;
-}; /* struct cache */
+	dns_p_init(&set->packet, sizeof set->pbuf);
 
+	if ((error = dns_p_push(&set->packet, DNS_S_QD, set->name, strlen(set->name), set->type, DNS_C_IN, 0, NULL)))
+		return error;
 
-static struct rrset *cache_find(struct cache *C, const char *name, enum dns_type type, _Bool make, int *error_) {
-	struct rrset key, *set;
-	int error;
+	dns_rr_foreach(&x, &old.packet, .section = DNS_S_AN) {
+		if (!found && cache_rrsame(&x, &old.packet, rr, P)) {
+			found = 1;
 
-	dns_strlcpy(key.name, name, sizeof key.name);
-	key.type = type;
+			continue;
+		}
 
-	if ((set = RB_FIND(rrcache, &C->root, &key)))
-		return set;
+		if ((error = dns_rr_copy(&set->packet, &x, &old.packet)))
+			return error;
+	}
 
-	if (!make)
-		return NULL;
+	if (!dns_p_count(&set->packet, DNS_S_AN)) {
+		RB_REMOVE(rrcache, &C->root, set);
+		free(set);
+	}
 
-	if (!(set = malloc(sizeof *set)))
-		goto syerr;
+	return 0;
+} /* cache_delrr() */
 
-	if ((error = rrset_init(set, name, type)))
-		goto error;
 
-	assert(!RB_INSERT(rrcache, &C->root, set));
+static int cache_setsoa(struct cache *C, const char *zone, struct dns_soa *soa, unsigned ttl) {
+	struct rrset *set;
+	int error;
 
-	return set;
-syerr:
-	error = errno;
-error:
-	*error_ = error;
+	cache_dropsoa(C, zone);
 
-	free(set);
+	if (!(set = cache_find(C, zone, DNS_T_SOA, 1, &error)))
+		return error;
 
-	return NULL;
-} /* cache_find() */
+	set->zone = 1;
 
+	return dns_p_push(&set->packet, DNS_S_AN, zone, strlen(zone), DNS_T_SOA, DNS_C_IN, ttl, soa);
+} /* cache_setsoa() */
 
-int cache_insert(struct cache *C, const char *name, enum dns_type type, unsigned ttl, const void *any) {
+
+static int cache_xferrr(struct cache_xfer *X, struct dns_rr *rr, struct dns_packet *P) {
+	struct dns_soa soa;
 	struct rrset *set;
 	int error;
 
-	if (!(set = cache_find(C, name, type, 1, &error)))
-		return error;
+	if (X->done)
+		return 0;
 
-	if ((error = dns_p_push(&set->packet, DNS_S_AN, name, strlen(name), type, DNS_C_IN, ttl, any)))
+	if (rr->type == DNS_T_SOA && (error = dns_soa_parse(&soa, rr, P)))
 		return error;
 
-	return 0;
-} /* cache_insert() */
+	switch (X->count++) {
+	case 0:
+		if (rr->type != DNS_T_SOA)
+			return DNS_EILLEGAL;
 
+		X->soa = soa;
+		X->ttl = rr->ttl;
 
-struct dns_packet *cache_query(struct dns_packet *query, struct dns_cache *res, int *error) {
-	struct cache *cache = res->state;
-	struct dns_packet *ans = NULL;
-	char qname[DNS_D_MAXNAME + 1];
-	struct dns_rr rr;
-	struct rrset *set;
+		return 0;
+	case 1:
+		/* an IXFR answer continues with the client's (older) SOA */
+		if (X->type == DNS_T_IXFR && rr->type == DNS_T_SOA && soa.serial != X->soa.serial) {
+			X->mode = XFR_DEL;
 
-	if ((*error = dns_rr_parse(&rr, 12, query)))
-		return NULL;
+			return 0;
+		}
 
-	if (!dns_d_expand(qname, sizeof qname, rr.dn.p, query, error))
-		goto error;
+		X->mode = XFR_FULL;
 
-	if (!(set = cache_find(cache, qname, rr.type, 0, error)))
-		return NULL;
+		if ((error = cache_diffinit(&X->diff, X->C, X->zone)))
+			return error;
 
-	if (!(ans = malloc(dns_p_sizeof(&set->packet))))
-		goto syerr;
+		/* held back by the diff until the transfer completes */
+		if (!(set = cache_diffset(&X->diff, X->zone, DNS_T_SOA, &error)))
+			return error;
 
-	dns_p_init(ans, dns_p_sizeof(&set->packet));
+		if ((error = dns_p_push(&set->packet, DNS_S_AN, X->zone, strlen(X->zone), DNS_T_SOA, DNS_C_IN, X->ttl, &X->soa)))
+			return error;
 
-	return dns_p_copy(ans, &set->packet);
-syerr:
-	*error = errno;
-error:
-	free(ans);
+		break;
+	}
 
-	return NULL;
-} /* cache_query() */
+	switch (X->mode) {
+	case XFR_FULL:
+		if (rr->type == DNS_T_SOA) {
+			X->done = (soa.serial == X->soa.serial);
 
+			return 0;
+		}
 
-struct dns_cache *cache_resi(struct cache *cache) {
-	return &cache->res;
-} /* cache_resi() */
+		return cache_diffrr(&X->diff, rr, P);
+	case XFR_DEL:
+		if (rr->type == DNS_T_SOA) {
+			X->mode = XFR_ADD;
 
+			return 0;
+		}
 
-void cache_close(struct cache *C) {
-	struct rrset *set;
+		X->dirty = 1;
 
-	if (!C)
-		return;
+		return cache_delrr(X->C, rr, P);
+	case XFR_ADD:
+		if (rr->type == DNS_T_SOA) {
+			if (soa.serial == X->soa.serial)
+				X->done = 1;
+			else
+				X->mode = XFR_DEL;
 
-	while ((set = RB_MIN(rrcache, &C->root))) {
-		RB_REMOVE(rrcache, &C->root, set);
-		free(set);
+			return 0;
+		}
+
+		X->dirty = 1;
+
+		return cache_addrr(X->C, rr, P);
+	case XFR_NONE:
+		break;
 	}
 
-	free(C);
-} /* cache_close() */
+	return DNS_EUNKNOWN;
+} /* cache_xferrr() */
 
 
-struct cache *cache_open(int *error) {
-	struct cache *C;
+/*
+ * Transfers zone from host over TCP. An IXFR request carries the serial
+ * of the zone's SOA in the cache; without one, or if the server only
+ * offers a full transfer, AXFR is used. The timeout applies per message.
+ */
+int cache_transfer(struct cache *C, const char *zone, enum dns_type type, struct sockaddr *host, int timeout) {
+	struct cache_xfer X;
+	struct sockaddr_storage local;
+	struct dns_socket *so = NULL;
+	struct dns_packet *Q = NULL, *A = NULL;
+	struct dns_soa soa;
+	struct dns_rr rr;
+	size_t len;
+	int error;
 
-	if (!(C = malloc(sizeof *C)))
-		goto syerr;
+	memset(&X, 0, sizeof X);
+	X.C = C;
+	X.type = (type == DNS_T_IXFR)? DNS_T_IXFR : DNS_T_AXFR;
 
-	dns_cache_init(&C->res);
-	C->res.state = C;
-	C->res.query = &cache_query;
+	if ((len = dns_d_anchor(X.zone, sizeof X.zone, zone, strlen(zone))) >= sizeof X.zone)
+		return DNS_EILLEGAL;
 
-	RB_INIT(&C->root);
+	if (X.type == DNS_T_IXFR && !cache_soa(C, X.zone, &soa))
+		X.type = DNS_T_AXFR;
 
-	return C;
-syerr:
-	*error = errno;
+	/* room for the question and an IXFR's SOA */
+	if (!(Q = dns_p_make2(1024, &C->alloc, &error)))
+		goto error;
 
-	cache_close(C);
+	if ((error = dns_p_push(Q, DNS_S_QD, X.zone, len, X.type, DNS_C_IN, 0, NULL)))
+		goto error;
 
-	return NULL;
-} /* cache_open() */
+	if (X.type == DNS_T_IXFR && (error = dns_p_push(Q, DNS_S_NS, X.zone, len, DNS_T_SOA, DNS_C_IN, 0, &soa)))
+		goto error;
 
+	memset(&local, 0, sizeof local);
+	local.ss_family = host->sa_family;
 
-int cache_loadfile(struct cache *C, FILE *fp, const char *origin, unsigned ttl) {
-	struct zonefile *zone;
-	struct zonerr rr;
-	struct dns_soa *soa;
-	int error;
+	if (!(so = dns_so_open((struct sockaddr *)&local, SOCK_STREAM, NULL, &error)))
+		goto error;
 
-	if (!(zone = zone_open(origin, ttl, &error)))
+	if ((error = dns_so_submit(so, Q, host)))
 		goto error;
 
-	while (zone_parsefile(zone, fp)) {
-		while (zone_getrr(&rr, &soa, zone)) {
-			if ((error = cache_insert(C, rr.name, rr.type, rr.ttl, &rr.data)))
+	for (;;) {
+		while ((error = dns_so_check(so))) {
+			if (error != EAGAIN)
+				goto error;
+
+			if (dns_so_elapsed(so) >= timeout) {
+				error = ETIMEDOUT;
+
 				goto error;
+			}
+
+			dns_so_poll(so, 1);
 		}
-	}
 
-	zone_close(zone);
+		if (!(A = dns_so_fetch(so, &error)))
+			goto error;
 
-	return 0;
-error:
-	zone_close(zone);
+		if (dns_p_rcode(A) != DNS_RC_NOERROR) {
+			error = DNS_EFAIL;
 
-	return error;
-} /* cache_loadfile() */
+			goto error;
+		}
 
+		dns_rr_foreach(&rr, A, .section = DNS_S_AN) {
+			if ((error = cache_xferrr(&X, &rr, A)))
+				goto error;
+		}
 
-int cache_loadpath(struct cache *C, const char *path, const char *origin, unsigned ttl) {
-	FILE *fp;
-	int error;
+		dns_p_free(A);
+		A = NULL;
 
-	if (!strcmp(path, "-"))
-		return cache_loadfile(C, stdin, origin, ttl);
+		/* a lone SOA answers an IXFR when no deltas are on offer */
+		if (X.done || (X.type == DNS_T_IXFR && X.count == 1))
+			break;
 
-	if (!(fp = fopen(path, "r")))
-		return errno;
+		if ((error = dns_so_next(so)))
+			goto error;
+	}
 
-	error = cache_loadfile(C, fp, origin, ttl);
+	dns_so_close(so);
+	so = NULL;
+	dns_p_free(Q);
+	Q = NULL;
+
+	if (X.mode == XFR_FULL) {
+		cache_diffend(&X.diff);
+	} else if (X.count == 1) {
+		if (X.soa.serial != soa.serial)
+			return cache_transfer(C, X.zone, DNS_T_AXFR, host, timeout);
+	} else if ((error = cache_setsoa(C, X.zone, &X.soa, X.ttl))) {
+		goto error;
+	}
 
-	fclose(fp);
+	return 0;
+error:
+	if (X.mode == XFR_FULL)
+		cache_diffabort(&X.diff);
+	else if (X.dirty)
+		cache_dropsoa(C, X.zone);
+
+	dns_p_free(A);
+	dns_p_free(Q);
+	dns_so_close(so);
 
 	return error;
-} /* cache_loadpath() */
+} /* cache_transfer() */
 
 
 static void cache_showpkt(struct dns_packet *pkt, FILE *fp) {
@@ -275,15 +1469,161 @@ static void cache_showpkt(struct dns_packet *pkt, FILE *fp) {
 
 int cache_dumpfile(struct cache *C, FILE *fp) {
 	struct rrset *set;
+	struct dns_packet *P;
+	size_t i;
+	int error;
 
 	RB_FOREACH(set, rrcache, &C->root) {
 		cache_showpkt(&set->packet, fp);
 	}
 
+	for (i = 0; i < C->image.count; i++) {
+		if (!(P = cache_imgpacket(C, &C->image.index[i], &error)))
+			return error;
+
+		cache_showpkt(P, fp);
+		dns_p_free(P);
+	}
+
 	return 0;
 } /* cache_dumpfile() */
 
 
+int cache_saveimage(struct cache *C, FILE *fp) {
+	struct imghdr hdr;
+	struct imgent ent;
+	struct rrset *set;
+	uint64_t off, size;
+	size_t count = 0;
+
+	size = sizeof hdr;
+
+	RB_FOREACH(set, rrcache, &C->root) {
+		size += sizeof ent + strlen(set->name) + 1 + set->packet.end;
+		count++;
+	}
+
+	if (size > UINT32_MAX)
+		return EFBIG;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, IMG_MAGIC, sizeof hdr.magic);
+	hdr.bom = IMG_BOM;
+	hdr.version = IMG_VERSION;
+	hdr.count = count;
+	hdr.size = size;
+
+	if (1 != fwrite(&hdr, sizeof hdr, 1, fp))
+		goto syerr;
+
+	off = sizeof hdr + count * sizeof ent;
+
+	RB_FOREACH(set, rrcache, &C->root) {
+		ent.type = set->type;
+		ent.name = off;
+		off += strlen(set->name) + 1;
+		ent.data = off;
+		ent.len = set->packet.end;
+		off += set->packet.end;
+
+		if (1 != fwrite(&ent, sizeof ent, 1, fp))
+			goto syerr;
+	}
+
+	RB_FOREACH(set, rrcache, &C->root) {
+		if (1 != fwrite(set->name, strlen(set->name) + 1, 1, fp))
+			goto syerr;
+
+		if (set->packet.end && 1 != fwrite(set->packet.data, set->packet.end, 1, fp))
+			goto syerr;
+	}
+
+	if (0 != fflush(fp))
+		goto syerr;
+
+	return 0;
+syerr:
+	return errno;
+} /* cache_saveimage() */
+
+
+/*
+ * Attaches an image read-only. Lookups which miss the tree fall through
+ * to a binary search of the image index, so nothing is inserted. Every
+ * offset is checked against the file and the index must be strictly
+ * ascending, or the search would silently miss entries.
+ */
+int cache_loadimage(struct cache *C, const char *path) {
+	const struct imghdr *hdr;
+	const struct imgent *ent;
+	struct stat st;
+	void *base = MAP_FAILED;
+	size_t size = 0, i;
+	int fd, error;
+
+	if (-1 == (fd = open(path, O_RDONLY)))
+		goto syerr;
+
+	if (0 != fstat(fd, &st))
+		goto syerr;
+
+	if (st.st_size < (off_t)sizeof *hdr || (off_t)(size_t)st.st_size != st.st_size)
+		goto invalid;
+
+	size = st.st_size;
+
+	if (MAP_FAILED == (base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)))
+		goto syerr;
+
+	hdr = base;
+
+	if (memcmp(hdr->magic, IMG_MAGIC, sizeof hdr->magic) || hdr->bom != IMG_BOM || hdr->version != IMG_VERSION)
+		goto invalid;
+
+	if (hdr->size != size || hdr->count > (size - sizeof *hdr) / sizeof *ent)
+		goto invalid;
+
+	ent = (const struct imgent *)(hdr + 1);
+
+	for (i = 0; i < hdr->count; i++) {
+		if (ent[i].name >= size || !memchr((char *)base + ent[i].name, '\0', size - ent[i].name))
+			goto invalid;
+
+		if (ent[i].data > size || ent[i].len > size - ent[i].data || ent[i].len < 12)
+			goto invalid;
+
+		if (i > 0 && cache_imgcmp(base, &ent[i - 1], ent[i].type, (char *)base + ent[i].name) <= 0)
+			goto invalid;
+	}
+
+	close(fd);
+
+	if (C->image.base)
+		munmap(C->image.base, C->image.size);
+
+	C->image.base = base;
+	C->image.size = size;
+	C->image.index = ent;
+	C->image.count = hdr->count;
+
+	return 0;
+invalid:
+	error = EINVAL;
+
+	goto error;
+syerr:
+	error = errno;
+error:
+	if (base != MAP_FAILED)
+		munmap(base, size);
+
+	if (fd != -1)
+		close(fd);
+
+	return error;
+} /* cache_loadimage() */
+
+
 #if CACHE_MAIN
 
 #include <ctype.h>	/* tolower(3) */
@@ -295,6 +1635,8 @@ struct {
 	char *progname;
 	char *origin;
 	unsigned ttl;
+	_Bool recurse;
+	char *image;
 	struct dns_resolv_conf *resconf;
 	struct dns_hosts *hosts;
 	struct dns_hints *hints;
@@ -314,6 +1656,8 @@ static struct dns_resolv_conf *resconf(void) {
 		MAIN.resconf->lookup[2] = MAIN.resconf->lookup[1];
 		MAIN.resconf->lookup[1] = MAIN.resconf->lookup[0];
 		MAIN.resconf->lookup[0] = 'c';
+
+		MAIN.resconf->options.recurse = MAIN.recurse;
 	}
 
 	return MAIN.resconf;
@@ -333,7 +1677,9 @@ static struct dns_hosts *hosts(void) {
 static struct dns_hints *hints(void) {
 	int error;
 
-	if (!MAIN.hints)
+	if (!MAIN.hints && MAIN.recurse)
+		assert(MAIN.hints = dns_hints_root(resconf(), &error));
+	else if (!MAIN.hints)
 		assert(MAIN.hints = dns_hints_local(resconf(), &error));
 
 	return MAIN.hints;
@@ -345,7 +1691,16 @@ static struct cache *cache(void) {
 
 	if (!MAIN.cache) {
 		assert(MAIN.cache = cache_open(&error));
-		assert(!cache_loadfile(MAIN.cache, stdin, MAIN.origin, MAIN.ttl));
+
+		if (MAIN.image)
+			error = cache_loadimage(MAIN.cache, MAIN.image);
+		else
+			error = cache_loadfile(MAIN.cache, stdin, MAIN.origin, MAIN.ttl);
+
+		if (error) {
+			fprintf(stderr, "%s: %s: %s\n", MAIN.progname, (MAIN.image)? MAIN.image : "stdin", dns_strerror(error));
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	return MAIN.cache;
@@ -357,6 +1712,8 @@ static void usage(FILE *fp) {
 		" [OPTIONS] [QNAME [QTYPE]]\n"
 		"  -o ORIGIN  Zone origin\n"
 		"  -t TTL     Zone TTL\n"
+		"  -r         Recurse, serving the zone locally (e.g. root, RFC 8806)\n"
+		"  -i IMAGE   Attach a compiled image instead of reading stdin\n"
 		"  -V         Print version info\n"
 		"  -h         Print this usage message\n"
 		"\n"
@@ -417,7 +1774,7 @@ int main(int argc, char **argv) {
 
 	MAIN.progname = argv[0];
 
-	while (-1 != (opt = getopt(argc, argv, "o:t:Vh"))) {
+	while (-1 != (opt = getopt(argc, argv, "o:t:ri:Vh"))) {
 		switch (opt) {
 		case 'o':
 			MAIN.origin = optarg;
@@ -426,6 +1783,14 @@ int main(int argc, char **argv) {
 		case 't':
 			MAIN.ttl = parsettl(optarg);
 
+			break;
+		case 'r':
+			MAIN.recurse = 1;
+
+			break;
+		case 'i':
+			MAIN.image = optarg;
+
 			break;
 		case 'h':
 			usage(stdout);
@@ -449,6 +1814,9 @@ int main(int argc, char **argv) {
 	if (qname) {
 		assert(res = dns_res_open(resconf(), hosts(), hints(), cache_resi(cache()), dns_opts(), &error));
 
+		if (MAIN.recurse)
+			dns_res_setlocal(res, cache_local(cache()));
+
 		assert(!dns_res_submit(res, qname, qtype, DNS_C_IN));
 
 		while ((error = dns_res_check(res))) {
@@ -460,7 +1828,7 @@ int main(int argc, char **argv) {
 
 		cache_showpkt(ans, stdout);
 
-		free(ans);
+		dns_p_free(ans);
 
 		dns_res_close(res);
 	} else {
@@ -33,19 +33,39 @@
 
 struct cache;
 
+struct zonerec;
+struct zonearena;
+
 struct cache *cache_open(int *);
 
+/** like cache_open, but the answers it hands out come from the options' allocator */
+struct cache *cache_open2(const struct dns_options *, int *);
+
 void cache_close(struct cache *);
 
 int cache_loadfile(struct cache *, FILE *, const char *, unsigned);
 
+int cache_reloadfile(struct cache *, FILE *, const char *, unsigned);
+
 int cache_loadpath(struct cache *, const char *, const char *, unsigned);
 
+int cache_loadparallel(struct cache *, const char *, const char *, unsigned, unsigned);
+
+int cache_transfer(struct cache *, const char *, enum dns_type, struct sockaddr *, int);
+
 struct dns_cache *cache_resi(struct cache *);
 
+struct dns_cache *cache_local(struct cache *);
+
 int cache_insert(struct cache *, const char *, enum dns_type, unsigned, const void *);
 
+int cache_insertrecs(struct cache *, const struct zonerec *, size_t, const struct zonearena *);
+
 int cache_dumpfile(struct cache *, FILE *);
 
+int cache_saveimage(struct cache *, FILE *);
+
+int cache_loadimage(struct cache *, const char *);
+
 
 #endif /* CACHE_H */
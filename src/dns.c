@@ -38,7 +38,7 @@
 #define _NETBSD_SOURCE
 #endif
 
-#include <limits.h>		/* INT_MAX */
+#include <limits.h>		/* INT_MAX UINT_MAX */
 #include <stddef.h>		/* offsetof() */
 #ifdef _WIN32
 #define uint32_t unsigned int
@@ -1085,6 +1085,314 @@ static inline _Bool dns_isspace(unsigned char c) {
 } /* dns_isspace() */
 
 
+/*
+ * A S C I I  K E R N E L S
+ *
+ * Label scanning, LDH validation, case folding and case-insensitive
+ * comparison sit beneath every name parse, compare and compress. Each
+ * kernel has a portable scalar implementation as well as SSE2 and AVX2
+ * implementations. The widest one the CPU supports is chosen at runtime
+ * by dns_ascii().
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef HAVE_SSE2
+#define HAVE_SSE2 (defined __SSE2__)
+#endif
+
+#ifndef HAVE___BUILTIN_CPU_SUPPORTS
+#define HAVE___BUILTIN_CPU_SUPPORTS ((DNS_GNUC_PREREQ(4,8,0) || dns_has_builtin(__builtin_cpu_supports)) && (defined __x86_64__ || defined __i386__))
+#endif
+
+#ifndef HAVE_AVX2
+#define HAVE_AVX2 (HAVE_SSE2 && HAVE___BUILTIN_CPU_SUPPORTS && (DNS_GNUC_PREREQ(4,9,0) || __clang__))
+#endif
+
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if HAVE_AVX2
+#include <immintrin.h>
+#define DNS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+struct dns_ascii {
+	const char *name;
+
+	/* offset of first ch in src, or len if none */
+	size_t (*find)(const unsigned char *src, size_t len, unsigned char ch);
+
+	/* length of the leading span of letters, digits and hyphens */
+	size_t (*ldhspn)(const unsigned char *src, size_t len);
+
+	/* fold A-Z to a-z; dst may equal src */
+	void (*lower)(unsigned char *dst, const unsigned char *src, size_t len);
+
+	/* like strncasecmp(3) but doesn't stop at '\0' */
+	int (*casecmp)(const unsigned char *a, const unsigned char *b, size_t len);
+}; /* struct dns_ascii */
+
+
+static inline unsigned char dns_ascii_lc(unsigned char c) {
+	return (c >= 'A' && c <= 'Z')? c | 0x20 : c;
+} /* dns_ascii_lc() */
+
+static inline _Bool dns_ascii_isldh(unsigned char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+} /* dns_ascii_isldh() */
+
+
+static size_t dns_ascii_find_scalar(const unsigned char *src, size_t len, unsigned char ch) {
+	size_t p;
+
+	for (p = 0; p < len && src[p] != ch; p++)
+		;;
+
+	return p;
+} /* dns_ascii_find_scalar() */
+
+static size_t dns_ascii_ldhspn_scalar(const unsigned char *src, size_t len) {
+	size_t p;
+
+	for (p = 0; p < len && dns_ascii_isldh(src[p]); p++)
+		;;
+
+	return p;
+} /* dns_ascii_ldhspn_scalar() */
+
+static void dns_ascii_lower_scalar(unsigned char *dst, const unsigned char *src, size_t len) {
+	size_t p;
+
+	for (p = 0; p < len; p++)
+		dst[p] = dns_ascii_lc(src[p]);
+} /* dns_ascii_lower_scalar() */
+
+static int dns_ascii_casecmp_scalar(const unsigned char *a, const unsigned char *b, size_t len) {
+	size_t p;
+	int cmp;
+
+	for (p = 0; p < len; p++) {
+		if ((cmp = dns_ascii_lc(a[p]) - dns_ascii_lc(b[p])))
+			return cmp;
+	}
+
+	return 0;
+} /* dns_ascii_casecmp_scalar() */
+
+DNS_NOTUSED static const struct dns_ascii dns_ascii_scalar = {
+	.name    = "scalar",
+	.find    = &dns_ascii_find_scalar,
+	.ldhspn  = &dns_ascii_ldhspn_scalar,
+	.lower   = &dns_ascii_lower_scalar,
+	.casecmp = &dns_ascii_casecmp_scalar,
+};
+
+
+#if HAVE_SSE2
+/*
+ * NB: SSE2 only has signed byte comparisons. Bytes >= 0x80 compare as
+ * negative, so they fall outside every ASCII range tested below.
+ */
+static inline __m128i dns_ascii_isupper_sse2(__m128i x) {
+	return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+} /* dns_ascii_isupper_sse2() */
+
+static inline __m128i dns_ascii_lc_sse2(__m128i x) {
+	return _mm_or_si128(x, _mm_and_si128(dns_ascii_isupper_sse2(x), _mm_set1_epi8(0x20)));
+} /* dns_ascii_lc_sse2() */
+
+static inline __m128i dns_ascii_isldh_sse2(__m128i x) {
+	__m128i lc = _mm_or_si128(x, _mm_set1_epi8(0x20));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lc, _mm_set1_epi8('z' + 1)));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+	__m128i hyphen = _mm_cmpeq_epi8(x, _mm_set1_epi8('-'));
+
+	return _mm_or_si128(alpha, _mm_or_si128(digit, hyphen));
+} /* dns_ascii_isldh_sse2() */
+
+static size_t dns_ascii_find_sse2(const unsigned char *src, size_t len, unsigned char ch) {
+	const __m128i c = _mm_set1_epi8((char)ch);
+	unsigned mask;
+	size_t p;
+
+	for (p = 0; len - p >= 16; p += 16) {
+		if ((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&src[p]), c))))
+			return p + __builtin_ctz(mask);
+	}
+
+	return p + dns_ascii_find_scalar(&src[p], len - p, ch);
+} /* dns_ascii_find_sse2() */
+
+static size_t dns_ascii_ldhspn_sse2(const unsigned char *src, size_t len) {
+	unsigned mask;
+	size_t p;
+
+	for (p = 0; len - p >= 16; p += 16) {
+		if ((mask = 0xffff & ~_mm_movemask_epi8(dns_ascii_isldh_sse2(_mm_loadu_si128((const __m128i *)&src[p])))))
+			return p + __builtin_ctz(mask);
+	}
+
+	return p + dns_ascii_ldhspn_scalar(&src[p], len - p);
+} /* dns_ascii_ldhspn_sse2() */
+
+static void dns_ascii_lower_sse2(unsigned char *dst, const unsigned char *src, size_t len) {
+	size_t p;
+
+	for (p = 0; len - p >= 16; p += 16)
+		_mm_storeu_si128((__m128i *)&dst[p], dns_ascii_lc_sse2(_mm_loadu_si128((const __m128i *)&src[p])));
+
+	dns_ascii_lower_scalar(&dst[p], &src[p], len - p);
+} /* dns_ascii_lower_sse2() */
+
+static int dns_ascii_casecmp_sse2(const unsigned char *a, const unsigned char *b, size_t len) {
+	__m128i x, y;
+	unsigned mask;
+	size_t p;
+
+	for (p = 0; len - p >= 16; p += 16) {
+		x = dns_ascii_lc_sse2(_mm_loadu_si128((const __m128i *)&a[p]));
+		y = dns_ascii_lc_sse2(_mm_loadu_si128((const __m128i *)&b[p]));
+
+		if ((mask = 0xffff & ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)))) {
+			p += __builtin_ctz(mask);
+
+			return dns_ascii_lc(a[p]) - dns_ascii_lc(b[p]);
+		}
+	}
+
+	return dns_ascii_casecmp_scalar(&a[p], &b[p], len - p);
+} /* dns_ascii_casecmp_sse2() */
+
+static const struct dns_ascii dns_ascii_sse2 = {
+	.name    = "sse2",
+	.find    = &dns_ascii_find_sse2,
+	.ldhspn  = &dns_ascii_ldhspn_sse2,
+	.lower   = &dns_ascii_lower_sse2,
+	.casecmp = &dns_ascii_casecmp_sse2,
+};
+#endif /* HAVE_SSE2 */
+
+
+#if HAVE_AVX2
+/* NB: AVX2 has no cmplt; swap the operands of cmpgt instead. */
+DNS_TARGET_AVX2 static inline __m256i dns_ascii_isupper_avx2(__m256i x) {
+	return _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+} /* dns_ascii_isupper_avx2() */
+
+DNS_TARGET_AVX2 static inline __m256i dns_ascii_lc_avx2(__m256i x) {
+	return _mm256_or_si256(x, _mm256_and_si256(dns_ascii_isupper_avx2(x), _mm256_set1_epi8(0x20)));
+} /* dns_ascii_lc_avx2() */
+
+DNS_TARGET_AVX2 static inline __m256i dns_ascii_isldh_avx2(__m256i x) {
+	__m256i lc = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+	__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lc, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lc));
+	__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), x));
+	__m256i hyphen = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-'));
+
+	return _mm256_or_si256(alpha, _mm256_or_si256(digit, hyphen));
+} /* dns_ascii_isldh_avx2() */
+
+DNS_TARGET_AVX2 static size_t dns_ascii_find_avx2(const unsigned char *src, size_t len, unsigned char ch) {
+	const __m256i c = _mm256_set1_epi8((char)ch);
+	unsigned mask;
+	size_t p;
+
+	for (p = 0; len - p >= 32; p += 32) {
+		if ((mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&src[p]), c))))
+			return p + __builtin_ctz(mask);
+	}
+
+	return p + dns_ascii_find_sse2(&src[p], len - p, ch);
+} /* dns_ascii_find_avx2() */
+
+DNS_TARGET_AVX2 static size_t dns_ascii_ldhspn_avx2(const unsigned char *src, size_t len) {
+	unsigned mask;
+	size_t p;
+
+	for (p = 0; len - p >= 32; p += 32) {
+		if ((mask = ~(unsigned)_mm256_movemask_epi8(dns_ascii_isldh_avx2(_mm256_loadu_si256((const __m256i *)&src[p])))))
+			return p + __builtin_ctz(mask);
+	}
+
+	return p + dns_ascii_ldhspn_sse2(&src[p], len - p);
+} /* dns_ascii_ldhspn_avx2() */
+
+DNS_TARGET_AVX2 static void dns_ascii_lower_avx2(unsigned char *dst, const unsigned char *src, size_t len) {
+	size_t p;
+
+	for (p = 0; len - p >= 32; p += 32)
+		_mm256_storeu_si256((__m256i *)&dst[p], dns_ascii_lc_avx2(_mm256_loadu_si256((const __m256i *)&src[p])));
+
+	dns_ascii_lower_sse2(&dst[p], &src[p], len - p);
+} /* dns_ascii_lower_avx2() */
+
+DNS_TARGET_AVX2 static int dns_ascii_casecmp_avx2(const unsigned char *a, const unsigned char *b, size_t len) {
+	__m256i x, y;
+	unsigned mask;
+	size_t p;
+
+	for (p = 0; len - p >= 32; p += 32) {
+		x = dns_ascii_lc_avx2(_mm256_loadu_si256((const __m256i *)&a[p]));
+		y = dns_ascii_lc_avx2(_mm256_loadu_si256((const __m256i *)&b[p]));
+
+		if ((mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)))) {
+			p += __builtin_ctz(mask);
+
+			return dns_ascii_lc(a[p]) - dns_ascii_lc(b[p]);
+		}
+	}
+
+	return dns_ascii_casecmp_sse2(&a[p], &b[p], len - p);
+} /* dns_ascii_casecmp_avx2() */
+
+static const struct dns_ascii dns_ascii_avx2 = {
+	.name    = "avx2",
+	.find    = &dns_ascii_find_avx2,
+	.ldhspn  = &dns_ascii_ldhspn_avx2,
+	.lower   = &dns_ascii_lower_avx2,
+	.casecmp = &dns_ascii_casecmp_avx2,
+};
+#endif /* HAVE_AVX2 */
+
+
+static const struct dns_ascii *dns_ascii_select(void) {
+#if HAVE_AVX2
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return &dns_ascii_avx2;
+#endif
+#if HAVE_SSE2
+	return &dns_ascii_sse2;
+#else
+	return &dns_ascii_scalar;
+#endif
+} /* dns_ascii_select() */
+
+/*
+ * NB: Racing threads all select the same table, so the unsynchronized
+ * pointer store below is benign.
+ */
+static const struct dns_ascii *dns_ascii(void) {
+	static const struct dns_ascii *volatile ascii;
+	const struct dns_ascii *ops;
+
+	if (!(ops = ascii))
+		ascii = ops = dns_ascii_select();
+
+	return ops;
+} /* dns_ascii() */
+
+
+static int dns_strcasecmp(const char *a, const char *b) {
+	size_t alen = strlen(a), blen = strlen(b);
+
+	/* include the shorter string's '\0' so a prefix sorts first */
+	return dns_ascii()->casecmp((const unsigned char *)a, (const unsigned char *)b, DNS_PP_MIN(alen, blen) + 1);
+} /* dns_strcasecmp() */
+
+
 static int dns_poll(int fd, short events, int timeout) {
 	fd_set rset, wset;
 
@@ -1496,6 +1804,52 @@ dns_b_move(struct dns_buf *dst, const struct dns_buf *_src, size_t n)
 }
 
 
+/*
+ * M E M O R Y  R O U T I N E S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static inline _Bool dns_a_isset(const struct dns_allocator *a) {
+	return a && a->malloc;
+} /* dns_a_isset() */
+
+
+static void *dns_a_malloc(const struct dns_allocator *a, size_t size) {
+	return (dns_a_isset(a))? a->malloc(size, a->arg) : malloc(size);
+} /* dns_a_malloc() */
+
+
+static void *dns_a_realloc(const struct dns_allocator *a, void *p, size_t osize, size_t size) {
+	void *tmp;
+
+	if (!dns_a_isset(a))
+		return realloc(p, size);
+
+	if (a->realloc)
+		return a->realloc(p, size, a->arg);
+
+	if (!(tmp = a->malloc(size, a->arg)))
+		return NULL;
+
+	if (p) {
+		memcpy(tmp, p, DNS_PP_MIN(osize, size));
+
+		if (a->free)
+			a->free(p, a->arg);
+	}
+
+	return tmp;
+} /* dns_a_realloc() */
+
+
+static void dns_a_free(const struct dns_allocator *a, void *p) {
+	if (!dns_a_isset(a))
+		free(p);
+	else if (p && a->free)
+		a->free(p, a->arg);
+} /* dns_a_free() */
+
+
 /*
  * P A C K E T  R O U T I N E S
  *
@@ -1530,6 +1884,21 @@ unsigned dns_p_count(struct dns_packet *P, enum dns_section section) {
 } /* dns_p_count() */
 
 
+unsigned dns_p_minttl(struct dns_packet *P, unsigned ttl) {
+	struct dns_rr rr;
+	struct dns_soa soa;
+
+	dns_rr_foreach(&rr, P, .section = DNS_S_AN|DNS_S_NS) {
+		ttl = DNS_PP_MIN(ttl, rr.ttl);
+
+		if (rr.type == DNS_T_SOA && rr.section == DNS_S_NS && !dns_soa_parse(&soa, &rr, P))
+			ttl = DNS_PP_MIN(ttl, soa.minimum);
+	}
+
+	return ttl;
+} /* dns_p_minttl() */
+
+
 struct dns_packet *dns_p_init(struct dns_packet *P, size_t size) {
 	if (!P)
 		return 0;
@@ -1547,7 +1916,12 @@ struct dns_packet *dns_p_init(struct dns_packet *P, size_t size) {
 
 
 static struct dns_packet *dns_p_reset(struct dns_packet *P) {
-	return dns_p_init(P, offsetof(struct dns_packet, data) + P->size);
+	struct dns_allocator alloc = P->alloc;
+
+	dns_p_init(P, offsetof(struct dns_packet, data) + P->size);
+	P->alloc = alloc;
+
+	return P;
 } /* dns_p_reset() */
 
 
@@ -1571,19 +1945,236 @@ invalid:
 } /* dns_p_qend() */
 
 
-struct dns_packet *dns_p_make(size_t len, int *error) {
+/*
+ * Packets are carved from power-of-two size classes of 512 through 65536
+ * payload bytes. Released packets are cached on per-thread free lists so
+ * steady-state traffic doesn't touch malloc(3). Pooled packets are plain
+ * malloc(3) blocks, so free(3) remains a valid way to dispose of them.
+ * Usage counters live in the pool too, so counting stays thread-local.
+ * Builds without DNS_THREAD_SAFE neither pool nor count.
+ */
+#ifndef DNS_P_POOL
+#define DNS_P_POOL	1
+#endif
+
+#ifndef DNS_P_POOLMAX
+#define DNS_P_POOLMAX	16	/* cached packets per size class per thread */
+#endif
+
+#define DNS_P_POOLLO	9	/* log2 of smallest class */
+#define DNS_P_POOLHI	16	/* log2 of largest class */
+
+struct dns_p_pool {
+	struct {
+		struct dns_packet *head;
+		unsigned count;
+	} bin[DNS_P_POOLHI - DNS_P_POOLLO + 1];
+
+	struct dns_p_stat stat;
+}; /* struct dns_p_pool */
+
+
+static int dns_p_pool_class(size_t size) {
+	int n;
+
+	for (n = DNS_P_POOLLO; n <= DNS_P_POOLHI; n++) {
+		if (size <= ((size_t)1 << n))
+			return n - DNS_P_POOLLO;
+	}
+
+	return -1;
+} /* dns_p_pool_class() */
+
+
+static void dns_p_pool_flush(struct dns_p_pool *pool) {
+	struct dns_packet *P;
+	unsigned i;
+
+	for (i = 0; i < lengthof(pool->bin); i++) {
+		while ((P = pool->bin[i].head)) {
+			pool->bin[i].head = P->cqe.cqe_next;
+			free(P);
+		}
+
+		pool->bin[i].count = 0;
+	}
+} /* dns_p_pool_flush() */
+
+
+#if DNS_THREAD_SAFE
+#include <pthread.h>
+
+static pthread_once_t dns_p_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dns_p_pool_key;
+static _Bool dns_p_pool_haskey;
+
+static void dns_p_pool_destroy(void *pool) {
+	dns_p_pool_flush(pool);
+	free(pool);
+} /* dns_p_pool_destroy() */
+
+static void dns_p_pool_keyinit(void) {
+	dns_p_pool_haskey = (0 == pthread_key_create(&dns_p_pool_key, &dns_p_pool_destroy));
+} /* dns_p_pool_keyinit() */
+
+static struct dns_p_pool *dns_p_pool(_Bool create) {
+	struct dns_p_pool *pool;
+
+	pthread_once(&dns_p_pool_once, &dns_p_pool_keyinit);
+
+	if (!dns_p_pool_haskey)
+		return NULL;
+
+	if (!(pool = pthread_getspecific(dns_p_pool_key)) && create) {
+		if (!(pool = calloc(1, sizeof *pool)))
+			return NULL;
+
+		if (0 != pthread_setspecific(dns_p_pool_key, pool)) {
+			free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+} /* dns_p_pool() */
+#else
+/*
+ * Without thread-local storage the only pool is a process-wide one,
+ * which threads the library can't see would race on. Don't pool.
+ */
+static struct dns_p_pool *dns_p_pool(_Bool create DNS_NOTUSED) {
+	return NULL;
+} /* dns_p_pool() */
+#endif
+
+
+/*
+ * Allocate room for a packet with at least *size payload bytes. On return
+ * *size holds the payload capacity actually allocated.
+ */
+static void *dns_p_pool_get(size_t *size) {
+	struct dns_p_pool *pool;
 	struct dns_packet *P;
-	size_t size = dns_p_calcsize(len);
+	int n;
+
+	if ((pool = dns_p_pool(1)))
+		pool->stat.allocs++;
+
+	if (!DNS_P_POOL || !pool || (n = dns_p_pool_class(*size)) < 0)
+		goto nopool;
 
-	if (!(P = dns_p_init(malloc(size), size)))
-		*error = dns_syerr();
+	*size = (size_t)1 << (n + DNS_P_POOLLO);
+
+	if (!(P = pool->bin[n].head))
+		goto nopool;
+
+	pool->bin[n].head = P->cqe.cqe_next;
+	pool->bin[n].count--;
+
+	pool->stat.hits++;
 
 	return P;
-} /* dns_p_make() */
+nopool:
+	if (pool)
+		pool->stat.misses++;
+
+	return malloc(dns_p_calcsize(*size));
+} /* dns_p_pool_get() */
 
 
-static void dns_p_free(struct dns_packet *P) {
+static void dns_p_pool_put(struct dns_packet *P) {
+	struct dns_p_pool *pool;
+	int n;
+
+	if ((pool = dns_p_pool(1)))
+		pool->stat.frees++;
+
+	/*
+	 * Only cache packets whose capacity is exactly a size class. Packets
+	 * initialized by the application over its own buffers are passed
+	 * back to free(3) just as before.
+	 */
+	if (!DNS_P_POOL || !pool || (n = dns_p_pool_class(P->size)) < 0 || P->size != ((size_t)1 << (n + DNS_P_POOLLO)))
+		goto nopool;
+
+	if (pool->bin[n].count >= DNS_P_POOLMAX)
+		goto nopool;
+
+	P->cqe.cqe_next = pool->bin[n].head;
+	pool->bin[n].head = P;
+	pool->bin[n].count++;
+
+	pool->stat.cached++;
+
+	return;
+nopool:
 	free(P);
+} /* dns_p_pool_put() */
+
+
+const struct dns_p_stat *dns_p_stat(void) {
+	static const struct dns_p_stat none;
+	struct dns_p_pool *pool;
+
+	return ((pool = dns_p_pool(0)))? &pool->stat : &none;
+} /* dns_p_stat() */
+
+
+void dns_p_flush(void) {
+	struct dns_p_pool *pool;
+
+	if ((pool = dns_p_pool(0)))
+		dns_p_pool_flush(pool);
+} /* dns_p_flush() */
+
+
+/*
+ * Allocate a packet with at least *size payload bytes from the specified
+ * allocator, or from the pool if none. On return *size holds the payload
+ * capacity actually allocated.
+ */
+static struct dns_packet *dns_p_alloc(size_t *size, const struct dns_allocator *alloc, int *error) {
+	struct dns_packet *P;
+
+	if (dns_a_isset(alloc)) {
+		if (!(P = alloc->malloc(dns_p_calcsize(*size), alloc->arg)))
+			return *error = dns_syerr(), (void *)0;
+
+		dns_p_init(P, dns_p_calcsize(*size));
+		P->alloc = *alloc;
+
+		return P;
+	}
+
+	if (!(P = dns_p_pool_get(size)))
+		return *error = dns_syerr(), (void *)0;
+
+	return dns_p_init(P, dns_p_calcsize(*size));
+} /* dns_p_alloc() */
+
+
+struct dns_packet *dns_p_make2(size_t len, const struct dns_allocator *alloc, int *error) {
+	return dns_p_alloc(&len, alloc, error);
+} /* dns_p_make2() */
+
+
+struct dns_packet *dns_p_make(size_t len, int *error) {
+	return dns_p_make2(len, NULL, error);
+} /* dns_p_make() */
+
+
+void dns_p_free(struct dns_packet *P) {
+	struct dns_allocator alloc;
+
+	if (!P)
+		return;
+
+	if (dns_a_isset(&P->alloc)) {
+		alloc = P->alloc;
+		dns_a_free(&alloc, P);
+	} else {
+		dns_p_pool_put(P);
+	}
 } /* dns_p_free() */
 
 
@@ -1618,7 +2209,7 @@ int dns_p_grow(struct dns_packet **P) {
 		return 0;
 	}
 
-	size = dns_p_sizeof(*P);
+	size = dns_p_calcsize((*P)->size);
 	size |= size >> 1;
 	size |= size >> 2;
 	size |= size >> 4;
@@ -1628,10 +2219,13 @@ int dns_p_grow(struct dns_packet **P) {
 	if (size > 65536)
 		return DNS_ENOBUFS;
 
-	if (!(tmp = realloc(*P, dns_p_calcsize(size))))
-		return dns_syerr();
+	if (!(tmp = dns_p_alloc(&size, &(*P)->alloc, &error)))
+		return error;
 
+	memcpy(tmp, *P, offsetof(struct dns_packet, data) + (*P)->end);
 	tmp->size = size;
+
+	dns_p_free(*P);
 	*P = tmp;
 
 	return 0;
@@ -1740,7 +2334,40 @@ void dns_p_dictadd(struct dns_packet *P, unsigned short dn) {
 } /* dns_p_dictadd() */
 
 
-int dns_p_push(struct dns_packet *P, enum dns_section section, const void *dn, size_t dnlen, enum dns_type type, enum dns_class class, unsigned ttl, const void *any) {
+/*
+ * Rewrite the raw RDATA just appended to P through dns_any_push(), so its
+ * names are compressed and the RR packs like one from dns_p_push().
+ */
+static int dns_p_rdcomp(struct dns_packet *P, enum dns_type type, enum dns_class class, size_t rdlen) {
+	struct dns_rr rr = { .type = type, .class = class };
+	union dns_any any;
+	int error;
+
+	switch (type) {
+	case DNS_T_NS:
+	case DNS_T_CNAME:
+	case DNS_T_SOA:
+	case DNS_T_PTR:
+	case DNS_T_MX:
+	case DNS_T_SRV:
+		break;
+	default:
+		return 0;
+	} /* switch() */
+
+	rr.rd.p = P->end - rdlen;
+	rr.rd.len = rdlen;
+
+	if ((error = dns_any_parse(dns_any_init(&any, sizeof any), &rr, P)))
+		return error;
+
+	P->end = rr.rd.p - 2;
+
+	return dns_any_push(P, &any, type);
+} /* dns_p_rdcomp() */
+
+
+static int dns_p_push2(struct dns_packet *P, enum dns_section section, const void *dn, size_t dnlen, enum dns_type type, enum dns_class class, unsigned ttl, const void *any, const void *rd, size_t rdlen) {
 	size_t end = P->end;
 	int error;
 
@@ -1769,8 +2396,21 @@ int dns_p_push(struct dns_packet *P, enum dns_section section, const void *dn, s
 	P->data[P->end++] = ttl >> 8;
 	P->data[P->end++] = ttl >> 0;
 
-	if ((error = dns_any_push(P, (union dns_any *)any, type)))
+	if (rd) {
+		if (rdlen > 0xffff || P->size - P->end < rdlen + 2)
+			goto nobufs;
+
+		P->data[P->end++] = 0xff & (rdlen >> 8);
+		P->data[P->end++] = 0xff & (rdlen >> 0);
+
+		memcpy(&P->data[P->end], rd, rdlen);
+		P->end += rdlen;
+
+		if ((error = dns_p_rdcomp(P, type, class, rdlen)))
+			goto error;
+	} else if ((error = dns_any_push(P, (union dns_any *)any, type))) {
 		goto error;
+	}
 
 update:
 	switch (section) {
@@ -1856,9 +2496,21 @@ error:
 	P->end = end;
 
 	return error;
+} /* dns_p_push2() */
+
+
+int dns_p_push(struct dns_packet *P, enum dns_section section, const void *dn, size_t dnlen, enum dns_type type, enum dns_class class, unsigned ttl, const void *any) {
+	return dns_p_push2(P, section, dn, dnlen, type, class, ttl, any, NULL, 0);
 } /* dns_p_push() */
 
 
+int dns_p_pushrd(struct dns_packet *P, enum dns_section section, const void *dn, size_t dnlen, enum dns_type type, enum dns_class class, unsigned ttl, const void *rd, size_t rdlen) {
+	static const unsigned char none;
+
+	return dns_p_push2(P, section, dn, dnlen, type, class, ttl, NULL, (rd)? rd : &none, rdlen);
+} /* dns_p_pushrd() */
+
+
 static void dns_p_dump3(struct dns_packet *P, struct dns_rr_i *I, FILE *fp) {
 	enum dns_section section;
 	struct dns_rr rr;
@@ -1948,54 +2600,176 @@ static int dns_m_study(struct dns_p_memo *m, struct dns_packet *P) {
 
 	return 0;
 error:
-	dns_m_unstudy(m);
+	dns_m_unstudy(m);
+
+	return error;
+} /* dns_m_study() */
+
+int dns_p_study(struct dns_packet *P) {
+	return dns_m_study(&P->memo, P);
+} /* dns_p_study() */
+
+
+enum dns_rcode dns_p_rcode(struct dns_packet *P) {
+	return 0xfff & ((P->memo.opt.ttl >> 20) | dns_header(P)->rcode);
+} /* dns_p_rcode() */
+
+
+/*
+ * Q U E R Y  P A C K E T  R O U T I N E S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define DNS_Q_RD    0x1 /* recursion desired */
+#define DNS_Q_EDNS0 0x2 /* include OPT RR */
+
+static dns_error_t
+dns_q_push(struct dns_packet *Q, const char *qname, size_t qlen, enum dns_type qtype, enum dns_class qclass, int qflags)
+{
+	int error;
+
+	if ((error = dns_p_push(Q, DNS_S_QD, qname, qlen, qtype, qclass, 0, 0)))
+		return error;
+
+	dns_header(Q)->rd = !!(qflags & DNS_Q_RD);
+
+	if (qflags & DNS_Q_EDNS0) {
+		struct dns_opt opt = DNS_OPT_INIT(&opt);
+
+		opt.version = 0; /* RFC 6891 version */
+		opt.maxudp = 4096;
+
+		if ((error = dns_p_push(Q, DNS_S_AR, ".", 1, DNS_T_OPT, dns_opt_class(&opt), dns_opt_ttl(&opt), &opt)))
+			return error;
+	}
+
+	return 0;
+}
+
+static dns_error_t
+dns_q_make2(struct dns_packet **_Q, const char *qname, size_t qlen, enum dns_type qtype, enum dns_class qclass, int qflags, const struct dns_allocator *alloc)
+{
+	struct dns_packet *Q = NULL;
+	int error;
+
+	if (dns_p_movptr(&Q, _Q)) {
+		dns_p_reset(Q);
+	} else if (!(Q = dns_p_make2(DNS_P_QBUFSIZ, alloc, &error))) {
+		goto error;
+	}
+
+	if ((error = dns_q_push(Q, qname, qlen, qtype, qclass, qflags)))
+		goto error;
+
+	*_Q = Q;
+
+	return 0;
+error:
+	dns_p_free(Q);
 
 	return error;
-} /* dns_m_study() */
+}
 
-int dns_p_study(struct dns_packet *P) {
-	return dns_m_study(&P->memo, P);
-} /* dns_p_study() */
+/*
+ * Query templates. Everything in a query except the QNAME depends only on
+ * (qtype, qclass, qflags), so we encode the header and the trailing
+ * QTYPE/QCLASS and OPT RR once against the root name, then splice new
+ * names into the gap. Offsets recorded past the QNAME are shifted by the
+ * difference between the new name's length and the root's single octet.
+ */
+#ifndef DNS_Q_TMPLSIZE
+#define DNS_Q_TMPLSIZE	8
+#endif
 
+struct dns_q_tmpl {
+	enum dns_type qtype;
+	enum dns_class qclass;
+	int qflags;
+	_Bool valid;
 
-enum dns_rcode dns_p_rcode(struct dns_packet *P) {
-	return 0xfff & ((P->memo.opt.ttl >> 20) | dns_header(P)->rcode);
-} /* dns_p_rcode() */
+	unsigned char head[12];
+	unsigned char tail[4 + 11]; /* QTYPE, QCLASS and an empty OPT RR */
+	unsigned char tlen;
 
+	struct dns_p_memo memo;
+	unsigned short dict[DNS_P_DICTSIZE];
+}; /* struct dns_q_tmpl */
 
-/*
- * Q U E R Y  P A C K E T  R O U T I N E S
- *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define dns_q_shift(p, delta) (((p) > 12)? (p) + (delta) : (p))
 
-#define DNS_Q_RD    0x1 /* recursion desired */
-#define DNS_Q_EDNS0 0x2 /* include OPT RR */
+static dns_error_t
+dns_q_tmpl_init(struct dns_q_tmpl *T, enum dns_type qtype, enum dns_class qclass, int qflags)
+{
+	struct dns_packet *P = dns_p_new(64);
+	int error;
+
+	if ((error = dns_q_push(P, ".", 1, qtype, qclass, qflags)))
+		return error;
+
+	if (P->end - 13 > sizeof T->tail)
+		return DNS_ENOBUFS;
+
+	memcpy(T->head, P->data, sizeof T->head);
+	memcpy(T->tail, &P->data[13], P->end - 13);
+	T->tlen = P->end - 13;
+
+	T->memo = P->memo;
+	memcpy(T->dict, P->dict, sizeof T->dict);
+
+	T->qtype = qtype;
+	T->qclass = qclass;
+	T->qflags = qflags;
+	T->valid = 1;
+
+	return 0;
+}
 
 static dns_error_t
-dns_q_make2(struct dns_packet **_Q, const char *qname, size_t qlen, enum dns_type qtype, enum dns_class qclass, int qflags)
+dns_q_tmpl_make(struct dns_packet **_Q, const struct dns_q_tmpl *T, const char *qname, size_t qlen, const struct dns_allocator *alloc)
 {
 	struct dns_packet *Q = NULL;
+	size_t len, delta;
+	unsigned i;
 	int error;
 
 	if (dns_p_movptr(&Q, _Q)) {
 		dns_p_reset(Q);
-	} else if (!(Q = dns_p_make(DNS_P_QBUFSIZ, &error))) {
+	} else if (!(Q = dns_p_make2(DNS_P_QBUFSIZ, alloc, &error))) {
 		goto error;
 	}
 
-	if ((error = dns_p_push(Q, DNS_S_QD, qname, qlen, qtype, qclass, 0, 0)))
+	/* dictionary is empty after reset, so no compression pointers */
+	if (!(len = dns_d_comp(&Q->data[12], Q->size - 12, qname, qlen, Q, &error)))
 		goto error;
 
-	dns_header(Q)->rd = !!(qflags & DNS_Q_RD);
+	if (len > Q->size - 12 || Q->size - 12 - len < T->tlen) {
+		error = DNS_ENOBUFS;
+		goto error;
+	}
 
-	if (qflags & DNS_Q_EDNS0) {
-		struct dns_opt opt = DNS_OPT_INIT(&opt);
+	memcpy(Q->data, T->head, sizeof T->head);
+	memcpy(&Q->data[12 + len], T->tail, T->tlen);
+	Q->end = 12 + len + T->tlen;
 
-		opt.version = 0; /* RFC 6891 version */
-		opt.maxudp = 4096;
+	delta = len - 1;
 
-		if ((error = dns_p_push(Q, DNS_S_AR, ".", 1, DNS_T_OPT, dns_opt_class(&opt), dns_opt_ttl(&opt), &opt)))
-			goto error;
+	Q->memo = T->memo;
+	Q->memo.qd.end = dns_q_shift(T->memo.qd.end, delta);
+	Q->memo.an.base = dns_q_shift(T->memo.an.base, delta);
+	Q->memo.an.end = dns_q_shift(T->memo.an.end, delta);
+	Q->memo.ns.base = dns_q_shift(T->memo.ns.base, delta);
+	Q->memo.ns.end = dns_q_shift(T->memo.ns.end, delta);
+	Q->memo.ar.base = dns_q_shift(T->memo.ar.base, delta);
+	Q->memo.ar.end = dns_q_shift(T->memo.ar.end, delta);
+	Q->memo.opt.p = dns_q_shift(T->memo.opt.p, delta);
+
+	/* enter the QNAME as dns_d_push() would, then the names past it */
+	memset(Q->dict, 0, sizeof Q->dict);
+	dns_p_dictadd(Q, 12);
+
+	for (i = 0; i < lengthof(T->dict) && T->dict[i]; i++) {
+		if (T->dict[i] > 12)
+			dns_p_dictadd(Q, dns_q_shift(T->dict[i], delta));
 	}
 
 	*_Q = Q;
@@ -2007,12 +2781,6 @@ error:
 	return error;
 }
 
-static dns_error_t
-dns_q_make(struct dns_packet **Q, const char *qname, enum dns_type qtype, enum dns_class qclass, int qflags)
-{
-	return dns_q_make2(Q, qname, strlen(qname), qtype, qclass, qflags);
-}
-
 static dns_error_t
 dns_q_remake(struct dns_packet **Q, int qflags)
 {
@@ -2028,7 +2796,7 @@ dns_q_remake(struct dns_packet **Q, int qflags)
 		return error;
 	if (qlen >= sizeof qname)
 		return DNS_EILLEGAL;
-	return dns_q_make2(Q, qname, qlen, rr.type, rr.class, qflags);
+	return dns_q_make2(Q, qname, qlen, rr.type, rr.class, qflags, NULL);
 }
 
 /*
@@ -2137,24 +2905,31 @@ static size_t dns_d_ndots(const void *_src, size_t len) {
 
 
 static size_t dns_d_trim(void *dst_, size_t lim, const void *src_, size_t len, int flags) {
+	const struct dns_ascii *ascii = dns_ascii();
 	unsigned char *dst = dst_;
 	const unsigned char *src = src_;
-	size_t dp = 0, sp = 0;
-	int lc;
+	size_t dp = 0, sp = 0, n;
+	int lc = 0;
 
 	/* trim any leading dot(s) */
 	while (sp < len && src[sp] == '.')
 		sp++;
 
-	for (lc = 0; sp < len; lc = src[sp++]) {
-		/* trim extra dot(s) */
-		if (src[sp] == '.' && lc == '.')
-			continue;
+	while (sp < len) {
+		/* copy the label through its trailing dot, if any */
+		n = ascii->find(&src[sp], len - sp, '.');
+		n += (n < len - sp);
 
 		if (dp < lim)
-			dst[dp] = src[sp];
+			memcpy(&dst[dp], &src[sp], DNS_PP_MIN(n, lim - dp));
 
-		dp++;
+		dp += n;
+		sp += n;
+		lc = src[sp - 1];
+
+		/* trim extra dot(s) */
+		while (sp < len && src[sp] == '.')
+			sp++;
 	}
 
 	if ((flags & DNS_D_ANCHOR) && lc != '.') {
@@ -2174,7 +2949,7 @@ static size_t dns_d_trim(void *dst_, size_t lim, const void *src_, size_t len, i
 char *dns_d_init(void *dst, size_t lim, const void *src, size_t len, int flags) {
 	if (flags & DNS_D_TRIM) {
 		dns_d_trim(dst, lim, src, len, flags);
-	} if (flags & DNS_D_ANCHOR) {
+	} else if (flags & DNS_D_ANCHOR) {
 		dns_d_anchor(dst, lim, src, len);
 	} else {
 		memmove(dst, src, DNS_PP_MIN(lim, len));
@@ -2231,9 +3006,38 @@ size_t dns_d_cleave(void *dst, size_t lim, const void *src, size_t len) {
 } /* dns_d_cleave() */
 
 
+_Bool dns_d_isldh(const void *src_, size_t len) {
+	const struct dns_ascii *ascii = dns_ascii();
+	const unsigned char *src = src_;
+	size_t p = 0, n;
+
+	if (len == 0 || len > DNS_D_MAXNAME)
+		return 0;
+
+	if (len == 1 && src[0] == '.')
+		return 1;
+
+	while (p < len) {
+		n = ascii->find(&src[p], len - p, '.');
+
+		if (n == 0 || n > DNS_D_MAXLABEL)
+			return 0;
+		if (ascii->ldhspn(&src[p], n) != n)
+			return 0;
+		if (src[p] == '-' || src[p + n - 1] == '-')
+			return 0;
+
+		p += n + 1;
+	}
+
+	return 1;
+} /* dns_d_isldh() */
+
+
 size_t dns_d_comp(void *dst_, size_t lim, const void *src_, size_t len, struct dns_packet *P, int *error) {
+	const struct dns_ascii *ascii = dns_ascii();
 	struct { unsigned char *b; size_t p, x; } dst, src;
-	unsigned char ch	= '.';
+	size_t n;
 
 	dst.b	= dst_;
 	dst.p	= 0;
@@ -2244,20 +3048,20 @@ size_t dns_d_comp(void *dst_, size_t lim, const void *src_, size_t len, struct d
 	src.x	= 0;
 
 	while (src.x < len) {
-		ch	= src.b[src.x];
+		n	= ascii->find(&src.b[src.x], len - src.x, '.');
+
+		if (dst.x < lim)
+			memcpy(&dst.b[dst.x], &src.b[src.x], DNS_PP_MIN(n, lim - dst.x));
+
+		dst.x	+= n;
+		src.x	+= n;
 
-		if (ch == '.') {
+		if (src.x < len) {
 			if (dst.p < lim)
 				dst.b[dst.p]	= (0x3f & (src.x - src.p));
 
 			dst.p	= dst.x++;
 			src.p	= ++src.x;
-		} else {
-			if (dst.x < lim)
-				dst.b[dst.x]	= ch;
-
-			dst.x++;
-			src.x++;
 		}
 	} /* while() */
 
@@ -2290,7 +3094,7 @@ size_t dns_d_comp(void *dst_, size_t lim, const void *src_, size_t len, struct d
 					a.y	= a.x;
 					b.y	= b.x;
 
-					while (a.len && b.len && 0 == strcasecmp((char *)a.label, (char *)b.label)) {
+					while (a.len && a.len == b.len && 0 == ascii->casecmp(a.label, b.label, a.len)) {
 						a.len = dns_l_expand(a.label, sizeof a.label, a.y, &a.y, dst.b, lim);
 						b.len = dns_l_expand(b.label, sizeof b.label, b.y, &b.y, P->data, P->end);
 					}
@@ -2676,7 +3480,7 @@ int dns_rr_cmp(struct dns_rr *r0, struct dns_packet *P0, struct dns_rr *r1, stru
 	||  len >= sizeof host1)
 		return 1;
 
-	if ((cmp = strcasecmp(host0, host1)))
+	if ((cmp = dns_strcasecmp(host0, host1)))
 		return cmp;
 
 	if (DNS_S_QD & (r0->section | r1->section)) {
@@ -2732,7 +3536,7 @@ static _Bool dns_rr_i_match(struct dns_rr *rr, struct dns_rr_i *i, struct dns_pa
 		||  len >= sizeof dn)
 			return 0;
 
-		if (0 != strcasecmp(dn, i->name))
+		if (0 != dns_strcasecmp(dn, i->name))
 			return 0;
 	}
 
@@ -3185,7 +3989,7 @@ int dns_mx_cmp(const struct dns_mx *a, const struct dns_mx *b) {
 	if ((cmp = a->preference - b->preference))
 		return cmp;
 
-	return strcasecmp(a->host, b->host);
+	return dns_strcasecmp(a->host, b->host);
 } /* dns_mx_cmp() */
 
 
@@ -3245,7 +4049,7 @@ error:
 
 
 int dns_ns_cmp(const struct dns_ns *a, const struct dns_ns *b) {
-	return strcasecmp(a->host, b->host);
+	return dns_strcasecmp(a->host, b->host);
 } /* dns_ns_cmp() */
 
 
@@ -3270,7 +4074,7 @@ int dns_cname_push(struct dns_packet *P, struct dns_cname *cname) {
 
 
 int dns_cname_cmp(const struct dns_cname *a, const struct dns_cname *b) {
-	return strcasecmp(a->host, b->host);
+	return dns_strcasecmp(a->host, b->host);
 } /* dns_cname_cmp() */
 
 
@@ -3375,10 +4179,10 @@ error:
 int dns_soa_cmp(const struct dns_soa *a, const struct dns_soa *b) {
 	int cmp;
 
-	if ((cmp = strcasecmp(a->mname, b->mname)))
+	if ((cmp = dns_strcasecmp(a->mname, b->mname)))
 		return cmp;
 
-	if ((cmp = strcasecmp(a->rname, b->rname)))
+	if ((cmp = dns_strcasecmp(a->rname, b->rname)))
 		return cmp;
 
 	if (a->serial > b->serial)
@@ -3534,7 +4338,7 @@ int dns_srv_cmp(const struct dns_srv *a, const struct dns_srv *b) {
 	if ((cmp = a->port - b->port))
 		return cmp;
 
-	return strcasecmp(a->target, b->target);
+	return dns_strcasecmp(a->target, b->target);
 } /* dns_srv_cmp() */
 
 
@@ -3705,7 +4509,7 @@ size_t dns_ptr_qname(void *dst, size_t lim, int af, void *addr) {
 
 
 int dns_ptr_cmp(const struct dns_ptr *a, const struct dns_ptr *b) {
-	return strcasecmp(a->host, b->host);
+	return dns_strcasecmp(a->host, b->host);
 } /* dns_ptr_cmp() */
 
 
@@ -3973,6 +4777,12 @@ static const struct dns_rrtype {
 	{ DNS_T_TXT,    "TXT",    &dns_txt_initany,  &dns_txt_parse,    &dns_txt_push,    &dns_txt_cmp,    &dns_txt_print,    0,                },
 	{ DNS_T_SPF,    "SPF",    &dns_txt_initany,  &dns_txt_parse,    &dns_txt_push,    &dns_txt_cmp,    &dns_txt_print,    0,                },
 	{ DNS_T_SSHFP,  "SSHFP",  0,                 &dns_sshfp_parse,  &dns_sshfp_push,  &dns_sshfp_cmp,  &dns_sshfp_print,  0,                },
+	{ DNS_T_DS,     "DS",     0,                 0,                 0,                0,               0,                 0,                },
+	{ DNS_T_RRSIG,  "RRSIG",  0,                 0,                 0,                0,               0,                 0,                },
+	{ DNS_T_NSEC,   "NSEC",   0,                 0,                 0,                0,               0,                 0,                },
+	{ DNS_T_DNSKEY, "DNSKEY", 0,                 0,                 0,                0,               0,                 0,                },
+	{ DNS_T_ZONEMD, "ZONEMD", 0,                 0,                 0,                0,               0,                 0,                },
+	{ DNS_T_IXFR,   "IXFR",   0,                 0,                 0,                0,               0,                 0,                },
 	{ DNS_T_AXFR,   "AXFR",   0,                 0,                 0,                0,               0,                 0,                },
 }; /* dns_rrtypes[] */
 
@@ -4108,44 +4918,55 @@ struct dns_hosts {
 		struct dns_hosts_entry *next;
 	} *head, **tail;
 
+	struct dns_allocator alloc;
+
 	dns_atomic_t refcount;
 }; /* struct dns_hosts */
 
 
-struct dns_hosts *dns_hosts_open(int *error) {
+struct dns_hosts *dns_hosts_open2(const struct dns_options *opts, int *error) {
 	static const struct dns_hosts hosts_initializer	= { .refcount = 1 };
 	struct dns_hosts *hosts;
 
-	if (!(hosts = malloc(sizeof *hosts)))
+	if (!(hosts = dns_a_malloc((opts)? &opts->alloc : NULL, sizeof *hosts)))
 		goto syerr;
 
 	*hosts	= hosts_initializer;
 
 	hosts->tail	= &hosts->head;
 
+	if (opts)
+		hosts->alloc	= opts->alloc;
+
 	return hosts;
 syerr:
 	*error	= dns_syerr();
 
-	free(hosts);
-
 	return 0;
+} /* dns_hosts_open2() */
+
+
+struct dns_hosts *dns_hosts_open(int *error) {
+	return dns_hosts_open2(NULL, error);
 } /* dns_hosts_open() */
 
 
 void dns_hosts_close(struct dns_hosts *hosts) {
 	struct dns_hosts_entry *ent, *xnt;
+	struct dns_allocator alloc;
 
 	if (!hosts || 1 != dns_hosts_release(hosts))
 		return;
 
+	alloc	= hosts->alloc;
+
 	for (ent = hosts->head; ent; ent = xnt) {
 		xnt	= ent->next;
 
-		free(ent);
+		dns_a_free(&alloc, ent);
 	}
 
-	free(hosts);
+	dns_a_free(&alloc, hosts);
 
 	return;
 } /* dns_hosts_close() */
@@ -4169,11 +4990,11 @@ struct dns_hosts *dns_hosts_mortal(struct dns_hosts *hosts) {
 } /* dns_hosts_mortal() */
 
 
-struct dns_hosts *dns_hosts_local(int *error_) {
+static struct dns_hosts *dns_hosts_local2(const struct dns_options *opts, int *error_) {
 	struct dns_hosts *hosts;
 	int error;
 
-	if (!(hosts = dns_hosts_open(&error)))
+	if (!(hosts = dns_hosts_open2(opts, &error)))
 		goto error;
 
 	if ((error = dns_hosts_loadpath(hosts, "/etc/hosts")))
@@ -4186,6 +5007,11 @@ error:
 	dns_hosts_close(hosts);
 
 	return 0;
+} /* dns_hosts_local2() */
+
+
+struct dns_hosts *dns_hosts_local(int *error) {
+	return dns_hosts_local2(NULL, error);
 } /* dns_hosts_local() */
 
 
@@ -4298,7 +5124,7 @@ int dns_hosts_insert(struct dns_hosts *hosts, int af, const void *addr, const vo
 	struct dns_hosts_entry *ent;
 	int error;
 
-	if (!(ent = malloc(sizeof *ent)))
+	if (!(ent = dns_a_malloc(&hosts->alloc, sizeof *ent)))
 		goto syerr;
 
 	dns_d_anchor(ent->host, sizeof ent->host, host, strlen(host));
@@ -4332,7 +5158,7 @@ int dns_hosts_insert(struct dns_hosts *hosts, int af, const void *addr, const vo
 syerr:
 	error	= dns_syerr();
 error:
-	free(ent);
+	dns_a_free(&hosts->alloc, ent);
 
 	return error;
 } /* dns_hosts_insert() */
@@ -4361,7 +5187,7 @@ struct dns_packet *dns_hosts_query(struct dns_hosts *hosts, struct dns_packet *Q
 	switch (rr.type) {
 	case DNS_T_PTR:
 		for (ent = hosts->head; ent; ent = ent->next) {
-			if (ent->alias || 0 != strcasecmp(qname, ent->arpa))
+			if (ent->alias || 0 != dns_strcasecmp(qname, ent->arpa))
 				continue;
 
 			if ((error = dns_p_push(P, DNS_S_AN, qname, qlen, rr.type, rr.class, 0, ent->host)))
@@ -4377,7 +5203,7 @@ struct dns_packet *dns_hosts_query(struct dns_hosts *hosts, struct dns_packet *Q
 		af	= AF_INET;
 
 loop:		for (ent = hosts->head; ent; ent = ent->next) {
-			if (ent->af != af || 0 != strcasecmp(qname, ent->host))
+			if (ent->af != af || 0 != dns_strcasecmp(qname, ent->host))
 				continue;
 
 			if ((error = dns_p_push(P, DNS_S_AN, qname, qlen, rr.type, rr.class, 0, &ent->addr)))
@@ -4390,7 +5216,7 @@ loop:		for (ent = hosts->head; ent; ent = ent->next) {
 	} /* switch() */
 
 
-	if (!(A = dns_p_copy(dns_p_make(P->end, &error), P)))
+	if (!(A = dns_p_copy(dns_p_make2(P->end, &hosts->alloc, &error), P)))
 		goto error;
 
 	return A;
@@ -4410,7 +5236,7 @@ error:
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-struct dns_resolv_conf *dns_resconf_open(int *error) {
+struct dns_resolv_conf *dns_resconf_open2(const struct dns_options *opts, int *error) {
 	static const struct dns_resolv_conf resconf_initializer = {
 		.lookup = "bf",
 		.family = { AF_INET, AF_INET6 },
@@ -4420,11 +5246,14 @@ struct dns_resolv_conf *dns_resconf_open(int *error) {
 	struct dns_resolv_conf *resconf;
 	struct sockaddr_in *sin;
 
-	if (!(resconf = malloc(sizeof *resconf)))
+	if (!(resconf = dns_a_malloc((opts)? &opts->alloc : NULL, sizeof *resconf)))
 		goto syerr;
 
 	*resconf = resconf_initializer;
 
+	if (opts)
+		resconf->_.alloc = opts->alloc;
+
 	sin = (struct sockaddr_in *)&resconf->nameserver[0];
 	sin->sin_family      = AF_INET;
 	sin->sin_addr.s_addr = INADDR_ANY;
@@ -4450,17 +5279,26 @@ struct dns_resolv_conf *dns_resconf_open(int *error) {
 syerr:
 	*error	= dns_syerr();
 
-	free(resconf);
+	if (resconf)
+		dns_a_free(&resconf->_.alloc, resconf);
 
 	return 0;
+} /* dns_resconf_open2() */
+
+
+struct dns_resolv_conf *dns_resconf_open(int *error) {
+	return dns_resconf_open2(NULL, error);
 } /* dns_resconf_open() */
 
 
 void dns_resconf_close(struct dns_resolv_conf *resconf) {
+	struct dns_allocator alloc;
+
 	if (!resconf || 1 != dns_resconf_release(resconf))
 		return /* void */;
 
-	free(resconf);
+	alloc = resconf->_.alloc;
+	dns_a_free(&alloc, resconf);
 } /* dns_resconf_close() */
 
 
@@ -4482,11 +5320,11 @@ struct dns_resolv_conf *dns_resconf_mortal(struct dns_resolv_conf *resconf) {
 } /* dns_resconf_mortal() */
 
 
-struct dns_resolv_conf *dns_resconf_local(int *error_) {
+static struct dns_resolv_conf *dns_resconf_local2(const struct dns_options *opts, int *error_) {
 	struct dns_resolv_conf *resconf;
 	int error;
 
-	if (!(resconf = dns_resconf_open(&error)))
+	if (!(resconf = dns_resconf_open2(opts, &error)))
 		goto error;
 
 	if ((error = dns_resconf_loadpath(resconf, "/etc/resolv.conf"))) {
@@ -4513,6 +5351,11 @@ error:
 	dns_resconf_close(resconf);
 
 	return 0;
+} /* dns_resconf_local2() */
+
+
+struct dns_resolv_conf *dns_resconf_local(int *error) {
+	return dns_resconf_local2(NULL, error);
 } /* dns_resconf_local() */
 
 
@@ -5551,6 +6394,8 @@ struct dns_hints {
 	dns_atomic_t refcount;
 
 	struct dns_hints_soa *head;
+
+	struct dns_allocator alloc;
 }; /* struct dns_hints */
 
 
@@ -5558,38 +6403,40 @@ struct dns_hints *dns_hints_open(struct dns_resolv_conf *resconf, int *error) {
 	static const struct dns_hints H_initializer;
 	struct dns_hints *H;
 
-	(void)resconf;
-
-	if (!(H = malloc(sizeof *H)))
+	if (!(H = dns_a_malloc((resconf)? &resconf->_.alloc : NULL, sizeof *H)))
 		goto syerr;
 
 	*H	= H_initializer;
 
+	if (resconf)
+		H->alloc	= resconf->_.alloc;
+
 	dns_hints_acquire(H);
 
 	return H;
 syerr:
 	*error	= dns_syerr();
 
-	free(H);
-
 	return 0;
 } /* dns_hints_open() */
 
 
 void dns_hints_close(struct dns_hints *H) {
 	struct dns_hints_soa *soa, *nxt;
+	struct dns_allocator alloc;
 
 	if (!H || 1 != dns_hints_release(H))
 		return /* void */;
 
+	alloc	= H->alloc;
+
 	for (soa = H->head; soa; soa = nxt) {
 		nxt	= soa->next;
 
-		free(soa);
+		dns_a_free(&alloc, soa);
 	}
 
-	free(H);
+	dns_a_free(&alloc, H);
 
 	return /* void */;
 } /* dns_hints_close() */
@@ -5708,7 +6555,7 @@ static struct dns_hints_soa *dns_hints_fetch(struct dns_hints *H, const char *zo
 	struct dns_hints_soa *soa;
 
 	for (soa = H->head; soa; soa = soa->next) {
-		if (0 == strcasecmp(zone, (char *)soa->zone))
+		if (0 == dns_strcasecmp(zone, (char *)soa->zone))
 			return soa;
 	}
 
@@ -5722,7 +6569,7 @@ int dns_hints_insert(struct dns_hints *H, const char *zone, const struct sockadd
 	unsigned i;
 
 	if (!(soa = dns_hints_fetch(H, zone))) {
-		if (!(soa = malloc(sizeof *soa)))
+		if (!(soa = dns_a_malloc(&H->alloc, sizeof *soa)))
 			return dns_syerr();
 		*soa = soa_initializer;
 		dns_strlcpy((char *)soa->zone, zone, sizeof soa->zone);
@@ -5931,7 +6778,7 @@ struct dns_packet *dns_hints_query(struct dns_hints *hints, struct dns_packet *Q
 		}
 	} while ((zlen = dns_d_cleave(zone, sizeof zone, zone, zlen)));
 
-	if (!(A = dns_p_copy(dns_p_make(P->end, &error), P)))
+	if (!(A = dns_p_copy(dns_p_make2(P->end, &hints->alloc, &error), P)))
 		goto error;
 
 	return A;
@@ -6267,6 +7114,7 @@ struct dns_socket {
 
 	struct dns_packet *answer;
 	size_t alen, apos;
+	unsigned anum; /* messages received for this query */
 }; /* struct dns_socket */
 
 
@@ -6293,7 +7141,7 @@ static int dns_so_closefd(struct dns_socket *so, int *fd) {
 		unsigned olim = DNS_PP_MAX(4, so->olim * 2);
 		void *old;
 
-		if (!(old = realloc(so->old, sizeof so->old[0] * olim)))
+		if (!(old = dns_a_realloc(&so->opts.alloc, so->old, sizeof so->old[0] * so->olim, sizeof so->old[0] * olim)))
 			return dns_syerr();
 
 		so->old  = old;
@@ -6322,7 +7170,7 @@ static void dns_so_closefds(struct dns_socket *so, int which) {
 		for (i = 0; i < so->onum; i++)
 			dns_socketclose(&so->old[i], &so->opts);
 		so->onum = 0;
-		free(so->old);
+		dns_a_free(&so->opts.alloc, so->old);
 		so->old  = 0;
 		so->olim = 0;
 	}
@@ -6359,7 +7207,7 @@ error:
 struct dns_socket *dns_so_open(const struct sockaddr *local, int type, const struct dns_options *opts, int *error) {
 	struct dns_socket *so;
 
-	if (!(so = malloc(sizeof *so)))
+	if (!(so = dns_a_malloc((opts)? &opts->alloc : NULL, sizeof *so)))
 		goto syerr;
 
 	if (!dns_so_init(so, local, type, opts, error))
@@ -6382,12 +7230,15 @@ static void dns_so_destroy(struct dns_socket *so) {
 
 
 void dns_so_close(struct dns_socket *so) {
+	struct dns_allocator alloc;
+
 	if (!so)
 		return;
 
 	dns_so_destroy(so);
 
-	free(so);
+	alloc = so->opts.alloc;
+	dns_a_free(&alloc, so);
 } /* dns_so_close() */
 
 
@@ -6406,13 +7257,19 @@ unsigned short dns_so_mkqid(struct dns_socket *so) {
 #define DNS_SO_MINBUF	768
 
 static int dns_so_newanswer(struct dns_socket *so, size_t len) {
-	size_t size	= offsetof(struct dns_packet, data) + DNS_PP_MAX(len, DNS_SO_MINBUF);
-	void *p;
+	size_t size	= DNS_PP_MAX(len, DNS_SO_MINBUF);
+	int error;
 
-	if (!(p = realloc(so->answer, size)))
-		return dns_syerr();
+	if (so->answer && so->answer->size >= size) {
+		dns_p_reset(so->answer);
+
+		return 0;
+	}
+
+	dns_p_setptr(&so->answer, NULL);
 
-	so->answer	= dns_p_init(p, size);
+	if (!(so->answer = dns_p_alloc(&size, &so->opts.alloc, &error)))
+		return error;
 
 	return 0;
 } /* dns_so_newanswer() */
@@ -6475,6 +7332,10 @@ static int dns_so_verify(struct dns_socket *so, struct dns_packet *P) {
 	if (so->qid != dns_header(so->answer)->qid)
 		goto reject;
 
+	/* later messages of a zone transfer may omit the question */
+	if (so->anum > 1 && !dns_p_count(so->answer, DNS_S_QD))
+		return 0;
+
 	if (!dns_p_count(so->answer, DNS_S_QD))
 		goto reject;
 
@@ -6489,7 +7350,7 @@ static int dns_so_verify(struct dns_socket *so, struct dns_packet *P) {
 	else if (qlen >= sizeof qname || qlen != so->qlen)
 		goto reject;
 
-	if (0 != strcasecmp(so->qname, qname))
+	if (0 != dns_strcasecmp(so->qname, qname))
 		goto reject;
 
 	return 0;
@@ -6577,6 +7438,7 @@ static int dns_so_tcp_recv(struct dns_socket *so) {
 	}
 
 	so->answer->end	= so->alen;
+	so->anum++;
 	so->stat.tcp.rcvd.count++;
 
 	return 0;
@@ -6724,6 +7586,30 @@ struct dns_packet *dns_so_fetch(struct dns_socket *so, int *error) {
 } /* dns_so_fetch() */
 
 
+/*
+ * Zone transfers answer a single query with a stream of messages over the
+ * same connection. Once one has been checked (and possibly fetched), rearm
+ * the socket to read the next one.
+ */
+int dns_so_next(struct dns_socket *so) {
+	int error;
+
+	if (so->state != DNS_SO_TCP_DONE || so->tcp == -1)
+		return DNS_EUNKNOWN;
+
+	if ((error = dns_so_newanswer(so, DNS_SO_MINBUF)))
+		return error;
+
+	so->alen	= 0;
+	so->apos	= 0;
+	so->state	= DNS_SO_TCP_RECV;
+
+	dns_begin(&so->elapsed);
+
+	return 0;
+} /* dns_so_next() */
+
+
 struct dns_packet *dns_so_query(struct dns_socket *so, struct dns_packet *Q, struct sockaddr *host, int *error_) {
 	struct dns_packet *A;
 	int error;
@@ -6870,9 +7756,13 @@ struct dns_resolver {
 	struct dns_hosts *hosts;
 	struct dns_hints *hints;
 	struct dns_cache *cache;
+	struct dns_cache *local; /* authoritative zones, e.g. a local root */
 
 	dns_atomic_t refcount;
 
+	/* prebuilt queries, keyed by (qtype, qclass, qflags); survive reset */
+	struct dns_q_tmpl qtmpl[DNS_Q_TMPLSIZE];
+
 	/* Reset zeroes everything below here. */
 
 	char qname[DNS_D_MAXNAME + 1];
@@ -6950,7 +7840,7 @@ struct dns_resolver *dns_res_open(struct dns_resolv_conf *resconf, struct dns_ho
 		goto _error;
 	}
 
-	if (!(R = malloc(sizeof *R)))
+	if (!(R = dns_a_malloc((opts)? &opts->alloc : NULL, sizeof *R)))
 		goto syerr;
 
 	*R	= R_initializer;
@@ -6987,10 +7877,10 @@ struct dns_resolver *dns_res_stub(const struct dns_options *opts, int *error) {
 	struct dns_hints *hints		= 0;
 	struct dns_resolver *res	= 0;
 
-	if (!(resconf = dns_resconf_local(error)))
+	if (!(resconf = dns_resconf_local2(opts, error)))
 		goto epilog;
 
-	if (!(hosts = dns_hosts_local(error)))
+	if (!(hosts = dns_hosts_local2(opts, error)))
 		goto epilog;
 
 	if (!(hints = dns_hints_local(resconf, error)))
@@ -7008,6 +7898,18 @@ epilog:
 } /* dns_res_stub() */
 
 
+struct dns_resolver *dns_res_clone(struct dns_resolver *R, int *error) {
+	struct dns_resolver *C;
+
+	if (!(C = dns_res_open(R->resconf, R->hosts, R->hints, R->cache, &R->so.opts, error)))
+		return 0;
+
+	dns_res_setlocal(C, R->local);
+
+	return C;
+} /* dns_res_clone() */
+
+
 static void dns_res_frame_destroy(struct dns_resolver *R, struct dns_res_frame *frame) {
 	(void)R;
 
@@ -7039,6 +7941,19 @@ static void dns_res_frame_reset(struct dns_resolver *R, struct dns_res_frame *fr
 } /* dns_res_frame_reset() */
 
 
+static dns_error_t dns_res_qmake(struct dns_resolver *R, struct dns_packet **Q, const char *qname, size_t qlen, enum dns_type qtype, enum dns_class qclass, int qflags) {
+	struct dns_q_tmpl *T = &R->qtmpl[((unsigned)qtype + (unsigned)qflags) % lengthof(R->qtmpl)];
+	int error;
+
+	if (!T->valid || T->qtype != qtype || T->qclass != qclass || T->qflags != qflags) {
+		if ((error = dns_q_tmpl_init(T, qtype, qclass, qflags)))
+			return error;
+	}
+
+	return dns_q_tmpl_make(Q, T, qname, qlen, &R->so.opts.alloc);
+} /* dns_res_qmake() */
+
+
 static dns_error_t dns_res_frame_prepare(struct dns_resolver *R, struct dns_res_frame *F, const char *qname, enum dns_type qtype, enum dns_class qclass) {
 	struct dns_packet *P = NULL;
 
@@ -7049,7 +7964,7 @@ static dns_error_t dns_res_frame_prepare(struct dns_resolver *R, struct dns_res_
 	dns_res_frame_reset(R, F);
 	dns_p_movptr(&F->query, &P);
 
-	return dns_q_make(&F->query, qname, qtype, qclass, F->qflags);
+	return dns_res_qmake(R, &F->query, qname, strlen(qname), qtype, qclass, F->qflags);
 } /* dns_res_frame_prepare() */
 
 
@@ -7070,6 +7985,8 @@ void dns_res_reset(struct dns_resolver *R) {
 
 
 void dns_res_close(struct dns_resolver *R) {
+	struct dns_allocator alloc;
+
 	if (!R || 1 < dns_res_release(R))
 		return;
 
@@ -7081,8 +7998,10 @@ void dns_res_close(struct dns_resolver *R) {
 	dns_hosts_close(R->hosts);
 	dns_resconf_close(R->resconf);
 	dns_cache_close(R->cache);
+	dns_cache_close(R->local);
 
-	free(R);
+	alloc = R->so.opts.alloc;
+	dns_a_free(&alloc, R);
 } /* dns_res_close() */
 
 
@@ -7103,54 +8022,222 @@ struct dns_resolver *dns_res_mortal(struct dns_resolver *res) {
 } /* dns_res_mortal() */
 
 
-static struct dns_packet *dns_res_merge(struct dns_packet *P0, struct dns_packet *P1, int *error_) {
-	size_t bufsiz	= P0->end + P1->end;
+/*
+ * Records are de-duplicated through an open-addressed hash of (type,
+ * class, case-folded owner, rdata), so merging is linear rather than a
+ * scan of the destination for every record. Names embedded in the rdata
+ * may be compressed, so they're hashed expanded and case-folded, as
+ * dns_rr_cmp() compares them; other rdata is hashed raw. dns_rr_cmp()
+ * settles collisions. The destination is sized once from an upper bound
+ * on the re-encoded records.
+ */
+struct dns_res_mrr {
+	struct dns_rr rr;
+	unsigned hash;
+	int i;
+}; /* struct dns_res_mrr */
+
+#define DNS_RES_FNV(h, c) (((h) ^ (c)) * 16777619U)
+
+static unsigned dns_res_mhashrd(unsigned h, struct dns_packet *P, size_t p, size_t pe) {
+	for (; p < pe && p < P->end; p++)
+		h = DNS_RES_FNV(h, P->data[p]);
+
+	return h;
+} /* dns_res_mhashrd() */
+
+/* names compare caselessly, so fold them before hashing */
+static unsigned dns_res_mhashlc(unsigned h, const char *dn, size_t len) {
+	unsigned char lc[DNS_D_MAXNAME + 1];
+	size_t i;
+
+	len = DNS_PP_MIN(len, sizeof lc);
+	dns_ascii()->lower(lc, (const unsigned char *)dn, len);
+
+	for (i = 0; i < len; i++)
+		h = DNS_RES_FNV(h, lc[i]);
+
+	return h;
+} /* dns_res_mhashlc() */
+
+static unsigned dns_res_mhashdn(unsigned h, struct dns_packet *P, unsigned short *p) {
+	char dn[DNS_D_MAXNAME + 1];
+	size_t len;
+	int error;
+
+	len = dns_d_expand(dn, sizeof dn, *p, P, &error);
+	h = dns_res_mhashlc(h, dn, DNS_PP_MIN(len, sizeof dn - 1));
+
+	*p = dns_d_skip(*p, P);
+
+	return h;
+} /* dns_res_mhashdn() */
+
+static unsigned dns_res_mhash(struct dns_rr *rr, struct dns_packet *P, const char *dn, size_t len) {
+	unsigned h = 2166136261U;
+	unsigned short p = rr->rd.p, pe = rr->rd.p + rr->rd.len;
+
+	h = dns_res_mhashlc(h, dn, len);
+	h = DNS_RES_FNV(h, rr->type);
+	h = DNS_RES_FNV(h, rr->class);
+
+	if (rr->section == DNS_S_QD)
+		return h;
+
+	switch (rr->type) {
+	case DNS_T_NS:
+	case DNS_T_CNAME:
+	case DNS_T_PTR:
+		return dns_res_mhashdn(h, P, &p);
+	case DNS_T_MX:
+		h = dns_res_mhashrd(h, P, p, p + 2);
+		p += 2;
+
+		return dns_res_mhashdn(h, P, &p);
+	case DNS_T_SRV:
+		h = dns_res_mhashrd(h, P, p, p + 6);
+		p += 6;
+
+		return dns_res_mhashdn(h, P, &p);
+	case DNS_T_SOA:
+		h = dns_res_mhashdn(h, P, &p);
+		h = dns_res_mhashdn(h, P, &p);
+
+		return dns_res_mhashrd(h, P, p, pe);
+	case DNS_T_SSHFP:
+		/* dns_sshfp_cmp() only compares SHA-1 digests */
+		return dns_res_mhashrd(h, P, p, p + 2);
+	default:
+		return dns_res_mhashrd(h, P, p, pe);
+	}
+} /* dns_res_mhash() */
+
+/* header counts are untrusted; no RR fits in fewer than 11 octets */
+static unsigned dns_res_mcount(struct dns_packet *P) {
+	unsigned count = dns_p_count(P, DNS_S_ALL & ~DNS_S_QD);
+
+	return DNS_PP_MIN(count, (P->end > 12)? (P->end - 12) / 11 : 0);
+} /* dns_res_mcount() */
+
+static size_t dns_res_mlen(struct dns_rr *rr, size_t dnlen) {
+	size_t len = dnlen + 1 + 4;
+
+	if (rr->section == DNS_S_QD)
+		return len;
+
+	len += 6 + rr->rd.len;
+
+	/* embedded names may lose their compression when re-encoded */
+	switch (rr->type) {
+	case DNS_T_SOA:
+		len += DNS_D_MAXNAME;
+		/* FALL THROUGH */
+	case DNS_T_NS:
+	case DNS_T_CNAME:
+	case DNS_T_PTR:
+	case DNS_T_MX:
+	case DNS_T_SRV:
+		len += DNS_D_MAXNAME;
+
+		break;
+	default:
+		break;
+	}
+
+	return len;
+} /* dns_res_mlen() */
+
+static struct dns_packet *dns_res_merge(struct dns_packet *P0, struct dns_packet *P1, const struct dns_allocator *alloc, int *error_) {
 	struct dns_packet *P[3]	= { P0, P1, 0 };
-	struct dns_rr rr[3];
-	int error, copy, i;
+	struct dns_res_mrr *rrs	= 0;
+	unsigned *tab, mask, count, n, j, k;
+	char dn[DNS_D_MAXNAME + 1];
+	size_t len, bufsiz = 12;
+	struct dns_rr rr;
+	int error, i;
 	enum dns_section section;
 
-retry:
-	if (!(P[2] = dns_p_make(bufsiz, &error)))
-		goto error;
+	count	= dns_res_mcount(P0) + dns_res_mcount(P1);
+
+	for (mask = 16; mask < count * 2; mask <<= 1)
+		;;
+	mask--;
+
+	if (!(rrs = dns_a_malloc(alloc, count * sizeof *rrs + (mask + 1) * sizeof *tab)))
+		goto syerr;
+
+	tab	= (unsigned *)&rrs[count];
+	memset(tab, 0, (mask + 1) * sizeof *tab);
+	n	= 0;
 
-	dns_rr_foreach(&rr[0], P[0], .section = DNS_S_QD) {
-		if ((error = dns_rr_copy(P[2], &rr[0], P[0])))
+	/*
+	 * Pass 1: pick the unique records in output order and bound the
+	 * space they need.
+	 */
+	dns_rr_foreach(&rr, P[0], .section = DNS_S_QD) {
+		if (!(len = dns_d_expand(dn, sizeof dn, rr.dn.p, P[0], &error)))
 			goto error;
+
+		bufsiz	+= dns_res_mlen(&rr, len);
 	}
 
 	for (section = DNS_S_AN; (DNS_S_ALL & section); section <<= 1) {
 		for (i = 0; i < 2; i++) {
-			dns_rr_foreach(&rr[i], P[i], .section = section) {
-				copy	= 1;
+			dns_rr_foreach(&rr, P[i], .section = section) {
+				if (n >= count)
+					break;
+
+				if (!(len = dns_d_expand(dn, sizeof dn, rr.dn.p, P[i], &error)))
+					goto error;
+				else if (len >= sizeof dn)
+					len = sizeof dn - 1;
 
-				dns_rr_foreach(&rr[2], P[2], .type = rr[i].type, .section = (DNS_S_ALL & ~DNS_S_QD)) {
-					if (0 == dns_rr_cmp(&rr[i], P[i], &rr[2], P[2])) {
-						copy	= 0;
+				rrs[n].rr	= rr;
+				rrs[n].hash	= dns_res_mhash(&rr, P[i], dn, len);
+				rrs[n].i	= i;
 
+				for (j = rrs[n].hash & mask; (k = tab[j]); j = (j + 1) & mask) {
+					if (rrs[k - 1].hash == rrs[n].hash
+					&&  0 == dns_rr_cmp(&rrs[k - 1].rr, P[rrs[k - 1].i], &rr, P[i]))
 						break;
-					}
 				}
 
-				if (copy && (error = dns_rr_copy(P[2], &rr[i], P[i]))) {
-					if (error == DNS_ENOBUFS && bufsiz < 65535) {
-						dns_p_setptr(&P[2], NULL);
-
-						bufsiz	= DNS_PP_MAX(65535, bufsiz * 2);
-
-						goto retry;
-					}
+				if (k)
+					continue; /* duplicate */
 
-					goto error;
-				}
+				tab[j]	= ++n;
+				bufsiz	+= dns_res_mlen(&rr, len);
 			} /* foreach(rr) */
 		} /* foreach(packet) */
 	} /* foreach(section) */
 
+	/*
+	 * Pass 2: copy into a packet grown once, up front.
+	 */
+	if (!(P[2] = dns_p_make2(DNS_PP_MIN(bufsiz, 65535), alloc, &error)))
+		goto error;
+
+	dns_rr_foreach(&rr, P[0], .section = DNS_S_QD) {
+		if ((error = dns_rr_copy(P[2], &rr, P[0])))
+			goto error;
+	}
+
+	for (j = 0; j < n; j++) {
+		while ((error = dns_rr_copy(P[2], &rrs[j].rr, P[rrs[j].i]))) {
+			if (error != DNS_ENOBUFS || (error = dns_p_grow(&P[2])))
+				goto error;
+		}
+	}
+
+	dns_a_free(alloc, rrs);
+
 	return P[2];
+syerr:
+	error	= dns_syerr();
 error:
 	*error_	= error;
 
+	dns_a_free(alloc, rrs);
 	dns_p_free(P[2]);
 
 	return 0;
@@ -7208,7 +8295,7 @@ static struct dns_packet *dns_res_glue(struct dns_resolver *R, struct dns_packet
 		return 0;
 
 copy:
-	return dns_p_copy(dns_p_make(P->end, &error), P);
+	return dns_p_copy(dns_p_make2(P->end, &R->so.opts.alloc, &error), P);
 } /* dns_res_glue() */
 
 
@@ -7352,7 +8439,7 @@ exec:
 			R->search = 0;
 
 			while ((len = dns_resconf_search(u.name, sizeof u.name, R->qname, R->qlen, R->resconf, &R->search))) {
-				if ((error = dns_q_make2(&F->query, u.name, len, R->qtype, R->qclass, F->qflags)))
+				if ((error = dns_res_qmake(R, &F->query, u.name, len, R->qtype, R->qclass, F->qflags)))
 					goto error;
 
 				if (!dns_p_setptr(&F->answer, dns_hosts_query(R->hosts, F->query, &error)))
@@ -7369,7 +8456,7 @@ exec:
 	case DNS_R_CACHE:
 		error = 0;
 
-		if (!F->query && (error = dns_q_make(&F->query, R->qname, R->qtype, R->qclass, F->qflags)))
+		if (!F->query && (error = dns_res_qmake(R, &F->query, R->qname, strlen(R->qname), R->qtype, R->qclass, F->qflags)))
 			goto error;
 
 		if (dns_p_setptr(&F->answer, R->cache->query(F->query, R->cache, &error))) {
@@ -7426,11 +8513,33 @@ exec:
 		if (!(len = dns_resconf_search(u.name, sizeof u.name, R->qname, R->qlen, R->resconf, &R->search)))
 			dgoto(R->sp, DNS_R_SWITCH);
 
-		if ((error = dns_q_make2(&F->query, u.name, len, R->qtype, R->qclass, F->qflags)))
+		if ((error = dns_res_qmake(R, &F->query, u.name, len, R->qtype, R->qclass, F->qflags)))
 			goto error;
 
 		F->state++;
 	case DNS_R_HINTS:
+		/*
+		 * A local copy of the root (RFC 8806) or other zones either
+		 * answers outright, authoritatively denies the name or type,
+		 * or refers us below its cut, skipping the round trips to its
+		 * servers.
+		 */
+		if (R->local && R->resconf->options.recurse) {
+			error = 0;
+
+			if (dns_p_setptr(&F->hints, R->local->query(F->query, R->local, &error))) {
+				if (dns_p_count(F->hints, DNS_S_AN) > 0 || dns_header(F->hints)->aa) {
+					dns_p_movptr(&F->answer, &F->hints);
+
+					dgoto(R->sp, DNS_R_FINISH);
+				}
+
+				if (dns_p_count(F->hints, DNS_S_NS) > 0)
+					dgoto(R->sp, DNS_R_ITERATE);
+			} else if (error)
+				goto error;
+		}
+
 		if (!dns_p_setptr(&F->hints, dns_hints_query(R->hints, F->query, &error)))
 			goto error;
 
@@ -7521,10 +8630,15 @@ exec:
 		else
 			sin.sin_port = htons(53);
 
+		/*
+		 * The query is reused for each nameserver; patch a fresh QID
+		 * in place rather than rebuilding it.
+		 */
+		dns_header(F->query)->qid = dns_so_mkqid(&R->so);
+
 		if (DNS_DEBUG) {
 			char addr[INET_ADDRSTRLEN + 1];
 			dns_a_print(addr, sizeof addr, &a);
-			dns_header(F->query)->qid = dns_so_mkqid(&R->so);
 			DNS_SHOW(F->query, "ASKING: %s/%s @ DEPTH: %u)", u.ns.host, addr, R->sp);
 		}
 
@@ -7617,7 +8731,7 @@ exec:
 
 		dgoto(++R->sp, DNS_R_INIT);
 	case DNS_R_CNAME1_A:
-		if (!(P = dns_res_merge(F->answer, F[1].answer, &error)))
+		if (!(P = dns_res_merge(F->answer, F[1].answer, &R->so.opts.alloc, &error)))
 			goto error;
 
 		dns_p_setptr(&F->answer, P);
@@ -7740,7 +8854,7 @@ exec:
 
 		break;
 	case DNS_R_SERVFAIL:
-		if (!dns_p_setptr(&F->answer, dns_p_make(DNS_P_QBUFSIZ, &error)))
+		if (!dns_p_setptr(&F->answer, dns_p_make2(DNS_P_QBUFSIZ, &R->so.opts.alloc, &error)))
 			goto error;
 
 		dns_header(F->answer)->qr	= 1;
@@ -7955,6 +9069,14 @@ void dns_res_sethints(struct dns_resolver *res, struct dns_hints *hints) {
 } /* dns_res_sethints() */
 
 
+void dns_res_setlocal(struct dns_resolver *res, struct dns_cache *local) {
+	if (local)
+		dns_cache_acquire(local); /* acquire first in case same object */
+	dns_cache_close(res->local);
+	res->local = local;
+} /* dns_res_setlocal() */
+
+
 /*
  * A D D R I N F O  R O U T I N E S
  *
@@ -7963,6 +9085,7 @@ void dns_res_sethints(struct dns_resolver *res, struct dns_hints *hints) {
 struct dns_addrinfo {
 	struct addrinfo hints;
 	struct dns_resolver *res;
+	struct dns_allocator alloc;
 
 	char qname[DNS_D_MAXNAME + 1];
 	enum dns_type qtype;
@@ -7977,6 +9100,7 @@ struct dns_addrinfo {
 
 	struct dns_packet *answer;
 	struct dns_packet *glue;
+	unsigned ttl;
 
 	struct dns_rr_i i, g;
 	struct dns_rr rr;
@@ -8119,11 +9243,15 @@ struct dns_addrinfo *dns_ai_open(const char *host, const char *serv, enum dns_ty
 		return NULL;
 	}
 
-	if (!(ai = malloc(sizeof *ai)))
+	if (!(ai = dns_a_malloc((res)? &res->so.opts.alloc : NULL, sizeof *ai)))
 		goto syerr;
 
 	*ai = ai_initializer;
 	ai->hints = *hints;
+	ai->ttl = UINT_MAX;
+
+	if (res)
+		ai->alloc = res->so.opts.alloc;
 
 	ai->res = res;
 	res = NULL;
@@ -8181,6 +9309,8 @@ error:
 
 
 void dns_ai_close(struct dns_addrinfo *ai) {
+	struct dns_allocator alloc;
+
 	if (!ai)
 		return;
 
@@ -8190,7 +9320,9 @@ void dns_ai_close(struct dns_addrinfo *ai) {
 		dns_p_free(ai->glue);
 
 	dns_p_free(ai->answer);
-	free(ai);
+
+	alloc = ai->alloc;
+	dns_a_free(&alloc, ai);
 } /* dns_ai_close() */
 
 
@@ -8232,7 +9364,7 @@ static int dns_ai_setent(struct addrinfo **ent, union dns_any *any, enum dns_typ
 		clen	= 0;
 	}
 
-	if (!(*ent = malloc(sizeof **ent + dns_sa_len(saddr) + ((ai->hints.ai_flags & AI_CANONNAME)? clen + 1 : 0))))
+	if (!(*ent = dns_a_malloc(&ai->alloc, sizeof **ent + dns_sa_len(saddr) + ((ai->hints.ai_flags & AI_CANONNAME)? clen + 1 : 0))))
 		return dns_syerr();
 
 	memset(*ent, '\0', sizeof **ent);
@@ -8330,6 +9462,7 @@ exec:
 	case DNS_AI_S_FETCH:
 		if (!(ans = dns_res_fetch_and_study(ai->res, &error)))
 			return error;
+		ai->ttl = dns_p_minttl(ans, ai->ttl);
 		if (ai->glue != ai->answer)
 			dns_p_free(ai->glue);
 		ai->glue = dns_p_movptr(&ai->answer, &ans);
@@ -8428,6 +9561,7 @@ exec:
 	case DNS_AI_S_FETCH_G:
 		if (!(ans = dns_res_fetch_and_study(ai->res, &error)))
 			return error;
+		ai->ttl = dns_p_minttl(ans, ai->ttl);
 
 		glue = dns_p_merge(ai->glue, DNS_S_ALL, ans, DNS_S_ALL, &error);
 		dns_p_setptr(&ans, NULL);
@@ -8560,6 +9694,11 @@ const struct dns_stat *dns_ai_stat(struct dns_addrinfo *ai) {
 } /* dns_ai_stat() */
 
 
+unsigned dns_ai_ttl(struct dns_addrinfo *ai) {
+	return ai->ttl;
+} /* dns_ai_ttl() */
+
+
 /*
  * M I S C E L L A N E O U S  R O U T I N E S
  *
@@ -9202,7 +10341,7 @@ static int expand_domain(int argc, char *argv[]) {
 
 	free(src);
 	free(dst);
-	free(pkt);
+	dns_p_free(pkt);
 
 	return 0;
 } /* expand_domain() */
@@ -9301,7 +10440,7 @@ static int query_hosts(int argc, char *argv[]) {
 
 	print_packet(A, stdout);
 
-	free(A);
+	dns_p_free(A);
 
 	return 0;
 } /* query_hosts() */
@@ -9492,7 +10631,7 @@ static int show_hints(int argc, char *argv[]) {
 
 		print_packet(answer, stdout);
 
-		free(answer);
+		dns_p_free(answer);
 	}
 
 	dns_hints_close(hints);
@@ -9533,7 +10672,7 @@ static int resolve_query(int argc DNS_NOTUSED, char *argv[]) {
 
 	ans = dns_res_fetch(R, &error);
 	print_packet(ans, stdout);
-	free(ans);
+	dns_p_free(ans);
 
 	st = dns_res_stat(R);
 	putchar('\n');
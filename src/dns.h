@@ -76,8 +76,8 @@
 #define DNS_VENDOR "william@25thandClement.com"
 
 #define DNS_V_REL  0x20161214
-#define DNS_V_ABI  0x20160608
-#define DNS_V_API  0x20160608
+#define DNS_V_ABI  0x20261018
+#define DNS_V_API  0x20261018
 
 
 DNS_PUBLIC const char *dns_vendor(void);
@@ -251,8 +251,14 @@ enum dns_type {
 	DNS_T_AAAA	= 28,
 	DNS_T_SRV	= 33,
 	DNS_T_OPT	= 41,
+	DNS_T_DS	= 43,
 	DNS_T_SSHFP	= 44,
+	DNS_T_RRSIG	= 46,
+	DNS_T_NSEC	= 47,
+	DNS_T_DNSKEY	= 48,
+	DNS_T_ZONEMD	= 63,
 	DNS_T_SPF	= 99,
+	DNS_T_IXFR	= 251,
 	DNS_T_AXFR      = 252,
 
 	DNS_T_ALL	= 255
@@ -334,6 +340,24 @@ typedef unsigned long dns_atomic_t;
 typedef unsigned long dns_refcount_t; /* must be same value type as dns_atomic_t */
 
 
+/*
+ * M E M O R Y  I N T E R F A C E S
+ *
+ * Optional application allocator. .malloc must be set for the allocator
+ * to be used. .realloc may be NULL, in which case it's emulated with
+ * .malloc and memcpy(3). .free may be NULL for arena-style allocators
+ * which release everything at once.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct dns_allocator {
+	void *arg;
+	void *(*malloc)(size_t, void *arg);
+	void *(*realloc)(void *, size_t, void *arg);
+	void (*free)(void *, void *arg);
+}; /* struct dns_allocator */
+
+
 /*
  * C R Y P T O  I N T E R F A C E S
  *
@@ -412,6 +436,15 @@ struct dns_packet {
 
 	size_t size, end;
 
+	/*
+	 * allocator which owns this packet; zeroed for malloc(3) packets
+	 *
+	 * NB: added with DNS_V_ABI 0x20261018. It moves .data, and so the
+	 * size dns_p_calcsize() computes; code built against older headers
+	 * must be rebuilt.
+	 */
+	struct dns_allocator alloc;
+
 	int:16; /* tcp padding */
 
 	DNS_PRAGMA_EXTENSION union {
@@ -433,8 +466,28 @@ DNS_PUBLIC struct dns_packet *dns_p_init(struct dns_packet *, size_t);
 /** takes size of maximum desired payload */
 DNS_PUBLIC struct dns_packet *dns_p_make(size_t, int *);
 
+/** like dns_p_make, but from the allocator if set */
+DNS_PUBLIC struct dns_packet *dns_p_make2(size_t, const struct dns_allocator *, int *);
+
+/** returns packet to its allocator or the calling thread's pool */
+DNS_PUBLIC void dns_p_free(struct dns_packet *);
+
 DNS_PUBLIC int dns_p_grow(struct dns_packet **);
 
+struct dns_p_stat {
+	unsigned long allocs;	/* dns_p_make, dns_p_grow, etc */
+	unsigned long hits;	/* allocations served from a free list */
+	unsigned long misses;	/* allocations passed to malloc(3) */
+	unsigned long frees;	/* dns_p_free, etc */
+	unsigned long cached;	/* frees kept on a free list */
+}; /* struct dns_p_stat */
+
+/** returns the calling thread's packet pool counters; all 0 unless built with DNS_THREAD_SAFE */
+DNS_PUBLIC const struct dns_p_stat *dns_p_stat(void);
+
+/** releases packets cached by the calling thread */
+DNS_PUBLIC void dns_p_flush(void);
+
 DNS_PUBLIC struct dns_packet *dns_p_copy(struct dns_packet *, const struct dns_packet *);
 
 #define dns_p_opcode(P)		(dns_header(P)->opcode)
@@ -443,8 +496,14 @@ DNS_PUBLIC enum dns_rcode dns_p_rcode(struct dns_packet *);
 
 DNS_PUBLIC unsigned dns_p_count(struct dns_packet *, enum dns_section);
 
+/** lowers ttl to that of the shortest-lived answer or authority record, honouring the SOA minimum */
+DNS_PUBLIC unsigned dns_p_minttl(struct dns_packet *, unsigned);
+
 DNS_PUBLIC int dns_p_push(struct dns_packet *, enum dns_section, const void *, size_t, enum dns_type, enum dns_class, unsigned, const void *);
 
+/** like dns_p_push, but takes RDATA already in uncompressed wire format; its names are compressed as dns_p_push would */
+DNS_PUBLIC int dns_p_pushrd(struct dns_packet *, enum dns_section, const void *, size_t, enum dns_type, enum dns_class, unsigned, const void *, size_t);
+
 DNS_PUBLIC void dns_p_dictadd(struct dns_packet *, unsigned short);
 
 DNS_PUBLIC struct dns_packet *dns_p_merge(struct dns_packet *, enum dns_section, struct dns_packet *, enum dns_section, int *);
@@ -477,6 +536,8 @@ DNS_PUBLIC size_t dns_d_anchor(void *, size_t, const void *, size_t);
 
 DNS_PUBLIC size_t dns_d_cleave(void *, size_t, const void *, size_t);
 
+DNS_PUBLIC _Bool dns_d_isldh(const void *, size_t);
+
 DNS_PUBLIC size_t dns_d_comp(void *, size_t, const void *, size_t, struct dns_packet *, int *);
 
 DNS_PUBLIC size_t dns_d_expand(void *, size_t, unsigned short, struct dns_packet *, int *);
@@ -860,8 +921,13 @@ DNS_PUBLIC size_t dns_any_cname(void *, size_t, union dns_any *, enum dns_type);
 
 struct dns_hosts;
 
+struct dns_options;
+
 DNS_PUBLIC struct dns_hosts *dns_hosts_open(int *);
 
+/** like dns_hosts_open, but entries come from the options' allocator */
+DNS_PUBLIC struct dns_hosts *dns_hosts_open2(const struct dns_options *, int *);
+
 DNS_PUBLIC void dns_hosts_close(struct dns_hosts *);
 
 DNS_PUBLIC dns_refcount_t dns_hosts_acquire(struct dns_hosts *);
@@ -925,11 +991,15 @@ struct dns_resolv_conf {
 
 	struct { /* PRIVATE */
 		dns_atomic_t refcount;
+		struct dns_allocator alloc;
 	} _;
 }; /* struct dns_resolv_conf */
 
 DNS_PUBLIC struct dns_resolv_conf *dns_resconf_open(int *);
 
+/** like dns_resconf_open, but from the options' allocator */
+DNS_PUBLIC struct dns_resolv_conf *dns_resconf_open2(const struct dns_options *, int *);
+
 DNS_PUBLIC void dns_resconf_close(struct dns_resolv_conf *);
 
 DNS_PUBLIC dns_refcount_t dns_resconf_acquire(struct dns_resolv_conf *);
@@ -970,6 +1040,7 @@ DNS_PUBLIC size_t dns_resconf_search(void *, size_t, const void *, size_t, struc
 
 struct dns_hints;
 
+/** hints, their zones and query answers come from the resolv.conf's allocator, if any */
 DNS_PUBLIC struct dns_hints *dns_hints_open(struct dns_resolv_conf *, int *);
 
 DNS_PUBLIC void dns_hints_close(struct dns_hints *);
@@ -1075,6 +1146,19 @@ struct dns_options {
 		DNS_SYSPOLL,
 		DNS_LIBEVENT,
 	} events;
+
+	/*
+	 * Allocator for sockets, resolvers, addrinfo objects and their
+	 * internal buffers. Packets fetched from a resolver must be
+	 * released with dns_p_free(), and addrinfo entries with the
+	 * allocator itself, rather than free(3). Hosts tables and
+	 * resolv.conf objects take it through dns_hosts_open2() and
+	 * dns_resconf_open2(), and hints through their resolv.conf;
+	 * dns_res_stub() passes it to all three.
+	 *
+	 * NB: added with DNS_V_ABI 0x20261018, growing this structure.
+	 */
+	struct dns_allocator alloc;
 }; /* struct dns_options */
 
 
@@ -1117,6 +1201,9 @@ DNS_PUBLIC int dns_so_check(struct dns_socket *);
 
 DNS_PUBLIC struct dns_packet *dns_so_fetch(struct dns_socket *, int *);
 
+/** rearm a stream socket to receive the next message of a zone transfer */
+DNS_PUBLIC int dns_so_next(struct dns_socket *);
+
 DNS_PUBLIC time_t dns_so_elapsed(struct dns_socket *);
 
 DNS_PUBLIC void dns_so_clear(struct dns_socket *);
@@ -1141,6 +1228,9 @@ DNS_PUBLIC struct dns_resolver *dns_res_open(struct dns_resolv_conf *, struct dn
 
 DNS_PUBLIC struct dns_resolver *dns_res_stub(const struct dns_options *, int *);
 
+/** new resolver sharing configuration, hints and caches, for concurrent queries */
+DNS_PUBLIC struct dns_resolver *dns_res_clone(struct dns_resolver *, int *);
+
 DNS_PUBLIC void dns_res_reset(struct dns_resolver *);
 
 DNS_PUBLIC void dns_res_close(struct dns_resolver *);
@@ -1177,6 +1267,9 @@ DNS_PUBLIC const struct dns_stat *dns_res_stat(struct dns_resolver *);
 
 DNS_PUBLIC void dns_res_sethints(struct dns_resolver *, struct dns_hints *);
 
+/** zones answered locally when recursing, in place of their servers */
+DNS_PUBLIC void dns_res_setlocal(struct dns_resolver *, struct dns_cache *);
+
 
 /*
  * A D D R I N F O  I N T E R F A C E
@@ -1207,6 +1300,9 @@ DNS_PUBLIC int dns_ai_poll(struct dns_addrinfo *, int);
 
 DNS_PUBLIC const struct dns_stat *dns_ai_stat(struct dns_addrinfo *);
 
+/** dns_p_minttl() over every answer fetched so far; UINT_MAX if none */
+DNS_PUBLIC unsigned dns_ai_ttl(struct dns_addrinfo *);
+
 
 /*
  * U T I L I T Y  I N T E R F A C E S
@@ -28,6 +28,7 @@
 
 #include <stddef.h>	/* size_t */
 #include <stdio.h>	/* FILE */
+#include <time.h>	/* time_t */
 
 #include <netinet/in.h>	/* struct in_addr struct in6_addr */
 
@@ -340,6 +341,42 @@ size_t spf_expand(char *, size_t, spf_macros_t *, const char *, const struct spf
 spf_macros_t spf_macros(const char *, const struct spf_env *);
 
 
+/*
+ * P O L I C Y  C A C H E  I N T E R F A C E S
+ *
+ * Caches compiled policy bytecode by domain and TXT rdata for the rdata's
+ * TTL, so repeated checks skip parsing and compiling. A cache may be
+ * shared by any number of resolvers, including across threads.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct spf_pcache;
+
+/** limit is the max. # of policies retained; 0 selects a default */
+struct spf_pcache *spf_pcache_open(unsigned, int *);
+
+void spf_pcache_close(struct spf_pcache *);
+
+
+/*
+ * V E R D I C T  C A C H E  I N T E R F A C E S
+ *
+ * Caches finished results by policy domain, client address and whichever
+ * other macros the evaluation read, for the shortest TTL of any record
+ * consulted. Temporary errors and checks reading %{t} aren't retained. A
+ * cache may be shared by any number of resolvers, including across
+ * threads.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct spf_vcache;
+
+/** limit is the max. # of verdicts retained; 0 selects a default */
+struct spf_vcache *spf_vcache_open(unsigned, int *);
+
+void spf_vcache_close(struct spf_vcache *);
+
+
 /*
  * R E S O L V E R  I N T E R F A C E S
  *
@@ -357,9 +394,15 @@ struct spf_limits {
 
 extern const struct spf_limits spf_safelimits;
 
+struct spf_flat;
+
 struct spf_options {
 	struct spf_limits limit;
 	int lookup[2]; /* lookup order: SPF_RR_TXT SPF_RR_SPF */
+	struct spf_pcache *pcache; /* optional; not owned */
+	unsigned prefetch; /* max concurrent lookups issued per policy; 0 disables */
+	struct spf_flat *flat; /* optional; tried before the VM; not owned */
+	struct spf_vcache *vcache; /* optional; tried before .flat; not owned */
 }; /* struct spf_options */
 
 extern const struct spf_options spf_defaults;
@@ -371,6 +414,9 @@ struct spf_resolver *spf_open(const struct spf_env *, struct dns_resolver *, con
 
 void spf_close(struct spf_resolver *);
 
+/** reinitialize for a new check, keeping the DNS resolver, options and buffers */
+int spf_reset(struct spf_resolver *, const struct spf_env *);
+
 int spf_check(struct spf_resolver *);
 
 enum spf_result spf_result(struct spf_resolver *);
@@ -382,6 +428,10 @@ struct spf_info {
 		enum spf_errno code;
 		char exp[128];
 	} error;
+
+	struct {
+		unsigned long ops; /* VM instructions dispatched */
+	} stat;
 }; /* struct spf_info */
 
 const struct spf_info *spf_info(struct spf_resolver *);
@@ -397,4 +447,89 @@ int spf_pollfd(struct spf_resolver *);
 int spf_poll(struct spf_resolver *, int);
 
 
+/*
+ * P O O L  I N T E R F A C E S
+ *
+ * Keeps resolvers warm between checks. Each resolver handed out runs on a
+ * DNS resolver cloned from the pool's, so any number may be in use at
+ * once, including across threads.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct spf_pool;
+
+/** NULL DNS resolver opens one stub for the whole pool; limit is the max. # of idle resolvers kept, 0 selects a default */
+struct spf_pool *spf_pool_open(struct dns_resolver *, const struct spf_options *, unsigned, int *);
+
+void spf_pool_close(struct spf_pool *);
+
+/** takes an idle resolver and resets it for env, or opens a new one */
+struct spf_resolver *spf_pool_get(struct spf_pool *, const struct spf_env *, int *);
+
+/** returns a resolver to the pool, closing it if the pool is full */
+void spf_pool_put(struct spf_pool *, struct spf_resolver *);
+
+
+/*
+ * B A T C H  I N T E R F A C E S
+ *
+ * Runs many checks at once. Each running check takes a resolver from a
+ * pool built on the one passed to spf_batch_open(), sharing its
+ * configuration and cache; resolvers are reused as checks complete.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct spf_batch;
+struct pollfd;
+
+struct spf_batch_result {
+	void *arg;              /* as passed to spf_batch_submit() */
+	int error;              /* non-zero if the check could not complete */
+	enum spf_result result;
+	const char *exp;        /* valid until the next spf_batch_fetch() */
+	struct spf_info info;
+}; /* struct spf_batch_result */
+
+/** limit is the max. # of concurrently running checks; 0 selects a default */
+struct spf_batch *spf_batch_open(struct dns_resolver *, const struct spf_options *, unsigned, int *);
+
+void spf_batch_close(struct spf_batch *);
+
+int spf_batch_submit(struct spf_batch *, const struct spf_env *, void *);
+
+/** advances every running check; returns EAGAIN while any remain unfinished */
+int spf_batch_check(struct spf_batch *);
+
+/** returns 1 and pops the oldest completed check, or 0 if none */
+int spf_batch_fetch(struct spf_batch *, struct spf_batch_result *);
+
+/** fills up to n descriptors the running checks wait on; returns the count */
+unsigned spf_batch_pollfds(struct spf_batch *, struct pollfd *, unsigned);
+
+int spf_batch_poll(struct spf_batch *, int);
+
+
+/*
+ * F L A T T E N E D  P O L I C Y  I N T E R F A C E S
+ *
+ * Resolves the include and redirect tree of a domain's policy ahead of
+ * time. ip4, ip6 and all terms are answered from a CIDR trie; anything
+ * else, e.g. macros or a, mx, ptr and exists terms, defers to the VM when
+ * evaluation would reach it. A Fail defers too, so that spf_exp() is the
+ * explanation the VM would give.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/** blocks, waiting up to timeout seconds on each query */
+struct spf_flat *spf_flat_open(const char *, struct dns_resolver *, const struct spf_options *, int, int *);
+
+void spf_flat_close(struct spf_flat *);
+
+/** time after which spf_flat_match() declines, per the shortest policy TTL */
+time_t spf_flat_expires(struct spf_flat *);
+
+/** result for the env's client, or SPF_NONE if the VM must decide */
+enum spf_result spf_flat_match(struct spf_flat *, const struct spf_env *);
+
+
 #endif /* SPF_H */
@@ -41,10 +41,13 @@
 
 #include <time.h>	/* time(3) */
 
-#include <setjmp.h>	/* jmp_buf _setjmp(3) _longjmp(3) */
+
+#include <pthread.h>	/* pthread_mutex_t pthread_mutex_lock(3) pthread_mutex_unlock(3) */
 
 #include <sys/socket.h>	/* AF_INET AF_INET6 */
 
+#include <poll.h>	/* struct pollfd poll(2) */
+
 #include <unistd.h>	/* gethostname(3) */
 
 #include <netinet/in.h>	/* struct in_addr struct in6_addr */
@@ -1748,6 +1751,538 @@ spf_macros_t spf_macros(const char *src, const struct spf_env *env) {
 } /* spf_macros() */
 
 
+/*
+ * P O L I C Y  C A C H E  R O U T I N E S
+ *
+ * Compiled policy bytecode is position independent--jumps are relative,
+ * and literals are either embedded or point to static strings--so code
+ * emitted by OP_COMP can be saved and copied back into any VM. Entries are
+ * keyed by domain and policy rdata, and expire with the rdata's TTL.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SPF_PCACHE_LIMIT
+#define SPF_PCACHE_LIMIT 1024
+#endif
+
+struct pcache_entry {
+	struct pcache_entry *next;        /* hash chain */
+	struct pcache_entry *older, *newer; /* LRU list */
+
+	unsigned long hash;
+	time_t expires;
+
+	size_t dnlen, txtlen, codelen;
+	unsigned char data[];             /* domain, rdata, code */
+}; /* struct pcache_entry */
+
+struct spf_pcache {
+	pthread_mutex_t mutex;
+
+	unsigned count, limit;
+	struct pcache_entry *oldest, *newest;
+
+	unsigned nbucket;
+	struct pcache_entry *bucket[];
+}; /* struct spf_pcache */
+
+
+struct spf_pcache *spf_pcache_open(unsigned limit, int *error) {
+	struct spf_pcache *pc;
+	unsigned nbucket;
+
+	if (!limit)
+		limit = SPF_PCACHE_LIMIT;
+
+	for (nbucket = 16; nbucket < limit; nbucket <<= 1)
+		;;
+
+	if (!(pc = calloc(1, sizeof *pc + nbucket * sizeof pc->bucket[0])))
+		goto syerr;
+
+	if ((*error = pthread_mutex_init(&pc->mutex, NULL)))
+		goto error;
+
+	pc->limit   = limit;
+	pc->nbucket = nbucket;
+
+	return pc;
+syerr:
+	*error = errno;
+error:
+	free(pc);
+
+	return NULL;
+} /* spf_pcache_open() */
+
+
+void spf_pcache_close(struct spf_pcache *pc) {
+	struct pcache_entry *ent;
+
+	if (!pc)
+		return;
+
+	while ((ent = pc->oldest)) {
+		pc->oldest = ent->newer;
+		free(ent);
+	}
+
+	pthread_mutex_destroy(&pc->mutex);
+	free(pc);
+} /* spf_pcache_close() */
+
+
+static unsigned long pcache_hash(const char *dn, const char *txt) {
+	unsigned long h = 2166136261UL;
+
+	for (; *dn; dn++)
+		h = (h ^ (unsigned char)tolower((unsigned char)*dn)) * 16777619UL;
+
+	for (; *txt; txt++)
+		h = (h ^ (unsigned char)*txt) * 16777619UL;
+
+	return h;
+} /* pcache_hash() */
+
+
+static void pcache_unlink(struct spf_pcache *pc, struct pcache_entry *ent) {
+	struct pcache_entry **pp;
+
+	for (pp = &pc->bucket[ent->hash & (pc->nbucket - 1)]; *pp != ent; pp = &(*pp)->next)
+		;;
+
+	*pp = ent->next;
+
+	if (ent->older)
+		ent->older->newer = ent->newer;
+	else
+		pc->oldest = ent->newer;
+
+	if (ent->newer)
+		ent->newer->older = ent->older;
+	else
+		pc->newest = ent->older;
+
+	pc->count--;
+} /* pcache_unlink() */
+
+
+static void pcache_link(struct spf_pcache *pc, struct pcache_entry *ent) {
+	struct pcache_entry **head = &pc->bucket[ent->hash & (pc->nbucket - 1)];
+
+	ent->next = *head;
+	*head = ent;
+
+	ent->older = pc->newest;
+	ent->newer = NULL;
+
+	if (pc->newest)
+		pc->newest->newer = ent;
+	else
+		pc->oldest = ent;
+
+	pc->newest = ent;
+
+	pc->count++;
+} /* pcache_link() */
+
+
+static struct pcache_entry *pcache_find(struct spf_pcache *pc, unsigned long hash, const char *dn, const char *txt, time_t now) {
+	size_t dnlen = strlen(dn), txtlen = strlen(txt);
+	struct pcache_entry *ent;
+
+	for (ent = pc->bucket[hash & (pc->nbucket - 1)]; ent; ent = ent->next) {
+		if (ent->hash != hash || ent->dnlen != dnlen || ent->txtlen != txtlen)
+			continue;
+
+		if (strncasecmp((char *)ent->data, dn, dnlen) || memcmp(&ent->data[dnlen], txt, txtlen))
+			continue;
+
+		if (ent->expires <= now) {
+			pcache_unlink(pc, ent);
+			free(ent);
+
+			return NULL;
+		}
+
+		return ent;
+	}
+
+	return NULL;
+} /* pcache_find() */
+
+
+/*
+ * Copy compiled code for the policy into dst. Returns the code length, or
+ * 0 if there's no live entry or it doesn't fit.
+ */
+static size_t pcache_get(struct spf_pcache *pc, const char *dn, const char *txt, unsigned char *dst, size_t lim) {
+	struct pcache_entry *ent;
+	size_t len = 0;
+
+	pthread_mutex_lock(&pc->mutex);
+
+	if ((ent = pcache_find(pc, pcache_hash(dn, txt), dn, txt, time(NULL))) && ent->codelen <= lim) {
+		len = ent->codelen;
+		memcpy(dst, &ent->data[ent->dnlen + ent->txtlen], len);
+
+		/* refresh LRU position */
+		pcache_unlink(pc, ent);
+		pcache_link(pc, ent);
+	}
+
+	pthread_mutex_unlock(&pc->mutex);
+
+	return len;
+} /* pcache_get() */
+
+
+static void pcache_put(struct spf_pcache *pc, const char *dn, const char *txt, const unsigned char *code, size_t codelen, unsigned ttl) {
+	size_t dnlen = strlen(dn), txtlen = strlen(txt);
+	unsigned long hash = pcache_hash(dn, txt);
+	struct pcache_entry *ent, *old;
+	time_t now = time(NULL);
+
+	if (!ttl || !codelen)
+		return;
+
+	/* failing to cache isn't an error */
+	if (!(ent = malloc(sizeof *ent + dnlen + txtlen + codelen)))
+		return;
+
+	ent->hash    = hash;
+	ent->expires = now + ttl;
+	ent->dnlen   = dnlen;
+	ent->txtlen  = txtlen;
+	ent->codelen = codelen;
+	memcpy(&ent->data[0], dn, dnlen);
+	memcpy(&ent->data[dnlen], txt, txtlen);
+	memcpy(&ent->data[dnlen + txtlen], code, codelen);
+
+	pthread_mutex_lock(&pc->mutex);
+
+	if ((old = pcache_find(pc, hash, dn, txt, now))) {
+		pcache_unlink(pc, old);
+		free(old);
+	}
+
+	while (pc->count >= pc->limit && (old = pc->oldest)) {
+		pcache_unlink(pc, old);
+		free(old);
+	}
+
+	pcache_link(pc, ent);
+
+	pthread_mutex_unlock(&pc->mutex);
+} /* pcache_put() */
+
+
+/*
+ * V E R D I C T  C A C H E  R O U T I N E S
+ *
+ * A finished result depends only on DNS data and those parts of the
+ * environment the evaluation read. Entries are keyed by the policy
+ * domain and client address (%{d}, %{v}, %{i} and %{c}), plus the
+ * values of any other macros seen by OP_EXPAND or OP_GETENV, and expire
+ * with the shortest TTL of every answer consulted.
+ *
+ * Different inputs may steer evaluation through different macros, so
+ * one address can have several entries for a domain, each with its own
+ * macro set. A lookup hashes only the domain and address, then compares
+ * each candidate's macro values against the environment.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SPF_VCACHE_LIMIT
+#define SPF_VCACHE_LIMIT 4096
+#endif
+
+/* upper bound when no answer carried a TTL, e.g. NXDOMAIN without SOA */
+#ifndef SPF_VCACHE_MAXTTL
+#define SPF_VCACHE_MAXTTL 3600
+#endif
+
+/* macros always part of the key */
+#define VCACHE_KEYMACROS ((1U << ('d' - 'a')) | (1U << ('v' - 'a')) | (1U << ('i' - 'a')) | (1U << ('c' - 'a')))
+
+struct vcache_entry {
+	struct vcache_entry *next;        /* hash chain */
+	struct vcache_entry *older, *newer; /* LRU list */
+
+	unsigned long hash;
+	time_t expires;
+	spf_macros_t macros;              /* read beyond VCACHE_KEYMACROS */
+
+	enum spf_result result;
+	struct spf_info info;
+
+	size_t baselen, keylen, explen;   /* explen is 0 if exp was NULL */
+	unsigned char data[];             /* key, exp */
+}; /* struct vcache_entry */
+
+struct spf_vcache {
+	pthread_mutex_t mutex;
+
+	unsigned count, limit;
+	struct vcache_entry *oldest, *newest;
+
+	unsigned nbucket;
+	struct vcache_entry *bucket[];
+}; /* struct spf_vcache */
+
+struct vcache_verdict {
+	enum spf_result result;
+	struct spf_info info;
+	_Bool hasexp;
+	char exp[512]; /* as sized by OP_EXPAND */
+}; /* struct vcache_verdict */
+
+
+struct spf_vcache *spf_vcache_open(unsigned limit, int *error) {
+	struct spf_vcache *vc;
+	unsigned nbucket;
+
+	if (!limit)
+		limit = SPF_VCACHE_LIMIT;
+
+	for (nbucket = 16; nbucket < limit; nbucket <<= 1)
+		;;
+
+	if (!(vc = calloc(1, sizeof *vc + nbucket * sizeof vc->bucket[0])))
+		goto syerr;
+
+	if ((*error = pthread_mutex_init(&vc->mutex, NULL)))
+		goto error;
+
+	vc->limit   = limit;
+	vc->nbucket = nbucket;
+
+	return vc;
+syerr:
+	*error = errno;
+error:
+	free(vc);
+
+	return NULL;
+} /* spf_vcache_open() */
+
+
+void spf_vcache_close(struct spf_vcache *vc) {
+	struct vcache_entry *ent;
+
+	if (!vc)
+		return;
+
+	while ((ent = vc->oldest)) {
+		vc->oldest = ent->newer;
+		free(ent);
+	}
+
+	pthread_mutex_destroy(&vc->mutex);
+	free(vc);
+} /* spf_vcache_close() */
+
+
+/*
+ * Serialize %{d}, %{v}, %{i} and %{c}, then the value of each macro in
+ * `macros', as NUL-terminated strings. The domain is folded to lower
+ * case. *baselen receives the length of the first four. dst must be at
+ * least sizeof (struct spf_env), which bounds the total.
+ */
+static size_t vcache_key(char *dst, size_t *baselen, spf_macros_t macros, const struct spf_env *env) {
+	static const char base[] = "dvic";
+	size_t p = 0, n;
+	unsigned i;
+	int which;
+
+	for (i = 0; i < sizeof base - 1; i++) {
+		dst[p] = '\0';
+		p += spf_getenv(&dst[p], sizeof (struct spf_env) - p, base[i], env) + 1;
+	}
+
+	for (n = 0; dst[n]; n++)
+		dst[n] = tolower((unsigned char)dst[n]);
+
+	*baselen = p;
+
+	macros &= ~VCACHE_KEYMACROS;
+
+	for (which = 'a'; which <= 'z'; which++) {
+		if (!spf_isset(macros, which))
+			continue;
+
+		dst[p] = '\0';
+		p += spf_getenv(&dst[p], sizeof (struct spf_env) - p, which, env) + 1;
+	}
+
+	return p;
+} /* vcache_key() */
+
+
+static unsigned long vcache_hash(const char *key, size_t len) {
+	unsigned long h = 2166136261UL;
+
+	while (len--)
+		h = (h ^ (unsigned char)*key++) * 16777619UL;
+
+	return h;
+} /* vcache_hash() */
+
+
+static void vcache_unlink(struct spf_vcache *vc, struct vcache_entry *ent) {
+	struct vcache_entry **pp;
+
+	for (pp = &vc->bucket[ent->hash & (vc->nbucket - 1)]; *pp != ent; pp = &(*pp)->next)
+		;;
+
+	*pp = ent->next;
+
+	if (ent->older)
+		ent->older->newer = ent->newer;
+	else
+		vc->oldest = ent->newer;
+
+	if (ent->newer)
+		ent->newer->older = ent->older;
+	else
+		vc->newest = ent->older;
+
+	vc->count--;
+} /* vcache_unlink() */
+
+
+static void vcache_link(struct spf_vcache *vc, struct vcache_entry *ent) {
+	struct vcache_entry **head = &vc->bucket[ent->hash & (vc->nbucket - 1)];
+
+	ent->next = *head;
+	*head = ent;
+
+	ent->older = vc->newest;
+	ent->newer = NULL;
+
+	if (vc->newest)
+		vc->newest->newer = ent;
+	else
+		vc->oldest = ent;
+
+	vc->newest = ent;
+
+	vc->count++;
+} /* vcache_link() */
+
+
+/*
+ * Find the entry whose macro values all match env. `key' holds the base
+ * of env's key, as serialized by vcache_key().
+ */
+static struct vcache_entry *vcache_find(struct spf_vcache *vc, unsigned long hash, const char *key, size_t baselen, const struct spf_env *env, time_t now) {
+	struct vcache_entry *ent, *nxt;
+	char tmp[sizeof (struct spf_env)];
+	size_t keylen;
+
+	for (ent = vc->bucket[hash & (vc->nbucket - 1)]; ent; ent = nxt) {
+		nxt = ent->next;
+
+		if (ent->hash != hash || ent->baselen != baselen || memcmp(ent->data, key, baselen))
+			continue;
+
+		if (ent->expires <= now) {
+			vcache_unlink(vc, ent);
+			free(ent);
+
+			continue;
+		}
+
+		if (ent->keylen == baselen)
+			return ent;
+
+		keylen = vcache_key(tmp, &(size_t){ 0 }, ent->macros, env);
+
+		if (keylen == ent->keylen && !memcmp(&ent->data[baselen], &tmp[baselen], keylen - baselen))
+			return ent;
+	}
+
+	return NULL;
+} /* vcache_find() */
+
+
+static _Bool vcache_get(struct spf_vcache *vc, const struct spf_env *env, struct vcache_verdict *verdict) {
+	char key[sizeof (struct spf_env)];
+	size_t baselen;
+	struct vcache_entry *ent;
+	_Bool found = 0;
+
+	vcache_key(key, &baselen, 0, env);
+
+	pthread_mutex_lock(&vc->mutex);
+
+	if ((ent = vcache_find(vc, vcache_hash(key, baselen), key, baselen, env, time(NULL)))) {
+		verdict->result = ent->result;
+		verdict->info   = ent->info;
+		verdict->hasexp = !!ent->explen;
+		spf_strlcpy(verdict->exp, (ent->explen)? (char *)&ent->data[ent->keylen] : "", sizeof verdict->exp);
+
+		/* refresh LRU position */
+		vcache_unlink(vc, ent);
+		vcache_link(vc, ent);
+
+		found = 1;
+	}
+
+	pthread_mutex_unlock(&vc->mutex);
+
+	return found;
+} /* vcache_get() */
+
+
+static void vcache_put(struct spf_vcache *vc, const struct spf_env *env, spf_macros_t macros, enum spf_result result, const char *exp, const struct spf_info *info, unsigned ttl) {
+	char key[sizeof (struct spf_env)];
+	size_t baselen, keylen, explen;
+	unsigned long hash;
+	struct vcache_entry *ent, *old;
+	time_t now = time(NULL);
+
+	if (!ttl)
+		return;
+
+	keylen = vcache_key(key, &baselen, macros, env);
+	hash   = vcache_hash(key, baselen);
+	explen = (exp)? strlen(exp) + 1 : 0;
+
+	/* failing to cache isn't an error */
+	if (!(ent = malloc(sizeof *ent + keylen + explen)))
+		return;
+
+	ent->hash    = hash;
+	ent->expires = now + SPF_MIN(ttl, SPF_VCACHE_MAXTTL);
+	ent->macros  = macros & ~VCACHE_KEYMACROS;
+	ent->result  = result;
+	ent->info    = *info;
+	ent->baselen = baselen;
+	ent->keylen  = keylen;
+	ent->explen  = explen;
+	memcpy(&ent->data[0], key, keylen);
+	if (explen)
+		memcpy(&ent->data[keylen], exp, explen);
+
+	pthread_mutex_lock(&vc->mutex);
+
+	if ((old = vcache_find(vc, hash, key, baselen, env, now))) {
+		vcache_unlink(vc, old);
+		free(old);
+	}
+
+	while (vc->count >= vc->limit && (old = vc->oldest)) {
+		vcache_unlink(vc, old);
+		free(old);
+	}
+
+	vcache_link(vc, ent);
+
+	pthread_mutex_unlock(&vc->mutex);
+} /* vcache_put() */
+
+
 /*
  * V I R T U A L  M A C H I N E  R O U T I N E S
  *
@@ -1811,12 +2346,15 @@ enum vm_opcode {
 
 	OP_EXPAND,	/* 1/1 Push spf_expand(S(-1)). */
 	OP_ISSET,	/* 2/1 Check for macro S(-1) in S(-2). */
+	OP_STREXP,	/* 0/1 Decode until next NUL and push its expansion (OP_STR + OP_EXPAND). */
 
 	OP_SUBMIT,	/* 2/0 dns_res_submit(). in: 2(qtype, qname) out: 0 */
 	OP_FETCH,	/* 0/1 dns_res_fetch(). in: 0 out: 1(struct dns_packet) */
 	OP_QNAME,	/* 1/1 Pop packet, Push QNAME. */
 	OP_GREP,	/* 3/1 Push iterator. Takes QNAME, section and type. */
 	OP_NEXT,	/* 1/2 Push next stringized RR data. */
+	OP_PREFETCH,	/* 0/0 Decode (qtype, qname) pairs until qtype 0; query them concurrently. */
+	OP_QUERY,	/* 2/2 Query QNAME for |type|, push packet and answer iterator (OP_SUBMIT + OP_FETCH + OP_GREP). */
 
 	OP_ADDRINFO,	/* 3/0 dns_ai_open(). */
 	OP_NEXTENT,	/* 0/1 dns_ai_nextent(). */
@@ -1824,8 +2362,8 @@ enum vm_opcode {
 	OP_CHECK,	/* 1/2 Pop target domain, push exp and result. */
 	OP_COMP,	/* 1/1 Compile S(-1), push code address or 0 if invalid policy. */
 
-	OP_FCRD,	/* 0/0 Forward-confirmed Reverse DNS */
-	OP_FCRDx,	/* 1/0 Pop addrinfo; if A/AAAA matches ${i}, add .ai_canonname as FCRD */
+	OP_RDNS,	/* 0/0 Resolve the PTR names and issue their confirmations */
+	OP_FCRD,	/* 0/0 Forward-confirmed Reverse DNS; settles %{p} */
 
 	OP_SLEEP,	/* 1/0 Sleep */
 
@@ -1868,65 +2406,255 @@ enum vm_opcode {
 #define VM_MAXSTACK 64
 #endif
 
-struct spf_resolver;
+#if !defined SPF_PREFETCH_MAX
+#define SPF_PREFETCH_MAX 10
+#endif
 
-struct spf_vm {
-	unsigned char code[VM_MAXCODE];
-	unsigned pc, end;
+/* RFC 7208 5.5: PTR names beyond the first 10 are ignored */
+#if !defined SPF_FCRD_MAX
+#define SPF_FCRD_MAX 10
+#endif
 
-	unsigned char type[VM_MAXSTACK];
-	intptr_t stack[VM_MAXSTACK];
-	unsigned sp;
+#if !defined VM_PAGESIZE
+#define VM_PAGESIZE 4096U
+#endif
 
-	jmp_buf trap;
+#define VM_SLOTSIZE 16U
 
-	struct spf_resolver *spf;
-}; /* struct spf_vm */
 
-static void vm_init(struct spf_vm *vm, struct spf_resolver *spf) {
-	vm->spf = spf;
-} /* vm_init() */
+/*
+ * Region backing every T_MEM item on the VM stack. Like the pages of
+ * mem.c, allocations are whole slots carved from fixed pages, but they're
+ * bump-allocated so the arena resets in constant time. Freeing the most
+ * recent allocation rolls the page back, which catches the usual pop-then-
+ * push sequences; everything else waits for arena_reset(). Pages past the
+ * first are retained until arena_destroy().
+ */
+struct vm_page {
+	struct vm_page *next;
+	size_t size, end, last;
+	unsigned char data[1];
+}; /* struct vm_page */
 
+#define vm_page_calcsize(n) (offsetof(struct vm_page, data) + (n))
 
-/** forward definition */
-struct spf_resolver {
-	struct spf_options opt;
+struct vm_arena {
+	struct vm_page *cur;
 
-	struct spf_limits stat;
+	union {
+		struct vm_page page;
+		char buf[vm_page_calcsize(VM_PAGESIZE)];
+	} head;
+}; /* struct vm_arena */
 
-	struct spf_env env;
 
-	struct spf_vm vm;
+static void arena_reset(struct vm_arena *A) {
+	A->cur = &A->head.page;
+	A->cur->end  = 0;
+	A->cur->last = 0;
+} /* arena_reset() */
 
-	struct dns_resolver *res;
 
-	struct {
-		struct dns_addrinfo *res;
-		char cname[DNS_D_MAXNAME + 1]; /* last canonical name */
-		unsigned count;
-	} ai;
+static void arena_init(struct vm_arena *A) {
+	A->head.page.next = NULL;
+	A->head.page.size = VM_PAGESIZE;
 
-	struct {
-		_Bool done;
+	arena_reset(A);
+} /* arena_init() */
 
-		union {
-			struct dns_packet ptr;
-			char buf[dns_p_calcsize(512)];
-		};
-	} fcrd;
 
-	enum spf_result result;
+static void arena_destroy(struct vm_arena *A) {
+	struct vm_page *page, *next;
+
+	for (page = A->head.page.next; page; page = next) {
+		next = page->next;
+		free(page);
+	}
+
+	A->head.page.next = NULL;
+
+	arena_reset(A);
+} /* arena_destroy() */
+
+
+static void *arena_get(struct vm_arena *A, size_t size) {
+	struct vm_page *page = A->cur, *tmp;
+	size_t n = DNS_PP_MAX(1, (size + VM_SLOTSIZE - 1) / VM_SLOTSIZE) * VM_SLOTSIZE;
+	void *p;
+
+	while (page->size - page->end < n) {
+		if (!(tmp = page->next) || tmp->size < n) {
+			if (!(tmp = malloc(vm_page_calcsize(DNS_PP_MAX(n, VM_PAGESIZE)))))
+				return NULL;
+
+			tmp->size = DNS_PP_MAX(n, VM_PAGESIZE);
+			tmp->next = page->next;
+			page->next = tmp;
+		}
+
+		tmp->end  = 0;
+		tmp->last = 0;
+
+		A->cur = page = tmp;
+	}
+
+	p = &page->data[page->end];
+	page->last = page->end;
+	page->end += n;
+
+	return p;
+} /* arena_get() */
+
+
+/*
+ * Returns false if `p' wasn't allocated from the arena, i.e. it belongs
+ * to malloc(3).
+ */
+static _Bool arena_put(struct vm_arena *A, void *p) {
+	struct vm_page *page = &A->head.page;
+	unsigned char *q = p;
+
+	for (;;) {
+		if (q >= page->data && q < &page->data[page->end]) {
+			if (page == A->cur && q == &page->data[page->last])
+				page->end = page->last;
+
+			return 1;
+		}
+
+		if (page == A->cur)
+			return 0;
+
+		page = page->next;
+	}
+} /* arena_put() */
+
+
+struct spf_resolver;
+
+struct spf_vm {
+	unsigned char code[VM_MAXCODE];
+	unsigned pc, end;
+
+	_Bool busy; /* OP_QUERY submitted, but not yet fetched */
+
+	unsigned long count; /* instructions dispatched; see spf_info() */
+
+	unsigned char type[VM_MAXSTACK];
+	intptr_t stack[VM_MAXSTACK];
+	unsigned sp;
+
+	struct vm_arena arena;
+
+	int error; /* first fault raised by vm_throw(); see vm_catch() */
+
+	struct spf_resolver *spf;
+}; /* struct spf_vm */
+
+static void vm_init(struct spf_vm *vm, struct spf_resolver *spf) {
+	vm->spf = spf;
+
+	arena_init(&vm->arena);
+} /* vm_init() */
+
+
+/** forward definition */
+struct spf_resolver {
+	struct spf_options opt;
+
+	struct spf_limits stat;
+
+	struct spf_env env;
+
+	struct spf_vm vm;
+
+	struct dns_resolver *res;
+
+	struct {
+		struct dns_addrinfo *res;
+		char cname[DNS_D_MAXNAME + 1]; /* last canonical name */
+		unsigned count;
+	} ai;
+
+	struct {
+		_Bool submitted; /* PTR query outstanding on .res */
+		_Bool done;      /* PTR names known; confirmations issued */
+
+		struct spf_fcrd {
+			struct dns_resolver *res; /* cloned from .res on first use */
+			char host[DNS_D_MAXNAME + 1];
+			int state; /* 0 pending, 1 confirmed, -1 not */
+		} name[SPF_FCRD_MAX];
+
+		unsigned count;
+
+		struct dns_resolver *waiting; /* pending name for spf_pollfd() */
+	} fcrd;
+
+	struct {
+		unsigned ttl; /* of the last policy rdata pushed by OP_NEXT */
+	} policy;
+
+	struct {
+		struct spf_env env;   /* as checked; only kept with .opt.vcache */
+		spf_macros_t macros;  /* read by OP_EXPAND and OP_GETENV */
+		unsigned ttl;         /* shortest of any answer consulted */
+	} verdict;
+
+	struct {
+		_Bool done; /* parsed from %{v} and %{i}; reset by OP_SETENV */
+		int af;
+
+		union {
+			struct in_addr a4;
+			struct in6_addr a6;
+		};
+	} client;
+
+	struct {
+		struct spf_prefetch {
+			struct dns_resolver *res; /* cloned from .res on first use */
+			char qname[DNS_D_MAXNAME + 1]; /* empty if slot is free */
+			int qtype;
+			_Bool done;
+			struct dns_packet *answer;
+		} slot[SPF_PREFETCH_MAX];
+
+		struct dns_resolver *waiting; /* pending slot for spf_pollfd() */
+		struct dns_packet *answer;    /* claimed by OP_SUBMIT for OP_FETCH */
+	} prefetch;
+
+	enum spf_result result;
 	const char *exp;
 
 	struct spf_info info;
 }; /* struct spf_resolver */
 
 
-static void vm_throw() __attribute__((__noreturn__));
+/*
+ * Faults are returned rather than thrown. vm_throw() records the first
+ * one, helpers which fault return a harmless value, and the instruction
+ * leaves through vm_assert() or vm_unwind(). vm_opcode() then halts the
+ * dispatch loop, and vm_exec() returns the fault to its caller.
+ */
 static void vm_throw(struct spf_vm *vm, int error) {
-	_longjmp(vm->trap, (error)? error : EINVAL);
+	if (!vm->error)
+		vm->error = (error)? error : EINVAL;
 } /* vm_throw() */
 
+static int vm_catch(struct spf_vm *vm) {
+	int error = vm->error;
+
+	vm->error = 0;
+
+	return error;
+} /* vm_catch() */
+
+#define vm_unwind(vm) do { \
+	if (spf_unlikely((vm)->error)) \
+		return; \
+} while (0)
+
 /*
  * NOTE: Using a macro because it delays evaluation of `error' to allow
  * code like:
@@ -1934,11 +2662,14 @@ static void vm_throw(struct spf_vm *vm, int error) {
  * 	vm_assert(vm, !(error = do_something()), error)
  * 	vm_assert(vm, (rval = do_something(&error)), error)
  * 	vm_assert(vm, (p = malloc()), errno)
+ *
+ * On failure it returns from the calling function, which must be void.
  */
 #define vm_assert0(vm, cond, error) do { \
 	if (spf_unlikely(!(cond))) { \
 		SPF_SAY("fail: %s", SPF_STRINGIFY(cond)); \
 		vm_throw((vm), (error)); \
+		return; \
 	} \
 } while (0)
 
@@ -1947,6 +2678,7 @@ static void vm_throw(struct spf_vm *vm, int error) {
 		spf_fmt((vm)->spf->info.error.exp, sizeof (vm)->spf->info.error.exp, __VA_ARGS__); \
 		SPF_SAY("fail: %s", (vm)->spf->info.error.exp); \
 		vm_throw((vm), (err)); \
+		return; \
 	} \
 } while (0)
 
@@ -1983,14 +2715,18 @@ static inline int vm_indexof(struct spf_vm *vm, int p) {
 	if (spf_likely(p < 0))
 		p = vm->sp + p;
 
-	vm_assert(vm, p >= 0 && p < vm->sp, EFAULT);
+	if (spf_unlikely(p < 0 || p >= vm->sp)) {
+		vm_throw(vm, EFAULT);
+
+		return -1;
+	}
 
 	return p;
 } /* vm_indexof() */
 
 
 static inline enum vm_type vm_typeof(struct spf_vm *vm, int p) {
-	return vm->type[vm_indexof(vm, p)];
+	return ((p = vm_indexof(vm, p)) < 0)? 0 : vm->type[p];
 } /* vm_typeof() */
 
 
@@ -2001,7 +2737,8 @@ static void t_free(struct spf_vm *vm, enum vm_type t, intptr_t v) {
 	case T_REF:
 		break;
 	case T_MEM:
-		free((void *)v);
+		if (!arena_put(&vm->arena, (void *)v))
+			free((void *)v);
 
 		break;
 	default:
@@ -2012,9 +2749,11 @@ static void t_free(struct spf_vm *vm, enum vm_type t, intptr_t v) {
 
 static inline intptr_t vm_pop(struct spf_vm *vm, enum vm_type t) {
 	intptr_t v;
-	vm_assert(vm, vm->sp, EFAULT);
+	if (spf_unlikely(!vm->sp || !(vm->type[vm->sp - 1] & t))) {
+		vm_throw(vm, (vm->sp)? EINVAL : EFAULT);
+		return 0;
+	}
 	vm->sp--;
-	vm_assert(vm, (vm->type[vm->sp] & t), EINVAL);
 	t = vm->type[vm->sp];
 	v = vm->stack[vm->sp];
 	t_free(vm, t, v);
@@ -2031,8 +2770,13 @@ static void vm_discard(struct spf_vm *vm, unsigned n) {
 } /* vm_discard() */
 
 
+/* pushing, poking and moving do nothing once faulted */
 static inline intptr_t vm_push(struct spf_vm *vm, enum vm_type t, intptr_t v) {
-	vm_assert(vm, vm->sp < spf_lengthof(vm->stack), ENOMEM);
+	if (spf_unlikely(vm->error || vm->sp >= spf_lengthof(vm->stack))) {
+		vm_throw(vm, ENOMEM);
+
+		return v;
+	}
 
 	vm->type[vm->sp]  = t;
 	vm->stack[vm->sp] = v;
@@ -2050,7 +2794,9 @@ static intptr_t vm_move(struct spf_vm *vm, int p) {
 	intptr_t v;
 	int i;
 
-	p = vm_indexof(vm, p);
+	if (vm->error || (p = vm_indexof(vm, p)) < 0)
+		return 0;
+
 	t = vm->type[p];
 	v = vm->stack[p];
 
@@ -2089,37 +2835,70 @@ static intptr_t vm_move(struct spf_vm *vm, int p) {
 } /* vm_move() */
 
 
-static intptr_t vm_strdup(struct spf_vm *vm, const void *s) {
+static intptr_t vm_memdup(struct spf_vm *vm, const void *p, size_t len) {
 	void *v;
 
 	vm_extend(vm, 1);
-	vm_assert(vm, (v = strdup(s)), errno);
-	vm_push(vm, T_MEM, (intptr_t)v);
-
-	return (intptr_t)v;
-} /* vm_strdup() */
 
+	if (vm->error || !(v = arena_get(&vm->arena, len))) {
+		vm_throw(vm, errno);
 
-static intptr_t vm_memdup(struct spf_vm *vm, const void *p, size_t len) {
-	void *v;
+		return 0;
+	}
 
-	vm_extend(vm, 1);
-	vm_assert(vm, (v = malloc(len)), errno);
 	vm_push(vm, T_MEM, (intptr_t)memcpy(v, p, len));
 
 	return (intptr_t)v;
 } /* vm_memdup() */
 
 
+static intptr_t vm_strdup(struct spf_vm *vm, const void *s) {
+	return vm_memdup(vm, s, strlen(s) + 1);
+} /* vm_strdup() */
+
+
+/*
+ * Move a fetched answer into the arena, returning the original to the
+ * packet pool so the next query can reuse it.
+ */
+static intptr_t vm_packet(struct spf_vm *vm, struct dns_packet *P) {
+	size_t size = dns_p_calcsize(P->end);
+	struct dns_packet *Q;
+	int error;
+
+	if (!(Q = arena_get(&vm->arena, size)) || vm->sp >= spf_lengthof(vm->stack)) {
+		error = (Q)? ENOMEM : errno;
+		dns_p_free(P);
+		vm_throw(vm, error);
+
+		return 0;
+	}
+
+	memcpy(Q, P, size);
+	Q->size = size - offsetof(struct dns_packet, data);
+	memset(&Q->alloc, 0, sizeof Q->alloc);
+
+	if (vm->spf->opt.vcache)
+		vm->spf->verdict.ttl = dns_p_minttl(Q, vm->spf->verdict.ttl);
+
+	dns_p_free(P);
+
+	return vm_push(vm, T_MEM, (intptr_t)Q);
+} /* vm_packet() */
+
+
 static inline intptr_t vm_peek(struct spf_vm *vm, int p, enum vm_type t) {
-	p = vm_indexof(vm, p);
-	vm_assert(vm, (t & vm->type[p]), EINVAL);
+	if ((p = vm_indexof(vm, p)) < 0 || spf_unlikely(!(t & vm->type[p]))) {
+		vm_throw(vm, EINVAL);
+		return 0;
+	}
 	return vm->stack[p];
 } /* vm_peek() */
 
 
 static inline intptr_t vm_poke(struct spf_vm *vm, int p, enum vm_type t, intptr_t v) {
-	p = vm_indexof(vm, p);
+	if (vm->error || (p = vm_indexof(vm, p)) < 0)
+		return 0;
 	t_free(vm, vm->type[p], vm->stack[p]);
 	vm->type[p]  = t;
 	vm->stack[p] = v;
@@ -2127,8 +2906,13 @@ static inline intptr_t vm_poke(struct spf_vm *vm, int p, enum vm_type t, intptr_
 } /* vm_poke() */
 
 
+/* a pending fault halts the dispatch loop */
 static inline int vm_opcode(struct spf_vm *vm) {
-	vm_assert(vm, vm->pc < spf_lengthof(vm->code), EFAULT);
+	if (spf_unlikely(vm->error || vm->pc >= spf_lengthof(vm->code))) {
+		vm_throw(vm, EFAULT);
+
+		return OP_HALT;
+	}
 
 	return vm->code[vm->pc];
 } /* vm_opcode() */
@@ -2142,7 +2926,9 @@ static unsigned (vm_emit)(struct spf_vm *vm, enum vm_opcode code, intptr_t v_) {
 	void *p;
 	unsigned i, n;
 
-	vm_assert(vm, vm->end < spf_lengthof(vm->code), ENOMEM);
+	/* once faulted, emit nothing more; see sub_link() */
+	if (spf_unlikely(vm->error || vm->end >= spf_lengthof(vm->code)))
+		goto nomem;
 
 	vm->code[vm->end] = code;
 
@@ -2159,17 +2945,22 @@ static unsigned (vm_emit)(struct spf_vm *vm, enum vm_opcode code, intptr_t v_) {
 		n = sizeof (uintptr_t);
 copy:
 		v = (uintptr_t)v_;
-		vm_assert(vm, vm->end <= spf_lengthof(vm->code) - n, ENOMEM);
+
+		if (vm->end > spf_lengthof(vm->code) - n)
+			goto nomem;
 
 		for (i = 0; i < n; i++)
 			vm->code[++vm->end] = 0xffU & (v >> (8U * ((n-i)-1)));
 
 		return vm->end++;
 	case OP_STR:
+		/* FALL THROUGH */
+	case OP_STREXP:
 		p = (void *)v_;
 		n = strlen(p) + 1;
 embed:
-		vm_assert(vm, spf_lengthof(vm->code) - (vm->end + 1) >= n, ENOMEM);
+		if (spf_lengthof(vm->code) - (vm->end + 1) < n)
+			goto nomem;
 		memcpy(&vm->code[++vm->end], p, n);
 		vm->end += n;
 
@@ -2183,10 +2974,22 @@ embed:
 		p = (void *)v_;
 		n = sizeof (struct in6_addr);
 
+		goto embed;
+	case OP_PREFETCH:
+		p = (void *)v_;
+
+		for (n = 0; ((unsigned char *)p)[n]; n += strlen((char *)p + n + 1) + 2)
+			;;
+		n++;
+
 		goto embed;
 	default:
 		return vm->end++;
 	} /* switch() */
+nomem:
+	vm_throw(vm, ENOMEM);
+
+	return 0;
 } /* vm_emit() */
 
 
@@ -2210,6 +3013,7 @@ embed:
 #define REF(sub,v)  sub_emit((sub), OP_REF, (v))
 #define MEM(sub,v)  sub_emit((sub), OP_MEM, (v))
 #define STR(sub,v)  sub_emit((sub), OP_STR, (v))
+#define STREXP(sub,v) sub_emit((sub), OP_STREXP, (v))
 #define IN4(sub,v)  sub_emit((sub), OP_IN4, (v))
 #define IN6(sub,v)  sub_emit((sub), OP_IN6, (v))
 #define DEC(sub)    sub_emit((sub), OP_DEC)
@@ -2235,10 +3039,12 @@ embed:
 #define QNAME(sub)  sub_emit((sub), OP_QNAME)
 #define GREP(sub)   sub_emit((sub), OP_GREP)
 #define NEXT(sub)   sub_emit((sub), OP_NEXT)
+#define PREFETCH(sub,v) sub_emit((sub), OP_PREFETCH, (v))
+#define QUERY(sub)  sub_emit((sub), OP_QUERY)
 #define CHECK(sub)  sub_emit((sub), OP_CHECK)
 #define COMP(sub)   sub_emit((sub), OP_COMP)
+#define RDNS(sub)   sub_emit((sub), OP_RDNS)
 #define FCRD(sub)   sub_emit((sub), OP_FCRD)
-#define FCRDx(sub)  sub_emit((sub), OP_FCRDx)
 #define CAT(sub)    sub_emit((sub), OP_CAT)
 #define CMP(sub)    sub_emit((sub), OP_CMP)
 #define LC(sub)     sub_emit((sub), OP_LC)
@@ -2282,6 +3088,9 @@ static void sub_init(struct vm_sub *sub, struct spf_vm *vm)
 static void sub_link(struct vm_sub *sub) {
 	unsigned i, lp, jp;
 
+	/* a faulted emit leaves the jumps unpatchable */
+	vm_unwind(sub->vm);
+
 	for (i = 0; i < sub->jc; i++) {
 		lp = sub->l[sub->j[i].id];
 		jp = sub->j[i].cp;
@@ -2512,6 +3321,8 @@ static void op_lit(struct spf_vm *vm) {
 		break;
 	default:
 		vm_throw(vm, EINVAL);
+
+		return;
 	} /* switch () */
 
 	vm_assert(vm, vm->pc + n < vm->end, EFAULT);
@@ -2617,11 +3428,143 @@ static void op_lt(struct spf_vm *vm) {
 } /* op_lt() */
 
 
+static struct spf_prefetch *prefetch_find(struct spf_resolver *spf, const char *qname, int qtype) {
+	unsigned i;
+
+	for (i = 0; i < spf_lengthof(spf->prefetch.slot); i++) {
+		if (spf->prefetch.slot[i].qtype == qtype && !strcasecmp(spf->prefetch.slot[i].qname, qname))
+			return &spf->prefetch.slot[i];
+	}
+
+	return NULL;
+} /* prefetch_find() */
+
+
+static void prefetch_submit(struct spf_resolver *spf, const char *qname, int qtype) {
+	struct spf_prefetch *slot;
+	int error = 0;
+
+	if (!*qname || prefetch_find(spf, qname, qtype) || !(slot = prefetch_find(spf, "", 0)))
+		return;
+
+	if (!slot->res && !(slot->res = dns_res_clone(spf->res, &error)))
+		return;
+
+	if (spf_strlcpy(slot->qname, qname, sizeof slot->qname) >= sizeof slot->qname)
+		goto error;
+
+	if ((error = dns_res_submit(slot->res, slot->qname, qtype, DNS_C_IN)))
+		goto error;
+
+	SPF_SAY("prefetching %s IN %s", slot->qname, dns_strtype(qtype));
+
+	slot->qtype = qtype;
+	slot->done = 0;
+
+	return;
+error:
+	slot->qname[0] = '\0';
+} /* prefetch_submit() */
+
+
+/*
+ * Hand the answer of a completed prefetch to OP_FETCH. The slot is
+ * released whether or not the prefetch succeeded; on failure the query is
+ * simply repeated in-line.
+ */
+static _Bool prefetch_claim(struct spf_resolver *spf, const char *qname, int qtype) {
+	struct spf_prefetch *slot;
+
+	if (!(slot = prefetch_find(spf, qname, qtype)) || !slot->done)
+		return 0;
+
+	dns_p_free(spf->prefetch.answer);
+	spf->prefetch.answer = slot->answer;
+	slot->answer = NULL;
+	slot->qname[0] = '\0';
+	slot->qtype = 0;
+
+	return !!spf->prefetch.answer;
+} /* prefetch_claim() */
+
+
+static void prefetch_reset(struct spf_resolver *spf) {
+	unsigned i;
+
+	for (i = 0; i < spf_lengthof(spf->prefetch.slot); i++) {
+		dns_p_free(spf->prefetch.slot[i].answer);
+		spf->prefetch.slot[i].answer = NULL;
+		spf->prefetch.slot[i].qname[0] = '\0';
+		spf->prefetch.slot[i].qtype = 0;
+	}
+
+	dns_p_free(spf->prefetch.answer);
+	spf->prefetch.answer = NULL;
+	spf->prefetch.waiting = NULL;
+} /* prefetch_reset() */
+
+
+static void op_prefetch(struct spf_vm *vm) {
+	struct spf_resolver *spf = vm->spf;
+	struct spf_prefetch *slot;
+	unsigned pe = vm->pc + 1, n = 0, i;
+	const char *qname;
+	int qtype, error;
+
+	while (pe < spf_lengthof(vm->code) && (qtype = vm->code[pe])) {
+		qname = (char *)&vm->code[++pe];
+		pe += strnlen(qname, spf_lengthof(vm->code) - pe) + 1;
+		vm_assert(vm, pe < spf_lengthof(vm->code), EFAULT);
+
+		if (n++ < spf->opt.prefetch)
+			prefetch_submit(spf, qname, qtype);
+	}
+
+	vm_assert(vm, pe < spf_lengthof(vm->code), EFAULT);
+
+	spf->prefetch.waiting = NULL;
+
+	for (i = 0; i < spf_lengthof(spf->prefetch.slot); i++) {
+		slot = &spf->prefetch.slot[i];
+
+		if (!slot->qname[0] || slot->done)
+			continue;
+
+		if (EAGAIN == (error = dns_res_check(slot->res))) {
+			if (!spf->prefetch.waiting)
+				spf->prefetch.waiting = slot->res;
+
+			continue;
+		}
+
+		if (!error)
+			slot->answer = dns_res_fetch(slot->res, &error);
+
+		slot->done = 1;
+	}
+
+	vm_assert(vm, !spf->prefetch.waiting, EAGAIN);
+
+	vm->pc = pe + 1;
+} /* op_prefetch() */
+
+
 static void op_submit(struct spf_vm *vm) {
 	void *qname = (void *)vm_peek(vm, -2, T_REF|T_MEM);
 	int qtype   = vm_peek(vm, -1, T_INT);
 	int error;
 
+	vm_unwind(vm);
+
+	if (prefetch_claim(vm->spf, qname, qtype)) {
+		SPF_SAY("prefetched %s IN %s", (char *)qname, dns_strtype(qtype));
+
+		vm_discard(vm, 2);
+		vm->pc++;
+
+		return;
+	}
+
 	SPF_SAY("querying %s IN %s", (char *)qname, dns_strtype(qtype));
 
 	error = dns_res_submit(vm->spf->res, qname, qtype, DNS_C_IN);
@@ -2637,13 +3580,20 @@ static void op_fetch(struct spf_vm *vm) {
 	struct dns_packet *pkt;
 	int error;
 
+	if ((pkt = vm->spf->prefetch.answer)) {
+		vm->spf->prefetch.answer = NULL;
+		vm_packet(vm, pkt);
+		vm->pc++;
+
+		return;
+	}
+
 	error = dns_res_check(vm->spf->res);
 	vm_assert(vm, !error, error);
 
-	vm_extend(vm, 1);
 	pkt = dns_res_fetch(vm->spf->res, &error);
 	vm_assert(vm, !!pkt, error);
-	vm_push(vm, T_MEM, (intptr_t)pkt);
+	vm_packet(vm, pkt);
 
 	vm->pc++;
 } /* op_fetch() */
@@ -2655,6 +3605,7 @@ static void op_qname(struct spf_vm *vm) {
 	int error;
 
 	pkt = (void *)vm_peek(vm, -1, T_REF|T_MEM);
+	vm_unwind(vm);
 
 	vm_assert(vm, dns_d_expand(qname, sizeof qname, 12, pkt, &error), error);
 
@@ -2671,18 +3622,14 @@ struct vm_grep {
 	char name[DNS_D_MAXNAME + 1];
 }; /* struct vm_grep */
 
-static void op_grep(struct spf_vm *vm) {
-	struct dns_packet *pkt;
-	char *name;
+static struct vm_grep *grep_open(struct spf_vm *vm, struct dns_packet *pkt, const char *name, int sec, int type) {
 	struct vm_grep *grep;
-	int sec, type;
 
-	pkt  = (void *)vm_peek(vm, -4, T_REF|T_MEM);
-	name = (void *)vm_peek(vm, -3, T_REF|T_MEM);
-	sec  = vm_peek(vm, -2, T_INT);
-	type = vm_peek(vm, -1, T_INT);
+	if (!(grep = arena_get(&vm->arena, sizeof *grep))) {
+		vm_throw(vm, errno);
 
-	vm_assert(vm, (grep = malloc(sizeof *grep)), errno);
+		return NULL;
+	}
 
 	memset(&grep->iterator, 0, sizeof grep->iterator);
 
@@ -2698,6 +3645,23 @@ static void op_grep(struct spf_vm *vm) {
 
 	dns_rr_i_init(&grep->iterator, pkt);
 
+	return grep;
+} /* grep_open() */
+
+static void op_grep(struct spf_vm *vm) {
+	struct dns_packet *pkt;
+	char *name;
+	struct vm_grep *grep;
+	int sec, type;
+
+	pkt  = (void *)vm_peek(vm, -4, T_REF|T_MEM);
+	name = (void *)vm_peek(vm, -3, T_REF|T_MEM);
+	sec  = vm_peek(vm, -2, T_INT);
+	type = vm_peek(vm, -1, T_INT);
+	vm_unwind(vm);
+
+	grep = grep_open(vm, pkt, name, sec, type);
+
 	vm_discard(vm, 3);
 	vm_push(vm, T_MEM, (intptr_t)grep);
 
@@ -2721,6 +3685,7 @@ static void op_next(struct spf_vm *vm) {
 
 	pkt  = (void *)vm_peek(vm, -2, T_REF|T_MEM);
 	grep = (void *)vm_peek(vm, -1, T_REF|T_MEM);
+	vm_unwind(vm);
 
 grep:
 	if (dns_rr_grep(&rr, 1, &grep->iterator, pkt, &error)) {
@@ -2755,11 +3720,16 @@ grep:
 				sbuf_puts(&exp, " has embedded NUL");
 				spf_strlcpy(vm->spf->info.error.exp, exp.str, sizeof vm->spf->info.error.exp);
 				vm_throw(vm, SPF_EBADPOLICY);
+
+				return;
 			}
 
 			txt = (char *)vm_memdup(vm, any.txt.data, any.txt.len + 1);
+			vm_unwind(vm);
 			txt[any.txt.len] = '\0';
 
+			vm->spf->policy.ttl = rr.ttl;
+
 			break;
 		default:
 			if (!dns_any_print(rd, sizeof rd, &any, rr.type))
@@ -2778,13 +3748,67 @@ none:
 } /* op_next() */
 
 
-static void op_addrinfo(struct spf_vm *vm) {
-	struct addrinfo hints = { .ai_family = PF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_CANONNAME };
-	const char *host;
-	char serv[16];
-	int qtype, error;
-
-	host = (char *)vm_peek(vm, -4, T_REF|T_MEM);
+/*
+ * Fused OP_SUBMIT, OP_FETCH and OP_GREP for the common case of iterating
+ * over the answer section. The instruction is restartable: a query left
+ * in flight by DNS_EAGAIN is remembered in vm.busy and only fetched when
+ * we're resumed.
+ */
+static void op_query(struct spf_vm *vm) {
+	struct dns_packet *pkt;
+	struct vm_grep *grep;
+	int type, error;
+
+	type = vm_peek(vm, -1, T_INT);
+
+	if (!vm->busy) {
+		void *qname = (void *)vm_peek(vm, -2, T_REF|T_MEM);
+
+		vm_unwind(vm);
+
+		if (prefetch_claim(vm->spf, qname, abs(type))) {
+			SPF_SAY("prefetched %s IN %s", (char *)qname, dns_strtype(abs(type)));
+		} else {
+			SPF_SAY("querying %s IN %s", (char *)qname, dns_strtype(abs(type)));
+
+			error = dns_res_submit(vm->spf->res, qname, abs(type), DNS_C_IN);
+			vm_assert(vm, !error, error);
+		}
+
+		vm->busy = 1;
+	}
+
+	if ((pkt = vm->spf->prefetch.answer)) {
+		vm->spf->prefetch.answer = NULL;
+		vm->busy = 0;
+	} else {
+		error = dns_res_check(vm->spf->res);
+		vm_assert(vm, error != EAGAIN, error);
+
+		vm->busy = 0;
+		vm_assert(vm, !error, error);
+		vm_assert(vm, (pkt = dns_res_fetch(vm->spf->res, &error)), error);
+	}
+
+	vm_discard(vm, 2);
+	pkt = (void *)vm_packet(vm, pkt);
+	vm_unwind(vm);
+
+	grep = grep_open(vm, pkt, NULL, DNS_S_AN, type);
+	vm_push(vm, T_MEM, (intptr_t)grep);
+
+	vm->pc++;
+} /* op_query() */
+
+
+static void op_addrinfo(struct spf_vm *vm) {
+	struct addrinfo hints = { .ai_family = PF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_CANONNAME };
+	const char *host;
+	char serv[16];
+	int qtype, error;
+
+	host = (char *)vm_peek(vm, -4, T_REF|T_MEM);
+	vm_unwind(vm);
 
 	if (T_INT == vm_typeof(vm, -3))
 		spf_itoa(serv, sizeof serv, vm_peek(vm, -3, T_INT));
@@ -2793,6 +3817,7 @@ static void op_addrinfo(struct spf_vm *vm) {
 
 	qtype = vm_peek(vm, -2, T_INT);
 	hints.ai_family = vm_peek(vm, -1, T_INT);
+	vm_unwind(vm);
 
 	SPF_SAY("querying %s IN %s", host, dns_strtype(qtype));
 
@@ -2813,12 +3838,16 @@ static void op_nextent(struct spf_vm *vm) {
 	int error;
 
 	vm_extend(vm, 1);
+	vm_unwind(vm);
+
 	if ((error = dns_ai_nextent(&ent, vm->spf->ai.res)))
 		vm_assert(vm, error == ENOENT, error);
 	vm_push(vm, T_MEM, (intptr_t)ent);
 
 	vm->pc++;
 
+	vm->spf->verdict.ttl = SPF_MIN(vm->spf->verdict.ttl, dns_ai_ttl(vm->spf->ai.res));
+
 	if (!ent || !ent->ai_canonname || !strcasecmp(ent->ai_canonname, vm->spf->ai.cname))
 		return;
 
@@ -2830,8 +3859,14 @@ static void op_nextent(struct spf_vm *vm) {
 
 static void op_getenv(struct spf_vm *vm) {
 	char dst[512];
+	int which;
 
-	spf_getenv(dst, sizeof dst, vm_pop(vm, T_INT), &vm->spf->env);
+	which = vm_pop(vm, T_INT);
+
+	if (isalpha((unsigned char)which))
+		vm->spf->verdict.macros |= 1U << (tolower((unsigned char)which) - 'a');
+
+	spf_getenv(dst, sizeof dst, which, &vm->spf->env);
 	vm_strdup(vm, dst);
 
 	vm->pc++;
@@ -2840,21 +3875,39 @@ static void op_getenv(struct spf_vm *vm) {
 
 static void op_setenv(struct spf_vm *vm) {
 	char *src;
+	int which;
 
 	vm_assert(vm, (src = (char *)vm_peek(vm, -2, T_REF|T_MEM)), EINVAL);
-	spf_setenv(&vm->spf->env, vm_pop(vm, T_INT), src);
+	which = vm_pop(vm, T_INT);
+	vm_unwind(vm);
+
+	spf_setenv(&vm->spf->env, which, src);
 	vm_discard(vm, 1);
 
+	if (which == 'i' || which == 'v')
+		vm->spf->client.done = 0;
+
 	vm->pc++;
 } /* op_setenv() */
 
 
-static void op_expand(struct spf_vm *vm) {
+static void vm_expand(struct spf_vm *vm, char *dst, size_t lim, const char *src) {
 	spf_macros_t macros = 0;
-	char dst[512];
 	int error;
 
-	vm_assert(vm, spf_expand(dst, sizeof dst, &macros, (void *)vm_peek(vm, -1, T_REF|T_MEM), &vm->spf->env, &error), error);
+	vm_assert(vm, spf_expand(dst, lim, &macros, src, &vm->spf->env, &error), error);
+
+	vm->spf->verdict.macros |= macros;
+} /* vm_expand() */
+
+
+static void op_expand(struct spf_vm *vm) {
+	char dst[512];
+	const char *src;
+
+	vm_assert(vm, (src = (void *)vm_peek(vm, -1, T_REF|T_MEM)), EINVAL);
+	vm_expand(vm, dst, sizeof dst, src);
+	vm_unwind(vm);
 
 	vm_pop(vm, T_ANY);
 	vm_strdup(vm, dst);
@@ -2863,11 +3916,34 @@ static void op_expand(struct spf_vm *vm) {
 } /* op_expand() */
 
 
+/*
+ * Expand the inline string directly from the code segment, sparing
+ * OP_STR's copy.
+ */
+static void op_strexp(struct spf_vm *vm) {
+	char dst[512];
+	unsigned pe, pc = vm->pc + 1;
+
+	for (pe = pc; pe < spf_lengthof(vm->code) && vm->code[pe]; pe++)
+		;;
+	pe++;
+	vm_assert(vm, pe < spf_lengthof(vm->code), EFAULT);
+
+	vm_expand(vm, dst, sizeof dst, (char *)&vm->code[pc]);
+	vm_unwind(vm);
+	vm_strdup(vm, dst);
+
+	vm->pc = pe;
+} /* op_strexp() */
+
+
 static void op_isset(struct spf_vm *vm) {
 	spf_macros_t macros = 0;
+	const char *src;
 	int isset, error;
 
-	vm_assert(vm, spf_expand(0, 0, &macros, (void *)vm_peek(vm, -2, T_REF|T_MEM), &vm->spf->env, &error), error);
+	vm_assert(vm, (src = (void *)vm_peek(vm, -2, T_REF|T_MEM)), EINVAL);
+	vm_assert(vm, spf_expand(0, 0, &macros, src, &vm->spf->env, &error), error);
 
 	isset = !!spf_isset(macros, vm_peek(vm, -1, T_INT));
 	vm_discard(vm, 2);
@@ -2882,6 +3958,7 @@ static void op_check(struct spf_vm *vm) {
 	unsigned end, ret;
 
 	lim_checkterms(vm, 1);
+	vm_unwind(vm);
 
 	end = vm->end;
 	ret = vm->pc + 1;
@@ -2896,20 +3973,16 @@ static void op_check(struct spf_vm *vm) {
 	 */
 	DUP(&sub);
 	I8(&sub, vm->spf->opt.lookup[0]);
-	SUBMIT(&sub);
-	FETCH(&sub);
+	NEG(&sub); /* -DNS_T_TXT asks query/next to scan for TXT v=spf1 or SPF  */
+	QUERY(&sub);
 
 	/*
-	 * [-4] reset address
-	 * [-3] return address
-	 * [-2] domain
-	 * [-1] packet
+	 * [-5] reset address
+	 * [-4] return address
+	 * [-3] domain
+	 * [-2] packet
+	 * [-1] iterator
 	 */
-	NIL(&sub);
-	TWO(&sub);
-	I8(&sub, vm->spf->opt.lookup[0]);
-	NEG(&sub); /* -DNS_T_TXT asks grep/next to scan for TXT v=spf1 or SPF  */
-	GREP(&sub);
 	L0(&sub);
 	NEXT(&sub);
 	DUP(&sub);
@@ -2939,20 +4012,16 @@ static void op_check(struct spf_vm *vm) {
 	POP(&sub);
 	DUP(&sub);
 	I8(&sub, vm->spf->opt.lookup[1]);
-	SUBMIT(&sub);
-	FETCH(&sub);
+	NEG(&sub); /* -DNS_T_TXT asks query/next to scan for TXT v=spf1 or SPF  */
+	QUERY(&sub);
 
 	/*
-	 * [-4] reset address
-	 * [-3] return address
-	 * [-2] domain
-	 * [-1] packet
+	 * [-5] reset address
+	 * [-4] return address
+	 * [-3] domain
+	 * [-2] packet
+	 * [-1] iterator
 	 */
-	NIL(&sub);
-	TWO(&sub);
-	I8(&sub, vm->spf->opt.lookup[1]);
-	NEG(&sub); /* -DNS_T_TXT asks grep/next to scan for TXT v=spf1 or SPF  */
-	GREP(&sub);
 	L3(&sub);
 	NEXT(&sub);
 	DUP(&sub);
@@ -3020,20 +4089,111 @@ L6:	L6(&sub);
 } /* op_check() */
 
 
+/*
+ * Emit OP_PREFETCH for the include, redirect and exists targets of a
+ * policy which need no macro expansion, so their queries are in flight
+ * before the first term is evaluated. a, mx and ptr are resolved through
+ * dns_ai and cannot be served from prefetched answers.
+ */
+static void comp_prefetch(struct spf_vm *vm, const char *txt) {
+	struct spf_resolver *spf = vm->spf;
+	struct spf_parser parser;
+	union spf_term term;
+	unsigned char buf[SPF_PREFETCH_MAX * (SPF_MAXDN + 2) + 1];
+	unsigned n = 0, lim;
+	size_t p = 0, len;
+	const char *dn;
+	int qtype, type, error;
+
+	/* only as many as the terms left can use */
+	lim = (spf->stat.query.terms < spf->opt.limit.query.terms)? spf->opt.limit.query.terms - spf->stat.query.terms : 0;
+	lim = SPF_MIN(lim, spf->opt.prefetch);
+	lim = SPF_MIN(lim, SPF_PREFETCH_MAX);
+
+	spf_parser_init(&parser, txt, strlen(txt));
+
+	while (n < lim && (type = spf_parse(&term, &parser, &error))) {
+		if (term.macros)
+			continue;
+
+		switch (type) {
+		case SPF_INCLUDE:
+			dn = term.include.domain;
+			qtype = spf->opt.lookup[0];
+			break;
+		case SPF_REDIRECT:
+			dn = term.redirect.domain;
+			qtype = spf->opt.lookup[0];
+			break;
+		case SPF_EXISTS:
+			dn = term.exists.domain;
+			qtype = DNS_T_A;
+			break;
+		default:
+			continue;
+		}
+
+		if (!*dn || qtype <= 0 || qtype > UCHAR_MAX)
+			continue;
+
+		len = strlen(dn) + 1;
+		buf[p++] = qtype;
+		memcpy(&buf[p], dn, len);
+		p += len;
+		n++;
+	}
+
+	buf[p] = 0;
+
+	/* don't crowd out the code of nested policies */
+	if (n && p + 2 <= (spf_lengthof(vm->code) - vm->end) / 4)
+		vm_emit(vm, OP_PREFETCH, (intptr_t)buf);
+} /* comp_prefetch() */
+
+
+/*
+ * Emit code pushing a target domain-spec. FCRD leaves the stack alone, so
+ * it can precede the expansion and let the string be expanded in place.
+ */
+static void comp_domain(struct vm_sub *sub, const char *dn, spf_macros_t macros) {
+	if (!macros) {
+		STR(sub, (intptr_t)dn);
+
+		return;
+	}
+
+	if (spf_isset(macros, 'p'))
+		FCRD(sub);
+
+	STREXP(sub, (intptr_t)dn);
+} /* comp_domain() */
+
+
 static void op_comp(struct spf_vm *vm) {
 	struct spf_parser parser;
 	union spf_term term;
 	struct spf_exp exp = { 0 };
 	struct spf_redirect redir = { 0 };
 	struct vm_sub sub;
+	struct spf_pcache *pc = vm->spf->opt.pcache;
 	const char *txt;
 	int type, error;
 	unsigned end;
+	size_t len;
 
 	end = vm->end;
 
 	vm_assert(vm, (txt = (char *)vm_peek(vm, -1, T_REF|T_MEM)), EINVAL);
 
+	if (pc && (len = pcache_get(pc, vm->spf->env.d, txt, &vm->code[end], spf_lengthof(vm->code) - end))) {
+		vm->end += len;
+
+		goto done;
+	}
+
+	if (vm->spf->opt.prefetch)
+		comp_prefetch(vm, txt);
+
 	spf_parser_init(&parser, txt, strlen(txt));
 
 	/*
@@ -3060,12 +4220,7 @@ static void op_comp(struct spf_vm *vm) {
 			I8(&sub, 'd');
 			GETENV(&sub);
 
-			STR(&sub, (intptr_t)&term.include.domain[0]);
-			if (term.macros) {
-				if (spf_isset(term.macros, 'p'))
-					FCRD(&sub);
-				EXPAND(&sub);
-			}
+			comp_domain(&sub, &term.include.domain[0], term.macros);
 			DUP(&sub);
 			I8(&sub, 'd');
 			SETENV(&sub);
@@ -3093,27 +4248,19 @@ static void op_comp(struct spf_vm *vm) {
 			I8(&sub, term.mx.prefix6);
 			I8(&sub, term.mx.prefix4);
 			if (term.mx.domain[0]) {
-				STR(&sub, (intptr_t)&term.mx.domain[0]);
-				if (term.macros) {
-					if (spf_isset(term.macros, 'p'))
-						FCRD(&sub);
-					EXPAND(&sub);
-				}
+				comp_domain(&sub, &term.mx.domain[0], term.macros);
 			} else {
-				STR(&sub, (intptr_t)"%{d}");
-				EXPAND(&sub);
+				STREXP(&sub, (intptr_t)"%{d}");
 			}
 			sub_emit(&sub, (type == SPF_A)? OP_A : OP_MX);
 			break;
 		case SPF_PTR:
-			FCRD(&sub);
+			/* OP_PTR waits on the names it needs itself */
+			RDNS(&sub);
 			if (term.ptr.domain[0]) {
-				STR(&sub, (intptr_t)&term.ptr.domain[0]);
-				if (term.macros)
-					EXPAND(&sub);
+				comp_domain(&sub, &term.ptr.domain[0], term.macros);
 			} else {
-				STR(&sub, (intptr_t)"%{d}");
-				EXPAND(&sub);
+				STREXP(&sub, (intptr_t)"%{d}");
 			}
 			sub_emit(&sub, OP_PTR);
 			break;
@@ -3128,18 +4275,15 @@ static void op_comp(struct spf_vm *vm) {
 			sub_emit(&sub, OP_IP6);
 			break;
 		case SPF_EXISTS:
-			STR(&sub, (intptr_t)&term.exists.domain[0]);
-			if (term.macros) {
-				if (spf_isset(term.macros, 'p'))
-					FCRD(&sub);
-				EXPAND(&sub);
-			}
+			comp_domain(&sub, &term.exists.domain[0], term.macros);
 			sub_emit(&sub, OP_EXISTS);
 			break;
 		case SPF_EXP:
 			if (exp.type) {
 				vm_assert(vm, spf_expand(vm->spf->info.error.exp, sizeof vm->spf->info.error.exp, &(spf_macros_t){ 0 }, "multiple exp terms in %{d} policy", &vm->spf->env, &error), error);
 				vm_throw(vm, SPF_EBADPOLICY);
+
+				return;
 			}
 			exp = term.exp;
 			continue;
@@ -3147,6 +4291,8 @@ static void op_comp(struct spf_vm *vm) {
 			if (redir.type) {
 				vm_assert(vm, spf_expand(vm->spf->info.error.exp, sizeof vm->spf->info.error.exp, &(spf_macros_t){ 0 }, "multiple redirect terms in %{d} policy", &vm->spf->env, &error), error);
 				vm_throw(vm, SPF_EBADPOLICY);
+
+				return;
 			}
 			redir = term.redirect;
 			continue;
@@ -3190,18 +4336,15 @@ static void op_comp(struct spf_vm *vm) {
 		spf_strlcpy(vm->spf->info.error.exp, exp.str, sizeof vm->spf->info.error.exp);
 
 		vm_throw(vm, error);
+
+		return;
 	}
 
 	if (redir.type) {
 		I8(&sub, 'd');
 		GETENV(&sub);
 
-		STR(&sub, (intptr_t)&redir.domain[0]);
-		if (redir.macros) {
-			if (spf_isset(redir.macros, 'p'))
-				FCRD(&sub);
-			EXPAND(&sub);
-		}
+		comp_domain(&sub, &redir.domain[0], redir.macros);
 		DUP(&sub);
 		I8(&sub, 'd');
 		SETENV(&sub);
@@ -3263,12 +4406,7 @@ static void op_comp(struct spf_vm *vm) {
 	POP(&sub);  /* otherwise discard the NIL exp */
 
 	if (exp.type) {
-		STR(&sub, (intptr_t)&exp.domain[0]);
-		if (exp.macros) {
-			if (spf_isset(exp.macros, 'p'))
-				FCRD(&sub);
-			EXPAND(&sub);
-		}
+		comp_domain(&sub, &exp.domain[0], exp.macros);
 		sub_emit(&sub, OP_EXP);
 		SWAP(&sub);
 	} else {
@@ -3293,7 +4431,11 @@ static void op_comp(struct spf_vm *vm) {
 	TRAP(&sub);
 
 	sub_link(&sub);
+	vm_unwind(vm);
 
+	if (pc)
+		pcache_put(pc, vm->spf->env.d, txt, &vm->code[end], vm->end - end, vm->spf->policy.ttl);
+done:
 	/*
 	 * We should always be called in conjunction with OP_CHECK. OP_COMP
 	 * returns the address of the new code, which OP_CHECK will jump
@@ -3307,18 +4449,42 @@ static void op_comp(struct spf_vm *vm) {
 } /* op_comp() */
 
 
+/*
+ * Parse the client address once per check rather than once per ip4 or
+ * ip6 term.
+ */
+static int vm_client(struct spf_vm *vm) {
+	struct spf_resolver *spf = vm->spf;
+
+	if (spf->client.done)
+		return spf->client.af;
+
+	if (!strcmp(spf->env.v, "ip6")) {
+		spf->client.af = AF_INET6;
+		spf_pto6(&spf->client.a6, spf->env.i);
+	} else if (!strcmp(spf->env.v, "in-addr")) {
+		spf->client.af = AF_INET;
+		spf_pto4(&spf->client.a4, spf->env.i);
+	} else
+		spf->client.af = AF_UNSPEC;
+
+	spf->client.done = 1;
+
+	return spf->client.af;
+} /* vm_client() */
+
+
 static void op_ip4(struct spf_vm *vm) {
-	struct in_addr a, b;
+	struct in_addr a;
 	unsigned prefix;
 	int match;
 
 	prefix   = vm_pop(vm, T_INT);
 	a.s_addr = vm_pop(vm, T_INT);
 
-	if (!strcmp(vm->spf->env.v, "in-addr")) {
-		spf_pto4(&b, vm->spf->env.i);
-		match = (0 == spf_4cmp(&a, &b, prefix));
-	} else
+	if (AF_INET == vm_client(vm))
+		match = (0 == spf_4cmp(&a, &vm->spf->client.a4, prefix));
+	else
 		match = 0;
 
 	vm_push(vm, T_INT, match);
@@ -3328,17 +4494,17 @@ static void op_ip4(struct spf_vm *vm) {
 
 
 static void op_ip6(struct spf_vm *vm) {
-	struct in6_addr *a, b;
+	struct in6_addr *a;
 	unsigned prefix;
 	int match;
 
 	a = (struct in6_addr *)vm_peek(vm, -2, T_REF|T_MEM);
 	prefix = vm_peek(vm, -1, T_INT);
+	vm_unwind(vm);
 
-	if (!strcmp(vm->spf->env.v, "ip6")) {
-		spf_pto6(&b, vm->spf->env.i);
-		match = (0 == spf_6cmp(a, &b, prefix));
-	} else
+	if (AF_INET6 == vm_client(vm))
+		match = (0 == spf_6cmp(a, &vm->spf->client.a6, prefix));
+	else
 		match = 0;
 
 	vm_discard(vm, 2);
@@ -3353,6 +4519,7 @@ static void op_exists(struct spf_vm *vm) {
 	unsigned end, ret;
 
 	lim_checkterms(vm, 1);
+	vm_unwind(vm);
 
 	end = vm->end;
 	ret = vm->pc + 1;
@@ -3365,12 +4532,7 @@ static void op_exists(struct spf_vm *vm) {
 	 * [-1] domain
 	 */
 	I8(&sub, DNS_T_A);
-	SUBMIT(&sub);
-	FETCH(&sub);
-	NIL(&sub);
-	TWO(&sub);
-	I8(&sub, DNS_T_A);
-	GREP(&sub);
+	QUERY(&sub);
 	NEXT(&sub);
 
 	/*
@@ -3407,6 +4569,8 @@ static void op_a_mxv(struct spf_vm *vm) {
 	union { struct in_addr a4; struct in6_addr a6; } a, b;
 	int af, prefix, match = 0;
 
+	vm_unwind(vm);
+
 	if (!strcmp(vm->spf->env.v, "ip6")) {
 		af     = AF_INET6;
 		prefix = prefix6;
@@ -3506,75 +4670,244 @@ static void op_a_mx(struct spf_vm *vm, enum dns_type type) {
 
 static void op_a(struct spf_vm *vm) {
 	lim_checkterms(vm, 1);
+	vm_unwind(vm);
 	op_a_mx(vm, (!strcmp(vm->spf->env.v, "ip6"))? DNS_T_AAAA : DNS_T_A);
 } /* op_a() */
 
 
 static void op_mx(struct spf_vm *vm) {
 	lim_checkterms(vm, 1);
+	vm_unwind(vm);
 	op_a_mx(vm, DNS_T_MX);
 } /* op_mx() */
 
 
+/*
+ * Collect finished forward confirmations. A name is confirmed if any of
+ * its A or AAAA records equals the client address; per RFC 7208 5.5 a
+ * failed lookup merely leaves the name unconfirmed.
+ */
+static void fcrd_poll(struct spf_vm *vm) {
+	struct spf_resolver *spf = vm->spf;
+	struct spf_fcrd *name;
+	struct dns_packet *P;
+	struct dns_rr rr;
+	union { struct dns_a a; struct dns_aaaa aaaa; } rd;
+	int af = vm_client(vm), error;
+	unsigned i;
+
+	for (i = 0; i < spf->fcrd.count; i++) {
+		name = &spf->fcrd.name[i];
+
+		if (name->state || EAGAIN == (error = dns_res_check(name->res)))
+			continue;
+
+		name->state = -1;
+
+		if (error || !(P = dns_res_fetch(name->res, &error)))
+			continue;
+
+		if (spf->opt.vcache)
+			spf->verdict.ttl = dns_p_minttl(P, spf->verdict.ttl);
+
+		dns_rr_foreach(&rr, P, .section = DNS_S_AN, .type = (af == AF_INET6)? DNS_T_AAAA : DNS_T_A) {
+			if (af == AF_INET6) {
+				if (!dns_aaaa_parse(&rd.aaaa, &rr, P) && !memcmp(&rd.aaaa.addr, &spf->client.a6, sizeof spf->client.a6))
+					name->state = 1;
+			} else {
+				if (!dns_a_parse(&rd.a, &rr, P) && rd.a.addr.s_addr == spf->client.a4.s_addr)
+					name->state = 1;
+			}
+
+			if (name->state > 0)
+				break;
+		}
+
+		dns_p_free(P);
+	}
+} /* fcrd_poll() */
+
+
+static _Bool fcrd_within(const char *dn, const char *host) {
+	char cn[DNS_D_MAXNAME + 1];
+
+	spf_strlcpy(cn, host, sizeof cn);
+
+	do {
+		if (!strcasecmp(dn, cn))
+			return 1;
+	} while (spf_fixdn(cn, cn, sizeof cn, SPF_DN_SUPER));
+
+	return 0;
+} /* fcrd_within() */
+
+
+/*
+ * Matches once any name within the target domain is confirmed, without
+ * waiting on the others. Only names within the domain are waited on.
+ */
 static void op_ptr(struct spf_vm *vm) {
+	struct spf_resolver *spf = vm->spf;
+	struct spf_fcrd *name, *pending = NULL;
 	const char *arg;
-	struct dns_rr rr;
-	char dn[DNS_D_MAXNAME + 1], cn[DNS_D_MAXNAME + 1];
-	int error, match = 0;
+	char dn[DNS_D_MAXNAME + 1];
+	unsigned i;
+	int match = 0;
 
 	lim_checkterms(vm, 0);
+	vm_unwind(vm);
 
-	vm_assert(vm, vm->spf->fcrd.done, EFAULT);
+	vm_assert(vm, spf->fcrd.done, EFAULT);
 	vm_assert(vm, (arg = (char *)vm_peek(vm, -1, T_REF|T_MEM)), EFAULT);
 
 	spf_strlcpy(dn, arg, sizeof dn);
 	spf_fixdn(dn, dn, sizeof dn, SPF_DN_ANCHOR);
 
-	dns_rr_foreach(&rr, &vm->spf->fcrd.ptr, .section = DNS_S_ANSWER) {
-		vm_assert(vm, dns_d_expand(cn, sizeof cn, rr.dn.p, &vm->spf->fcrd.ptr, &error), error);
+	fcrd_poll(vm);
 
-		do {
-			if ((match = !strcasecmp(dn, cn)))
-				goto done;
-		} while (spf_fixdn(cn, cn, sizeof cn, SPF_DN_SUPER));
+	for (i = 0; i < spf->fcrd.count; i++) {
+		name = &spf->fcrd.name[i];
+
+		if (name->state < 0 || !fcrd_within(dn, name->host))
+			continue;
+
+		if ((match = (name->state > 0)))
+			goto done;
+
+		if (!pending)
+			pending = name;
 	}
 
+	spf->fcrd.waiting = (pending)? pending->res : NULL;
+	vm_assert(vm, !pending, EAGAIN);
 done:
+	spf->fcrd.waiting = NULL;
+
 	vm_discard(vm, 1);
 	vm_push(vm, T_INT, match);
 
-	vm->spf->stat.query.terms++;
+	spf->stat.query.terms++;
 	vm->pc++;
 } /* op_ptr() */
 
 
-static void op_fcrdx(struct spf_vm *vm) {
-	struct addrinfo *ent = (void *)vm_peek(vm, -1, T_REF|T_MEM);
-	union { struct in_addr a4; struct in6_addr a6; } a, b;
-	int af, rtype, error;
+/*
+ * Issue the forward lookups for every PTR name at once.
+ */
+static void fcrd_submit(struct spf_vm *vm, struct dns_packet *P) {
+	struct spf_resolver *spf = vm->spf;
+	struct spf_fcrd *name;
+	struct dns_rr rr;
+	struct dns_ptr ptr;
+	int qtype, error;
 
-	if (!strcmp(vm->spf->env.v, "ip6")) {
-		af    = AF_INET6;
-		rtype = DNS_T_AAAA;
-	} else {
-		af    = AF_INET;
-		rtype = DNS_T_A;
+	qtype = (AF_INET6 == vm_client(vm))? DNS_T_AAAA : DNS_T_A;
+
+	dns_rr_foreach(&rr, P, .section = DNS_S_AN, .type = DNS_T_PTR) {
+		if (spf->fcrd.count >= SPF_MIN(spf_lengthof(spf->fcrd.name), spf->opt.limit.query.cnames))
+			break;
+
+		if (dns_ptr_parse(&ptr, &rr, P))
+			continue;
+
+		name = &spf->fcrd.name[spf->fcrd.count];
+
+		if (!name->res && !(name->res = dns_res_clone(spf->res, &error)))
+			goto error;
+
+		spf_strlcpy(name->host, ptr.host, sizeof name->host);
+
+		if ((error = dns_res_submit(name->res, name->host, qtype, DNS_C_IN)))
+			goto error;
+
+		SPF_SAY("confirming %s IN %s", name->host, dns_strtype(qtype));
+
+		name->state = 0;
+		spf->fcrd.count++;
 	}
 
-	if (ent->ai_addr->sa_family != af)
-		goto done;
+	dns_p_free(P);
 
-	spf_pton(&a, af, vm->spf->env.c);
+	return;
+error:
+	dns_p_free(P);
 
-	if (af == AF_INET6)
-		b.a6 = ((struct sockaddr_in6 *)ent->ai_addr)->sin6_addr;
-	else
-		b.a4 = ((struct sockaddr_in *)ent->ai_addr)->sin_addr;
+	vm_throw(vm, error);
+} /* fcrd_submit() */
 
-	if (0 != spf_addrcmp(af, &a, &b, 128))
-		goto done;
-	
-	vm_assert(vm, !(error = dns_p_push(&vm->spf->fcrd.ptr, DNS_S_AN, ent->ai_canonname, strlen(ent->ai_canonname), rtype, DNS_C_IN, 0, &b)), error);
+
+/*
+ * Resolve the PTR names and submit their forward confirmations, without
+ * waiting on any. A failed PTR lookup leaves no names, as RFC 7208 5.5
+ * requires.
+ */
+static void fcrd_names(struct spf_vm *vm) {
+	struct spf_resolver *spf = vm->spf;
+	struct dns_packet *P;
+	char qname[DNS_D_MAXNAME + 1];
+	int error;
+
+	if (spf->fcrd.done)
+		return;
+
+	if (!spf->fcrd.submitted) {
+		vm_expand(vm, qname, sizeof qname, "%{ir}.%{v}.arpa.");
+		vm_unwind(vm);
+
+		SPF_SAY("querying %s IN PTR", qname);
+
+		vm_assert(vm, !(error = dns_res_submit(spf->res, qname, DNS_T_PTR, DNS_C_IN)), error);
+
+		spf->fcrd.submitted = 1;
+	}
+
+	vm_assert(vm, EAGAIN != (error = dns_res_check(spf->res)), error);
+
+	spf->fcrd.submitted = 0;
+	spf->fcrd.done = 1;
+
+	if (error || AF_UNSPEC == vm_client(vm) || !(P = dns_res_fetch(spf->res, &error)))
+		return;
+
+	if (spf->opt.vcache)
+		spf->verdict.ttl = dns_p_minttl(P, spf->verdict.ttl);
+
+	fcrd_submit(vm, P);
+} /* fcrd_names() */
+
+
+static void op_rdns(struct spf_vm *vm) {
+	fcrd_names(vm);
+	vm_unwind(vm);
+
+	vm->pc++;
+} /* op_rdns() */
+
+
+/*
+ * Confirm the PTR names concurrently, finishing once %{p} is settled:
+ * the first name, in PTR order, which is confirmed.
+ */
+static void op_fcrd(struct spf_vm *vm) {
+	struct spf_resolver *spf = vm->spf;
+	unsigned i;
+
+	fcrd_names(vm);
+	vm_unwind(vm);
+
+	fcrd_poll(vm);
+
+	for (i = 0; i < spf->fcrd.count; i++) {
+		if (spf->fcrd.name[i].state > 0)
+			break;
+
+		if (!spf->fcrd.name[i].state) {
+			spf->fcrd.waiting = spf->fcrd.name[i].res;
+			vm_throw(vm, EAGAIN);
+
+			return;
+		}
+	}
 
 	/*
 	 * FIXME: We need to give preference to a verified domain which is
@@ -3582,58 +4915,16 @@ static void op_fcrdx(struct spf_vm *vm) {
 	 * require= recursion temporarily replace %{d}, so we need to copy
 	 * the _original_ %{d} somewhere for comparing.
 	 */
-	if (!*vm->spf->env.p || !strcmp(vm->spf->env.p, "unknown"))
-		spf_strlcpy(vm->spf->env.p, ent->ai_canonname, sizeof vm->spf->env.p);
-done:
-	vm_discard(vm, 1);
+	if (i < spf->fcrd.count && (!*spf->env.p || !strcmp(spf->env.p, "unknown")))
+		spf_strlcpy(spf->env.p, spf->fcrd.name[i].host, sizeof spf->env.p);
+
+	spf->fcrd.waiting = NULL;
 
 	vm->pc++;
-} /* op_fcrdx() */
+} /* op_fcrd() */
 
 
-static void op_fcrd(struct spf_vm *vm) {
-	struct vm_sub sub;
-	unsigned end, ret;
-
-	if (vm->spf->fcrd.done)
-		{ vm->pc++; return; }
-
-	end = vm->end;
-	ret = vm->pc + 1;
-
-	sub_init(&sub, vm);
-
-	REF(&sub, (intptr_t)"%{ir}.%{v}.arpa.");
-	EXPAND(&sub);
-	I8(&sub, 0);
-	I8(&sub, DNS_T_PTR);
-	I8(&sub, (!strcmp(vm->spf->env.v, "ip6"))? PF_INET6 : PF_INET);
-	sub_emit(&sub, OP_ADDRINFO);
-	L0(&sub);
-	sub_emit(&sub, OP_NEXTENT);
-	DUP(&sub);
-	NOT(&sub);
-	J1(&sub);
-	FCRDx(&sub);
-	TRUE(&sub);
-	J0(&sub);
-	L1(&sub);
-	POP(&sub);
-	ZERO(&sub);
-	EXIT(&sub); /* [-1] return address [-2] reset address */
-
-	sub_link(&sub);
-
-	vm->spf->fcrd.done = 1;
-
-	vm_push(vm, T_INT, end);
-	vm_push(vm, T_INT, ret);
-
-	vm->pc = end;
-} /* op_fcrd() */
-
-
-static void op_exp(struct spf_vm *vm) {
+static void op_exp(struct spf_vm *vm) {
 	struct vm_sub sub;
 	unsigned end, ret;
 
@@ -3648,12 +4939,7 @@ static void op_exp(struct spf_vm *vm) {
 	 */
 	L0(&sub);
 	I8(&sub, DNS_T_TXT);
-	SUBMIT(&sub);
-	FETCH(&sub);
-	REF(&sub, (intptr_t)"");
-	I8(&sub, DNS_S_AN);
-	I8(&sub, DNS_T_TXT);
-	GREP(&sub);
+	QUERY(&sub);
 	NEXT(&sub); // pops 0, pushes rdata (rdata could be NULL)
 	SWAP(&sub);
 	POP(&sub);  // discard grep iterator
@@ -3726,9 +5012,12 @@ static void op_gets(struct spf_vm *vm) {
 		vm_strdup(vm, sbuf);
 	} else if (feof(stdin)) {
 		vm_push(vm, T_REF, 0);
-	} else
+	} else {
 		vm_throw(vm, errno);
 
+		return;
+	}
+
 	vm->pc++;
 } /* op_gets() */
 
@@ -3761,6 +5050,7 @@ static void op_cmp(struct spf_vm *vm) {
 	int cmp;
 	a = (char *)vm_peek(vm, -2, T_REF|T_MEM);
 	b = (char *)vm_peek(vm, -1, T_REF|T_MEM);
+	vm_unwind(vm);
 	cmp = strcmp(a, b);
 	vm_discard(vm, 2);
 	vm_push(vm, T_INT, cmp);
@@ -3771,7 +5061,10 @@ static void op_cmp(struct spf_vm *vm) {
 static void op_lc(struct spf_vm *vm) {
 	char *s;
 	s = (char *)vm_peek(vm, -1, T_REF|T_MEM);
-	spf_tolower((char *)vm_strdup(vm, s));
+	vm_unwind(vm);
+	s = (char *)vm_strdup(vm, s);
+	vm_unwind(vm);
+	spf_tolower(s);
 	vm_swap(vm);
 	vm_pop(vm, T_REF|T_MEM);
 	vm->pc++;
@@ -3788,7 +5081,10 @@ static void op_puti(struct spf_vm *vm) {
 
 
 static void op_puts(struct spf_vm *vm) {
-	printf("%s\n", (char *)vm_peek(vm, -1, T_REF|T_MEM));
+	const char *s = (char *)vm_peek(vm, -1, T_REF|T_MEM);
+
+	vm_unwind(vm);
+	printf("%s\n", s);
 	vm_pop(vm, T_ANY);
 	vm->pc++;
 } /* op_puts() */
@@ -3802,6 +5098,8 @@ static void op_putp(struct spf_vm *vm) {
 	char pretty[1024];
 	size_t len;
 
+	vm_unwind(vm);
+
 	section	= 0;
 
 	dns_rr_foreach(&rr, pkt) {
@@ -3824,6 +5122,8 @@ static void op_puta(struct spf_vm *vm) {
 	struct addrinfo *ent = (void *)vm_peek(vm, -1, T_REF|T_MEM);
 	char pretty[1024];
 
+	vm_unwind(vm);
+
 	dns_ai_print(pretty, sizeof pretty, ent, vm->spf->ai.res);
 	printf("%s", pretty);
 
@@ -3841,9 +5141,12 @@ static void op_rstr(struct spf_vm *vm) {
 
 
 static void op_atoi(struct spf_vm *vm) {
+	const char *s = (char *)vm_peek(vm, -1, T_REF|T_MEM);
 	unsigned long i;
 
-	i = spf_atoi((char *)vm_peek(vm, -1, T_REF|T_MEM));
+	vm_unwind(vm);
+
+	i = spf_atoi(s);
 	vm_pop(vm, T_REF|T_MEM);
 	vm_push(vm, T_INT, i);
 
@@ -3852,9 +5155,12 @@ static void op_atoi(struct spf_vm *vm) {
 
 
 static void op_4top(struct spf_vm *vm) {
+	void *src = (void *)vm_peek(vm, -1, T_REF|T_MEM);
 	char sbuf[INET_ADDRSTRLEN + 1];
 
-	spf_4top(sbuf, sizeof sbuf, (void *)vm_peek(vm, -1, T_REF|T_MEM));
+	vm_unwind(vm);
+
+	spf_4top(sbuf, sizeof sbuf, src);
 	vm_pop(vm, T_REF|T_MEM);
 	vm_strdup(vm, sbuf);
 
@@ -3863,9 +5169,12 @@ static void op_4top(struct spf_vm *vm) {
 
 
 static void op_pto4(struct spf_vm *vm) {
+	void *src = (void *)vm_peek(vm, -1, T_REF|T_MEM);
 	struct in_addr in;
 
-	spf_pto4(&in, (void *)vm_peek(vm, -1, T_REF|T_MEM));
+	vm_unwind(vm);
+
+	spf_pto4(&in, src);
 	vm_pop(vm, T_REF|T_MEM);
 	vm_memdup(vm, &in, sizeof in);
 
@@ -3874,9 +5183,12 @@ static void op_pto4(struct spf_vm *vm) {
 
 
 static void op_6top(struct spf_vm *vm) {
+	void *src = (void *)vm_peek(vm, -1, T_REF|T_MEM);
 	char sbuf[INET6_ADDRSTRLEN + 1];
 
-	spf_6top(sbuf, sizeof sbuf, (void *)vm_peek(vm, -1, T_REF|T_MEM), SPF_6TOP_MIXED);
+	vm_unwind(vm);
+
+	spf_6top(sbuf, sizeof sbuf, src, SPF_6TOP_MIXED);
 	vm_pop(vm, T_REF|T_MEM);
 	vm_strdup(vm, sbuf);
 
@@ -3885,9 +5197,12 @@ static void op_6top(struct spf_vm *vm) {
 
 
 static void op_pto6(struct spf_vm *vm) {
+	void *src = (void *)vm_peek(vm, -1, T_REF|T_MEM);
 	struct in6_addr in;
 
-	spf_pto6(&in, (void *)vm_peek(vm, -1, T_REF|T_MEM));
+	vm_unwind(vm);
+
+	spf_pto6(&in, src);
 	vm_pop(vm, T_REF|T_MEM);
 	vm_memdup(vm, &in, sizeof in);
 
@@ -3960,12 +5275,15 @@ static const struct {
 
 	[OP_EXPAND] = { "expand", &op_expand, },
 	[OP_ISSET]  = { "isset", &op_isset, },
+	[OP_STREXP] = { "strexp", &op_strexp, },
 
 	[OP_SUBMIT] = { "submit", &op_submit, },
 	[OP_FETCH]  = { "fetch", &op_fetch, },
 	[OP_QNAME]  = { "qname", &op_qname, },
 	[OP_GREP]   = { "grep", &op_grep, },
 	[OP_NEXT]   = { "next", &op_next, },
+	[OP_PREFETCH] = { "prefetch", &op_prefetch, },
+	[OP_QUERY]  = { "query", &op_query, },
 
 	[OP_ADDRINFO] = { "addrinfo", &op_addrinfo, },
 	[OP_NEXTENT]  = { "nextent", &op_nextent, },
@@ -3978,8 +5296,8 @@ static const struct {
 	[OP_A_MXv]  = { "mxv", &op_a_mxv },
 	[OP_PTR]    = { "ptr", &op_ptr },
 
+	[OP_RDNS]  = { "rdns", &op_rdns, },
 	[OP_FCRD]  = { "fcrd", &op_fcrd, },
-	[OP_FCRDx] = { "fcrdx", &op_fcrdx, },
 
 	[OP_CHECK]  = { "check", &op_check, },
 	[OP_COMP]   = { "comp", &op_comp, },
@@ -4007,7 +5325,7 @@ static const struct {
 }; /* vm_op[] */
 
 SPF_NOTUSED static const char *vm_strcode(int code) {
-	return vm_op[code].name;
+	return (code < (int)spf_lengthof(vm_op) && vm_op[code].name)? vm_op[code].name : "?";
 } /* vm_strcode() */
 
 static int vm_icode(const char *name) {
@@ -4022,23 +5340,94 @@ static int vm_icode(const char *name) {
 } /* vm_icode() */
 
 
+/*
+ * With GCC's labels-as-values each hot instruction gets its own indirect
+ * jump and a direct call the compiler can inline. Everything else goes
+ * through vm_op[] as before.
+ */
+#if !defined VM_THREADED
+#if __GNUC__
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+#endif
+
+static void vm_generic(struct spf_vm *vm, enum vm_opcode code) {
+	vm_assert(vm, code < spf_lengthof(vm_op) && vm_op[code].exec, SPF_EVMFAULT);
+
+	vm_op[code].exec(vm);
+} /* vm_generic() */
+
 static int vm_exec(struct spf_vm *vm) {
 	enum vm_opcode code;
 	int error;
 
-	if ((error = _setjmp(vm->trap))) {
-		SPF_SAY("trap: %s", spf_strerror(error));
-		return error;
-	}
+#if VM_THREADED
+#define VM_OP(op, f) [OP_##op] = &&L_##op
+	static void *const label[256] = {
+		[0 ... 255] = &&L_GENERIC,
+		[OP_HALT] = &&L_HALT,
+		VM_OP(TRUE, op_lit), VM_OP(FALSE, op_lit), VM_OP(ZERO, op_lit),
+		VM_OP(ONE, op_lit), VM_OP(TWO, op_lit), VM_OP(THREE, op_lit),
+		VM_OP(I8, op_lit), VM_OP(I16, op_lit), VM_OP(I32, op_lit),
+		VM_OP(NIL, op_lit), VM_OP(REF, op_lit), VM_OP(MEM, op_lit),
+		VM_OP(STR, op_str), VM_OP(STREXP, op_strexp),
+		VM_OP(NOT, op_not), VM_OP(NEG, op_neg), VM_OP(EQ, op_eq),
+		VM_OP(JMP, op_jmp), VM_OP(GOTO, op_goto),
+		VM_OP(POP, op_pop), VM_OP(DUP, op_dup), VM_OP(SWAP, op_swap),
+		VM_OP(GETENV, op_getenv), VM_OP(SETENV, op_setenv),
+		VM_OP(EXPAND, op_expand), VM_OP(QUERY, op_query),
+		VM_OP(NEXT, op_next), VM_OP(IP4, op_ip4), VM_OP(IP6, op_ip6),
+		VM_OP(EXIT, op_exit),
+	};
+#undef VM_OP
 
+#define VM_NEXT() do { \
+	code = vm_opcode(vm); \
+	vm->count++; \
+	if (spf_unlikely(SPF_DEBUG >= 2)) { \
+		SPF_SAY("code: %-7s (%u)", vm_strcode(code), vm->pc); \
+	} \
+	goto *label[code]; \
+} while (0)
+#define VM_OP(op, f) L_##op: f(vm); VM_NEXT()
+
+	VM_NEXT();
+
+	VM_OP(TRUE, op_lit); VM_OP(FALSE, op_lit); VM_OP(ZERO, op_lit);
+	VM_OP(ONE, op_lit); VM_OP(TWO, op_lit); VM_OP(THREE, op_lit);
+	VM_OP(I8, op_lit); VM_OP(I16, op_lit); VM_OP(I32, op_lit);
+	VM_OP(NIL, op_lit); VM_OP(REF, op_lit); VM_OP(MEM, op_lit);
+	VM_OP(STR, op_str); VM_OP(STREXP, op_strexp);
+	VM_OP(NOT, op_not); VM_OP(NEG, op_neg); VM_OP(EQ, op_eq);
+	VM_OP(JMP, op_jmp); VM_OP(GOTO, op_goto);
+	VM_OP(POP, op_pop); VM_OP(DUP, op_dup); VM_OP(SWAP, op_swap);
+	VM_OP(GETENV, op_getenv); VM_OP(SETENV, op_setenv);
+	VM_OP(EXPAND, op_expand); VM_OP(QUERY, op_query);
+	VM_OP(NEXT, op_next); VM_OP(IP4, op_ip4); VM_OP(IP6, op_ip6);
+	VM_OP(EXIT, op_exit);
+L_GENERIC:
+	vm_generic(vm, code);
+	VM_NEXT();
+L_HALT:
+#undef VM_OP
+#undef VM_NEXT
+#else
 	while ((code = vm_opcode(vm))) {
+		vm->count++;
+
 		if (spf_unlikely(SPF_DEBUG >= 2)) {
-			SPF_SAY("code: %-7s (%u)", vm_op[code].name, vm->pc);
+			SPF_SAY("code: %-7s (%u)", vm_strcode(code), vm->pc);
 		}
-		vm_op[code].exec(vm);
+		vm_generic(vm, code);
 	}
+#endif
 
-	return 0;
+	if ((error = vm_catch(vm)))
+		SPF_SAY("trap: %s", spf_strerror(error));
+
+	return error;
 } /* vm_exec() */
 
 
@@ -4059,6 +5448,26 @@ const struct spf_options spf_defaults = {
 	.lookup = { SPF_RR_TXT, SPF_RR_SPF },
 }; /* spf_defaults */
 
+/*
+ * Per-check initialization shared by spf_open() and spf_reset(). Expects
+ * the VM to be empty.
+ */
+static int spf_init(struct spf_resolver *spf, const struct spf_env *env) {
+	spf->env = *env;
+
+	if (spf->opt.vcache)
+		spf->verdict.env = *env;
+	spf->verdict.macros = 0;
+	spf->verdict.ttl    = SPF_VCACHE_MAXTTL;
+
+	vm_emit(&spf->vm, OP_STREXP, (intptr_t)"%{d}");
+	vm_emit(&spf->vm, OP_CHECK);
+	vm_emit(&spf->vm, OP_HALT);
+
+	return vm_catch(&spf->vm);
+} /* spf_init() */
+
+
 struct spf_resolver *spf_open(const struct spf_env *env, struct dns_resolver *res, const struct spf_options *opts, int *error_) {
 	struct spf_resolver *spf = 0;
 	int error;
@@ -4073,8 +5482,6 @@ struct spf_resolver *spf_open(const struct spf_env *env, struct dns_resolver *re
 
 	spf->opt = (opts)? *opts : spf_defaults;
 
-	spf->env = *env;
-
 	vm_init(&spf->vm, spf);
 
 	if (res) {
@@ -4082,16 +5489,9 @@ struct spf_resolver *spf_open(const struct spf_env *env, struct dns_resolver *re
 	} else if (!(spf->res = dns_res_stub(NULL, &error)))
 		goto error;
 
-	dns_p_init(&spf->fcrd.ptr, sizeof spf->fcrd.buf);
-
-	if ((error = _setjmp(spf->vm.trap)))
+	if ((error = spf_init(spf, env)))
 		goto error;
 
-	vm_emit(&spf->vm, OP_STR, (intptr_t)"%{d}");
-	vm_emit(&spf->vm, OP_EXPAND);
-	vm_emit(&spf->vm, OP_CHECK);
-	vm_emit(&spf->vm, OP_HALT);
-
 	return spf;
 syerr:
 	error = errno;
@@ -4106,21 +5506,104 @@ error:
 
 
 void spf_close(struct spf_resolver *spf) {
+	unsigned i;
+
 	if (!spf)
 		return;
 
+	prefetch_reset(spf);
+
+	for (i = 0; i < spf_lengthof(spf->prefetch.slot); i++)
+		dns_res_close(spf->prefetch.slot[i].res);
+
+	for (i = 0; i < spf_lengthof(spf->fcrd.name); i++)
+		dns_res_close(spf->fcrd.name[i].res);
+
 	dns_res_close(spf->res);
 	dns_ai_close(spf->ai.res);
 
 	vm_discard(&spf->vm, spf->vm.sp);
+	arena_destroy(&spf->vm.arena);
 
 	free(spf);
 } /* spf_close() */
 
 
+int spf_reset(struct spf_resolver *spf, const struct spf_env *env) {
+	prefetch_reset(spf);
+
+	dns_ai_close(spf->ai.res);
+	memset(&spf->ai, 0, sizeof spf->ai);
+
+	vm_discard(&spf->vm, spf->vm.sp);
+	arena_reset(&spf->vm.arena);
+	spf->vm.pc    = 0;
+	spf->vm.end   = 0;
+	spf->vm.busy  = 0;
+	spf->vm.count = 0;
+
+	memset(&spf->stat, 0, sizeof spf->stat);
+	spf->fcrd.submitted = 0;
+	spf->fcrd.done      = 0;
+	spf->fcrd.count     = 0;
+	spf->fcrd.waiting   = NULL;
+	spf->policy.ttl     = 0;
+	spf->client.done    = 0;
+
+	spf->result = 0;
+	spf->exp    = NULL;
+	memset(&spf->info, 0, sizeof spf->info);
+
+	return spf_init(spf, env);
+} /* spf_reset() */
+
+
+static int spf_hit(struct spf_resolver *spf, const struct vcache_verdict *verdict) {
+	char *exp = NULL;
+
+	if (verdict->hasexp) {
+		if (!(exp = arena_get(&spf->vm.arena, strlen(verdict->exp) + 1)))
+			return errno;
+
+		strcpy(exp, verdict->exp);
+	}
+
+	spf->result     = verdict->result;
+	spf->exp        = exp;
+	spf->info.error = verdict->info.error;
+
+	return 0;
+} /* spf_hit() */
+
+
+/*
+ * Only a verdict computed wholly from DNS data and the environment can be
+ * replayed; a temporary error or a read of %{t} pins it to this check.
+ */
+static void spf_keep(struct spf_resolver *spf) {
+	if (spf->result == SPF_TEMPERROR || spf_isset(spf->verdict.macros, 't'))
+		return;
+
+	vcache_put(spf->opt.vcache, &spf->verdict.env, spf->verdict.macros, spf->result, spf->exp, &spf->info, spf->verdict.ttl);
+} /* spf_keep() */
+
+
 int spf_check(struct spf_resolver *spf) {
+	struct vcache_verdict verdict;
+	enum spf_result result;
 	int error;
 
+	if (spf->opt.vcache && !spf->vm.pc && vcache_get(spf->opt.vcache, &spf->env, &verdict))
+		return spf_hit(spf, &verdict);
+
+	/* a Fail carries an explanation, which only the VM evaluates */
+	if (spf->opt.flat && !spf->vm.pc && (result = spf_flat_match(spf->opt.flat, &spf->env)) && result != SPF_FAIL) {
+		spf->result = result;
+		spf->exp = NULL;
+
+		return 0;
+	}
+
 	if ((error = vm_exec(&spf->vm))) {
 		switch (error) {
 		case SPF_EQUERYLIMIT:
@@ -4131,7 +5614,7 @@ int spf_check(struct spf_resolver *spf) {
 			spf->info.error.code = error;
 			spf->result = SPF_PERMERROR;
 
-			return 0;
+			goto done;
 		case SPF_ESERVFAIL:
 			spf->info.error.code = error;
 			spf->result = SPF_TEMPERROR;
@@ -4142,12 +5625,15 @@ int spf_check(struct spf_resolver *spf) {
 		}
 	}
 
-	if ((error = _setjmp(spf->vm.trap)))
-		return error;
-
 	spf->result = vm_peek(&spf->vm, -1, T_INT);
 	spf->exp    = (char *)vm_peek(&spf->vm, -2, T_REF|T_MEM);
 
+	if ((error = vm_catch(&spf->vm)))
+		return error;
+done:
+	if (spf->opt.vcache)
+		spf_keep(spf);
+
 	return 0;
 } /* spf_check() */
 
@@ -4163,185 +5649,1124 @@ const char *spf_exp(struct spf_resolver *spf) {
 
 
 const struct spf_info *spf_info(struct spf_resolver *spf) {
+	spf->info.stat.ops = spf->vm.count;
+
 	return &spf->info;
 } /* spf_info() */
 
 
+/*
+ * While OP_PREFETCH or a forward confirmation waits, report on one of its
+ * outstanding queries. The others are collected on the next spf_check()
+ * in any event.
+ */
+static struct dns_resolver *spf_waiting(struct spf_resolver *spf) {
+	if (spf->prefetch.waiting)
+		return spf->prefetch.waiting;
+
+	return (spf->fcrd.waiting)? spf->fcrd.waiting : spf->res;
+} /* spf_waiting() */
+
+
 int spf_elapsed(struct spf_resolver *spf) {
-	return dns_res_elapsed(spf->res);
+	return dns_res_elapsed(spf_waiting(spf));
 } /* spf_elapsed() */
 
 
 void spf_clear(struct spf_resolver *spf) {
-	dns_res_clear(spf->res);
+	dns_res_clear(spf_waiting(spf));
 } /* spf_clear() */
 
 
 int spf_events(struct spf_resolver *spf) {
-	return dns_res_events(spf->res);
+	return dns_res_events(spf_waiting(spf));
 } /* spf_events() */
 
 
 int spf_pollfd(struct spf_resolver *spf) {
-	return dns_res_pollfd(spf->res);
+	return dns_res_pollfd(spf_waiting(spf));
 } /* spf_pollfd() */
 
 
 int spf_poll(struct spf_resolver *spf, int timeout) {
-	return dns_res_poll(spf->res, timeout);
+	return dns_res_poll(spf_waiting(spf), timeout);
 } /* spf_poll() */
 
 
 
-#if SPF_MAIN
-
-#include <stdlib.h>
-#include <stdio.h>
-
-#include <string.h>
-
-#include <ctype.h>	/* isspace(3) */
-
-#include <unistd.h>	/* getopt(3) */
+/*
+ * P O O L  R O U T I N E S
+ *
+ * Idle resolvers wait on a stack. The mutex only guards the stack and
+ * cloning of the template; a resolver, once handed out, is private to the
+ * caller.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#if SPF_CACHE
-#include "cache.h"
+#ifndef SPF_POOL_LIMIT
+#define SPF_POOL_LIMIT 64
 #endif
 
+struct spf_pool {
+	pthread_mutex_t mutex;
 
-struct {
-	const char *resconf;
-	const char *cache;
-	struct dns_resolver *res;
-} MAIN;
+	struct dns_resolver *res; /* template */
+	struct spf_options opt;
 
+	unsigned nidle, limit;
+	struct spf_resolver *idle[];
+}; /* struct spf_pool */
 
-#define panic_(fn, ln, fmt, ...) \
-	do { fprintf(stderr, fmt "%.1s", (fn), (ln), __VA_ARGS__); _Exit(EXIT_FAILURE); } while (0)
 
-#define panic(...) panic_(__func__, __LINE__, "spf: (%s:%d) " __VA_ARGS__, "\n")
+struct spf_pool *spf_pool_open(struct dns_resolver *res, const struct spf_options *opts, unsigned limit, int *error) {
+	struct spf_pool *P;
 
+	if (!limit)
+		limit = SPF_POOL_LIMIT;
 
-struct dns_cache;
+	if (!(P = calloc(1, sizeof *P + limit * sizeof P->idle[0])))
+		goto syerr;
 
-static struct dns_cache *mkcache(void) {
-#if SPF_CACHE
-	static struct cache *cache;
-	int error;
+	if ((*error = pthread_mutex_init(&P->mutex, NULL)))
+		goto error;
 
-	if (cache)
-		return cache_resi(cache);
+	P->opt   = (opts)? *opts : spf_defaults;
+	P->limit = limit;
 
-	if (!MAIN.cache)
-		return NULL;
+	if (res) {
+		dns_res_acquire(res);
+		P->res = res;
+	} else if (!(P->res = dns_res_stub(NULL, error))) {
+		pthread_mutex_destroy(&P->mutex);
 
-	assert(cache = cache_open(&error));
+		goto error;
+	}
 
-	if ((error = cache_loadpath(cache, MAIN.cache, NULL, 0)))
-		panic("%s: %s", MAIN.cache, strerror(error));
+	return P;
+syerr:
+	*error = errno;
+error:
+	free(P);
 
-	return cache_resi(cache);
-#else
 	return NULL;
-#endif
-} /* mkcache() */
+} /* spf_pool_open() */
 
 
-static struct dns_resolv_conf *mkresconf(void) {
-	static struct dns_resolv_conf *resconf;
-	int error;
+void spf_pool_close(struct spf_pool *P) {
+	if (!P)
+		return;
 
-	if (resconf)
-		return resconf;
+	while (P->nidle)
+		spf_close(P->idle[--P->nidle]);
 
-	if (MAIN.resconf) {
-		assert(resconf = dns_resconf_open(&error));
+	dns_res_close(P->res);
+	pthread_mutex_destroy(&P->mutex);
 
-		if ((error = dns_resconf_loadpath(resconf, MAIN.resconf)))
-			panic("%s: %s", MAIN.resconf, strerror(error));
-	} else {
-		assert(resconf = dns_resconf_local(&error));
+	free(P);
+} /* spf_pool_close() */
 
-		resconf->lookup[2] = resconf->lookup[1];
-		resconf->lookup[1] = resconf->lookup[0];
-		resconf->lookup[0] = 'c';
-	}
 
-	return resconf;
-} /* mkresconf() */
+struct spf_resolver *spf_pool_get(struct spf_pool *P, const struct spf_env *env, int *error) {
+	struct spf_resolver *spf = NULL;
+	struct dns_resolver *res = NULL;
 
+	pthread_mutex_lock(&P->mutex);
 
-static struct dns_resolver *mkres(void) {
-	int error;
+	if (P->nidle)
+		spf = P->idle[--P->nidle];
+	else
+		res = dns_res_clone(P->res, error);
 
-	if (MAIN.res)
-		return MAIN.res;
+	pthread_mutex_unlock(&P->mutex);
 
-	MAIN.res = dns_res_open(mkresconf(), dns_hosts_mortal(dns_hosts_local(&error)), dns_hints_mortal(dns_hints_local(mkresconf(), &error)), mkcache(), dns_opts(), &error);
+	if (spf) {
+		if ((*error = spf_reset(spf, env))) {
+			spf_close(spf);
 
-	assert(MAIN.res);
+			return NULL;
+		}
 
-	return MAIN.res;
-} /* mkres() */
+		return spf;
+	}
 
+	if (!res)
+		return NULL;
 
-static void frepc(int ch, int count, FILE *fp)
-	{ while (count--) fputc(ch, fp); }
+	spf = spf_open(env, res, &P->opt, error);
+	dns_res_close(res);
 
-static int vm(const struct spf_env *env, const char *file) {
-#define VM_C(name) { #name, name }
-	static const struct { const char *name; int value; } ctable[] = {
-		VM_C(AF_INET), VM_C(AF_INET6), VM_C(PF_UNSPEC),
-		VM_C(PF_INET), VM_C(PF_INET6),
-		VM_C(SPF_NONE), VM_C(SPF_NEUTRAL), VM_C(SPF_PASS),
-		VM_C(SPF_FAIL), VM_C(SPF_SOFTFAIL), VM_C(SPF_TEMPERROR),
-		VM_C(SPF_PERMERROR),
-		VM_C(DNS_S_QD), VM_C(DNS_S_AN), VM_C(DNS_S_NS),
-		VM_C(DNS_S_AR), VM_C(DNS_S_ALL),
-		VM_C(DNS_C_IN), VM_C(DNS_C_ANY),
-		VM_C(DNS_T_A), VM_C(DNS_T_NS), VM_C(DNS_T_CNAME),
-		VM_C(DNS_T_SOA), VM_C(DNS_T_PTR), VM_C(DNS_T_MX),
-		VM_C(DNS_T_TXT), VM_C(DNS_T_AAAA), VM_C(DNS_T_SRV),
-		VM_C(DNS_T_SPF), VM_C(DNS_T_ALL),
-	};
-	FILE *fp = stdin;
-	struct spf_resolver *spf;
-	struct spf_vm *vm;
-	char line[256], *eos;
-	long i;
-	struct vm_sub sub;
-	int code, error;
+	return spf;
+} /* spf_pool_get() */
 
-	if (file && strcmp(file, "-"))
-		assert((fp = fopen(file, "r")));
 
-	assert((spf = spf_open(env, mkres(), NULL, &error)));
-	vm = &spf->vm;
-	vm->end = 0;
+void spf_pool_put(struct spf_pool *P, struct spf_resolver *spf) {
+	if (!spf)
+		return;
 
-	if ((error = _setjmp(spf->vm.trap)))
-		panic("vm_exec: %s", spf_strerror(error));
+	pthread_mutex_lock(&P->mutex);
 
-	sub_init(&sub, vm);
+	if (P->nidle < P->limit) {
+		P->idle[P->nidle++] = spf;
+		spf = NULL;
+	}
 
-	while (fgets(line, sizeof line, fp)) {
-		spf_rtrim(line, "\r\n");
+	pthread_mutex_unlock(&P->mutex);
 
-		switch (line[0]) {
-		case '#': case ';':
-			break;
-		case '$':
-			spf_rtrim(line, " \t");
+	spf_close(spf);
+} /* spf_pool_put() */
 
-			for (i = 0; i < spf_lengthof(ctable); i++) {
-				if (!strcasecmp(&line[1], ctable[i].name))
-					break;
-			}
 
-			if (i >= spf_lengthof(ctable))
-				panic("%s: unknown constant", line);
 
-			i = ctable[i].value;
+/*
+ * B A T C H  R O U T I N E S
+ *
+ * Checks move from the pending queue to the running list as slots open
+ * up, and from there to the completion queue. A running check owns a
+ * resolver taken from the batch's pool, and gives it back when the check
+ * completes.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SPF_BATCH_LIMIT
+#define SPF_BATCH_LIMIT 256
+#endif
+
+struct batch_job {
+	struct batch_job *next;
+
+	struct spf_env env;
+	void *arg;
+
+	struct spf_resolver *spf;
+
+	int error;
+	enum spf_result result;
+	char *exp;
+	struct spf_info info;
+}; /* struct batch_job */
+
+struct batch_queue {
+	struct batch_job *head, **tail;
+}; /* struct batch_queue */
+
+struct spf_batch {
+	struct spf_pool *pool;
+
+	unsigned limit, running;
+
+	struct batch_queue pending, done;
+	struct batch_job *run;  /* running checks */
+	struct batch_job *last; /* most recently fetched */
+	struct batch_job *free;
+
+	struct pollfd *pfd;
+}; /* struct spf_batch */
+
+
+static void bq_init(struct batch_queue *q) {
+	q->head = NULL;
+	q->tail = &q->head;
+} /* bq_init() */
+
+
+static void bq_put(struct batch_queue *q, struct batch_job *job) {
+	job->next = NULL;
+	*q->tail = job;
+	q->tail = &job->next;
+} /* bq_put() */
+
+
+static struct batch_job *bq_get(struct batch_queue *q) {
+	struct batch_job *job;
+
+	if ((job = q->head) && !(q->head = job->next))
+		q->tail = &q->head;
+
+	return job;
+} /* bq_get() */
+
+
+static void batch_recycle(struct spf_batch *B, struct batch_job *job) {
+	if (!job)
+		return;
+
+	free(job->exp);
+	job->exp = NULL;
+
+	job->next = B->free;
+	B->free = job;
+} /* batch_recycle() */
+
+
+static int batch_start(struct spf_batch *B, struct batch_job *job) {
+	int error;
+
+	if (!(job->spf = spf_pool_get(B->pool, &job->env, &error)))
+		return error;
+
+	job->next = B->run;
+	B->run = job;
+	B->running++;
+
+	return 0;
+} /* batch_start() */
+
+
+static void batch_finish(struct spf_batch *B, struct batch_job *job, int error) {
+	const char *exp;
+
+	if (!(job->error = error)) {
+		job->result = spf_result(job->spf);
+
+		if ((exp = spf_exp(job->spf)) && !(job->exp = strdup(exp)))
+			job->error = errno;
+	}
+
+	if (job->spf)
+		job->info = *spf_info(job->spf);
+
+	spf_pool_put(B->pool, job->spf);
+	job->spf = NULL;
+
+	bq_put(&B->done, job);
+} /* batch_finish() */
+
+
+struct spf_batch *spf_batch_open(struct dns_resolver *res, const struct spf_options *opts, unsigned limit, int *error) {
+	struct spf_batch *B;
+
+	if (!(B = calloc(1, sizeof *B)))
+		goto syerr;
+
+	B->limit = (limit)? limit : SPF_BATCH_LIMIT;
+
+	bq_init(&B->pending);
+	bq_init(&B->done);
+
+	if (!(B->pfd = calloc(B->limit, sizeof *B->pfd)))
+		goto syerr;
+
+	if (!(B->pool = spf_pool_open(res, opts, B->limit, error)))
+		goto error;
+
+	return B;
+syerr:
+	*error = errno;
+error:
+	spf_batch_close(B);
+
+	return NULL;
+} /* spf_batch_open() */
+
+
+void spf_batch_close(struct spf_batch *B) {
+	struct batch_job *job;
+
+	if (!B)
+		return;
+
+	while ((job = B->run)) {
+		B->run = job->next;
+		spf_close(job->spf);
+		batch_recycle(B, job);
+	}
+
+	while ((job = bq_get(&B->pending)))
+		batch_recycle(B, job);
+
+	while ((job = bq_get(&B->done)))
+		batch_recycle(B, job);
+
+	batch_recycle(B, B->last);
+
+	while ((job = B->free)) {
+		B->free = job->next;
+		free(job);
+	}
+
+	spf_pool_close(B->pool);
+
+	free(B->pfd);
+	free(B);
+} /* spf_batch_close() */
+
+
+int spf_batch_submit(struct spf_batch *B, const struct spf_env *env, void *arg) {
+	struct batch_job *job;
+
+	if ((job = B->free))
+		B->free = job->next;
+	else if (!(job = malloc(sizeof *job)))
+		return errno;
+
+	memset(job, 0, sizeof *job);
+	job->env = *env;
+	job->arg = arg;
+
+	bq_put(&B->pending, job);
+
+	return 0;
+} /* spf_batch_submit() */
+
+
+int spf_batch_check(struct spf_batch *B) {
+	struct batch_job *job, **pp;
+	int error;
+
+	while (B->running < B->limit && (job = bq_get(&B->pending))) {
+		if ((error = batch_start(B, job)))
+			batch_finish(B, job, error);
+	}
+
+	for (pp = &B->run; (job = *pp); ) {
+		if (EAGAIN == (error = spf_check(job->spf))) {
+			pp = &job->next;
+
+			continue;
+		}
+
+		*pp = job->next;
+		B->running--;
+
+		batch_finish(B, job, error);
+
+		/* keep the slot busy */
+		if ((job = bq_get(&B->pending)) && (error = batch_start(B, job)))
+			batch_finish(B, job, error);
+	}
+
+	return (B->running || B->pending.head)? EAGAIN : 0;
+} /* spf_batch_check() */
+
+
+int spf_batch_fetch(struct spf_batch *B, struct spf_batch_result *res) {
+	struct batch_job *job;
+
+	batch_recycle(B, B->last);
+	B->last = NULL;
+
+	if (!(job = bq_get(&B->done)))
+		return 0;
+
+	res->arg = job->arg;
+	res->error = job->error;
+	res->result = job->result;
+	res->exp = job->exp;
+	res->info = job->info;
+
+	B->last = job;
+
+	return 1;
+} /* spf_batch_fetch() */
+
+
+unsigned spf_batch_pollfds(struct spf_batch *B, struct pollfd *pfd, unsigned n) {
+	struct batch_job *job;
+	unsigned i = 0;
+
+	for (job = B->run; job && i < n; job = job->next) {
+		pfd[i].fd = spf_pollfd(job->spf);
+		pfd[i].events = spf_events(job->spf);
+		pfd[i].revents = 0;
+
+		if (pfd[i].fd >= 0)
+			i++;
+	}
+
+	return i;
+} /* spf_batch_pollfds() */
+
+
+int spf_batch_poll(struct spf_batch *B, int timeout) {
+	unsigned n;
+
+	if (B->pending.head && B->running < B->limit)
+		return 0;
+
+	if (!(n = spf_batch_pollfds(B, B->pfd, B->limit)))
+		return 0;
+
+	if (-1 == poll(B->pfd, n, (timeout >= 0)? timeout * 1000 : -1))
+		return (errno == EINTR)? 0 : errno;
+
+	return 0;
+} /* spf_batch_poll() */
+
+
+
+/*
+ * F L A T T E N I N G  R O U T I N E S
+ *
+ * Every term of the include tree gets a sequence number in evaluation
+ * order. ip4, ip6 and all terms become (seq, outcome) entries in a
+ * path-compressed binary trie, one per address family. A term the
+ * flattener can't judge--macros, a, mx, ptr, exists, an unresolvable
+ * include, or the lookup past the query limit--becomes a barrier.
+ *
+ * An entry's outcome is the check result if its own result propagates
+ * through every enclosing include, i.e. until some include sees a
+ * non-Pass. Otherwise evaluation resumes after the end of that include.
+ * Matching walks the entries on the trie path in sequence order. It
+ * answers with the first final outcome it reaches, unless a barrier
+ * comes first.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SPF_FLAT_MAXHIT
+#define SPF_FLAT_MAXHIT 64
+#endif
+
+struct flat_entry {
+	unsigned seq;
+	unsigned level;         /* 0 if final, else skip to end of level */
+	enum spf_result result;
+}; /* struct flat_entry */
+
+struct flat_node {
+	struct flat_node *child[2];
+	unsigned char addr[16];
+	unsigned prefix;
+
+	struct flat_entry *ent;
+	unsigned nent;
+}; /* struct flat_node */
+
+struct flat_level {
+	unsigned parent, end;
+	enum spf_result result; /* qualifier of the include */
+}; /* struct flat_level */
+
+struct spf_flat {
+	char domain[SPF_MAXDN + 1];
+	time_t expires;
+
+	struct flat_node *root[2]; /* in-addr, ip6 */
+
+	unsigned *barrier; /* ascending */
+	unsigned nbarrier;
+
+	struct flat_level *level;
+	unsigned nlevel;
+
+	unsigned nterm;
+	unsigned horizon; /* terms from here on weren't flattened */
+}; /* struct spf_flat */
+
+struct flat_build {
+	struct spf_flat *flat;
+	struct dns_resolver *res;
+	const struct spf_options *opt;
+	int timeout;
+
+	unsigned lookups, ttl;
+	_Bool stop;
+}; /* struct flat_build */
+
+
+static inline unsigned flat_bit(const unsigned char *addr, unsigned i) {
+	return 1U & (addr[i / 8] >> (7 - (i % 8)));
+} /* flat_bit() */
+
+
+/** length of the common prefix of a and b, up to lim bits */
+static unsigned flat_cpl(const unsigned char *a, const unsigned char *b, unsigned lim) {
+	unsigned i, x;
+
+	for (i = 0; i < lim; i += 8) {
+		if ((x = a[i / 8] ^ b[i / 8])) {
+			for (; !(x & 0x80); x <<= 1)
+				i++;
+
+			return SPF_MIN(i, lim);
+		}
+	}
+
+	return lim;
+} /* flat_cpl() */
+
+
+static struct flat_node *flat_mknode(const unsigned char *addr, unsigned prefix) {
+	struct flat_node *node;
+	unsigned i;
+
+	if (!(node = calloc(1, sizeof *node)))
+		return NULL;
+
+	for (i = 0; i < prefix; i += 8)
+		node->addr[i / 8] = addr[i / 8] & (0xffU << (8 - SPF_MIN(8, prefix - i)));
+
+	node->prefix = prefix;
+
+	return node;
+} /* flat_mknode() */
+
+
+static int flat_addent(struct flat_node *node, const struct flat_entry *ent) {
+	struct flat_entry *tmp;
+
+	if (!(tmp = realloc(node->ent, (node->nent + 1) * sizeof *tmp)))
+		return errno;
+
+	node->ent = tmp;
+	node->ent[node->nent++] = *ent;
+
+	return 0;
+} /* flat_addent() */
+
+
+static int flat_insert(struct flat_node **np, const unsigned char *addr, unsigned prefix, const struct flat_entry *ent) {
+	struct flat_node *node, *fork, *leaf;
+	unsigned cpl;
+
+	while ((node = *np)) {
+		cpl = flat_cpl(node->addr, addr, SPF_MIN(node->prefix, prefix));
+
+		if (cpl < node->prefix) {
+			if (!(fork = flat_mknode(addr, cpl)))
+				return errno;
+
+			fork->child[flat_bit(node->addr, cpl)] = node;
+			*np = fork;
+
+			if (cpl == prefix)
+				return flat_addent(fork, ent);
+
+			if (!(leaf = flat_mknode(addr, prefix)))
+				return errno;
+
+			fork->child[flat_bit(addr, cpl)] = leaf;
+
+			return flat_addent(leaf, ent);
+		}
+
+		if (node->prefix == prefix)
+			return flat_addent(node, ent);
+
+		np = &node->child[flat_bit(addr, node->prefix)];
+	}
+
+	if (!(*np = flat_mknode(addr, prefix)))
+		return errno;
+
+	return flat_addent(*np, ent);
+} /* flat_insert() */
+
+
+static void flat_freenode(struct flat_node *node) {
+	if (!node)
+		return;
+
+	flat_freenode(node->child[0]);
+	flat_freenode(node->child[1]);
+	free(node->ent);
+	free(node);
+} /* flat_freenode() */
+
+
+static int flat_add(struct flat_build *B, int af, const void *addr, unsigned prefix, unsigned seq, enum spf_result result, unsigned level) {
+	struct spf_flat *F = B->flat;
+	struct flat_entry ent;
+	unsigned char key[16] = { 0 };
+	unsigned bits = (af == AF_INET6)? 128 : 32;
+
+	while (level && result == SPF_PASS) {
+		result = F->level[level].result;
+		level  = F->level[level].parent;
+	}
+
+	ent.seq    = seq;
+	ent.level  = level;
+	ent.result = result;
+
+	if (addr)
+		memcpy(key, addr, bits / 8);
+
+	return flat_insert(&F->root[af == AF_INET6], key, SPF_MIN(prefix, bits), &ent);
+} /* flat_add() */
+
+
+static int flat_barrier(struct flat_build *B, unsigned seq) {
+	struct spf_flat *F = B->flat;
+	unsigned *tmp;
+
+	if (!(tmp = realloc(F->barrier, (F->nbarrier + 1) * sizeof *tmp)))
+		return errno;
+
+	F->barrier = tmp;
+	F->barrier[F->nbarrier++] = seq;
+
+	return 0;
+} /* flat_barrier() */
+
+
+/*
+ * Count a DNS-querying term, the same way as lim_checkterms() counts them
+ * after the implicit top-level query. The term over the limit becomes a
+ * barrier and stops the build. Evaluation can still step past it by
+ * leaving an enclosing include early, which the horizon catches.
+ */
+static int flat_lookup(struct flat_build *B, unsigned seq, _Bool *ok) {
+	if (++B->lookups > B->opt->limit.query.terms) {
+		B->stop = 1;
+		B->flat->horizon = seq + 1;
+		*ok = 0;
+
+		return flat_barrier(B, seq);
+	}
+
+	*ok = 1;
+
+	return 0;
+} /* flat_lookup() */
+
+
+/** copy the first SPF record of dn, like OP_CHECK's lookup order */
+static int flat_fetch(struct flat_build *B, const char *dn, char **txt) {
+	struct dns_packet *P;
+	struct dns_rr rr;
+	union dns_any any;
+	int i, error;
+
+	for (i = 0; i < 2 && B->opt->lookup[i]; i++) {
+		if (!(P = dns_res_query(B->res, dn, B->opt->lookup[i], DNS_C_IN, B->timeout, &error)))
+			return error;
+
+		dns_rr_foreach(&rr, P, .section = DNS_S_AN, .type = B->opt->lookup[i]) {
+			dns_any_init(&any, sizeof any);
+
+			if (dns_any_parse(&any, &rr, P) || !txt_isspf(&any.txt))
+				continue;
+
+			if (memchr(any.txt.data, '\0', any.txt.len))
+				error = SPF_EBADPOLICY;
+			else if (!(*txt = malloc(any.txt.len + 1)))
+				error = errno;
+			else {
+				memcpy(*txt, any.txt.data, any.txt.len);
+				(*txt)[any.txt.len] = '\0';
+				error = 0;
+			}
+
+			B->ttl = SPF_MIN(B->ttl, rr.ttl);
+
+			dns_p_free(P);
+
+			return error;
+		}
+
+		dns_p_free(P);
+	}
+
+	return SPF_ENOPOLICY;
+} /* flat_fetch() */
+
+
+static int flat_policy(struct flat_build *, const char *, unsigned);
+
+static int flat_include(struct flat_build *B, const char *dn, unsigned seq, enum spf_result result, unsigned parent) {
+	struct spf_flat *F = B->flat;
+	struct flat_level *tmp;
+	unsigned level;
+	int error;
+
+	if (!(tmp = realloc(F->level, (F->nlevel + 1) * sizeof *tmp)))
+		return errno;
+
+	F->level = tmp;
+	level = F->nlevel++;
+	F->level[level].parent = parent;
+	F->level[level].result = result;
+
+	if ((error = flat_policy(B, dn, level))) {
+		if (error == ENOMEM)
+			return error;
+
+		/* leave it to the VM to report */
+		if ((error = flat_barrier(B, seq)))
+			return error;
+	}
+
+	F->level[level].end = F->nterm;
+
+	return 0;
+} /* flat_include() */
+
+
+static int flat_policy(struct flat_build *B, const char *dn, unsigned level) {
+	struct spf_flat *F = B->flat;
+	struct spf_parser parser;
+	union spf_term term;
+	struct spf_redirect redir = { 0 };
+	_Bool all = 0, ok;
+	unsigned seq, nexp = 0, nredir = 0;
+	char *txt = NULL;
+	int type, error;
+
+	if ((error = flat_fetch(B, dn, &txt)))
+		return error;
+
+	/* a syntax error anywhere fails the whole policy */
+	spf_parser_init(&parser, txt, strlen(txt));
+
+	while ((type = spf_parse(&term, &parser, &error))) {
+		nexp += (type == SPF_EXP);
+		nredir += (type == SPF_REDIRECT);
+	}
+
+	if (error || nexp > 1 || nredir > 1) {
+		error = (error)? error : SPF_EBADPOLICY;
+		goto leave;
+	}
+
+	spf_parser_init(&parser, txt, strlen(txt));
+
+	while (!B->stop && (type = spf_parse(&term, &parser, &error))) {
+		if (type == SPF_EXP)
+			continue;
+
+		if (type == SPF_REDIRECT) {
+			redir = term.redirect;
+			continue;
+		}
+
+		if (!SPF_ISMECHANISM(type))
+			continue; /* unknown modifier */
+
+		seq = F->nterm++;
+
+		switch ((term.macros)? 0 : type) {
+		case SPF_ALL:
+			all = 1;
+
+			if ((error = flat_add(B, AF_INET, NULL, 0, seq, term.result, level)))
+				goto leave;
+			if ((error = flat_add(B, AF_INET6, NULL, 0, seq, term.result, level)))
+				goto leave;
+
+			break;
+		case SPF_IP4:
+			if ((error = flat_add(B, AF_INET, &term.ip4.addr, term.ip4.prefix, seq, term.result, level)))
+				goto leave;
+
+			break;
+		case SPF_IP6:
+			if ((error = flat_add(B, AF_INET6, &term.ip6.addr, term.ip6.prefix, seq, term.result, level)))
+				goto leave;
+
+			break;
+		case SPF_INCLUDE:
+			if ((error = flat_lookup(B, seq, &ok)) || !ok)
+				goto leave;
+
+			if ((error = flat_include(B, term.include.domain, seq, term.result, level)))
+				goto leave;
+
+			break;
+		default:
+			/* a, mx, ptr, exists, or include with macros */
+			if ((error = flat_lookup(B, seq, &ok)) || !ok)
+				goto leave;
+
+			if ((error = flat_barrier(B, seq)))
+				goto leave;
+
+			break;
+		} /* switch() */
+	}
+
+	/* all always matches, so a redirect after it is never reached */
+	if (redir.type && !all && !B->stop) {
+		seq = F->nterm++;
+
+		if (redir.macros) {
+			error = flat_barrier(B, seq);
+		} else if (!(error = flat_lookup(B, seq, &ok)) && ok) {
+			/*
+			 * The target's terms run in place of ours, so
+			 * flatten them at the same level. Mark the
+			 * barrier before them in case the target fails.
+			 */
+			if ((error = flat_policy(B, redir.domain, level)) && error != ENOMEM)
+				error = flat_barrier(B, seq);
+		}
+	}
+leave:
+	free(txt);
+
+	return error;
+} /* flat_policy() */
+
+
+struct spf_flat *spf_flat_open(const char *domain, struct dns_resolver *res, const struct spf_options *opts, int timeout, int *error_) {
+	struct flat_build B = { .res = res, .opt = (opts)? opts : &spf_defaults, .timeout = timeout, .ttl = ~0U };
+	struct spf_flat *F;
+	int error;
+
+	if (!(F = calloc(1, sizeof *F)))
+		goto syerr;
+
+	if (sizeof F->domain <= spf_strlcpy(F->domain, domain, sizeof F->domain)) {
+		error = ENAMETOOLONG;
+		goto error;
+	}
+
+	/* level 0 is the policy of domain itself */
+	if (!(F->level = calloc(1, sizeof *F->level)))
+		goto syerr;
+
+	F->nlevel = 1;
+	F->horizon = UINT_MAX;
+
+	B.flat = F;
+
+	if ((error = flat_policy(&B, domain, 0)))
+		goto error;
+
+	F->level[0].end = F->nterm;
+	F->expires = time(NULL) + B.ttl;
+
+	return F;
+syerr:
+	error = errno;
+error:
+	*error_ = error;
+
+	spf_flat_close(F);
+
+	return NULL;
+} /* spf_flat_open() */
+
+
+void spf_flat_close(struct spf_flat *F) {
+	if (!F)
+		return;
+
+	flat_freenode(F->root[0]);
+	flat_freenode(F->root[1]);
+	free(F->barrier);
+	free(F->level);
+	free(F);
+} /* spf_flat_close() */
+
+
+time_t spf_flat_expires(struct spf_flat *F) {
+	return F->expires;
+} /* spf_flat_expires() */
+
+
+enum spf_result spf_flat_match(struct spf_flat *F, const struct spf_env *env) {
+	struct flat_entry hit[SPF_FLAT_MAXHIT], tmp;
+	struct flat_node *node;
+	union { struct in_addr a4; struct in6_addr a6; unsigned char key[16]; } ip;
+	unsigned bits, n = 0, i, j, cur = 0, b = 0;
+
+	if (time(NULL) >= F->expires || strcasecmp(F->domain, env->d))
+		return SPF_NONE;
+
+	if (!strcmp(env->v, "in-addr")) {
+		spf_pto4(&ip.a4, env->i);
+		node = F->root[0];
+		bits = 32;
+	} else {
+		spf_pto6(&ip.a6, env->i);
+		node = F->root[1];
+		bits = 128;
+	}
+
+	for (; node; node = node->child[flat_bit(ip.key, node->prefix)]) {
+		if (flat_cpl(node->addr, ip.key, node->prefix) < node->prefix)
+			break;
+
+		for (i = 0; i < node->nent; i++) {
+			if (n >= spf_lengthof(hit))
+				return SPF_NONE;
+
+			/* keep hits ordered by seq */
+			for (j = n++; j > 0 && hit[j - 1].seq > node->ent[i].seq; j--)
+				hit[j] = hit[j - 1];
+
+			hit[j] = node->ent[i];
+		}
+
+		if (node->prefix >= bits)
+			break;
+	}
+
+	for (i = 0; i < n; i++) {
+		tmp = hit[i];
+
+		if (tmp.seq < cur)
+			continue; /* inside an include we already left */
+
+		while (b < F->nbarrier && F->barrier[b] < cur)
+			b++;
+
+		if (b < F->nbarrier && F->barrier[b] < tmp.seq)
+			return SPF_NONE;
+
+		if (!tmp.level)
+			return tmp.result;
+
+		cur = F->level[tmp.level].end;
+	}
+
+	if (cur >= F->horizon)
+		return SPF_NONE;
+
+	while (b < F->nbarrier && F->barrier[b] < cur)
+		b++;
+
+	return (b < F->nbarrier)? SPF_NONE : SPF_NEUTRAL;
+} /* spf_flat_match() */
+
+
+
+#if SPF_MAIN
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+
+#include <ctype.h>	/* isspace(3) */
+
+#include <unistd.h>	/* getopt(3) */
+
+#if SPF_CACHE
+#include "cache.h"
+#endif
+
+
+struct {
+	const char *resconf;
+	const char *cache;
+	struct dns_resolver *res;
+} MAIN;
+
+
+#define panic_(fn, ln, fmt, ...) \
+	do { fprintf(stderr, fmt "%.1s", (fn), (ln), __VA_ARGS__); _Exit(EXIT_FAILURE); } while (0)
+
+#define panic(...) panic_(__func__, __LINE__, "spf: (%s:%d) " __VA_ARGS__, "\n")
+
+
+struct dns_cache;
+
+static struct dns_cache *mkcache(void) {
+#if SPF_CACHE
+	static struct cache *cache;
+	int error;
+
+	if (cache)
+		return cache_resi(cache);
+
+	if (!MAIN.cache)
+		return NULL;
+
+	assert(cache = cache_open(&error));
+
+	if ((error = cache_loadpath(cache, MAIN.cache, NULL, 0)))
+		panic("%s: %s", MAIN.cache, strerror(error));
+
+	return cache_resi(cache);
+#else
+	return NULL;
+#endif
+} /* mkcache() */
+
+
+static struct dns_resolv_conf *mkresconf(void) {
+	static struct dns_resolv_conf *resconf;
+	int error;
+
+	if (resconf)
+		return resconf;
+
+	if (MAIN.resconf) {
+		assert(resconf = dns_resconf_open(&error));
+
+		if ((error = dns_resconf_loadpath(resconf, MAIN.resconf)))
+			panic("%s: %s", MAIN.resconf, strerror(error));
+	} else {
+		assert(resconf = dns_resconf_local(&error));
+
+		resconf->lookup[2] = resconf->lookup[1];
+		resconf->lookup[1] = resconf->lookup[0];
+		resconf->lookup[0] = 'c';
+	}
+
+	return resconf;
+} /* mkresconf() */
+
+
+static struct dns_resolver *mkres(void) {
+	int error;
+
+	if (MAIN.res)
+		return MAIN.res;
+
+	MAIN.res = dns_res_open(mkresconf(), dns_hosts_mortal(dns_hosts_local(&error)), dns_hints_mortal(dns_hints_local(mkresconf(), &error)), mkcache(), dns_opts(), &error);
+
+	assert(MAIN.res);
+
+	return MAIN.res;
+} /* mkres() */
+
+
+static void frepc(int ch, int count, FILE *fp)
+	{ while (count--) fputc(ch, fp); }
+
+static int vm(const struct spf_env *env, const char *file) {
+#define VM_C(name) { #name, name }
+	static const struct { const char *name; int value; } ctable[] = {
+		VM_C(AF_INET), VM_C(AF_INET6), VM_C(PF_UNSPEC),
+		VM_C(PF_INET), VM_C(PF_INET6),
+		VM_C(SPF_NONE), VM_C(SPF_NEUTRAL), VM_C(SPF_PASS),
+		VM_C(SPF_FAIL), VM_C(SPF_SOFTFAIL), VM_C(SPF_TEMPERROR),
+		VM_C(SPF_PERMERROR),
+		VM_C(DNS_S_QD), VM_C(DNS_S_AN), VM_C(DNS_S_NS),
+		VM_C(DNS_S_AR), VM_C(DNS_S_ALL),
+		VM_C(DNS_C_IN), VM_C(DNS_C_ANY),
+		VM_C(DNS_T_A), VM_C(DNS_T_NS), VM_C(DNS_T_CNAME),
+		VM_C(DNS_T_SOA), VM_C(DNS_T_PTR), VM_C(DNS_T_MX),
+		VM_C(DNS_T_TXT), VM_C(DNS_T_AAAA), VM_C(DNS_T_SRV),
+		VM_C(DNS_T_SPF), VM_C(DNS_T_ALL),
+	};
+	FILE *fp = stdin;
+	struct spf_resolver *spf;
+	struct spf_vm *vm;
+	char line[256], *eos;
+	long i;
+	struct vm_sub sub;
+	int code, error;
+
+	if (file && strcmp(file, "-"))
+		assert((fp = fopen(file, "r")));
+
+	assert((spf = spf_open(env, mkres(), NULL, &error)));
+	vm = &spf->vm;
+	vm->end = 0;
+
+	sub_init(&sub, vm);
+
+	while (fgets(line, sizeof line, fp)) {
+		spf_rtrim(line, "\r\n");
+
+		switch (line[0]) {
+		case '#': case ';':
+			break;
+		case '$':
+			spf_rtrim(line, " \t");
+
+			for (i = 0; i < spf_lengthof(ctable); i++) {
+				if (!strcasecmp(&line[1], ctable[i].name))
+					break;
+			}
+
+			if (i >= spf_lengthof(ctable))
+				panic("%s: unknown constant", line);
+
+			i = ctable[i].value;
 
 			goto number;
 		case '-': case '+':
@@ -4404,6 +6829,9 @@ search:
 
 	sub_link(&sub);
 
+	if ((error = vm_catch(vm)))
+		panic("vm_emit: %s", spf_strerror(error));
+
 	while ((error = vm_exec(vm))) {
 		switch (error) {
 		case EAGAIN:
@@ -41,6 +41,28 @@ struct zonerr {
 }; /* struct zonerr */
 
 
+/*
+ * Compact records, as filled by zone_getrrs(). The owner name and RDATA
+ * are in uncompressed wire format and live in the caller's arena. A
+ * return of 0 with the error set means a record was rejected; callers may
+ * stop or call again to continue past it.
+ */
+struct zonerec {
+	enum dns_class class;
+	enum dns_type type;
+	unsigned ttl;
+
+	unsigned char namelen;
+	unsigned short rdlen;
+	size_t name, rdata; /* offsets into zonearena.base */
+}; /* struct zonerec */
+
+struct zonearena {
+	unsigned char *base;
+	size_t size, end;
+}; /* struct zonearena */
+
+
 struct zonefile;
 
 struct zonefile *zone_open(const char *, unsigned, int *);
@@ -51,7 +73,13 @@ size_t zone_parsesome(struct zonefile *, const void *, size_t);
 
 size_t zone_parsefile(struct zonefile *, FILE *);
 
+int zone_parsemap(struct zonefile *, int);
+
+int zone_parallel(int, const char *, unsigned, unsigned, int (*)(void *, const struct zonerec *, size_t, const struct zonearena *), void *);
+
 struct zonerr *zone_getrr(struct zonerr *, struct dns_soa **, struct zonefile *);
 
+size_t zone_getrrs(struct zonerec *, size_t, struct zonearena *, struct zonefile *, int *);
+
 
 #endif /* ZONE_H */
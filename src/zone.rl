@@ -24,10 +24,11 @@
  * ==========================================================================
  */
 #include <stddef.h>	/* NULL */
+#include <stdint.h>	/* uint64_t */
 #include <stdlib.h>	/* malloc(3) free(3) */
 #include <stdio.h>	/* fopen(3) fclose(3) fread(3) fputc(3) */
 
-#include <string.h>	/* memset(3) memmove(3) */
+#include <string.h>	/* memset(3) memmove(3) memcpy(3) memchr(3) strspn(3) strncasecmp(3) */
 
 #include <ctype.h>	/* isspace(3) isgraph(3) isdigit(3) */
 
@@ -35,6 +36,14 @@
 
 #include <errno.h>	/* errno */
 
+#include <sys/types.h>	/* off_t */
+#include <sys/stat.h>	/* struct stat fstat(2) */
+#include <sys/mman.h>	/* mmap(2) munmap(2) madvise(2) */
+
+#include <unistd.h>	/* _SC_NPROCESSORS_ONLN sysconf(3) */
+
+#include <pthread.h>
+
 #include <arpa/inet.h>	/* inet_pton(3) */
 
 #include "dns.h"
@@ -81,43 +90,254 @@
  *
  * o Comments are discarded.
  *
- * o Quoted and escaped whitespace characters are coded as a short with the
- *   T_LIT bit set.
+ * o Quoted and escaped whitespace characters, and NUL, are coded as a T_LIT
+ *   octet followed by the literal octet.
+ *
+ * o Output stops after each unquoted, ungrouped newline so the caller can
+ *   record the line boundary.
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#define T_LIT 0x0100
+#define T_LIT 0x00
+#define T_LITBIT 0x0100 /* marks literals in zonepp.lastc */
 
 struct zonepp {
-	int escaped, quoted, grouped, comment, lastc;
+	int escaped, quoted, grouped, comment, lastc, eol;
 	struct { int v, n; } octet;
 }; /* struct zonepp */
 
 #define islwsp(ch) ((ch) == ' ' || (ch) == '\t')
 
-static size_t fold(short *dst, size_t lim, unsigned char **src, size_t *len, struct zonepp *state) {
-	short *p, *pe;
-	int ch;
+
+/*
+ * Most octets pass through fold() unchanged. Blocks of 64 octets are
+ * classified into bitmasks of the structural characters, so that runs
+ * between them can be copied wholesale and only the structural octets
+ * themselves go through the byte-at-a-time state machine.
+ */
+#ifndef HAVE_SSE2
+#define HAVE_SSE2 (defined __SSE2__)
+#endif
+
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define FOLD_BLOCK 64
+
+struct foldcls {
+	uint64_t hard;  /* \ ; " ( ) \n NUL */
+	uint64_t qhard; /* \ " NUL and whitespace, within quotes */
+	uint64_t lwsp;  /* space and tab */
+	uint64_t tab;
+}; /* struct foldcls */
+
+#if HAVE_SSE2
+/*
+ * NB: SSE2 only has signed byte comparisons, but octets >= 0x80 compare
+ * as negative and so fall outside the \t-\r range.
+ */
+static void fold_classify(struct foldcls *cls, const unsigned char *src) {
+	__m128i x, space, tab, hard, qhard;
+	unsigned i;
+
+	memset(cls, 0, sizeof *cls);
+
+	for (i = 0; i < FOLD_BLOCK; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)&src[i]);
+
+		space = _mm_cmpeq_epi8(x, _mm_set1_epi8(' '));
+		tab   = _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'));
+
+		hard = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_setzero_si128()), _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+		hard = _mm_or_si128(hard, _mm_cmpeq_epi8(x, _mm_set1_epi8('"')));
+
+		qhard = _mm_or_si128(hard, space);
+		qhard = _mm_or_si128(qhard, _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('\r' + 1))));
+
+		hard = _mm_or_si128(hard, _mm_cmpeq_epi8(x, _mm_set1_epi8(';')));
+		hard = _mm_or_si128(hard, _mm_cmpeq_epi8(x, _mm_set1_epi8('(')));
+		hard = _mm_or_si128(hard, _mm_cmpeq_epi8(x, _mm_set1_epi8(')')));
+		hard = _mm_or_si128(hard, _mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+
+		cls->hard  |= (uint64_t)(unsigned)_mm_movemask_epi8(hard) << i;
+		cls->qhard |= (uint64_t)(unsigned)_mm_movemask_epi8(qhard) << i;
+		cls->lwsp  |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_or_si128(space, tab)) << i;
+		cls->tab   |= (uint64_t)(unsigned)_mm_movemask_epi8(tab) << i;
+	}
+} /* fold_classify() */
+#else
+static void fold_classify(struct foldcls *cls, const unsigned char *src) {
+	uint64_t bit;
+	unsigned i;
+
+	memset(cls, 0, sizeof *cls);
+
+	for (i = 0; i < FOLD_BLOCK; i++) {
+		bit = (uint64_t)1 << i;
+
+		switch (src[i]) {
+		case '\0': case '\\': case '"':
+			cls->hard |= bit;
+			cls->qhard |= bit;
+
+			break;
+		case ';': case '(': case ')':
+			cls->hard |= bit;
+
+			break;
+		case '\n':
+			cls->hard |= bit;
+			cls->qhard |= bit;
+
+			break;
+		case '\t':
+			cls->tab |= bit;
+			/* FALL THROUGH */
+		case ' ':
+			cls->lwsp |= bit;
+			cls->qhard |= bit;
+
+			break;
+		case '\v': case '\f': case '\r':
+			cls->qhard |= bit;
+
+			break;
+		}
+	}
+} /* fold_classify() */
+#endif
+
+static inline unsigned fold_ctz(uint64_t mask) {
+#if __GNUC__
+	return __builtin_ctzll(mask);
+#else
+	unsigned n;
+
+	for (n = 0; !(mask & 1); mask >>= 1)
+		n++;
+
+	return n;
+#endif
+} /* fold_ctz() */
+
+
+/*
+ * Copy the octets up to the next structural character, translating tabs
+ * and squeezing linear whitespace on the way. Returns the new end of dst;
+ * the caller handles the structural character itself.
+ */
+static unsigned char *fold_run(unsigned char *p, unsigned char *pe, unsigned char **src, size_t *len, struct zonepp *state) {
+	unsigned char block[FOLD_BLOCK];
+	struct foldcls cls;
+	uint64_t stop, drop, tab, mask;
+	size_t i, j, k, n;
+
+	while (*len && p < pe) {
+		n = MIN(*len, FOLD_BLOCK);
+
+		/* NUL padding is hard, so a short block always stops at n */
+		if (n < FOLD_BLOCK) {
+			memset(block, '\0', sizeof block);
+			memcpy(block, *src, n);
+			fold_classify(&cls, block);
+		} else {
+			fold_classify(&cls, *src);
+		}
+
+		if (state->quoted) {
+			stop = cls.qhard;
+			drop = 0;
+			tab  = 0;
+		} else {
+			/* linear whitespace following linear whitespace is dropped */
+			stop = cls.hard;
+			drop = cls.lwsp & ((cls.lwsp << 1) | islwsp(state->lastc));
+			tab  = cls.tab & ~drop;
+		}
+
+		for (i = 0; i < n; i = j + 1) {
+			mask = (stop | drop) & (~(uint64_t)0 << i);
+			j = (mask)? fold_ctz(mask) : FOLD_BLOCK;
+			k = MIN(j - i, (size_t)(pe - p));
+
+			if (k > 0) {
+				memcpy(p, *src, k);
+
+				/* unquoted tabs become spaces */
+				mask = tab & (~(uint64_t)0 << i);
+
+				if (i + k < FOLD_BLOCK)
+					mask &= ((uint64_t)1 << (i + k)) - 1;
+
+				for (; mask; mask &= mask - 1)
+					p[fold_ctz(mask) - i] = ' ';
+
+				p += k;
+				*src += k;
+				*len -= k;
+
+				state->lastc = p[-1];
+			}
+
+			if (i + k < j)
+				return p; /* out of room */
+
+			if (j >= n)
+				break;
+
+			if (!((drop >> j) & 1))
+				return p; /* structural */
+
+			++*src;
+			--*len;
+		}
+	}
+
+	return p;
+} /* fold_run() */
+
+
+static size_t fold(unsigned char *dst, size_t lim, unsigned char **src, size_t *len, struct zonepp *state) {
+	unsigned char *p, *pe, *eol;
+	int ch, lit;
 
 	if (!state->lastc)
 		state->lastc = '\n';
 
+	state->eol = 0;
+
 	p  = dst;
 	pe = p + lim;
 
-	while (p < pe && *len) {
-		ch = **src;
+	/* leave room for a T_LIT pair */
+	while (pe - p >= 2 && *len) {
+		if (state->comment) {
+			if (!(eol = memchr(*src, '\n', *len)))
+				eol = *src + *len;
+
+			*len -= eol - *src;
+			*src = eol;
+		} else if (!state->escaped) {
+			p = fold_run(p, pe, src, len, state);
+		}
+
+		if (pe - p < 2 || !*len)
+			break;
+
+		ch  = **src;
+		lit = 0;
 
 		if (state->escaped) {
 			if (state->octet.n && (state->octet.n >= 3 || !isdigit(ch))) {
 				state->escaped = 0;
 
-				ch = state->octet.v;
+				ch = 0xff & state->octet.v;
 				state->octet.v = 0;
 				state->octet.n = 0;
 
-				if (isspace(ch))
-					ch |= T_LIT;
+				if (isspace(ch) || ch == T_LIT)
+					*p++ = T_LIT;
 
 				*p++ = ch;
 
@@ -132,7 +352,7 @@ static size_t fold(short *dst, size_t lim, unsigned char **src, size_t *len, str
 				state->escaped = 0;
 
 				if (isspace(ch))
-					ch |= T_LIT;
+					lit = 1;
 
 				goto copy;
 			}
@@ -203,12 +423,24 @@ test:
 			break;
 		} /* switch() */
 copy:
-		if (state->quoted && isspace((0xff & ch)))
-			ch |= T_LIT;
+		if ((state->quoted && isspace(ch)) || ch == T_LIT)
+			lit = 1;
+
+		if (lit)
+			*p++ = T_LIT;
+
+		*p++ = ch;
 
-		state->lastc = *p = ch;
+		state->lastc = (lit)? (T_LITBIT | ch) : ch;
 
-		++p;
+		if (state->lastc == '\n') {
+			state->eol = 1;
+
+			++*src;
+			--*len;
+
+			break;
+		}
 skip:
 		++*src;
 		--*len;
@@ -218,32 +450,70 @@ skip:
 } /* fold() */
 
 
+/*
+ * Folded octets are appended at tail and whole lines consumed from head,
+ * so parsing a record never shifts the buffer. Line ends are queued by
+ * zone_parsesome() as fold() reports them. Only when the buffer is full is
+ * the trailing partial line moved back to the front.
+ */
 struct tokens {
-	short base[4096];
-	unsigned count;
+	unsigned char base[8192];
+	unsigned head, tail;
+
+	struct {
+		unsigned base[256];
+		unsigned head, count;
+	} eol;
 }; /* struct tokens */
 
 
 static unsigned tok_eol(struct tokens *b) {
-	unsigned i;
-
-	for (i = 0; i < b->count; i++) {
-		if (b->base[i] == '\n')
-			return i + 1;
-	}
+	if (!b->eol.count)
+		return 0;
 
-	return 0;
+	return b->eol.base[b->eol.head] - b->head;
 } /* tok_eol() */
 
 
 static void tok_discard(struct tokens *b, unsigned count) {
-	if (count) {
-		memmove(b->base, &b->base[count], 2 * (b->count - count));
-		b->count = b->count - count;
-	}
+	if (!count)
+		return;
+
+	b->head += count;
+	b->eol.head = (b->eol.head + 1) % lengthof(b->eol.base);
+	b->eol.count--;
+
+	if (b->head == b->tail)
+		b->head = b->tail = 0;
 } /* tok_discard() */
 
 
+static void tok_addeol(struct tokens *b) {
+	b->eol.base[(b->eol.head + b->eol.count) % lengthof(b->eol.base)] = b->tail;
+	b->eol.count++;
+} /* tok_addeol() */
+
+
+static size_t tok_space(struct tokens *b) {
+	unsigned i;
+
+	if (b->eol.count >= lengthof(b->eol.base))
+		return 0;
+
+	if (sizeof b->base - b->tail < 2 && b->head > 0) {
+		memmove(b->base, &b->base[b->head], b->tail - b->head);
+
+		for (i = 0; i < b->eol.count; i++)
+			b->eol.base[(b->eol.head + i) % lengthof(b->eol.base)] -= b->head;
+
+		b->tail -= b->head;
+		b->head = 0;
+	}
+
+	return (sizeof b->base - b->tail < 2)? 0 : sizeof b->base - b->tail;
+} /* tok_space() */
+
+
 struct zonefile {
 	unsigned ttl;
 	char origin[DNS_D_MAXNAME + 1];
@@ -253,6 +523,23 @@ struct zonefile {
 
 	struct tokens toks;
 	struct zonepp pp;
+
+	struct {
+		unsigned char base[8192];
+		size_t p, pe;
+	} in;
+
+	struct {
+		void *base;
+		size_t size;
+		const unsigned char *p, *pe;
+	} map;
+
+	_Bool inmap; /* current record is a slice of the map */
+
+	struct zonerr pending; /* parsed but not yet encoded by zone_getrrs() */
+	_Bool haspending;
+	struct dns_packet *wire;
 }; /* struct zonefile */
 
 
@@ -267,6 +554,19 @@ void zone_init(struct zonefile *P, const char *origin, unsigned ttl) {
 } /* zone_init() */
 
 
+void zone_destroy(struct zonefile *P) {
+	if (P->map.base)
+		munmap(P->map.base, P->map.size);
+
+	P->map.base = NULL;
+	P->map.size = 0;
+	P->map.p = P->map.pe = NULL;
+
+	dns_p_free(P->wire);
+	P->wire = NULL;
+} /* zone_destroy() */
+
+
 void zonerr_init(struct zonerr *rr, struct zonefile *P) {
 	memset(rr, 0, sizeof *rr);
 	rr->class = DNS_C_IN;
@@ -275,17 +575,190 @@ void zonerr_init(struct zonerr *rr, struct zonefile *P) {
 } /* zonerr_init() */
 
 
+/*
+ * DNSSEC and ZONEMD RDATA have no counterparts in dns.c, so they're
+ * encoded field by field into opaque wire format, like the unknown types
+ * of RFC 3597. Names in them are never compressed (RFC 4034 section 6.2).
+ */
+static _Bool zone_rdput(struct zonerr *rr, const void *src, size_t len) {
+	if (rr->data.rdata.size - rr->data.rdata.len < len) {
+		SAY("RDATA too long");
+
+		return 0;
+	}
+
+	memcpy(&rr->data.rdata.data[rr->data.rdata.len], src, len);
+	rr->data.rdata.len += len;
+
+	return 1;
+} /* zone_rdput() */
+
+
+static _Bool zone_rdint(struct zonerr *rr, unsigned long v, unsigned width) {
+	unsigned char buf[4];
+	unsigned i;
+
+	for (i = 0; i < width; i++)
+		buf[i] = 0xff & (v >> (8 * (width - i - 1)));
+
+	return zone_rdput(rr, buf, width);
+} /* zone_rdint() */
+
+
+/* accumulates hex or base64 digits, width bits at a time, into octets */
+static _Bool zone_rdbits(struct zonerr *rr, unsigned *acc, unsigned *nbits, unsigned v, unsigned width) {
+	unsigned char octet;
+
+	*acc = (*acc << width) | v;
+	*nbits += width;
+
+	if (*nbits < 8)
+		return 1;
+
+	*nbits -= 8;
+	octet = 0xff & (*acc >> *nbits);
+	*acc &= (1U << *nbits) - 1;
+
+	return zone_rdput(rr, &octet, 1);
+} /* zone_rdbits() */
+
+
+static unsigned zone_b64(int ch) {
+	if (ch >= 'A' && ch <= 'Z')
+		return ch - 'A';
+	else if (ch >= 'a' && ch <= 'z')
+		return 26 + (ch - 'a');
+	else if (ch >= '0' && ch <= '9')
+		return 52 + (ch - '0');
+	else
+		return (ch == '+')? 62 : 63;
+} /* zone_b64() */
+
+
+static _Bool zone_rddn(struct zonerr *rr, const char *dn) {
+	const char *dot;
+	unsigned char len;
+
+	while (*dn && strcmp(dn, ".")) {
+		if (!(dot = strchr(dn, '.')))
+			dot = dn + strlen(dn);
+
+		if (dot == dn || dot - dn > 63) {
+			SAY("invalid name: %s", dn);
+
+			return 0;
+		}
+
+		len = dot - dn;
+
+		if (!zone_rdput(rr, &len, 1) || !zone_rdput(rr, dn, len))
+			return 0;
+
+		dn = (*dot)? dot + 1 : dot;
+	}
+
+	return zone_rdput(rr, "", 1);
+} /* zone_rddn() */
+
+
+/* mnemonic, decimal or the TYPEnnn of RFC 3597 */
+static unsigned zone_type(const char *src) {
+	if (!strncasecmp(src, "TYPE", 4) && isdigit((unsigned char)src[4]))
+		return 0xffff & strtoul(&src[4], NULL, 10);
+
+	return dns_itype(src);
+} /* zone_type() */
+
+
+static unsigned long zone_digits(const char *src, size_t n) {
+	unsigned long v = 0;
+
+	while (n--)
+		v = 10 * v + (*src++ - '0');
+
+	return v;
+} /* zone_digits() */
+
+
+/* YYYYMMDDHHmmSS in UTC, or seconds since the epoch (RFC 4034 section 3.2) */
+static _Bool zone_rdtime(struct zonerr *rr, const char *src) {
+	unsigned long y, m, d, days, t;
+	size_t len = strlen(src);
+
+	if (!len || strspn(src, "0123456789") != len) {
+		SAY("invalid time: %s", src);
+
+		return 0;
+	}
+
+	if (len != 14)
+		return zone_rdint(rr, strtoul(src, NULL, 10), 4);
+
+	y = zone_digits(&src[0], 4);
+	m = zone_digits(&src[4], 2);
+	d = zone_digits(&src[6], 2);
+
+	/* days from the civil calendar; March starts the computational year */
+	y -= (m <= 2);
+	days = 365 * y + y / 4 - y / 100 + y / 400 + (153 * ((m > 2)? m - 3 : m + 9) + 2) / 5 + d - 1 - 719468;
+
+	t = 86400 * days + 3600 * zone_digits(&src[8], 2) + 60 * zone_digits(&src[10], 2) + zone_digits(&src[12], 2);
+
+	return zone_rdint(rr, 0xffffffff & t, 4);
+} /* zone_rdtime() */
+
+
+/* sets type in the windowed bitmap of RFC 4034 section 4.1.2 at base */
+static _Bool zone_rdbitmap(struct zonerr *rr, size_t base, unsigned type) {
+	unsigned char *p = rr->data.rdata.data;
+	unsigned window = type >> 8, need = (0xff & type) / 8 + 1, grow;
+	size_t at = base, end;
+
+	while (at < rr->data.rdata.len && p[at] < window)
+		at += 2 + p[at + 1];
+
+	if (at >= rr->data.rdata.len || p[at] != window) {
+		if (!zone_rdput(rr, "\0\0", 2))
+			return 0;
+
+		memmove(&p[at + 2], &p[at], rr->data.rdata.len - 2 - at);
+		p[at] = window;
+		p[at + 1] = 0;
+	}
+
+	if (p[at + 1] < need) {
+		grow = need - p[at + 1];
+		end = at + 2 + p[at + 1];
+
+		if (rr->data.rdata.size - rr->data.rdata.len < grow) {
+			SAY("RDATA too long");
+
+			return 0;
+		}
+
+		memmove(&p[end + grow], &p[end], rr->data.rdata.len - end);
+		memset(&p[end], 0, grow);
+		rr->data.rdata.len += grow;
+		p[at + 1] = need;
+	}
+
+	p[at + 2 + (0xff & type) / 8] |= 0x80 >> (type % 8);
+
+	return 1;
+} /* zone_rdbitmap() */
+
+
 %%{
 	machine file_grammar;
-	alphtype short;
+	alphtype unsigned char;
 
 	action oops {
 		fprintf(stderr, "OOPS: ");
 		do {
-			unsigned i, at = p - P->toks.base;
+			unsigned i, at = p - line;
 			for (i = 0; i < span; i++) {
 				if (i == at) fputc('[', stderr);
-				fputc((0xff & P->toks.base[i]), stderr);
+				fputc(line[i], stderr);
 				if (i == at) fputc(']', stderr);
 			}
 		} while(0);
@@ -293,11 +766,19 @@ void zonerr_init(struct zonerr *rr, struct zonefile *P) {
 		goto next;
 	}
 
-	action str_init { sp = str; }
-	action str_copy { if (sp < endof(str)) *sp++ = fc; lc = fc; }
+	action str_init { sp = str; lit = 0; }
+	action str_copy {
+		if (!lit && fc == T_LIT) {
+			lit = 1;
+		} else {
+			if (sp < endof(str)) *sp++ = fc;
+			lc = fc;
+			lit = 0;
+		}
+	}
 	action str_end { if (sp >= endof(str)) sp--; *sp = '\0'; }
 
-	string = (any - space)+ >str_init $str_copy %str_end;
+	string = ((any - space - 0) | (0 any))+ >str_init $str_copy %str_end;
 
 	number = digit+ >{ n = 0; } ${ n *= 10; n += fc - '0'; };
 
@@ -409,7 +890,61 @@ void zonerr_init(struct zonerr *rr, struct zonefile *P) {
 	PTR_cname = domain %{ dns_strlcpy(rr->data.ptr.host, str, sizeof rr->data.ptr.host); };
 	PTR = PTR_type space+ PTR_cname space*;
 
-	rrdata = (SOA | NS | MX | CNAME | SRV | SSHFP | TXT | SPF | AAAA | A | PTR) space*;
+	action rd_u8 { if (!zone_rdint(rr, n, 1)) goto next; }
+	action rd_u16 { if (!zone_rdint(rr, n, 2)) goto next; }
+	action rd_u32 { if (!zone_rdint(rr, n, 4)) goto next; }
+	action rd_dn { if (!zone_rddn(rr, str)) goto next; }
+	action rd_time { if (!zone_rdtime(rr, str)) goto next; }
+
+	action rd_type {
+		if (!(n = zone_type(str))) {
+			SAY("unknown type: %s", str);
+			goto next;
+		}
+	}
+
+	action rd_nybble {
+		if (!zone_rdbits(rr, &n, &i, (isdigit(fc))? fc - '0' : 10 + (tolower(fc) - 'a'), 4))
+			goto next;
+	}
+
+	action rd_sextet {
+		if (!zone_rdbits(rr, &n, &i, zone_b64(fc), 6))
+			goto next;
+	}
+
+	rd_u8   = number %rd_u8;
+	rd_u16  = number %rd_u16;
+	rd_u32  = number %rd_u32;
+	rd_dn   = domain %rd_dn;
+	rd_time = string %rd_time;
+	rd_type = string %rd_type;
+
+	# hex and base64 may be split by spaces (RFC 4034 sections 2.2 and
+	# 5.3). Each record has one such field, and i starts out 0 for it.
+	rd_hex = (xdigit $rd_nybble)+ (space+ (xdigit $rd_nybble)+)*;
+	rd_b64char = ((alnum | "+" | "/") $rd_sextet) | "=";
+	rd_b64 = rd_b64char+ (space+ rd_b64char+)*;
+
+	DS_type = "DS"i %{ rr->type = DNS_T_DS; };
+	DS = DS_type space+ rd_u16 space+ rd_u8 space+ rd_u8 space+ rd_hex space*;
+
+	DNSKEY_type = "DNSKEY"i %{ rr->type = DNS_T_DNSKEY; };
+	DNSKEY = DNSKEY_type space+ rd_u16 space+ rd_u8 space+ rd_u8 space+ rd_b64 space*;
+
+	RRSIG_type    = "RRSIG"i %{ rr->type = DNS_T_RRSIG; };
+	RRSIG_covered = rd_type %rd_u16;
+	RRSIG = RRSIG_type space+ RRSIG_covered space+ rd_u8 space+ rd_u8 space+ rd_u32 space+ rd_time space+ rd_time space+ rd_u16 space+ rd_dn space+ rd_b64 space*;
+
+	NSEC_type = "NSEC"i %{ rr->type = DNS_T_NSEC; };
+	NSEC_next = rd_dn %{ i = rr->data.rdata.len; };
+	NSEC_bit  = rd_type %{ if (!zone_rdbitmap(rr, i, n)) goto next; };
+	NSEC = NSEC_type space+ NSEC_next (space+ NSEC_bit)* space*;
+
+	ZONEMD_type = "ZONEMD"i %{ rr->type = DNS_T_ZONEMD; };
+	ZONEMD = ZONEMD_type space+ rd_u32 space+ rd_u8 space+ rd_u8 space+ rd_hex space*;
+
+	rrdata = (SOA | NS | MX | CNAME | SRV | SSHFP | TXT | SPF | AAAA | A | PTR | DS | DNSKEY | RRSIG | NSEC | ZONEMD) space*;
 
 	rrname_blank  = " " %{ dns_strlcpy(rr->name, P->lastrr, sizeof rr->name); } " "*;
 	rrname_origin = "@ " %{ dns_strlcpy(rr->name, P->origin, sizeof rr->name); } " "*;
@@ -432,22 +967,156 @@ void zonerr_init(struct zonerr *rr, struct zonefile *P) {
 	main := (ORIGIN | TTL | zonerr | nothing) $!oops;
 }%%
 
+/*
+ * M A P P E D  I N P U T
+ *
+ * Lines already in folded normal form--no comments, quotes, escapes,
+ * groups, tabs, NULs or runs of spaces--are handed to the grammar as
+ * slices of the map. Anything else is folded into the token buffer one
+ * record at a time.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static _Bool zone_isplain(const unsigned char *p, const unsigned char *pe) {
+	static const unsigned char special[256] = {
+		['\0'] = 1, ['\t'] = 1, ['\\'] = 1, [';'] = 1, ['"'] = 1, ['('] = 1, [')'] = 1,
+	};
+	int lastc = '\n';
+
+	for (; p < pe; p++) {
+		if (special[*p] || (*p == ' ' && lastc == ' '))
+			return 0;
+
+		lastc = *p;
+	}
+
+	return 1;
+} /* zone_isplain() */
+
+
+static unsigned zone_mapline(struct zonefile *P, const unsigned char **line) {
+	const unsigned char *eol;
+	unsigned char *src;
+	struct zonepp *pp = &P->pp;
+	size_t len, lim;
+
+	while (P->map.p < P->map.pe) {
+		if (P->toks.head == P->toks.tail
+		&&  !pp->escaped && !pp->quoted && !pp->grouped && !pp->comment
+		&&  (!pp->lastc || pp->lastc == '\n')
+		&&  (eol = memchr(P->map.p, '\n', P->map.pe - P->map.p))) {
+			if (eol == P->map.p) {
+				P->map.p++; /* fold() drops blank lines */
+
+				continue;
+			}
+
+			if (zone_isplain(P->map.p, eol)) {
+				*line = P->map.p;
+				P->inmap = 1;
+
+				return eol + 1 - P->map.p;
+			}
+		}
+
+		if (!(lim = tok_space(&P->toks)))
+			return 0;
+
+		src = (unsigned char *)P->map.p;
+		len = P->map.pe - P->map.p;
+
+		P->toks.tail += fold(&P->toks.base[P->toks.tail], lim, &src, &len, pp);
+		P->map.p = src;
+
+		if (pp->eol) {
+			tok_addeol(&P->toks);
+
+			*line = &P->toks.base[P->toks.head];
+			P->inmap = 0;
+
+			return tok_eol(&P->toks);
+		}
+	}
+
+	return 0;
+} /* zone_mapline() */
+
+
+static unsigned zone_nextline(struct zonefile *P, const unsigned char **line) {
+	unsigned span;
+
+	if ((span = tok_eol(&P->toks))) {
+		*line = &P->toks.base[P->toks.head];
+		P->inmap = 0;
+
+		return span;
+	}
+
+	return zone_mapline(P, line);
+} /* zone_nextline() */
+
+
+static void zone_consume(struct zonefile *P, unsigned span) {
+	if (P->inmap)
+		P->map.p += span;
+	else
+		tok_discard(&P->toks, span);
+
+	P->inmap = 0;
+} /* zone_consume() */
+
+
+int zone_parsemap(struct zonefile *P, int fd) {
+	struct stat st;
+	void *base;
+
+	zone_destroy(P);
+
+	if (0 != fstat(fd, &st))
+		return errno;
+
+	if (!S_ISREG(st.st_mode))
+		return EINVAL;
+
+	if (st.st_size == 0)
+		return 0;
+
+	if ((off_t)(size_t)st.st_size != st.st_size)
+		return EFBIG;
+
+	if (MAP_FAILED == (base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)))
+		return errno;
+
+#if defined MADV_SEQUENTIAL
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	P->map.base = base;
+	P->map.size = st.st_size;
+	P->map.p = base;
+	P->map.pe = P->map.p + P->map.size;
+
+	return 0;
+} /* zone_parsemap() */
+
+
 struct zonerr *zone_getrr(struct zonerr *rr, struct dns_soa **soa, struct zonefile *P) {
 	%% write data;
-	short *p, *pe, *eof;
-	int cs;
+	const unsigned char *line, *p, *pe, *eof;
+	int cs, lit;
 	char str[1024], *sp, lc;
 	unsigned span, ttl, n, i;
 
 	span = 0;
 next:
-	tok_discard(&P->toks, span);
+	zone_consume(P, span);
 
-	if (!(span = tok_eol(&P->toks)))
+	if (!(span = zone_nextline(P, &line)))
 		return NULL;
 
 	sp  = str;
 	lc  = 0;
+	lit = 0;
 	ttl = 0;
 	n   = 0;
 	i   = 0;
@@ -456,13 +1125,13 @@ next:
 
 	%% write init;
 
-	p   = P->toks.base;
+	p   = line;
 	pe  = p + span;
 	eof = pe;
 
 	%% write exec;
 
-	tok_discard(&P->toks, span);
+	zone_consume(P, span);
 
 	dns_strlcpy(P->lastrr, rr->name, sizeof P->lastrr);
 
@@ -475,27 +1144,125 @@ next:
 } /* zone_getrr() */
 
 
+/*
+ * Names and RDATA are encoded into a scratch packet at an offset beyond
+ * the reach of a 14-bit compression pointer, so dns_any_push() can't
+ * compress them and the result can be copied out verbatim. Nor can it
+ * be longer than the room left beyond that offset.
+ */
+#define ZONE_NOCOMP 0x4000
+#define ZONE_MAXENCODE 4096
+
+static int zone_encode(struct zonerec *rec, struct zonearena *arena, struct zonerr *rr, struct zonefile *P) {
+	struct dns_packet *W;
+	size_t namelen, rdlen;
+	int error;
+
+	if (!P->wire && !(P->wire = dns_p_make(ZONE_NOCOMP + ZONE_MAXENCODE, &error)))
+		return error;
+
+	W = P->wire;
+	W->end = ZONE_NOCOMP;
+	memset(W->dict, 0, sizeof W->dict);
+
+	if (!(namelen = dns_d_comp(&W->data[W->end], W->size - W->end, rr->name, strlen(rr->name), W, &error)))
+		return error;
+	else if (namelen > W->size - W->end)
+		return DNS_ENOBUFS;
+
+	W->end += namelen;
+
+	if ((error = dns_any_push(W, &rr->data, rr->type)))
+		return error;
+
+	rdlen = W->end - (ZONE_NOCOMP + namelen + 2);
+
+	if (arena->size - arena->end < namelen + rdlen)
+		return DNS_ENOBUFS;
+
+	rec->class = rr->class;
+	rec->type = rr->type;
+	rec->ttl = rr->ttl;
+
+	rec->name = arena->end;
+	rec->namelen = namelen;
+	memcpy(&arena->base[arena->end], &W->data[ZONE_NOCOMP], namelen);
+	arena->end += namelen;
+
+	rec->rdata = arena->end;
+	rec->rdlen = rdlen;
+	memcpy(&arena->base[arena->end], &W->data[ZONE_NOCOMP + namelen + 2], rdlen);
+	arena->end += rdlen;
+
+	return 0;
+} /* zone_encode() */
+
+
+/*
+ * Fills up to lim records, restarting the arena. A record which doesn't
+ * fit is kept for the next call. A record which can't be encoded, such as
+ * one larger than the arena, ends the batch; once no records precede it
+ * it's dropped and 0 is returned with *error set.
+ */
+size_t zone_getrrs(struct zonerec *rec, size_t lim, struct zonearena *arena, struct zonefile *P, int *error) {
+	struct dns_soa *soa;
+	size_t n = 0;
+
+	*error = 0;
+	arena->end = 0;
+
+	while (n < lim) {
+		if (!P->haspending && !zone_getrr(&P->pending, &soa, P))
+			break;
+
+		P->haspending = 1;
+
+		if ((*error = zone_encode(&rec[n], arena, &P->pending, P))) {
+			if (n > 0) {
+				*error = 0;
+
+				break;
+			}
+
+			P->haspending = 0;
+
+			break;
+		}
+
+		n++;
+
+		P->haspending = 0;
+	}
+
+	return n;
+} /* zone_getrrs() */
+
+
 size_t zone_parsesome(struct zonefile *P, const void *src, size_t len) {
 	unsigned char *p = (unsigned char *)src;
-	size_t lim = lengthof(P->toks.base) - P->toks.count;
+	size_t lim;
 
-	P->toks.count += fold(&P->toks.base[P->toks.count], lim, &p, &len, &P->pp);
+	while (len && (lim = tok_space(&P->toks))) {
+		P->toks.tail += fold(&P->toks.base[P->toks.tail], lim, &p, &len, &P->pp);
+
+		if (P->pp.eol)
+			tok_addeol(&P->toks);
+	}
 
 	return p - (unsigned char *)src;
 } /* zone_parsesome() */
 
 
 size_t zone_parsefile(struct zonefile *P, FILE *fp) {
-	unsigned char buf[1024];
-	size_t tlim, lim, len;
-
-	tlim = lengthof(P->toks.base) - P->toks.count;
-	lim  = MIN(lengthof(buf), tlim);
+	size_t len;
 
-	if (!(len = fread(buf, 1, lim, fp)))
-		return 0;
+	if (P->in.p >= P->in.pe) {
+		P->in.p  = 0;
+		P->in.pe = fread(P->in.base, 1, sizeof P->in.base, fp);
+	}
 
-	assert(len == zone_parsesome(P, buf, len));
+	len = zone_parsesome(P, &P->in.base[P->in.p], P->in.pe - P->in.p);
+	P->in.p += len;
 
 	return len;
 } /* zone_parsefile() */
@@ -514,22 +1281,374 @@ struct zonefile *zone_open(const char *origin, unsigned ttl, int *error) {
 
 
 void zone_close(struct zonefile *P) {
+	if (P)
+		zone_destroy(P);
+
 	free(P);
 } /* zone_close() */
 
 
+/*
+ * P A R A L L E L  L O A D I N G
+ *
+ * A sequential pre-pass tracks only quoting, grouping, comments and
+ * escapes, and replays $ORIGIN and $TTL lines into a context parser. It
+ * cuts the map into chunks at line ends outside of any group or quote
+ * where the next record names its owner explicitly, so no chunk depends on
+ * the previous owner. Workers encode chunks into compact zonerec batches,
+ * as zone_getrrs() does, while the calling thread hands completed batches
+ * to the callback in file order. Workers stay at most a few chunks ahead
+ * of the merge to bound memory.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef ZONE_CHUNKSIZE
+#define ZONE_CHUNKSIZE (1U << 20)
+#endif
+
+struct zonechunk {
+	const unsigned char *p, *pe;
+	char origin[DNS_D_MAXNAME + 1];
+	unsigned ttl;
+
+	struct zonerec *rec;
+	size_t count, size;
+	struct zonearena arena;
+	int error;
+	_Bool done;
+}; /* struct zonechunk */
+
+struct zonepar {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	struct zonechunk *chunk;
+	size_t count, size;
+	size_t next, merged, window;
+	_Bool abort;
+}; /* struct zonepar */
+
+
+static _Bool zone_isowner(int ch) {
+	return isgraph(ch) && !strchr("$;()\"\\", ch);
+} /* zone_isowner() */
+
+
+static int zone_addchunk(struct zonepar *Z, const unsigned char *p, struct zonefile *ctx) {
+	struct zonechunk *chunk;
+
+	if (Z->count >= Z->size) {
+		size_t size = (Z->size)? Z->size * 2 : 64;
+
+		if (!(chunk = realloc(Z->chunk, size * sizeof *chunk)))
+			return errno;
+
+		Z->chunk = chunk;
+		Z->size = size;
+	}
+
+	chunk = &Z->chunk[Z->count++];
+	memset(chunk, 0, sizeof *chunk);
+	chunk->p = chunk->pe = p;
+	dns_strlcpy(chunk->origin, ctx->origin, sizeof chunk->origin);
+	chunk->ttl = ctx->ttl;
+
+	return 0;
+} /* zone_addchunk() */
+
+
+static int zone_split(struct zonepar *Z, const unsigned char *base, size_t size, const char *origin, unsigned ttl) {
+	const unsigned char *p, *pe, *line;
+	struct zonefile *ctx;
+	struct zonerr rr;
+	struct dns_soa *soa;
+	int escaped = 0, quoted = 0, grouped = 0, comment = 0;
+	int error;
+
+	if (!(ctx = zone_open(origin, ttl, &error)))
+		return error;
+
+	if ((error = zone_addchunk(Z, base, ctx)))
+		goto error;
+
+	p    = base;
+	pe   = base + size;
+	line = p;
+
+	for (; p < pe; p++) {
+		if (escaped) {
+			escaped = 0;
+
+			continue;
+		} else if (comment) {
+			if (*p != '\n')
+				continue;
+
+			comment = 0;
+		}
+
+		switch (*p) {
+		case '\\':
+			escaped = 1;
+
+			break;
+		case ';':
+			if (!quoted)
+				comment = 1;
+
+			break;
+		case '"':
+			quoted = !quoted;
+
+			break;
+		case '(':
+			if (!quoted)
+				grouped = 1;
+
+			break;
+		case ')':
+			if (!quoted)
+				grouped = 0;
+
+			break;
+		case '\n':
+			if (quoted || grouped)
+				break;
+
+			/* quotes and escapes can fold into a directive, too */
+			if (*line == '$' || *line == '"' || *line == '\\') {
+				zone_parsesome(ctx, line, p + 1 - line);
+
+				while (zone_getrr(&rr, &soa, ctx))
+					;;
+			}
+
+			line = p + 1;
+
+			if (line - Z->chunk[Z->count - 1].p >= ZONE_CHUNKSIZE && line < pe && zone_isowner(*line)) {
+				Z->chunk[Z->count - 1].pe = line;
+
+				if ((error = zone_addchunk(Z, line, ctx)))
+					goto error;
+			}
+
+			break;
+		} /* switch() */
+	} /* for() */
+
+	Z->chunk[Z->count - 1].pe = pe;
+
+	zone_close(ctx);
+
+	return 0;
+error:
+	zone_close(ctx);
+
+	return error;
+} /* zone_split() */
+
+
+static int zone_parsechunk(struct zonechunk *chunk) {
+	struct zonefile *P;
+	struct zonerec *rec;
+	struct dns_soa *soa;
+	unsigned char *base;
+	int error;
+
+	if (!(P = zone_open(chunk->origin, chunk->ttl, &error)))
+		return error;
+
+	P->map.p = chunk->p;
+	P->map.pe = chunk->pe;
+
+	while (zone_getrr(&P->pending, &soa, P)) {
+		if (chunk->count >= chunk->size) {
+			size_t size = (chunk->size)? chunk->size * 2 : 256;
+
+			if (!(rec = realloc(chunk->rec, size * sizeof *rec)))
+				goto syerr;
+
+			chunk->rec = rec;
+			chunk->size = size;
+		}
+
+		if (chunk->arena.size - chunk->arena.end < ZONE_MAXENCODE) {
+			size_t size = (chunk->arena.size)? chunk->arena.size * 2 : 65536;
+
+			if (!(base = realloc(chunk->arena.base, size)))
+				goto syerr;
+
+			chunk->arena.base = base;
+			chunk->arena.size = size;
+		}
+
+		if ((error = zone_encode(&chunk->rec[chunk->count], &chunk->arena, &P->pending, P)))
+			goto error;
+
+		chunk->count++;
+	}
+
+	zone_close(P);
+
+	return 0;
+syerr:
+	error = errno;
+error:
+	zone_close(P);
+
+	return error;
+} /* zone_parsechunk() */
+
+
+static void zone_freechunk(struct zonechunk *chunk) {
+	free(chunk->rec);
+	chunk->rec = NULL;
+
+	free(chunk->arena.base);
+	chunk->arena.base = NULL;
+} /* zone_freechunk() */
+
+
+static void *zone_worker(void *arg) {
+	struct zonepar *Z = arg;
+	struct zonechunk *chunk;
+	int error;
+
+	pthread_mutex_lock(&Z->mutex);
+
+	for (;;) {
+		while (!Z->abort && Z->next < Z->count && Z->next >= Z->merged + Z->window)
+			pthread_cond_wait(&Z->cond, &Z->mutex);
+
+		if (Z->abort || Z->next >= Z->count)
+			break;
+
+		chunk = &Z->chunk[Z->next++];
+
+		pthread_mutex_unlock(&Z->mutex);
+		error = zone_parsechunk(chunk);
+		pthread_mutex_lock(&Z->mutex);
+
+		chunk->error = error;
+		chunk->done = 1;
+		pthread_cond_broadcast(&Z->cond);
+	}
+
+	pthread_mutex_unlock(&Z->mutex);
+
+	return NULL;
+} /* zone_worker() */
+
+
+int zone_parallel(int fd, const char *origin, unsigned ttl, unsigned threads, int (*merge)(void *, const struct zonerec *, size_t, const struct zonearena *), void *arg) {
+	struct zonepar Z;
+	struct zonefile *map;
+	pthread_t *thread = NULL;
+	unsigned i, running = 0;
+	size_t n;
+	int error;
+
+	memset(&Z, 0, sizeof Z);
+	pthread_mutex_init(&Z.mutex, NULL);
+	pthread_cond_init(&Z.cond, NULL);
+
+	if (!(map = zone_open(origin, ttl, &error)))
+		goto error;
+
+	if ((error = zone_parsemap(map, fd)) || !map->map.base)
+		goto error;
+
+	if ((error = zone_split(&Z, map->map.p, map->map.size, map->origin, map->ttl)))
+		goto error;
+
+	if (!threads) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (ncpu > 0)? ncpu : 1;
+	}
+
+	Z.window = 2 * threads;
+
+	if (!(thread = calloc(threads, sizeof *thread)))
+		goto syerr;
+
+	for (i = 0; i < threads; i++) {
+		if ((error = pthread_create(&thread[i], NULL, &zone_worker, &Z)))
+			goto error;
+
+		running++;
+	}
+
+	for (n = 0; n < Z.count; n++) {
+		struct zonechunk *chunk = &Z.chunk[n];
+
+		pthread_mutex_lock(&Z.mutex);
+
+		while (!chunk->done)
+			pthread_cond_wait(&Z.cond, &Z.mutex);
+
+		pthread_mutex_unlock(&Z.mutex);
+
+		if ((error = chunk->error) || (error = merge(arg, chunk->rec, chunk->count, &chunk->arena)))
+			goto error;
+
+		zone_freechunk(chunk);
+
+		pthread_mutex_lock(&Z.mutex);
+		Z.merged = n + 1;
+		pthread_cond_broadcast(&Z.cond);
+		pthread_mutex_unlock(&Z.mutex);
+	}
+
+	error = 0;
+
+	goto done;
+syerr:
+	error = errno;
+error:
+	pthread_mutex_lock(&Z.mutex);
+	Z.abort = 1;
+	pthread_cond_broadcast(&Z.cond);
+	pthread_mutex_unlock(&Z.mutex);
+done:
+	for (i = 0; i < running; i++)
+		pthread_join(thread[i], NULL);
+
+	for (n = 0; n < Z.count; n++)
+		zone_freechunk(&Z.chunk[n]);
+
+	free(Z.chunk);
+	free(thread);
+	zone_close(map);
+
+	pthread_cond_destroy(&Z.cond);
+	pthread_mutex_destroy(&Z.mutex);
+
+	return error;
+} /* zone_parallel() */
+
+
 #if ZONE_MAIN
 
 #include <stdlib.h>	/* EXIT_FAILURE */
 
 #include <unistd.h>	/* getopt(3) */
 
+#include "cache.h"
+
 
 struct {
 	const char *progname;
 } MAIN;
 
 
+static void printrr(struct zonerr *rr) {
+	char data[512];
+
+	dns_any_print(data, sizeof data, &rr->data, rr->type);
+	printf("%s %u IN %s %s\n", rr->name, rr->ttl, dns_strtype(rr->type), data);
+} /* printrr() */
+
+
 static void parsefile(FILE *fp, const char *origin, unsigned ttl) {
 	struct zonefile P;
 	struct zonerr rr;
@@ -537,20 +1656,24 @@ static void parsefile(FILE *fp, const char *origin, unsigned ttl) {
 
 	zone_init(&P, origin, ttl);
 
-	while (zone_parsefile(&P, fp)) {
-		while (zone_getrr(&rr, &soa, &P)) {
-			char data[512];
-			dns_any_print(data, sizeof data, &rr.data, rr.type);
-			printf("%s %u IN %s %s\n", rr.name, rr.ttl, dns_strtype(rr.type), data);
+	if (0 == zone_parsemap(&P, fileno(fp))) {
+		while (zone_getrr(&rr, &soa, &P))
+			printrr(&rr);
+	} else {
+		while (zone_parsefile(&P, fp)) {
+			while (zone_getrr(&rr, &soa, &P))
+				printrr(&rr);
 		}
 	}
+
+	zone_destroy(&P);
 } /* parsefile() */
 
 
 static void foldfile(FILE *dst, FILE *src) {
 	struct zonepp state;
 	unsigned char in[16], *p;
-	short out[16];
+	unsigned char out[16];
 	size_t len, num, i;
 
 	memset(&state, 0, sizeof state);
@@ -560,11 +1683,12 @@ static void foldfile(FILE *dst, FILE *src) {
 
 		while ((num = fold(out, sizeof out, &p, &len, &state))) {
 			for (i = 0; i < num; i++) {
-				if ((out[i] & T_LIT)
-				||  (!isgraph(0xff & out[i]) && !isspace(0xff & out[i]))) {
-					fprintf(dst, "\\%.3d", (0xff & out[i]));
+				if (out[i] == T_LIT && i + 1 < num) {
+					fprintf(dst, "\\%.3d", out[++i]);
+				} else if (!isgraph(out[i]) && !isspace(out[i])) {
+					fprintf(dst, "\\%.3d", out[i]);
 				} else {
-					fputc((0xff & out[i]), dst);
+					fputc(out[i], dst);
 				}
 			}
 		}
@@ -572,6 +1696,22 @@ static void foldfile(FILE *dst, FILE *src) {
 } /* foldfile() */
 
 
+static void compilefile(FILE *dst, FILE *src, const char *origin, unsigned ttl) {
+	struct cache *cache;
+	int error;
+
+	if (!(cache = cache_open(&error))
+	||  (error = cache_loadfile(cache, src, origin, ttl))
+	||  (error = cache_saveimage(cache, dst))) {
+		fprintf(stderr, "%s: %s\n", MAIN.progname, dns_strerror(error));
+
+		exit(EXIT_FAILURE);
+	}
+
+	cache_close(cache);
+} /* compilefile() */
+
+
 static void usage(FILE *fp) {
 	static const char *usage =
 		" [OPTIONS] [COMMAND]\n"
@@ -582,6 +1722,7 @@ static void usage(FILE *fp) {
 		"\n"
 		"  fold       Fold into simple normal form\n"
 		"  parse      Parse zone file and recompose\n"
+		"  compile    Compile zone file into a cache image\n"
 		"\n"
 		"Report bugs to William Ahern <william@25thandClement.com>\n";
 
@@ -628,8 +1769,9 @@ static unsigned parsettl(const char *opt) {
 } /* parsettl() */
 
 
-#define CMD_FOLD  1
-#define CMD_PARSE 2
+#define CMD_FOLD    1
+#define CMD_PARSE   2
+#define CMD_COMPILE 3
 
 static int command(const char *arg) {
 	const char *p, *pe, *eof;
@@ -652,8 +1794,9 @@ static int command(const char *arg) {
 
 		fold = "fold" %{ return CMD_FOLD; };
 		parse = "parse" %{ return CMD_PARSE; };
+		compile = "compile" %{ return CMD_COMPILE; };
 
-		main := (fold | parse) $!oops;
+		main := (fold | parse | compile) $!oops;
 
 		write data;
 		write init;
@@ -704,6 +1847,9 @@ int main(int argc, char **argv) {
 	case CMD_PARSE:
 		parsefile(stdin, origin, ttl);
 		break;
+	case CMD_COMPILE:
+		compilefile(stdout, stdin, origin, ttl);
+		break;
 	}
 
 	return 0;